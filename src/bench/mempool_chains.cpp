@@ -0,0 +1,84 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <policy/policy.h>
+#include <txmempool.h>
+
+#include <vector>
+
+static const int NUM_CHAINS = 100;
+static const int CHAIN_LENGTH = 25;
+
+static void AddTx(const CTransactionRef& tx, const CAmount& nFee, CTxMemPool& pool) EXCLUSIVE_LOCKS_REQUIRED(cs_main, pool.cs)
+{
+    int64_t nTime = 0;
+    unsigned int nHeight = 1;
+    bool spendsCoinbase = false;
+    unsigned int sigOpCost = 4;
+    LockPoints lp;
+    pool.addUnchecked(CTxMemPoolEntry(
+                                         tx, nFee, nTime, nHeight,
+                                         spendsCoinbase, sigOpCost, lp));
+}
+
+// Chains of transactions each spending the previous one's first output, as
+// created by batched payouts that are chained while waiting for confirmation.
+static std::vector<CTransactionRef> CreateChains()
+{
+    std::vector<CTransactionRef> txs;
+    for (int i = 0; i < NUM_CHAINS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        tx.vout[1].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+        tx.vout[1].nValue = COIN;
+        txs.push_back(MakeTransactionRef(tx));
+        for (int j = 1; j < CHAIN_LENGTH; j++) {
+            tx.vin[0].prevout = COutPoint(txs.back()->GetHash(), 0);
+            tx.vin[0].scriptSig = CScript() << OP_1;
+            txs.push_back(MakeTransactionRef(tx));
+        }
+    }
+    return txs;
+}
+
+static void MempoolChainAncestors(benchmark::State& state)
+{
+    const std::vector<CTransactionRef> txs = CreateChains();
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    for (size_t i = 0; i < txs.size(); i++) {
+        AddTx(txs[i], 1000 + i, pool);
+    }
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < NUM_CHAINS; i++) {
+            CTxMemPool::setEntries ancestors;
+            CTxMemPool::txiter tip = pool.mapTx.find(txs[(i + 1) * CHAIN_LENGTH - 1]->GetHash());
+            pool.CalculateMemPoolAncestors(*tip, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        }
+    }
+}
+
+static void MempoolChainTrim(benchmark::State& state)
+{
+    const std::vector<CTransactionRef> txs = CreateChains();
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < txs.size(); i++) {
+            AddTx(txs[i], 1000 + i, pool);
+        }
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+        pool.TrimToSize(0);
+    }
+}
+
+BENCHMARK(MempoolChainAncestors, 1000);
+BENCHMARK(MempoolChainTrim, 10);
@@ -107,3 +107,51 @@ static void VerifyScriptBench(benchmark::State& state)
 }
 
 BENCHMARK(VerifyScriptBench, 6300);
+
+// Signature hashes of all inputs of a large transaction spending P2PKH outputs,
+// with and without the legacy midstates precomputed.
+static CMutableTransaction BuildLegacySpendingTransaction(CScript& scriptCode)
+{
+    const std::vector<unsigned char> vchPubKey(CPubKey::COMPRESSED_PUBLIC_KEY_SIZE, 2);
+    scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    CMutableTransaction tx;
+    tx.vin.resize(500);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout = COutPoint(uint256(), i);
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72) << vchPubKey;
+    }
+    tx.vout.resize(2);
+    for (CTxOut& txout : tx.vout) {
+        txout.scriptPubKey = scriptCode;
+        txout.nValue = 1;
+    }
+    return tx;
+}
+
+static void SignatureHashLegacy(benchmark::State& state)
+{
+    CScript scriptCode;
+    const CTransaction tx(BuildLegacySpendingTransaction(scriptCode));
+    while (state.KeepRunning()) {
+        PrecomputedTransactionData txdata(tx);
+        txdata.PrecomputeLegacy(tx);
+        for (size_t i = 0; i < tx.vin.size(); i++) {
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, 0, SigVersion::BASE, &txdata);
+        }
+    }
+}
+
+static void SignatureHashLegacyUncached(benchmark::State& state)
+{
+    CScript scriptCode;
+    const CTransaction tx(BuildLegacySpendingTransaction(scriptCode));
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < tx.vin.size(); i++) {
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, 0, SigVersion::BASE);
+        }
+    }
+}
+
+BENCHMARK(SignatureHashLegacy, 5);
+BENCHMARK(SignatureHashLegacyUncached, 5);
@@ -0,0 +1,169 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockcache.h>
+
+#include <chain.h>
+#include <chainparams.h>
+#include <crypto/common.h>
+#include <memusage.h>
+#include <primitives/block.h>
+#include <streams.h>
+#include <util/system.h>
+#include <validation.h>
+#include <version.h>
+
+CRawBlockCache g_raw_block_cache(DEFAULT_BLOCK_CACHE_SIZE << 20);
+
+size_t CRawBlockCache::KeyHasher::operator()(const Key& key) const
+{
+    return ReadLE64(key.hash.begin()) ^ key.fWitness;
+}
+
+CRawBlockCache::CRawBlockCache(size_t nMaxBytesIn) : nMaxBytes(nMaxBytesIn), nUsedBytes(0), nHits(0), nMisses(0) {}
+
+CRawBlockCache::RawBlockRef CRawBlockCache::Get(const uint256& hash, bool fWitness)
+{
+    LOCK(cs);
+    auto it = map.find(Key{hash, fWitness});
+    if (it == map.end()) {
+        ++nMisses;
+        return nullptr;
+    }
+    ++nHits;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->data;
+}
+
+void CRawBlockCache::Insert(const uint256& hash, bool fWitness, RawBlockRef data)
+{
+    if (!data) return;
+    // Account for the payload plus the list and map nodes that track it
+    const size_t nUsage = memusage::DynamicUsage(*data) + memusage::MallocUsage(sizeof(Entry)) +
+                          memusage::MallocUsage(sizeof(std::pair<Key, LruList::iterator>));
+
+    LOCK(cs);
+    if (nUsage > nMaxBytes) return;
+    const Key key{hash, fWitness};
+    auto it = map.find(key);
+    if (it != map.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return;
+    }
+    lru.push_front(Entry{key, std::move(data), nUsage});
+    map.emplace(key, lru.begin());
+    nUsedBytes += nUsage;
+    Trim();
+}
+
+void CRawBlockCache::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    for (bool fWitness : {false, true}) {
+        auto it = map.find(Key{hash, fWitness});
+        if (it != map.end()) EraseEntry(it->second);
+    }
+}
+
+void CRawBlockCache::Clear()
+{
+    LOCK(cs);
+    map.clear();
+    lru.clear();
+    nUsedBytes = 0;
+}
+
+void CRawBlockCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+size_t CRawBlockCache::GetMaxBytes() const
+{
+    LOCK(cs);
+    return nMaxBytes;
+}
+
+size_t CRawBlockCache::Size() const
+{
+    LOCK(cs);
+    return map.size();
+}
+
+size_t CRawBlockCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nUsedBytes;
+}
+
+uint64_t CRawBlockCache::GetHits() const
+{
+    LOCK(cs);
+    return nHits;
+}
+
+uint64_t CRawBlockCache::GetMisses() const
+{
+    LOCK(cs);
+    return nMisses;
+}
+
+void CRawBlockCache::EraseEntry(LruList::iterator it)
+{
+    AssertLockHeld(cs);
+    nUsedBytes -= it->nUsage;
+    map.erase(it->key);
+    lru.erase(it);
+}
+
+void CRawBlockCache::Trim()
+{
+    AssertLockHeld(cs);
+    while (nUsedBytes > nMaxBytes && !lru.empty()) {
+        EraseEntry(std::prev(lru.end()));
+    }
+}
+
+bool ReadRawBlockCached(CRawBlockCache::RawBlockRef& block, const CBlockIndex* pindex, bool fWitness, const CChainParams& chainparams)
+{
+    const uint256 hash = pindex->GetBlockHash();
+    block = g_raw_block_cache.Get(hash, fWitness);
+    if (block) return true;
+
+    bool fCache;
+    {
+        LOCK(cs_main);
+        fCache = chainActive.Height() - pindex->nHeight <= RAW_BLOCK_CACHE_DEPTH;
+    }
+
+    // The on-disk format is the full serialization, so the stripped form is
+    // always derived from it (preferably from an already cached copy).
+    CRawBlockCache::RawBlockRef full = fWitness ? nullptr : g_raw_block_cache.Get(hash, true);
+    if (!full) {
+        std::vector<uint8_t> block_data;
+        if (!ReadRawBlockFromDisk(block_data, pindex, chainparams.MessageStart())) {
+            return false;
+        }
+        full = std::make_shared<const std::vector<uint8_t>>(std::move(block_data));
+        if (fCache) g_raw_block_cache.Insert(hash, true, full);
+    }
+    if (fWitness) {
+        block = std::move(full);
+        return true;
+    }
+
+    CBlock fullBlock;
+    try {
+        VectorReader(SER_NETWORK, PROTOCOL_VERSION, *full, 0) >> fullBlock;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s for %s", __func__, e.what(), hash.ToString());
+    }
+    std::vector<uint8_t> stripped;
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS, stripped, 0) << fullBlock;
+    block = std::make_shared<const std::vector<uint8_t>>(std::move(stripped));
+    if (fCache) g_raw_block_cache.Insert(hash, false, block);
+    return true;
+}
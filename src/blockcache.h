@@ -0,0 +1,100 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <memory>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+class CBlockIndex;
+class CChainParams;
+
+/** Default for -blockcachesize, the raw block cache budget in MiB */
+static const int64_t DEFAULT_BLOCK_CACHE_SIZE = 16;
+/** Largest -blockcachesize accepted, in MiB */
+static const int64_t MAX_BLOCK_CACHE_SIZE = sizeof(void*) > 4 ? 16384 : 1024;
+/** Only blocks at most this many blocks below the tip are admitted into the raw block cache */
+static const int RAW_BLOCK_CACHE_DEPTH = 288;
+
+/**
+ * Byte-budgeted LRU cache of serialized blocks, keyed by block hash.
+ *
+ * Every block can be held in two forms: the full serialization (identical to
+ * the on-disk and MSG_WITNESS_BLOCK wire format) and the witness-stripped
+ * serialization used for MSG_BLOCK and -rpcserialversion=0. Entries are
+ * immutable and handed out as shared pointers, so callers may keep using
+ * them after they have been evicted.
+ */
+class CRawBlockCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> RawBlockRef;
+
+    explicit CRawBlockCache(size_t nMaxBytesIn);
+
+    /** Look up a block. Returns nullptr on a miss. */
+    RawBlockRef Get(const uint256& hash, bool fWitness);
+    /** Add a block, evicting the least recently used entries to stay within budget. */
+    void Insert(const uint256& hash, bool fWitness, RawBlockRef data);
+    /** Drop both forms of a block. */
+    void Erase(const uint256& hash);
+    void Clear();
+
+    /** Change the byte budget. A budget of zero disables the cache. */
+    void SetMaxBytes(size_t nMaxBytesIn);
+    size_t GetMaxBytes() const;
+    /** Number of cached serializations (each form counts separately). */
+    size_t Size() const;
+    /** Memory accounted against the budget. */
+    size_t DynamicMemoryUsage() const;
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+
+private:
+    struct Key {
+        uint256 hash;
+        bool fWitness;
+        bool operator==(const Key& other) const { return fWitness == other.fWitness && hash == other.hash; }
+    };
+    struct KeyHasher {
+        size_t operator()(const Key& key) const;
+    };
+    struct Entry {
+        Key key;
+        RawBlockRef data;
+        size_t nUsage;
+    };
+    typedef std::list<Entry> LruList;
+
+    mutable CCriticalSection cs;
+    //! Most recently used entries at the front
+    LruList lru GUARDED_BY(cs);
+    std::unordered_map<Key, LruList::iterator, KeyHasher> map GUARDED_BY(cs);
+    size_t nMaxBytes GUARDED_BY(cs);
+    size_t nUsedBytes GUARDED_BY(cs);
+    uint64_t nHits GUARDED_BY(cs);
+    uint64_t nMisses GUARDED_BY(cs);
+
+    void EraseEntry(LruList::iterator it) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void Trim() EXCLUSIVE_LOCKS_REQUIRED(cs);
+};
+
+/** Shared by P2P block serving, REST, RPC and ZMQ. */
+extern CRawBlockCache g_raw_block_cache;
+
+/**
+ * Fetch the serialization of a block, with or without witness data, going
+ * through g_raw_block_cache. Blocks close to the tip are added to the cache
+ * on a miss; older blocks are read from disk without disturbing it.
+ */
+bool ReadRawBlockCached(CRawBlockCache::RawBlockRef& block, const CBlockIndex* pindex, bool fWitness, const CChainParams& chainparams);
+
+#endif // BITCOIN_BLOCKCACHE_H
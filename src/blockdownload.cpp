@@ -0,0 +1,60 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockdownload.h>
+
+#include <consensus/params.h>
+#include <validation.h>
+
+#include <algorithm>
+
+int GetBlockDownloadWindow(const Consensus::Params& params)
+{
+    int nScale = 1;
+    if (params.nPowTargetSpacing > 0) {
+        nScale = std::max<int64_t>(1, std::min<int64_t>(BLOCK_DOWNLOAD_WINDOW_MAX_SCALE, BLOCK_DOWNLOAD_WINDOW_SPACING / params.nPowTargetSpacing));
+    }
+    return BLOCK_DOWNLOAD_WINDOW * nScale;
+}
+
+CBlockDownloadRate::CBlockDownloadRate() : nWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER), nInterval(0), nLatency(0), nLastDelivery(0) {}
+
+void CBlockDownloadRate::BlockReceived(int64_t nTimeRequested, int64_t nNow, int64_t nMinPingTime)
+{
+    const int64_t nSample = std::max<int64_t>(nNow - nTimeRequested, 1);
+    nLatency = nLatency == 0 ? nSample : std::max<int64_t>(nLatency + (nSample - nLatency) / 8, 1);
+
+    // Only a delivery that followed another one while this block was already
+    // requested says something about throughput; after an idle period the
+    // gap is just the latency.
+    if (nLastDelivery > nTimeRequested) {
+        const int64_t nGap = std::max<int64_t>(nNow - nLastDelivery, 1);
+        nInterval = nInterval == 0 ? nGap : std::max<int64_t>(nInterval + (nGap - nInterval) / 8, 1);
+    }
+    nLastDelivery = std::max(nLastDelivery, nNow);
+
+    // The ping time is the best estimate of the round trip without any
+    // queueing; fall back to the delivery latency until there is one.
+    UpdateWindow(nMinPingTime > 0 ? std::min(nMinPingTime, nLatency) : nLatency);
+}
+
+void CBlockDownloadRate::BlockStalled()
+{
+    nWindow = std::max(MIN_BLOCKS_IN_TRANSIT_PER_PEER, nWindow / 2);
+    // Halve the throughput estimate too, so that later deliveries grow the window back gradually
+    if (nInterval > 0) nInterval *= 2;
+}
+
+void CBlockDownloadRate::UpdateWindow(int64_t nRoundTrip)
+{
+    if (nInterval == 0) return;
+    const int64_t nBlocks = (2 * (nRoundTrip + nInterval) + nInterval - 1) / nInterval;
+    nWindow = std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nBlocks));
+}
+
+int64_t CBlockDownloadRate::GetStallTimeout() const
+{
+    if (nLatency == 0) return BLOCK_STALLING_TIMEOUT * 1000000;
+    return std::max(BLOCK_REASSIGN_MIN_TIMEOUT, std::min<int64_t>(BLOCK_STALLING_TIMEOUT * 1000000, BLOCK_REASSIGN_DELAY_FACTOR * nLatency));
+}
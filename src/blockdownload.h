@@ -0,0 +1,73 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKDOWNLOAD_H
+#define BITCOIN_BLOCKDOWNLOAD_H
+
+#include <stdint.h>
+
+namespace Consensus {
+struct Params;
+}
+
+/** Smallest number of blocks a slow or stalling peer is throttled down to. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+/** Largest number of blocks a fast peer can have in flight at once. */
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Shortest time (in microseconds) a block has to be in flight before it can be reassigned to another peer. */
+static const int64_t BLOCK_REASSIGN_MIN_TIMEOUT = 500000;
+/** How many times its expected delivery time a block may be in flight before it is considered stalled. */
+static const int BLOCK_REASSIGN_DELAY_FACTOR = 3;
+/** Block interval (in seconds) the base block download window was sized for. */
+static const int64_t BLOCK_DOWNLOAD_WINDOW_SPACING = 10 * 60;
+/** Limit on how far the block download window is widened for chains with shorter block intervals. */
+static const int BLOCK_DOWNLOAD_WINDOW_MAX_SCALE = 4;
+
+/** How far ahead of the last common block to fetch, widened for chains with small, frequent blocks. */
+int GetBlockDownloadWindow(const Consensus::Params& params);
+
+/**
+ * Estimate of how fast a peer delivers the blocks we request from it, used
+ * to size its in-flight window and to decide when a block it holds up
+ * should be requested elsewhere.
+ *
+ * The peer's throughput is measured as the time between consecutive
+ * deliveries while it has a backlog, and its latency as the time from
+ * request to delivery. The window is twice the number of blocks the peer
+ * delivers in one network round trip plus one delivery, so that the pipe
+ * stays full with room to discover a higher throughput. A peer that cannot
+ * keep up shows a longer delivery interval and its window stops growing.
+ */
+class CBlockDownloadRate
+{
+public:
+    CBlockDownloadRate();
+
+    /**
+     * Record the delivery at nNow of a block requested at nTimeRequested, given
+     * the lowest ping time seen for the peer (all in microseconds; 0 if unknown).
+     */
+    void BlockReceived(int64_t nTimeRequested, int64_t nNow, int64_t nMinPingTime);
+    /** Record that a block was taken away from this peer because it took too long. */
+    void BlockStalled();
+
+    /** Number of blocks this peer may have in flight. */
+    int GetWindow() const { return nWindow; }
+    /** How long (in microseconds) a block may be in flight from this peer before it is reassigned. */
+    int64_t GetStallTimeout() const;
+    /** Average time between deliveries while busy, in microseconds, or 0 if unknown. */
+    int64_t GetDeliveryInterval() const { return nInterval; }
+    /** Average time from request to delivery, in microseconds, or 0 if unknown. */
+    int64_t GetLatency() const { return nLatency; }
+
+private:
+    int nWindow;
+    int64_t nInterval;
+    int64_t nLatency;
+    int64_t nLastDelivery;
+
+    void UpdateWindow(int64_t nRoundTrip);
+};
+
+#endif // BITCOIN_BLOCKDOWNLOAD_H
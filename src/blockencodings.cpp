@@ -44,6 +44,18 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+void CBlockHeaderAndShortTxIDs::GetShortIDs(const uint256* const* txhashes, uint64_t* shortids, size_t n) const {
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    SipHashUint256Batch(shorttxidk0, shorttxidk1, txhashes, shortids, n);
+    for (size_t i = 0; i < n; i++)
+        shortids[i] &= 0xffffffffffffL;
+}
+
+/** Number of mempool transactions whose short IDs are computed together */
+static const size_t SHORTID_BATCH_SIZE = 64;
+/** Mempool transactions tried in order of ancestor feerate, per short ID in the block, before falling back to all of them */
+static const size_t SHORTID_BEST_TXN_FACTOR = 2;
+
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn) {
@@ -102,33 +114,81 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     if (shorttxids.size() != cmpctblock.shorttxids.size())
         return READ_STATUS_FAILED; // Short ID collision
 
+    // Short IDs are keyed by the block, so there is no way around hashing
+    // mempool transactions for every compact block. They are hashed in
+    // batches, and a bitmap of the block's short IDs keeps most of them away
+    // from the map lookup.
+    uint64_t filter_mask = 63;
+    while (filter_mask + 1 < 8 * shorttxids.size())
+        filter_mask = (filter_mask << 1) | 1;
+    std::vector<uint64_t> filter((filter_mask + 1) / 64);
+    for (const uint64_t shortid : cmpctblock.shorttxids)
+        filter[(shortid & filter_mask) / 64] |= uint64_t{1} << (shortid % 64);
+
     std::vector<bool> have_txn(txn_available.size());
     {
     LOCK(pool->cs);
-    const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
+    const uint256* batch_hashes[SHORTID_BATCH_SIZE];
+    const CTxMemPoolEntry* batch_entries[SHORTID_BATCH_SIZE];
+    uint64_t batch_shortids[SHORTID_BATCH_SIZE];
+    size_t batch_size = 0;
+    auto process_batch = [&]() {
+        cmpctblock.GetShortIDs(batch_hashes, batch_shortids, batch_size);
+        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
+        // the performance win of an early exit here is too good to pass up and worth
+        // the extra risk.
+        for (size_t i = 0; i < batch_size && mempool_count != shorttxids.size(); i++) {
+            const uint64_t shortid = batch_shortids[i];
+            if (!((filter[(shortid & filter_mask) / 64] >> (shortid % 64)) & 1))
+                continue;
+            std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
+            if (idit == shorttxids.end())
+                continue;
             if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
+                txn_available[idit->second] = batch_entries[i]->GetSharedTx();
                 have_txn[idit->second]  = true;
                 mempool_count++;
-            } else {
+            } else if (txn_available[idit->second].get() != &batch_entries[i]->GetTx()) {
                 // If we find two mempool txn that match the short id, just request it.
                 // This should be rare enough that the extra bandwidth doesn't matter,
                 // but eating a round-trip due to FillBlock failure would be annoying
+                // (a transaction seen again in the full scan below is not a match)
                 if (txn_available[idit->second]) {
                     txn_available[idit->second].reset();
                     mempool_count--;
                 }
             }
         }
-        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
-        // the performance win of an early exit here is too good to pass up and worth
-        // the extra risk.
-        if (mempool_count == shorttxids.size())
-            break;
+        batch_size = 0;
+    };
+
+    // Blocks are mostly made of the transactions that pay best, so try those
+    // first: when the whole block is in our mempool, this gets to the early
+    // exit after hashing a multiple of the block's transactions rather than
+    // the whole mempool.
+    const CTxMemPool::indexed_transaction_set::index<ancestor_score>::type& by_score = pool->mapTx.get<ancestor_score>();
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::const_iterator score_it = by_score.begin();
+    const size_t best_limit = SHORTID_BEST_TXN_FACTOR * shorttxids.size();
+    for (size_t n = 0; n < best_limit && score_it != by_score.end() && mempool_count != shorttxids.size(); n++, score_it++) {
+        batch_hashes[batch_size] = &score_it->GetTx().GetWitnessHash();
+        batch_entries[batch_size++] = &*score_it;
+        if (batch_size == SHORTID_BATCH_SIZE)
+            process_batch();
+    }
+    if (batch_size > 0)
+        process_batch();
+
+    // Otherwise go through all of them
+    if (score_it != by_score.end() && mempool_count != shorttxids.size()) {
+        const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
+        for (size_t i = 0; i < vTxHashes.size() && mempool_count != shorttxids.size(); i++) {
+            batch_hashes[batch_size] = &vTxHashes[i].first;
+            batch_entries[batch_size++] = &*vTxHashes[i].second;
+            if (batch_size == SHORTID_BATCH_SIZE)
+                process_batch();
+        }
+        if (batch_size > 0)
+            process_batch();
     }
     }
 
@@ -0,0 +1,137 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockfilewriter.h>
+
+#include <util/system.h>
+
+CBlockFileWriter g_block_file_writer;
+
+CBlockFileWriter::CBlockFileWriter(size_t nMaxPendingIn)
+    : m_next_seq(1), m_done_seq(0), m_running(false), m_stop(false), m_failed(false), m_max_pending(nMaxPendingIn) {}
+
+CBlockFileWriter::~CBlockFileWriter()
+{
+    Stop();
+}
+
+void CBlockFileWriter::Start()
+{
+    LOCK(m_mutex);
+    if (m_running) return;
+    m_running = true;
+    m_stop = false;
+    m_thread = std::thread(&TraceThread<std::function<void()>>, "blkwrite",
+                           std::bind(&CBlockFileWriter::ThreadWrite, this));
+}
+
+void CBlockFileWriter::Stop()
+{
+    {
+        LOCK(m_mutex);
+        m_stop = true;
+    }
+    m_cond_work.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void CBlockFileWriter::Enqueue(int nFile, WriteJob job)
+{
+    {
+        WAIT_LOCK(m_mutex, lock);
+        if (m_running) {
+            m_cond_done.wait(lock, [this]() { return m_queue.size() < m_max_pending || !m_running; });
+        }
+        if (m_running) {
+            const uint64_t nSeq = m_next_seq++;
+            m_last_seq_for_file[nFile] = nSeq;
+            m_queue.push_back(PendingWrite{nSeq, std::move(job)});
+            m_cond_work.notify_one();
+            return;
+        }
+    }
+    // No writer thread: everything before us has already completed, so
+    // running inline preserves ordering.
+    if (!job()) {
+        LOCK(m_mutex);
+        m_failed = true;
+    }
+}
+
+void CBlockFileWriter::WaitForSeq(uint64_t nSeq)
+{
+    WAIT_LOCK(m_mutex, lock);
+    m_cond_done.wait(lock, [this, nSeq]() { return m_done_seq >= nSeq; });
+}
+
+void CBlockFileWriter::WaitForFile(int nFile)
+{
+    uint64_t nSeq;
+    {
+        LOCK(m_mutex);
+        auto it = m_last_seq_for_file.find(nFile);
+        if (it == m_last_seq_for_file.end()) return;
+        nSeq = it->second;
+    }
+    WaitForSeq(nSeq);
+}
+
+void CBlockFileWriter::WaitForAll()
+{
+    uint64_t nSeq;
+    {
+        LOCK(m_mutex);
+        nSeq = m_next_seq - 1;
+    }
+    WaitForSeq(nSeq);
+}
+
+size_t CBlockFileWriter::GetPending() const
+{
+    LOCK(m_mutex);
+    return m_next_seq - 1 - m_done_seq;
+}
+
+bool CBlockFileWriter::HasFailed() const
+{
+    LOCK(m_mutex);
+    return m_failed;
+}
+
+void CBlockFileWriter::ThreadWrite()
+{
+    while (true) {
+        PendingWrite write;
+        {
+            WAIT_LOCK(m_mutex, lock);
+            m_cond_work.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                // Only reached once stopping and fully drained
+                m_running = false;
+                m_cond_done.notify_all();
+                return;
+            }
+            write = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        const bool fSuccess = write.job();
+
+        {
+            LOCK(m_mutex);
+            if (!fSuccess) m_failed = true;
+            m_done_seq = write.nSeq;
+            for (auto it = m_last_seq_for_file.begin(); it != m_last_seq_for_file.end();) {
+                if (it->second <= m_done_seq) {
+                    it = m_last_seq_for_file.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        m_cond_done.notify_all();
+    }
+}
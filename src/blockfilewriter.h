@@ -0,0 +1,86 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEWRITER_H
+#define BITCOIN_BLOCKFILEWRITER_H
+
+#include <sync.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <stdint.h>
+#include <thread>
+
+/** Maximum number of queued block/undo writes before Enqueue() blocks */
+static const size_t MAX_PENDING_BLOCK_FILE_WRITES = 64;
+
+/**
+ * Moves appends to blk?????.dat and rev?????.dat off the validation thread.
+ *
+ * Jobs are executed one at a time on a dedicated thread, in the order they
+ * were queued. File positions are still allocated synchronously by the
+ * caller, so the block index can refer to data that has not been written
+ * yet: anything reading from a block or undo file must call WaitForFile()
+ * first, and anything that fsyncs, truncates or deletes block files must
+ * call WaitForAll().
+ *
+ * A failed write is remembered, so that callers about to commit the block
+ * index can refuse to reference data that never made it to disk.
+ *
+ * When the writer thread is not running (before Start() and after Stop())
+ * jobs run synchronously inside Enqueue().
+ */
+class CBlockFileWriter
+{
+public:
+    /** A job returns false if the write failed (it is expected to have aborted the node already). */
+    typedef std::function<bool()> WriteJob;
+
+    explicit CBlockFileWriter(size_t nMaxPendingIn = MAX_PENDING_BLOCK_FILE_WRITES);
+    ~CBlockFileWriter();
+
+    void Start();
+    /** Finish all queued writes and join the writer thread. */
+    void Stop();
+
+    /** Queue a write to block/undo file number nFile. */
+    void Enqueue(int nFile, WriteJob job);
+    /** Block until every write to nFile queued before this call has completed. */
+    void WaitForFile(int nFile);
+    /** Block until every write queued before this call has completed. */
+    void WaitForAll();
+
+    size_t GetPending() const;
+    /** Whether any write has failed since startup. */
+    bool HasFailed() const;
+
+private:
+    void ThreadWrite();
+
+    mutable Mutex m_mutex;
+    std::condition_variable m_cond_work;
+    std::condition_variable m_cond_done;
+    struct PendingWrite {
+        uint64_t nSeq;
+        WriteJob job;
+    };
+    std::deque<PendingWrite> m_queue GUARDED_BY(m_mutex);
+    //! Sequence number of the most recently queued write per file
+    std::map<int, uint64_t> m_last_seq_for_file GUARDED_BY(m_mutex);
+    uint64_t m_next_seq GUARDED_BY(m_mutex);
+    uint64_t m_done_seq GUARDED_BY(m_mutex);
+    bool m_running GUARDED_BY(m_mutex);
+    bool m_stop GUARDED_BY(m_mutex);
+    bool m_failed GUARDED_BY(m_mutex);
+    const size_t m_max_pending;
+    std::thread m_thread;
+
+    void WaitForSeq(uint64_t nSeq);
+};
+
+extern CBlockFileWriter g_block_file_writer;
+
+#endif // BITCOIN_BLOCKFILEWRITER_H
@@ -110,6 +110,14 @@ struct Params {
     int64_t nLongblocks_StartV1a;
     int64_t nLongblocks_StartV1b;
     int64_t nLongblocks_StartV1c;
+    /** Target time between consecutive blocks of any algorithm at a given height */
+    int64_t TargetSpacing(int nHeight) const
+    {
+        if (nHeight >= nLongblocks_StartV1c) return nPowTargetSpacingV3c;
+        if (nHeight >= nLongblocks_StartV1b) return nPowTargetSpacingV3b;
+        if (nHeight >= nLongblocks_StartV1a) return nPowTargetSpacingV3a;
+        return nPowTargetSpacing;
+    }
     int nSubsidyHalvingIntervalV2a;
     int nSubsidyHalvingIntervalV2b;
     int nSubsidyHalvingIntervalV2c;
@@ -0,0 +1,182 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <crypto/muhash.h>
+
+#include <crypto/chacha20.h>
+#include <crypto/common.h>
+#include <crypto/sha256.h>
+
+#include <limits>
+#include <string.h>
+
+namespace {
+
+/** 2^3072 - MAX_PRIME_DIFF is the largest prime below 2^3072. */
+const Num3072::limb_t MAX_PRIME_DIFF = 1103717;
+
+inline Num3072::limb_t ReadLimb(const unsigned char* ptr)
+{
+    return Num3072::LIMB_SIZE == 64 ? (Num3072::limb_t)ReadLE64(ptr) : (Num3072::limb_t)ReadLE32(ptr);
+}
+
+inline void WriteLimb(unsigned char* ptr, Num3072::limb_t x)
+{
+    if (Num3072::LIMB_SIZE == 64) {
+        WriteLE64(ptr, x);
+    } else {
+        WriteLE32(ptr, (uint32_t)x);
+    }
+}
+
+} // namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        limbs[i] = ReadLimb(data + i * (LIMB_SIZE / 8));
+    }
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i) {
+        limbs[i] = 0;
+    }
+}
+
+bool Num3072::IsOverflow() const
+{
+    // The modulus is all ones, except for the lowest limb.
+    if (limbs[0] <= std::numeric_limits<limb_t>::max() - MAX_PRIME_DIFF) return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != std::numeric_limits<limb_t>::max()) return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the modulus is the same as adding MAX_PRIME_DIFF and dropping the 2^3072 bit.
+    double_limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; ++i) {
+        carry += limbs[i];
+        limbs[i] = (limb_t)carry;
+        carry >>= LIMB_SIZE;
+    }
+}
+
+void Num3072::Reduce(const limb_t (&wide)[2 * LIMBS])
+{
+    // wide = low + high * 2^3072, and 2^3072 is congruent to MAX_PRIME_DIFF.
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t t = (double_limb_t)wide[LIMBS + i] * MAX_PRIME_DIFF + wide[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_SIZE);
+    }
+    // Fold whatever overflowed back in; this terminates after at most two rounds.
+    while (carry != 0) {
+        double_limb_t t = (double_limb_t)carry * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS; ++i) {
+            t += limbs[i];
+            limbs[i] = (limb_t)t;
+            t >>= LIMB_SIZE;
+        }
+        carry = (limb_t)t;
+    }
+    if (IsOverflow()) FullReduce();
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t wide[2 * LIMBS];
+    memset(wide, 0, sizeof(wide));
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + wide[i + j] + carry;
+            wide[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_SIZE);
+        }
+        wide[i + LIMBS] = carry;
+    }
+    Reduce(wide);
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat's little theorem: a^-1 = a^(p - 2) mod p. The exponent is all
+    // ones except for its lowest limb, which is -(MAX_PRIME_DIFF + 2).
+    Num3072 result;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        const limb_t exp = i == 0 ? (limb_t)(0 - (MAX_PRIME_DIFF + 2)) : std::numeric_limits<limb_t>::max();
+        for (int bit = LIMB_SIZE - 1; bit >= 0; --bit) {
+            result.Multiply(result);
+            if ((exp >> bit) & 1) result.Multiply(*this);
+        }
+    }
+    return result;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    Num3072 reduced = *this;
+    if (reduced.IsOverflow()) reduced.FullReduce();
+    for (int i = 0; i < LIMBS; ++i) {
+        WriteLimb(out + i * (LIMB_SIZE / 8), reduced.limbs[i]);
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(hash);
+    unsigned char expanded[Num3072::BYTE_SIZE];
+    ChaCha20(hash, sizeof(hash)).Output(expanded, sizeof(expanded));
+    return Num3072(expanded);
+}
+
+MuHash3072::MuHash3072(const unsigned char* data, size_t len) : m_numerator(ToNum3072(data, len)) {}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    m_numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    m_denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    m_numerator.Multiply(mul.m_numerator);
+    m_denominator.Multiply(mul.m_denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    m_numerator.Multiply(div.m_denominator);
+    m_denominator.Multiply(div.m_numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 value = m_numerator;
+    value.Divide(m_denominator);
+    unsigned char data[Num3072::BYTE_SIZE];
+    value.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(hash);
+}
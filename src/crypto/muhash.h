@@ -0,0 +1,117 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An integer modulo the prime 2^3072 - 1103717. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+    static const int LIMB_SIZE = 64;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+    static const int LIMB_SIZE = 32;
+#endif
+    static const int LIMBS = 3072 / LIMB_SIZE;
+    static const size_t BYTE_SIZE = 384;
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    /** Interpret 384 bytes as a little-endian number. */
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    void Divide(const Num3072& a);
+    Num3072 GetInverse() const;
+    /** Write the fully reduced value as 384 little-endian bytes. */
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]) const;
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        unsigned char data[BYTE_SIZE];
+        ToBytes(data);
+        s.write((const char*)data, BYTE_SIZE);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        unsigned char data[BYTE_SIZE];
+        s.read((char*)data, BYTE_SIZE);
+        *this = Num3072(data);
+    }
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+    /** Reduce a double-width product into this number. */
+    void Reduce(const limb_t (&wide)[2 * LIMBS]);
+};
+
+/**
+ * A hash of a set of byte strings (a multiset), which can be updated
+ * incrementally: elements can be added and removed in any order, and two
+ * set hashes can be combined into the hash of their union.
+ *
+ * Each element is mapped to a number modulo a 3072-bit prime by expanding
+ * its SHA256 with ChaCha20; the set hash is the product of its elements.
+ * Removal multiplies the denominator instead, so the (expensive) modular
+ * inverse is only computed once in Finalize().
+ *
+ * See https://cseweb.ucsd.edu/~mihir/papers/inchash.pdf and
+ * https://lists.linuxfoundation.org/pipermail/bitcoin-dev/2017-May/014337.html.
+ */
+class MuHash3072
+{
+private:
+    Num3072 m_numerator;
+    Num3072 m_denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    /** The hash of the empty set. */
+    MuHash3072() {}
+    /** The hash of the set containing only the given element. */
+    MuHash3072(const unsigned char* data, size_t len);
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    /** Combine with another set: the result is the hash of the union. */
+    MuHash3072& operator*=(const MuHash3072& mul);
+    /** Remove every element of another set. */
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) const;
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        m_numerator.Serialize(s);
+        m_denominator.Serialize(s);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        m_numerator.Unserialize(s);
+        m_denominator.Unserialize(s);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -171,3 +171,55 @@ uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint3
     SIPROUND;
     return v0 ^ v1 ^ v2 ^ v3;
 }
+
+/** Number of hashes computed side by side by SipHashUint256Batch */
+static const size_t SIPHASH_BATCH_LANES = 4;
+
+#define SIPROUND_LANES do { \
+    for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) { \
+        v0[l] += v1[l]; v1[l] = ROTL(v1[l], 13); v1[l] ^= v0[l]; \
+        v0[l] = ROTL(v0[l], 32); \
+        v2[l] += v3[l]; v3[l] = ROTL(v3[l], 16); v3[l] ^= v2[l]; \
+        v0[l] += v3[l]; v3[l] = ROTL(v3[l], 21); v3[l] ^= v0[l]; \
+        v2[l] += v1[l]; v1[l] = ROTL(v1[l], 17); v1[l] ^= v2[l]; \
+        v2[l] = ROTL(v2[l], 32); \
+    } \
+} while (0)
+
+void SipHashUint256Batch(uint64_t k0, uint64_t k1, const uint256* const* vals, uint64_t* out, size_t n)
+{
+    size_t i = 0;
+    for (; i + SIPHASH_BATCH_LANES <= n; i += SIPHASH_BATCH_LANES) {
+        uint64_t v0[SIPHASH_BATCH_LANES], v1[SIPHASH_BATCH_LANES], v2[SIPHASH_BATCH_LANES], v3[SIPHASH_BATCH_LANES], d[SIPHASH_BATCH_LANES];
+        for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) {
+            v0[l] = 0x736f6d6570736575ULL ^ k0;
+            v1[l] = 0x646f72616e646f6dULL ^ k1;
+            v2[l] = 0x6c7967656e657261ULL ^ k0;
+            v3[l] = 0x7465646279746573ULL ^ k1;
+        }
+        for (int w = 0; w < 4; w++) {
+            for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) {
+                d[l] = vals[i + l]->GetUint64(w);
+                v3[l] ^= d[l];
+            }
+            SIPROUND_LANES;
+            SIPROUND_LANES;
+            for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) v0[l] ^= d[l];
+        }
+        for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) v3[l] ^= ((uint64_t)4) << 59;
+        SIPROUND_LANES;
+        SIPROUND_LANES;
+        for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) {
+            v0[l] ^= ((uint64_t)4) << 59;
+            v2[l] ^= 0xFF;
+        }
+        SIPROUND_LANES;
+        SIPROUND_LANES;
+        SIPROUND_LANES;
+        SIPROUND_LANES;
+        for (size_t l = 0; l < SIPHASH_BATCH_LANES; l++) out[i + l] = v0[l] ^ v1[l] ^ v2[l] ^ v3[l];
+    }
+    for (; i < n; i++) {
+        out[i] = SipHashUint256(k0, k1, *vals[i]);
+    }
+}
@@ -475,6 +475,22 @@ public:
             }
         return false;
     }
+
+    /** get_live appends every element that has not been erased to elems,
+     * so that the contents of the cache can be saved and inserted again
+     * later.
+     *
+     * Like contains, get_live may run concurrently with other readers but
+     * not with insert.
+     *
+     * @param elems the vector to append the elements to
+     */
+    void get_live(std::vector<Element>& elems) const
+    {
+        for (uint32_t i = 0; i < size; ++i)
+            if (!collection_flags.bit_is_set(i))
+                elems.push_back(table[i]);
+    }
 };
 } // namespace CuckooCache
 
@@ -233,6 +233,14 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+std::shared_ptr<const leveldb::Snapshot> CDBWrapper::GetSnapshot() const
+{
+    leveldb::DB* db = pdb;
+    return std::shared_ptr<const leveldb::Snapshot>(pdb->GetSnapshot(), [db](const leveldb::Snapshot* snapshot) {
+        db->ReleaseSnapshot(snapshot);
+    });
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() const { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
@@ -13,6 +13,8 @@
 #include <util/strencodings.h>
 #include <version.h>
 
+#include <memory>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
@@ -310,6 +312,20 @@ public:
         return new CDBIterator(*this, pdb->NewIterator(iteroptions));
     }
 
+    /**
+     * Pin the current state of the database. Iterators created from the
+     * snapshot all see that state, regardless of later writes. The snapshot
+     * is released when the last reference to it goes away.
+     */
+    std::shared_ptr<const leveldb::Snapshot> GetSnapshot() const;
+
+    CDBIterator *NewIterator(const leveldb::Snapshot* snapshot)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return new CDBIterator(*this, pdb->NewIterator(options));
+    }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
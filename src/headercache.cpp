@@ -0,0 +1,188 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <headercache.h>
+
+#include <chain.h>
+#include <memusage.h>
+#include <primitives/block.h>
+#include <streams.h>
+#include <version.h>
+
+CHeaderCache g_header_cache(DEFAULT_HEADER_CACHE_SIZE << 20);
+
+CHeaderCache::CHeaderCache(size_t nMaxBytesIn) : nBaseHeight(0), nMaxBytes(nMaxBytesIn), nUsedBytes(0) {}
+
+CHeaderCache::Entry CHeaderCache::MakeEntry(const CBlockIndex* pindex, const CBlockHeader& header)
+{
+    std::vector<unsigned char> data;
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, data, 0) << header;
+    data.shrink_to_fit();
+    Entry entry;
+    entry.pindex = pindex;
+    entry.data = std::make_shared<const std::vector<unsigned char>>(std::move(data));
+    // Account for the payload, its shared vector, the deque slot and the map node
+    entry.nUsage = memusage::DynamicUsage(*entry.data) + memusage::MallocUsage(sizeof(std::vector<unsigned char>)) +
+                   sizeof(Entry) + memusage::MallocUsage(sizeof(std::pair<const uint256, int>) + sizeof(void*));
+    return entry;
+}
+
+void CHeaderCache::BlockConnected(const CBlockIndex* pindex, const CBlockHeader& header)
+{
+    AssertLockHeld(cs_main);
+    {
+        LOCK(cs);
+        if (nMaxBytes == 0) return;
+    }
+    Entry entry = MakeEntry(pindex, header);
+
+    LOCK(cs);
+    // The chain was changed behind our back (e.g. by loading a snapshot): start over
+    if (!entries.empty() && entries.back().pindex != pindex->pprev) ClearInternal();
+    if (entries.empty()) nBaseHeight = pindex->nHeight;
+    mapHeight[pindex->GetBlockHash()] = pindex->nHeight;
+    nUsedBytes += entry.nUsage;
+    entries.push_back(std::move(entry));
+    Trim();
+}
+
+void CHeaderCache::BlockDisconnected(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs);
+    if (entries.empty()) return;
+    if (entries.back().pindex != pindex) {
+        ClearInternal();
+        return;
+    }
+    mapHeight.erase(pindex->GetBlockHash());
+    nUsedBytes -= entries.back().nUsage;
+    entries.pop_back();
+}
+
+void CHeaderCache::Backfill(const CChain& chain, const Consensus::Params& params)
+{
+    AssertLockHeld(cs_main);
+    int nHeight;
+    size_t nBudget;
+    {
+        LOCK(cs);
+        if (!entries.empty() && entries.back().pindex != chain.Tip()) ClearInternal();
+        if (entries.empty()) {
+            if (chain.Tip() == nullptr) return;
+            nBaseHeight = chain.Height() + 1;
+        }
+        nHeight = nBaseHeight;
+        nBudget = nMaxBytes > nUsedBytes ? nMaxBytes - nUsedBytes : 0;
+    }
+    if (nBudget == 0) return;
+
+    // Build the entries without holding the lock, as auxpow headers are read
+    // from disk. Other writers are kept out by cs_main.
+    std::vector<Entry> vNew;
+    size_t nNewBytes = 0;
+    while (nHeight > 0) {
+        const CBlockIndex* pindex = chain[nHeight - 1];
+        Entry entry = MakeEntry(pindex, pindex->GetBlockHeader(params));
+        if (nNewBytes + entry.nUsage > nBudget) break;
+        nNewBytes += entry.nUsage;
+        vNew.push_back(std::move(entry));
+        nHeight--;
+    }
+
+    LOCK(cs);
+    for (Entry& entry : vNew) {
+        mapHeight[entry.pindex->GetBlockHash()] = entry.pindex->nHeight;
+        entries.push_front(std::move(entry));
+    }
+    nBaseHeight = nHeight;
+    nUsedBytes += nNewBytes;
+}
+
+int CHeaderCache::FindHeight(const uint256& hash) const
+{
+    AssertLockHeld(cs);
+    auto it = mapHeight.find(hash);
+    return it == mapHeight.end() ? -1 : it->second;
+}
+
+CHeaderCache::HeaderRef CHeaderCache::Get(const uint256& hash) const
+{
+    LOCK(cs);
+    const int nHeight = FindHeight(hash);
+    if (nHeight < 0) return nullptr;
+    return entries[nHeight - nBaseHeight].data;
+}
+
+bool CHeaderCache::GetHeadersAfter(const uint256& hash, const uint256& hashStop, size_t nMax, std::vector<HeaderRef>& headers, const CBlockIndex*& pindexLast) const
+{
+    LOCK(cs);
+    const int nHeight = FindHeight(hash);
+    if (nHeight < 0) return false;
+    headers.clear();
+    pindexLast = entries.back().pindex;
+    for (size_t i = nHeight - nBaseHeight + 1; i < entries.size() && headers.size() < nMax; i++) {
+        headers.push_back(entries[i].data);
+        pindexLast = entries[i].pindex;
+        if (pindexLast->GetBlockHash() == hashStop) break;
+    }
+    return true;
+}
+
+bool CHeaderCache::GetHeadersFrom(const uint256& hash, size_t nMax, std::vector<HeaderRef>& headers) const
+{
+    LOCK(cs);
+    const int nHeight = FindHeight(hash);
+    if (nHeight < 0) return false;
+    headers.clear();
+    for (size_t i = nHeight - nBaseHeight; i < entries.size() && headers.size() < nMax; i++) {
+        headers.push_back(entries[i].data);
+    }
+    return true;
+}
+
+void CHeaderCache::Clear()
+{
+    LOCK(cs);
+    ClearInternal();
+}
+
+void CHeaderCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+size_t CHeaderCache::Size() const
+{
+    LOCK(cs);
+    return entries.size();
+}
+
+size_t CHeaderCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nUsedBytes;
+}
+
+void CHeaderCache::ClearInternal()
+{
+    AssertLockHeld(cs);
+    entries.clear();
+    mapHeight.clear();
+    nBaseHeight = 0;
+    nUsedBytes = 0;
+}
+
+void CHeaderCache::Trim()
+{
+    AssertLockHeld(cs);
+    while (nUsedBytes > nMaxBytes && !entries.empty()) {
+        mapHeight.erase(entries.front().pindex->GetBlockHash());
+        nUsedBytes -= entries.front().nUsage;
+        entries.pop_front();
+        nBaseHeight++;
+    }
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HEADERCACHE_H
+#define BITCOIN_HEADERCACHE_H
+
+#include <crypto/common.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+class CBlockHeader;
+class CBlockIndex;
+class CChain;
+
+namespace Consensus {
+struct Params;
+}
+
+extern CCriticalSection cs_main;
+
+/** Default for -headercachesize, the header cache budget in MiB */
+static const int64_t DEFAULT_HEADER_CACHE_SIZE = 16;
+
+/**
+ * Serialized headers (including any auxpow) of the most recent part of the
+ * active chain, so that getheaders, REST and RPC can serve headers without
+ * holding cs_main or reading auxpow headers from disk.
+ *
+ * The cache covers a contiguous range of heights ending at the tip. It is
+ * updated under cs_main together with chainActive: connecting a block
+ * appends its header, disconnecting one drops it, and the lowest headers
+ * are dropped to stay within budget. Readers only take the cache's own
+ * lock, for as long as it takes to copy out the shared pointers.
+ */
+class CHeaderCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<unsigned char>> HeaderRef;
+
+    explicit CHeaderCache(size_t nMaxBytesIn);
+
+    /** Append the header of a block that was just connected to the tip. */
+    void BlockConnected(const CBlockIndex* pindex, const CBlockHeader& header) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    /** Drop the header of a block that was just disconnected from the tip. */
+    void BlockDisconnected(const CBlockIndex* pindex) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    /** Extend the cached range downwards along the active chain, as far as the budget allows. */
+    void Backfill(const CChain& chain, const Consensus::Params& params) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
+    /** Serialized header of an active chain block, or nullptr if it is not cached. */
+    HeaderRef Get(const uint256& hash) const;
+    /**
+     * Collect the headers following the given active chain block, up to nMax
+     * or including hashStop, and the block index of the last one (or of the
+     * tip, if there are none). Returns false if the block is not cached.
+     */
+    bool GetHeadersAfter(const uint256& hash, const uint256& hashStop, size_t nMax, std::vector<HeaderRef>& headers, const CBlockIndex*& pindexLast) const;
+    /** Collect up to nMax headers of the active chain, starting with the given block. Returns false if it is not cached. */
+    bool GetHeadersFrom(const uint256& hash, size_t nMax, std::vector<HeaderRef>& headers) const;
+
+    void Clear();
+    /** Change the byte budget. A budget of zero disables the cache. */
+    void SetMaxBytes(size_t nMaxBytesIn);
+    size_t Size() const;
+    size_t DynamicMemoryUsage() const;
+
+private:
+    struct HashHasher {
+        size_t operator()(const uint256& hash) const { return ReadLE64(hash.begin()); }
+    };
+    struct Entry {
+        const CBlockIndex* pindex;
+        HeaderRef data;
+        size_t nUsage;
+    };
+
+    mutable CCriticalSection cs;
+    //! The header at height nBaseHeight + i is entries[i]
+    std::deque<Entry> entries GUARDED_BY(cs);
+    int nBaseHeight GUARDED_BY(cs);
+    std::unordered_map<uint256, int, HashHasher> mapHeight GUARDED_BY(cs);
+    size_t nMaxBytes GUARDED_BY(cs);
+    size_t nUsedBytes GUARDED_BY(cs);
+
+    static Entry MakeEntry(const CBlockIndex* pindex, const CBlockHeader& header);
+    void ClearInternal() EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void Trim() EXCLUSIVE_LOCKS_REQUIRED(cs);
+    int FindHeight(const uint256& hash) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+};
+
+/** Shared by P2P header serving, REST and RPC. */
+extern CHeaderCache g_header_cache;
+
+#endif // BITCOIN_HEADERCACHE_H
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <blockfilewriter.h>
 #include <index/txindex.h>
 #include <shutdown.h>
 #include <ui_interface.h>
@@ -267,6 +268,8 @@ bool TxIndex::FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRe
         return false;
     }
 
+    // The block may still be queued for writing
+    g_block_file_writer.WaitForFile(postx.nFile);
     CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
     if (file.IsNull()) {
         return error("%s: OpenBlockFile failed", __func__);
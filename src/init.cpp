@@ -12,18 +12,22 @@
 #include <addrman.h>
 #include <amount.h>
 #include <banman.h>
+#include <blockcache.h>
+#include <blockfilewriter.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <compat/sanity.h>
 #include <consensus/validation.h>
 #include <fs.h>
+#include <headercache.h>
 #include <httpserver.h>
 #include <httprpc.h>
 #include <interfaces/chain.h>
 #include <index/txindex.h>
 #include <key.h>
 #include <validation.h>
+#include <mempooljournal.h>
 #include <miner.h>
 #include <netbase.h>
 #include <net.h>
@@ -74,6 +78,7 @@
 #endif
 
 bool fFeeEstimatesInitialized = false;
+static bool fSignatureCachesInitialized = false;
 static const bool DEFAULT_PROXYRANDOMIZE = true;
 static const bool DEFAULT_REST_ENABLE = false;
 static const bool DEFAULT_STOPAFTERBLOCKIMPORT = false;
@@ -233,6 +238,9 @@ void Shutdown(InitInterfaces& interfaces)
     threadGroup.interrupt_all();
     threadGroup.join_all();
 
+    // Nothing queues block or undo writes anymore; let the pending ones finish.
+    g_block_file_writer.Stop();
+
     // After the threads that potentially access these pointers have been stopped,
     // destruct and reset all to nullptr.
     peerLogic.reset();
@@ -243,6 +251,15 @@ void Shutdown(InitInterfaces& interfaces)
     if (g_is_mempool_loaded && gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
         DumpMempool();
     }
+    if (g_mempool_journal) {
+        // Whatever the dump did not cover (or everything, if there was none)
+        g_mempool_journal->Flush();
+        g_mempool_journal.reset();
+    }
+
+    if (fSignatureCachesInitialized && gArgs.GetBoolArg("-persistsigcache", DEFAULT_PERSIST_SIGCACHE)) {
+        DumpSignatureCaches();
+    }
 
     if (fFeeEstimatesInitialized)
     {
@@ -379,6 +396,7 @@ void SetupServerArgs()
     gArgs.AddArg("-alertnotify=<cmd>", "Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-algo=<algo>", "For mining, what algorithm to accept submitted blocks (default: sha256d)", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-assumevalid=<hex>", strprintf("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s)", defaultChainParams->GetConsensus().defaultAssumeValid.GetHex(), testnetChainParams->GetConsensus().defaultAssumeValid.GetHex()), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-blockcachesize=<n>", strprintf("Keep up to <n> MiB of recently served blocks in serialized form in memory, 0 to disable (at most %d, default: %u)", MAX_BLOCK_CACHE_SIZE, DEFAULT_BLOCK_CACHE_SIZE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-blocksdir=<dir>", "Specify blocks directory (default: <datadir>/blocks)", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-blocknotify=<cmd>", "Execute command when the best block changes (%s in cmd is replaced by block hash)", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-blockreconstructionextratxn=<n>", strprintf("Extra transactions to keep in memory for compact block reconstructions (default: %u)", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN), false, OptionsCategory::OPTIONS);
@@ -389,15 +407,19 @@ void SetupServerArgs()
     gArgs.AddArg("-dbcache=<n>", strprintf("Maximum database cache size <n> MiB (%d to %d, default: %d). In addition, unused mempool memory is shared for this cache (see -maxmempool).", nMinDbCache, nMaxDbCache, nDefaultDbCache), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-debuglogfile=<file>", strprintf("Specify location of debug log file. Relative paths will be prefixed by a net-specific datadir location. (-nodebuglogfile to disable; default: %s)", DEFAULT_DEBUGLOGFILE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER), true, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-headercachesize=<n>", strprintf("Keep the headers of up to <n> MiB worth of recent blocks in serialized form in memory, 0 to disable (default: %u)", DEFAULT_HEADER_CACHE_SIZE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-includeconf=<file>", "Specify additional configuration file, relative to the -datadir path (only useable from configuration file, not command line)", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-loadblock=<file>", "Imports blocks from external blk000??.dat file on startup", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-maxmempool=<n>", strprintf("Keep the transaction memory pool below <n> megabytes (default: %u)", DEFAULT_MAX_MEMPOOL_SIZE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-maxorphantx=<n>", strprintf("Keep at most <n> unconnectable transactions in memory (default: %u)", DEFAULT_MAX_ORPHAN_TRANSACTIONS), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-mempoolclusters", strprintf("Group connected mempool transactions into clusters, and evict and mine them by cluster chunk feerate (default: %u)", DEFAULT_MEMPOOL_CLUSTERS), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-mempoolexpiry=<n>", strprintf("Do not keep transactions in the mempool longer than <n> hours (default: %u)", DEFAULT_MEMPOOL_EXPIRY), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-mempooljournal", strprintf("Keep a journal of mempool changes between saves of the mempool, so that they are restored after an unclean shutdown (default: %u, only with -persistmempool)", DEFAULT_MEMPOOL_JOURNAL), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-minimumchainwork=<hex>", strprintf("Minimum work assumed to exist on a valid chain in hex (default: %s, testnet: %s)", defaultChainParams->GetConsensus().nMinimumChainWork.GetHex(), testnetChainParams->GetConsensus().nMinimumChainWork.GetHex()), true, OptionsCategory::OPTIONS);
     gArgs.AddArg("-par=<n>", strprintf("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)",
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-persistmempool", strprintf("Whether to save the mempool on shutdown and load on restart (default: %u)", DEFAULT_PERSIST_MEMPOOL), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-persistsigcache", strprintf("Whether to save the signature and script execution caches on shutdown and load them on restart, so that transactions checked before a restart are not checked again in blocks (default: %u)", DEFAULT_PERSIST_SIGCACHE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-pid=<file>", strprintf("Specify pid file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)", BITCOIN_PID_FILENAME), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-prune=<n>", strprintf("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
@@ -410,10 +432,12 @@ void SetupServerArgs()
     hidden_args.emplace_back("-sysperms");
 #endif
     gArgs.AddArg("-txindex", strprintf("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)", DEFAULT_TXINDEX), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-utxocommitment", strprintf("Maintain a rolling hash of the UTXO set while connecting blocks, used by gettxoutsetinfo \"muhash\" (default: %u)", DEFAULT_UTXO_COMMITMENT), false, OptionsCategory::OPTIONS);
 
     gArgs.AddArg("-addnode=<ip>", "Add a node to connect to and attempt to keep the connection open (see the `addnode` RPC command help for more info). This option can be specified multiple times to add multiple nodes.", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-banscore=<n>", strprintf("Threshold for disconnecting misbehaving peers (default: %u)", DEFAULT_BANSCORE_THRESHOLD), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-bantime=<n>", strprintf("Number of seconds to keep misbehaving peers from reconnecting (default: %u)", DEFAULT_MISBEHAVING_BANTIME), false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-blockrelaynode", strprintf("Relay new blocks as compact blocks to all outbound peers that support them as soon as their proof of work checks out, and ask up to %u peers (instead of %u) to do the same for us (default: %u)", MAX_RELAY_NODE_HB_CMPCT_PEERS, MAX_HB_CMPCT_PEERS, DEFAULT_BLOCK_RELAY_NODE), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-bind=<addr>", "Bind to given address and always listen on it. Use [host]:port notation for IPv6", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-connect=<ip>", "Connect only to the specified node; -noconnect disables automatic connections (the rules for this peer are the same as for -addnode). This option can be specified multiple times to connect to multiple nodes.", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-discover", "Discover own IP addresses (default: 1 when listening and no -externalip or -proxy)", false, OptionsCategory::CONNECTION);
@@ -429,6 +453,7 @@ void SetupServerArgs()
     gArgs.AddArg("-maxsendbuffer=<n>", strprintf("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)", DEFAULT_MAXSENDBUFFER), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-maxtimeadjustment", strprintf("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)", DEFAULT_MAX_TIME_ADJUSTMENT), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-maxuploadtarget=<n>", strprintf("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)", DEFAULT_MAX_UPLOAD_TARGET), false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-msghandthreads=<n>", strprintf("Number of threads processing peer messages; the messages of a peer are always processed by the same thread (1 to %d, default: %d)", MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-onion=<ip:port>", "Use separate SOCKS5 proxy to reach peers via Tor hidden services, set -noonion to disable (default: -proxy)", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-onlynet=<net>", "Make outgoing connections only through network <net> (ipv4, ipv6 or onion). Incoming connections are not affected by this option. This option can be specified multiple times to allow multiple networks.", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-peerbloomfilters", strprintf("Support filtering of blocks and transaction with bloom filters (default: %u)", DEFAULT_PEERBLOOMFILTERS), false, OptionsCategory::CONNECTION);
@@ -1020,8 +1045,10 @@ bool AppInitParameterInteraction()
     if (ratio != 0) {
         mempool.setSanityCheck(1.0 / ratio);
     }
+    mempool.SetClusterTracking(gArgs.GetBoolArg("-mempoolclusters", DEFAULT_MEMPOOL_CLUSTERS));
     fCheckBlockIndex = gArgs.GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = gArgs.GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    fMaintainUTXOCommitment = gArgs.GetBoolArg("-utxocommitment", DEFAULT_UTXO_COMMITMENT);
 
     hashAssumeValid = uint256S(gArgs.GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
     if (!hashAssumeValid.IsNull())
@@ -1297,6 +1324,17 @@ bool AppInitMain(InitInterfaces& interfaces)
 
     InitSignatureCache();
     InitScriptExecutionCache();
+    if (gArgs.GetBoolArg("-persistsigcache", DEFAULT_PERSIST_SIGCACHE)) {
+        LoadSignatureCaches();
+    }
+    fSignatureCachesInitialized = true;
+
+    int64_t nBlockCacheSize = std::max<int64_t>(0, gArgs.GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE));
+    nBlockCacheSize = std::min(nBlockCacheSize, MAX_BLOCK_CACHE_SIZE); // cannot be greater than MAX_BLOCK_CACHE_SIZE
+    g_raw_block_cache.SetMaxBytes(nBlockCacheSize << 20);
+    LogPrintf("Using %d MiB for the raw block cache\n", nBlockCacheSize);
+    int64_t nHeaderCacheSize = std::max<int64_t>(0, gArgs.GetArg("-headercachesize", DEFAULT_HEADER_CACHE_SIZE));
+    g_header_cache.SetMaxBytes(nHeaderCacheSize << 20);
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
@@ -1304,6 +1342,9 @@ bool AppInitMain(InitInterfaces& interfaces)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    // Start the thread appending to block and undo files
+    g_block_file_writer.Start();
+
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = std::bind(&CScheduler::serviceQueue, &scheduler);
     threadGroup.create_thread(std::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
@@ -1361,7 +1402,7 @@ bool AppInitMain(InitInterfaces& interfaces)
     assert(!g_connman);
     g_connman = std::unique_ptr<CConnman>(new CConnman(GetRand(std::numeric_limits<uint64_t>::max()), GetRand(std::numeric_limits<uint64_t>::max())));
 
-    peerLogic.reset(new PeerLogicValidation(g_connman.get(), g_banman.get(), scheduler, gArgs.GetBoolArg("-enablebip61", DEFAULT_ENABLE_BIP61)));
+    peerLogic.reset(new PeerLogicValidation(g_connman.get(), g_banman.get(), scheduler, gArgs.GetBoolArg("-enablebip61", DEFAULT_ENABLE_BIP61), gArgs.GetBoolArg("-blockrelaynode", DEFAULT_BLOCK_RELAY_NODE)));
     RegisterValidationInterface(peerLogic.get());
 
     // sanitize comments per BIP-0014, format user agent and check total size
@@ -1666,10 +1707,17 @@ bool AppInitMain(InitInterfaces& interfaces)
     // Allowed to fail as this file IS missing on first startup.
     if (!est_filein.IsNull())
         ::feeEstimator.Read(est_filein);
+    {
+        LOCK(cs_main);
+        ::feeEstimator.SetBlockInterval(GetRecentBlockInterval(chainActive.Tip(), chainparams.GetConsensus()));
+    }
     fFeeEstimatesInitialized = true;
 
     // ********************************************************* Step 8: start indexers
     if (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
+        // The blocks below a snapshot's base were never downloaded
+        if (IsUsingUTXOSnapshot())
+            return InitError(_("-txindex requires the full block history and can't be used with a UTXO snapshot."));
         g_txindex = MakeUnique<TxIndex>(nTxIndexCache, false, fReindex);
         g_txindex->Start();
     }
@@ -1730,6 +1778,13 @@ bool AppInitMain(InitInterfaces& interfaces)
         vImportFiles.push_back(strFile);
     }
 
+    // Follow the mempool from before it is loaded, so that nothing is missed once the
+    // journal is started by the first dump after loading.
+    if (gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL) && gArgs.GetBoolArg("-mempooljournal", DEFAULT_MEMPOOL_JOURNAL)) {
+        g_mempool_journal.reset(new CMempoolJournal(GetDataDir() / "mempool.journal"));
+        g_mempool_journal->Connect(mempool);
+    }
+
     threadGroup.create_thread(std::bind(&ThreadImport, vImportFiles));
 
     // Wait for genesis block to be processed
@@ -1757,6 +1812,10 @@ bool AppInitMain(InitInterfaces& interfaces)
         LOCK(cs_main);
         LogPrintf("mapBlockIndex.size() = %u\n", mapBlockIndex.size());
         chain_active_height = chainActive.Height();
+
+        const int64_t nStart = GetTimeMillis();
+        g_header_cache.Backfill(chainActive, chainparams.GetConsensus());
+        LogPrintf("Loaded %u headers into the header cache: %dms\n", g_header_cache.Size(), GetTimeMillis() - nStart);
     }
     LogPrintf("nBestHeight = %d\n", chain_active_height);
 
@@ -1782,6 +1841,7 @@ bool AppInitMain(InitInterfaces& interfaces)
     connOptions.m_msgproc = peerLogic.get();
     connOptions.nSendBufferMaxSize = 1000*gArgs.GetArg("-maxsendbuffer", DEFAULT_MAXSENDBUFFER);
     connOptions.nReceiveFloodSize = 1000*gArgs.GetArg("-maxreceivebuffer", DEFAULT_MAXRECEIVEBUFFER);
+    connOptions.nMessageHandlerThreads = gArgs.GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
     connOptions.m_added_nodes = gArgs.GetArgs("-addnode");
 
     connOptions.nMaxOutboundTimeframe = nMaxOutboundTimeframe;
@@ -1841,5 +1901,18 @@ bool AppInitMain(InitInterfaces& interfaces)
         g_banman->DumpBanlist();
     }, DUMP_BANS_INTERVAL * 1000);
 
+    scheduler.scheduleEvery([]{
+        TrimMempool(::mempool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    }, MEMPOOL_TRIM_INTERVAL);
+
+    if (g_mempool_journal) {
+        scheduler.scheduleEvery([]{
+            g_mempool_journal->Flush();
+            if (g_is_mempool_loaded && g_mempool_journal->NeedsDump()) {
+                DumpMempool();
+            }
+        }, MEMPOOL_JOURNAL_FLUSH_INTERVAL * 1000);
+    }
+
     return true;
 }
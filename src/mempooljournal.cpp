@@ -0,0 +1,195 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <mempooljournal.h>
+
+#include <clientversion.h>
+#include <logging.h>
+#include <streams.h>
+#include <txmempool.h>
+#include <util/system.h>
+#include <util/time.h>
+
+#include <map>
+
+std::unique_ptr<CMempoolJournal> g_mempool_journal;
+
+static const uint64_t MEMPOOL_JOURNAL_VERSION = 1;
+static const uint8_t JOURNAL_ADD = 1;
+static const uint8_t JOURNAL_REMOVE = 2;
+
+CMempoolJournal::CMempoolJournal(const fs::path& pathIn) : path(pathIn), fDumping(false), fWritable(false), nFileSize(0) {}
+
+void CMempoolJournal::Connect(CTxMemPool& pool)
+{
+    connAdded = pool.NotifyEntryAdded.connect([this](CTransactionRef tx) {
+        TransactionAdded(tx, GetTime());
+    });
+    connRemoved = pool.NotifyEntryRemoved.connect([this](CTransactionRef tx, MemPoolRemovalReason reason) {
+        TransactionRemoved(tx->GetHash());
+    });
+}
+
+void CMempoolJournal::TransactionAdded(const CTransactionRef& tx, int64_t nTime)
+{
+    LOCK(cs);
+    vQueue.push_back(Record{tx, tx->GetHash(), nTime});
+}
+
+void CMempoolJournal::TransactionRemoved(const uint256& hash)
+{
+    LOCK(cs);
+    vQueue.push_back(Record{nullptr, hash, 0});
+}
+
+bool CMempoolJournal::Flush()
+{
+    LOCK(cs_file);
+    std::vector<Record> vRecords;
+    {
+        LOCK(cs);
+        if (!fWritable || fDumping) return true;
+        vRecords.swap(vQueue);
+    }
+    if (vRecords.empty()) return true;
+
+    try {
+        CAutoFile file(fsbridge::fopen(path, "ab"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            throw std::runtime_error("open failed");
+        }
+        for (const Record& record : vRecords) {
+            if (record.tx) {
+                file << JOURNAL_ADD << *record.tx << record.nTime;
+            } else {
+                file << JOURNAL_REMOVE << record.hash;
+            }
+        }
+        if (!FileCommit(file.Get()))
+            throw std::runtime_error("FileCommit failed");
+        file.fclose();
+        nFileSize = fs::file_size(path);
+    } catch (const std::exception& e) {
+        // The file may end in a partial record now, so leave it alone until
+        // the next dump starts it over.
+        LogPrintf("Failed to write mempool journal: %s. Continuing anyway.\n", e.what());
+        LOCK(cs);
+        fWritable = false;
+        vQueue.clear();
+        return false;
+    }
+    return true;
+}
+
+void CMempoolJournal::DumpStarted()
+{
+    LOCK(cs);
+    fDumping = true;
+    vBeforeDump.insert(vBeforeDump.end(), vQueue.begin(), vQueue.end());
+    vQueue.clear();
+}
+
+void CMempoolJournal::DumpFinished(bool fSuccess)
+{
+    LOCK(cs_file);
+    if (fSuccess) {
+        try {
+            CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull()) {
+                throw std::runtime_error("open failed");
+            }
+            file << MEMPOOL_JOURNAL_VERSION;
+            if (!FileCommit(file.Get()))
+                throw std::runtime_error("FileCommit failed");
+            file.fclose();
+            nFileSize = fs::file_size(path);
+        } catch (const std::exception& e) {
+            LogPrintf("Failed to start mempool journal: %s. Continuing anyway.\n", e.what());
+            fSuccess = false;
+        }
+    }
+
+    LOCK(cs);
+    fDumping = false;
+    if (!fSuccess && fWritable) {
+        // The journal still has to cover everything since the previous dump
+        vQueue.insert(vQueue.begin(), vBeforeDump.begin(), vBeforeDump.end());
+    } else if (!fSuccess) {
+        // No journal of ours to append to; the next dump will try again
+        vQueue.clear();
+    }
+    vBeforeDump.clear();
+    fWritable = fSuccess || fWritable;
+}
+
+bool CMempoolJournal::NeedsDump() const
+{
+    LOCK2(cs_file, cs);
+    return !fWritable || nFileSize > MAX_MEMPOOL_JOURNAL_SIZE;
+}
+
+uint64_t CMempoolJournal::GetFileSize() const
+{
+    LOCK(cs_file);
+    return nFileSize;
+}
+
+bool ReadMempoolJournal(const fs::path& path, std::vector<CMempoolJournal::Entry>& vAdded, std::set<uint256>& setRemoved)
+{
+    vAdded.clear();
+    setRemoved.clear();
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) return false;
+
+    // Transactions removed again are left as null entries, and dropped at the end
+    std::vector<CMempoolJournal::Entry> vAll;
+    std::map<uint256, size_t> mapIndex;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_JOURNAL_VERSION) return false;
+    } catch (const std::exception& e) {
+        return false;
+    }
+
+    while (true) {
+        uint8_t type;
+        try {
+            file >> type;
+        } catch (const std::exception& e) {
+            break;
+        }
+        try {
+            if (type == JOURNAL_ADD) {
+                CMempoolJournal::Entry entry;
+                file >> entry.tx >> entry.nTime;
+                const uint256& hash = entry.tx->GetHash();
+                auto it = mapIndex.find(hash);
+                if (it != mapIndex.end()) vAll[it->second].tx = nullptr;
+                mapIndex[hash] = vAll.size();
+                vAll.push_back(std::move(entry));
+                setRemoved.erase(hash);
+            } else if (type == JOURNAL_REMOVE) {
+                uint256 hash;
+                file >> hash;
+                auto it = mapIndex.find(hash);
+                if (it != mapIndex.end()) {
+                    vAll[it->second].tx = nullptr;
+                    mapIndex.erase(it);
+                }
+                setRemoved.insert(hash);
+            } else {
+                throw std::runtime_error("unknown record type");
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("Mempool journal ends in a partial record (%s), ignoring the rest\n", e.what());
+            break;
+        }
+    }
+
+    for (CMempoolJournal::Entry& entry : vAll) {
+        if (entry.tx) vAdded.push_back(std::move(entry));
+    }
+    return true;
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMPOOLJOURNAL_H
+#define BITCOIN_MEMPOOLJOURNAL_H
+
+#include <fs.h>
+#include <primitives/transaction.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <memory>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/signals2/connection.hpp>
+
+class CTxMemPool;
+
+/** Default for -mempooljournal */
+static const bool DEFAULT_MEMPOOL_JOURNAL = true;
+/** How often (in seconds) queued mempool changes are appended to the journal */
+static const int64_t MEMPOOL_JOURNAL_FLUSH_INTERVAL = 10;
+/** Journal size (in bytes) above which the mempool is dumped in full and the journal restarted */
+static const uint64_t MAX_MEMPOOL_JOURNAL_SIZE = 32 << 20;
+
+/**
+ * Log of the transactions added to and removed from the mempool since it
+ * was last dumped to mempool.dat, so that a node that goes down without
+ * dumping it still gets its mempool back on restart.
+ *
+ * Changes are queued as they happen and appended to the file by Flush().
+ * A dump holds appending back from the moment its snapshot is taken. Once
+ * the dump is in place the journal starts over, with only the changes
+ * made after the snapshot; if the dump fails, nothing is lost. Nothing is
+ * written before the first successful dump, as the existing journal still
+ * belongs to the existing mempool.dat until then.
+ *
+ * Fee deltas set with prioritisetransaction are only saved by full dumps.
+ */
+class CMempoolJournal
+{
+public:
+    struct Entry {
+        CTransactionRef tx;
+        int64_t nTime;
+    };
+
+    explicit CMempoolJournal(const fs::path& pathIn);
+
+    /** Follow the changes made to a mempool. */
+    void Connect(CTxMemPool& pool);
+    void TransactionAdded(const CTransactionRef& tx, int64_t nTime);
+    void TransactionRemoved(const uint256& hash);
+
+    /** Append the queued changes to the file. Returns false if they could not be written. */
+    bool Flush();
+    /** The mempool is being snapshotted for a dump; must be called under its lock. */
+    void DumpStarted();
+    /** The dump has been written out (fSuccess) or given up on. */
+    void DumpFinished(bool fSuccess);
+    /** Whether the mempool should be dumped in full, to start the journal or to stop it from growing. */
+    bool NeedsDump() const;
+    uint64_t GetFileSize() const;
+
+private:
+    //! A removal if tx is null
+    struct Record {
+        CTransactionRef tx;
+        uint256 hash;
+        int64_t nTime;
+    };
+
+    const fs::path path;
+    //! Taken before cs
+    mutable CCriticalSection cs_file;
+    mutable CCriticalSection cs;
+    std::vector<Record> vQueue GUARDED_BY(cs);
+    //! Changes queued before the snapshot of a dump in progress
+    std::vector<Record> vBeforeDump GUARDED_BY(cs);
+    bool fDumping GUARDED_BY(cs);
+    //! Whether the file was restarted by a dump of ours, so that it can be appended to
+    bool fWritable GUARDED_BY(cs);
+    uint64_t nFileSize GUARDED_BY(cs_file);
+
+    boost::signals2::scoped_connection connAdded;
+    boost::signals2::scoped_connection connRemoved;
+};
+
+/**
+ * Read the changes recorded in a journal: the transactions added and still
+ * in the mempool at the end, in the order they were added, and the hashes
+ * of those removed. A record cut short by a crash ends the journal.
+ */
+bool ReadMempoolJournal(const fs::path& path, std::vector<CMempoolJournal::Entry>& vAdded, std::set<uint256>& setRemoved);
+
+/** Journal of the node's mempool, if -persistmempool and -mempooljournal are enabled. */
+extern std::unique_ptr<CMempoolJournal> g_mempool_journal;
+
+#endif // BITCOIN_MEMPOOLJOURNAL_H
@@ -28,6 +28,7 @@
 #include <algorithm>
 #include <memory>
 #include <queue>
+#include <tuple>
 #include <utility>
 
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
@@ -149,7 +150,11 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    if (mempool.IsTrackingClusters()) {
+        addChunkTxs(nPackagesSelected);
+    } else {
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    }
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -438,6 +443,72 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     }
 }
 
+void BlockAssembler::addChunkTxs(int &nPackagesSelected)
+{
+    mempool.UpdateClusters();
+    const std::map<uint64_t, CTxMemPool::Cluster>& clusters = mempool.GetClusters();
+
+    // The next chunk of every cluster, by feerate. Chunks of a cluster come in
+    // non-increasing feerate order, so the best one left is always on top.
+    typedef std::tuple<double, uint64_t, size_t> NextChunk;
+    std::priority_queue<NextChunk> queue;
+    for (const auto& entry : clusters) {
+        const CTxMemPool::ClusterChunk& chunk = entry.second.vChunks.front();
+        queue.emplace((double)chunk.nFee / chunk.nSize, entry.first, 0);
+    }
+
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    while (!queue.empty()) {
+        const uint64_t nId = std::get<1>(queue.top());
+        const size_t nChunk = std::get<2>(queue.top());
+        queue.pop();
+        const CTxMemPool::Cluster& cluster = clusters.at(nId);
+        const CTxMemPool::ClusterChunk& chunk = cluster.vChunks[nChunk];
+
+        if (chunk.nFee < blockMinFeeRate.GetFee(chunk.nSize)) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        const size_t nBegin = nChunk > 0 ? cluster.vChunks[nChunk - 1].nEnd : 0;
+        CTxMemPool::setEntries package;
+        int64_t packageSigOpsCost = 0;
+        for (size_t i = nBegin; i < chunk.nEnd; i++) {
+            package.insert(cluster.vTx[i]);
+            packageSigOpsCost += cluster.vTx[i]->GetSigOpCost();
+        }
+
+        // Later chunks of the cluster may spend this one, so they are skipped
+        // along with it.
+        if (!TestPackage(chunk.nSize, packageSigOpsCost)) {
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
+                    nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+        if (!TestPackageTransactions(package)) {
+            continue;
+        }
+        nConsecutiveFailed = 0;
+
+        // The cluster's linearization is topological, and so is every chunk
+        for (size_t i = nBegin; i < chunk.nEnd; i++) {
+            AddToBlock(cluster.vTx[i]);
+        }
+        ++nPackagesSelected;
+
+        if (nChunk + 1 < cluster.vChunks.size()) {
+            const CTxMemPool::ClusterChunk& next = cluster.vChunks[nChunk + 1];
+            queue.emplace((double)next.nFee / next.nSize, nId, nChunk + 1);
+        }
+    }
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
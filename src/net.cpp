@@ -26,12 +26,18 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_POLL
 #include <poll.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -71,6 +77,16 @@ enum BindFlags {
 // The sleep time needs to be small to avoid new sockets stalling
 static const uint64_t SELECT_TIMEOUT_MILLISECONDS = 50;
 
+#ifndef WIN32
+/** Maximum number of queued buffers passed to a single sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+#endif
+
+#ifdef USE_EPOLL
+/** Maximum number of socket events handled per epoll_wait() call */
+static const int MAX_EPOLL_EVENTS = 256;
+#endif
+
 const std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 
 static const uint64_t RANDOMIZER_ID_NETGROUP = 0x6c0edd8036ef4036ULL; // SHA256("netgroup")[0:8]
@@ -527,6 +543,16 @@ void CNode::copyStats(CNodeStats &stats)
         X(mapRecvBytesPerMsgCmd);
         X(nRecvBytes);
     }
+    {
+        LOCK(cs_vProcessMsg);
+        stats.nProcessQueueMsgs = vProcessMsg.size();
+        stats.nProcessQueueBytes = nProcessQueueSize;
+        X(nProcessedMsgs);
+        X(nProcessTime);
+        X(mapProcessTimePerMsgCmd);
+        X(nQueueWaitTotal);
+        X(nQueueWaitMax);
+    }
     X(fWhitelisted);
     {
         LOCK(cs_feeFilter);
@@ -555,7 +581,22 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete)
+void CNode::RecordMsgProcessed(const std::string& command, int64_t nQueueWait, int64_t nTime)
+{
+    LOCK(cs_vProcessMsg);
+    nProcessedMsgs++;
+    nProcessTime += nTime;
+    // Only count known commands, as for mapRecvBytesPerMsgCmd
+    mapMsgCmdSize::iterator i = mapProcessTimePerMsgCmd.find(command);
+    if (i == mapProcessTimePerMsgCmd.end())
+        i = mapProcessTimePerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapProcessTimePerMsgCmd.end());
+    i->second += nTime;
+    nQueueWaitTotal += nQueueWait;
+    nQueueWaitMax = std::max(nQueueWaitMax, nQueueWait);
+}
+
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete, CNetRecvBufferPool* recv_pool)
 {
     complete = false;
     int64_t nTimeMicros = GetTimeMicros();
@@ -567,7 +608,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION, recv_pool);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -669,6 +710,9 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
+    if (nDataPos == 0 && m_recv_pool) {
+        m_recv_pool->Get(vRecv, std::min(hdr.nMessageSize, nCopy + 256 * 1024));
+    }
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
         vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
@@ -689,32 +733,122 @@ const uint256& CNetMessage::GetMessageHash() const
     return data_hash;
 }
 
+CNetRecvBufferPool::CNetRecvBufferPool(size_t nMaxRetainedIn) : nMaxRetained(nMaxRetainedIn), nBuffers(0), nBytesRetained(0), nHits(0), nMisses(0)
+{
+    static_assert(MIN_CLASS_SIZE << (NUM_CLASSES - 1) == MAX_CLASS_SIZE, "size classes must span MIN_CLASS_SIZE to MAX_CLASS_SIZE");
+}
+
+void CNetRecvBufferPool::Get(CDataStream& stream, size_t nSize)
+{
+    if (nSize > MAX_CLASS_SIZE) return;
+    int nClass = 0;
+    while ((MIN_CLASS_SIZE << nClass) < nSize) nClass++;
+
+    CSerializeData buffer;
+    {
+        LOCK(cs);
+        std::vector<CSerializeData>& free = vFree[nClass];
+        if (!free.empty()) {
+            buffer.swap(free.back());
+            free.pop_back();
+            nBuffers--;
+            nBytesRetained -= buffer.capacity();
+            nHits++;
+        } else {
+            nMisses++;
+        }
+    }
+    // Round fresh buffers up to their size class, so they can be pooled again
+    if (buffer.capacity() == 0) buffer.reserve(MIN_CLASS_SIZE << nClass);
+    stream.clear();
+    stream.swap(buffer);
+}
+
+void CNetRecvBufferPool::Release(CDataStream& stream)
+{
+    CSerializeData buffer;
+    stream.swap(buffer);
+    const size_t nCapacity = buffer.capacity();
+    if (nCapacity < MIN_CLASS_SIZE || nCapacity > MAX_CLASS_SIZE) return;
+    int nClass = 0;
+    while (nClass + 1 < NUM_CLASSES && (MIN_CLASS_SIZE << (nClass + 1)) <= nCapacity) nClass++;
+    buffer.clear();
+
+    LOCK(cs);
+    std::vector<CSerializeData>& free = vFree[nClass];
+    if (free.size() >= MAX_BUFFERS_PER_CLASS || nBytesRetained + nCapacity > nMaxRetained) return;
+    free.push_back(std::move(buffer));
+    nBuffers++;
+    nBytesRetained += nCapacity;
+}
+
+CNetRecvBufferPool::Stats CNetRecvBufferPool::GetStats() const
+{
+    LOCK(cs);
+    Stats stats;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nBuffers = nBuffers;
+    stats.nBytesRetained = nBytesRetained;
+    return stats;
+}
+
 size_t CConnman::SocketSendData(CNode *pnode) const EXCLUSIVE_LOCKS_REQUIRED(pnode->cs_vSend)
 {
-    auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+    while (!pnode->vSendMsg.empty()) {
+        assert(pnode->vSendMsg.front()->size() > pnode->nSendOffset);
+        size_t nToSend = 0;
         int nBytes = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            const auto& data = *pnode->vSendMsg.front();
+            nToSend = data.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Hand as many queued buffers to the kernel at once as possible
+            struct iovec iov[MAX_SEND_IOVECS];
+            int nBuffers = 0;
+            size_t nOffset = pnode->nSendOffset;
+            for (auto it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_IOVECS; ++it) {
+                const auto& data = **it;
+                iov[nBuffers].iov_base = const_cast<unsigned char*>(data.data()) + nOffset;
+                iov[nBuffers].iov_len = data.size() - nOffset;
+                nToSend += data.size() - nOffset;
+                nOffset = 0;
+                nBuffers++;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nBuffers;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the buffers that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const size_t nBufferSize = pnode->vSendMsg.front()->size();
+                const size_t nRemaining = nBufferSize - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
-                it++;
-            } else {
+                pnode->nSendSize -= nBufferSize;
+                pnode->vSendMsg.pop_front();
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nToSend) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -733,11 +867,10 @@ size_t CConnman::SocketSendData(CNode *pnode) const EXCLUSIVE_LOCKS_REQUIRED(pno
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
     return nSentSize;
 }
 
@@ -973,6 +1106,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    RegisterSocketEvents(pnode);
 }
 
 void CConnman::DisconnectNodes()
@@ -1248,8 +1382,72 @@ void CConnman::SocketEvents(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_s
 }
 #endif
 
+bool CConnman::SocketReceiveData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = 0;
+    {
+        LOCK(pnode->cs_hSocket);
+        if (pnode->hSocket == INVALID_SOCKET)
+            return false;
+        nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    }
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify, &m_recv_buffer_pool))
+            pnode->CloseSocketDisconnect();
+        RecordBytesRecv(nBytes);
+        if (notify) {
+            size_t nSizeAdded = 0;
+            auto it(pnode->vRecvMsg.begin());
+            for (; it != pnode->vRecvMsg.end(); ++it) {
+                if (!it->complete())
+                    break;
+                nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+            }
+            {
+                LOCK(pnode->cs_vProcessMsg);
+                pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                pnode->nProcessQueueSize += nSizeAdded;
+                pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
+            }
+            WakeMessageHandler(pnode->GetId());
+        }
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect) {
+            LogPrint(BCLog::NET, "socket closed\n");
+        }
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+        return false;
+    }
+    return true;
+}
+
 void CConnman::SocketHandler()
 {
+#ifdef USE_EPOLL
+    if (m_epoll_fd != -1) {
+        SocketHandlerEpoll();
+        return;
+    }
+#endif
+
     std::set<SOCKET> recv_set, send_set, error_set;
     SocketEvents(recv_set, send_set, error_set);
 
@@ -1297,57 +1495,7 @@ void CConnman::SocketHandler()
         }
         if (recvSet || errorSet)
         {
-            // typical socket buffer is 8K-64K
-            char pchBuf[0x10000];
-            int nBytes = 0;
-            {
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-            }
-            if (nBytes > 0)
-            {
-                bool notify = false;
-                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                    pnode->CloseSocketDisconnect();
-                RecordBytesRecv(nBytes);
-                if (notify) {
-                    size_t nSizeAdded = 0;
-                    auto it(pnode->vRecvMsg.begin());
-                    for (; it != pnode->vRecvMsg.end(); ++it) {
-                        if (!it->complete())
-                            break;
-                        nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                    }
-                    {
-                        LOCK(pnode->cs_vProcessMsg);
-                        pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                        pnode->nProcessQueueSize += nSizeAdded;
-                        pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                    }
-                    WakeMessageHandler();
-                }
-            }
-            else if (nBytes == 0)
-            {
-                // socket closed gracefully
-                if (!pnode->fDisconnect) {
-                    LogPrint(BCLog::NET, "socket closed\n");
-                }
-                pnode->CloseSocketDisconnect();
-            }
-            else if (nBytes < 0)
-            {
-                // error
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                {
-                    if (!pnode->fDisconnect)
-                        LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                    pnode->CloseSocketDisconnect();
-                }
-            }
+            SocketReceiveData(pnode);
         }
 
         //
@@ -1371,6 +1519,201 @@ void CConnman::SocketHandler()
     }
 }
 
+#ifdef USE_EPOLL
+/**
+ * Socket handler for the epoll backend. Sockets are registered once, when
+ * their peer is added, in edge-triggered mode, so every event is a change
+ * in readiness which is remembered in the peer until a read or write would
+ * block again. Only peers that were reported ready are looked at, instead
+ * of rebuilding and polling the full socket set on every iteration.
+ */
+void CConnman::SocketHandlerEpoll()
+{
+    // Let go of peers that are going away or have no readiness left, and find
+    // out whether the others can make progress without waiting for events.
+    bool fPending = false;
+    {
+        std::vector<CNode*> vReady;
+        std::vector<CNode*> vRelease;
+        for (CNode* pnode : m_ready_nodes) {
+            bool fHaveSend;
+            {
+                LOCK(pnode->cs_vSend);
+                fHaveSend = !pnode->vSendMsg.empty();
+            }
+            // Like the select() loop, drain pending sends before reading more
+            const bool fCanRecv = pnode->fSocketRecvReady && !fHaveSend;
+            const bool fCanSend = pnode->fSocketSendReady && fHaveSend;
+            if (pnode->fDisconnect || (!pnode->fSocketRecvReady && !fCanSend)) {
+                pnode->fSocketReadyListed = false;
+                vRelease.push_back(pnode);
+                continue;
+            }
+            if ((fCanRecv && !pnode->fPauseRecv) || fCanSend) fPending = true;
+            vReady.push_back(pnode);
+        }
+        m_ready_nodes.swap(vReady);
+        if (!vRelease.empty()) {
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vRelease)
+                pnode->Release();
+        }
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(m_epoll_fd, events, MAX_EPOLL_EVENTS, fPending ? 0 : SELECT_TIMEOUT_MILLISECONDS);
+
+    if (interruptNet) return;
+
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        }
+        nEvents = 0;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == &m_wakeup_fd) {
+            uint64_t nWakeups;
+            if (read(m_wakeup_fd, &nWakeups, sizeof(nWakeups)) < 0) {}
+            continue;
+        }
+        bool fListenSocket = false;
+        for (const ListenSocket& hListenSocket : vhListenSocket) {
+            if (ptr == &hListenSocket) {
+                // Listening sockets are level-triggered, so accepting one connection per event is enough
+                AcceptConnection(hListenSocket);
+                fListenSocket = true;
+                break;
+            }
+        }
+        if (fListenSocket) continue;
+
+        // A peer is only deleted once its socket is closed, which removes it
+        // from the epoll set, and never while we hold a reference to it.
+        CNode* pnode = static_cast<CNode*>(ptr);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) pnode->fSocketRecvReady = true;
+        if (events[i].events & EPOLLOUT) pnode->fSocketSendReady = true;
+        if (!pnode->fSocketReadyListed) {
+            pnode->fSocketReadyListed = true;
+            pnode->AddRef();
+            m_ready_nodes.push_back(pnode);
+        }
+    }
+
+    //
+    // Service the peers that are ready
+    //
+    for (CNode* pnode : m_ready_nodes)
+    {
+        if (interruptNet)
+            return;
+        if (pnode->fDisconnect)
+            continue;
+
+        bool fHaveSend;
+        {
+            LOCK(pnode->cs_vSend);
+            fHaveSend = !pnode->vSendMsg.empty();
+            if (fHaveSend && pnode->fSocketSendReady) {
+                size_t nBytes = SocketSendData(pnode);
+                if (nBytes) {
+                    RecordBytesSent(nBytes);
+                }
+                // Whatever is left did not fit; the next EPOLLOUT event tells us when it can
+                fHaveSend = !pnode->vSendMsg.empty();
+                if (fHaveSend) pnode->fSocketSendReady = false;
+            }
+        }
+
+        if (pnode->fSocketRecvReady && !fHaveSend && !pnode->fPauseRecv) {
+            if (!SocketReceiveData(pnode)) pnode->fSocketRecvReady = false;
+        }
+    }
+
+    // Idle peers produce no events, so check all of them for timeouts periodically
+    const int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime != m_last_inactivity_check) {
+        m_last_inactivity_check = nTime;
+        std::vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            for (CNode* pnode : vNodesCopy)
+                pnode->AddRef();
+        }
+        for (CNode* pnode : vNodesCopy)
+            InactivityCheck(pnode);
+        {
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+bool CConnman::InitSocketEvents()
+{
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd == -1) return false;
+    m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup_fd == -1) return false;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &m_wakeup_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event) != 0) return false;
+    for (ListenSocket& hListenSocket : vhListenSocket) {
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) return false;
+    }
+    return true;
+}
+
+void CConnman::ShutdownSocketEvents()
+{
+    for (CNode* pnode : m_ready_nodes) {
+        pnode->fSocketReadyListed = false;
+        pnode->Release();
+    }
+    m_ready_nodes.clear();
+    if (m_wakeup_fd != -1) close(m_wakeup_fd);
+    if (m_epoll_fd != -1) close(m_epoll_fd);
+    m_wakeup_fd = -1;
+    m_epoll_fd = -1;
+}
+#endif
+
+void CConnman::RegisterSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (m_epoll_fd == -1) return;
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET) return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("Failed to watch socket of peer=%d: %s\n", pnode->GetId(), NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+void CConnman::WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (m_wakeup_fd == -1) return;
+    uint64_t nOne = 1;
+    if (write(m_wakeup_fd, &nOne, sizeof(nOne)) < 0) {
+        // The counter is saturated, so a wakeup is pending anyway
+    }
+#endif
+}
+
 void CConnman::ThreadSocketHandler()
 {
     while (!interruptNet)
@@ -1385,9 +1728,27 @@ void CConnman::WakeMessageHandler()
 {
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+        for (size_t i = 0; i < vMsgProcWake.size(); i++) {
+            vMsgProcWake[i] = true;
+        }
     }
-    condMsgProc.notify_one();
+    condMsgProc.notify_all();
+}
+
+void CConnman::WakeMessageHandler(NodeId id)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        if (vMsgProcWake.empty()) return;
+        vMsgProcWake[GetMessageHandlerThread(id)] = true;
+    }
+    // The threads share the condition variable, so wake all of them to be sure to reach the right one
+    condMsgProc.notify_all();
+}
+
+int CConnman::GetMessageHandlerThread(NodeId id) const
+{
+    return id % nMessageHandlerThreads;
 }
 
 
@@ -1943,18 +2304,20 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    RegisterSocketEvents(pnode);
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int nShard)
 {
     while (!flagInterruptMsgProc)
     {
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
+            for (CNode* pnode : vNodes) {
+                if (GetMessageHandlerThread(pnode->GetId()) != nShard) continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -1988,9 +2351,9 @@ void CConnman::ThreadMessageHandler()
 
         WAIT_LOCK(mutexMsgProc, lock);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this, nShard] { return vMsgProcWake[nShard]; });
         }
-        fMsgProcWake = false;
+        vMsgProcWake[nShard] = false;
     }
 }
 
@@ -2234,6 +2597,13 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         semAddnode = MakeUnique<CSemaphore>(nMaxAddnode);
     }
 
+#ifdef USE_EPOLL
+    if (!InitSocketEvents()) {
+        LogPrintf("Unable to set up epoll (%s), falling back to poll()\n", NetworkErrorString(errno));
+        ShutdownSocketEvents();
+    }
+#endif
+
     //
     // Start threads
     //
@@ -2244,7 +2614,7 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 
     {
         LOCK(mutexMsgProc);
-        fMsgProcWake = false;
+        vMsgProcWake.assign(nMessageHandlerThreads, false);
     }
 
     // Send and receive from sockets, accept connections
@@ -2270,7 +2640,12 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        const std::string strName = nMessageHandlerThreads > 1 ? strprintf("msghand.%d", i) : "msghand";
+        threadMessageHandler.emplace_back([this, i, strName]() {
+            TraceThread(strName.c_str(), std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i)));
+        });
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpAddresses, this), DUMP_PEERS_INTERVAL * 1000);
@@ -2302,6 +2677,7 @@ void CConnman::Interrupt()
     condMsgProc.notify_all();
 
     interruptNet();
+    WakeSocketHandler();
     InterruptSocks5(true);
 
     if (semOutbound) {
@@ -2319,8 +2695,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (std::thread& thread : threadMessageHandler) {
+        if (thread.joinable())
+            thread.join();
+    }
+    threadMessageHandler.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2336,6 +2715,10 @@ void CConnman::Stop()
         fAddressesInitialized = false;
     }
 
+#ifdef USE_EPOLL
+    ShutdownSocketEvents();
+#endif
+
     // Close sockets
     for (CNode* pnode : vNodes)
         pnode->CloseSocketDisconnect();
@@ -2635,9 +3018,12 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     filterInventoryKnown.reset();
     pfilter = MakeUnique<CBloomFilter>();
 
-    for (const std::string &msg : getAllNetMessageTypes())
+    for (const std::string &msg : getAllNetMessageTypes()) {
         mapRecvBytesPerMsgCmd[msg] = 0;
+        mapProcessTimePerMsgCmd[msg] = 0;
+    }
     mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
+    mapProcessTimePerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
 
     if (fLogIPs) {
         LogPrint(BCLog::NET, "Added connection to %s peer=%d\n", addrName, id);
@@ -2690,19 +3076,31 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
-void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
-{
-    size_t nMessageSize = msg.data.size();
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
-    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
+CSharedNetMsg::CSharedNetMsg(CSerializedNetMsg&& msg) :
+    CSharedNetMsg(std::move(msg.command), std::make_shared<const std::vector<unsigned char>>(std::move(msg.data))) {}
 
+CSharedNetMsg::CSharedNetMsg(std::string commandIn, CSendBufferRef dataIn) : command(std::move(commandIn)), data(std::move(dataIn))
+{
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
+    uint256 hash = Hash(data->data(), data->data() + data->size());
+    CMessageHeader hdr(Params().MessageStart(), command.c_str(), data->size());
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+    header = std::make_shared<const std::vector<unsigned char>>(std::move(serializedHeader));
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    PushMessage(pnode, CSharedNetMsg(std::move(msg)));
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg)
+{
+    size_t nMessageSize = msg.data->size();
+    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
 
     size_t nBytesSent = 0;
     {
@@ -2715,9 +3113,9 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
+        pnode->vSendMsg.push_back(msg.header);
         if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+            pnode->vSendMsg.push_back(msg.data);
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
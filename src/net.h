@@ -93,6 +93,10 @@ static const int64_t DEFAULT_PEER_CONNECT_TIMEOUT = 60;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default number of threads processing peer messages */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 1;
+/** Maximum number of threads processing peer messages */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 typedef int64_t NodeId;
 
@@ -120,6 +124,66 @@ struct CSerializedNetMsg
     std::string command;
 };
 
+/** Immutable serialized message bytes, shared by the send queues of every peer they are pushed to */
+typedef std::shared_ptr<const std::vector<unsigned char>> CSendBufferRef;
+
+/**
+ * A message with its header serialized once, so that it can be pushed to any
+ * number of peers without copying or hashing the payload again.
+ */
+struct CSharedNetMsg
+{
+    explicit CSharedNetMsg(CSerializedNetMsg&& msg);
+    CSharedNetMsg(std::string commandIn, CSendBufferRef dataIn);
+
+    std::string command;
+    CSendBufferRef header;
+    CSendBufferRef data;
+};
+
+/**
+ * Keeps the receive buffers of processed messages for reuse by later
+ * messages, so that a stream of small messages (inv, tx, ...) does not
+ * allocate and free a buffer each. Buffers are binned in power-of-two size
+ * classes by capacity; buffers larger than the biggest class are not kept,
+ * and the total capacity held is bounded.
+ */
+class CNetRecvBufferPool
+{
+public:
+    static const size_t MIN_CLASS_SIZE = 256;
+    static const size_t MAX_CLASS_SIZE = 256 * 1024;
+    static const int NUM_CLASSES = 11;
+    static const size_t MAX_BUFFERS_PER_CLASS = 64;
+    static const size_t DEFAULT_MAX_RETAINED = 4 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t nHits;
+        uint64_t nMisses;
+        size_t nBuffers;
+        size_t nBytesRetained;
+    };
+
+    explicit CNetRecvBufferPool(size_t nMaxRetainedIn = DEFAULT_MAX_RETAINED);
+
+    /** Give an empty stream a buffer with room for at least nSize bytes, reusing a pooled one if possible. */
+    void Get(CDataStream& stream, size_t nSize);
+    /** Take the buffer out of a stream (leaving it empty) and keep it for reuse. */
+    void Release(CDataStream& stream);
+
+    Stats GetStats() const;
+
+private:
+    const size_t nMaxRetained;
+
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vFree[NUM_CLASSES] GUARDED_BY(cs);
+    size_t nBuffers GUARDED_BY(cs);
+    size_t nBytesRetained GUARDED_BY(cs);
+    uint64_t nHits GUARDED_BY(cs);
+    uint64_t nMisses GUARDED_BY(cs);
+};
+
 
 class NetEventsInterface;
 class CConnman
@@ -149,6 +213,7 @@ public:
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
         int64_t m_peer_connect_timeout = DEFAULT_PEER_CONNECT_TIMEOUT;
+        int nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
         std::vector<std::string> vSeedNodes;
         std::vector<CSubNet> vWhitelistedRange;
         std::vector<CService> vBinds, vWhiteBinds;
@@ -171,6 +236,7 @@ public:
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
         m_peer_connect_timeout = connOptions.m_peer_connect_timeout;
+        nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -208,6 +274,7 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -307,6 +374,7 @@ public:
 
     uint64_t GetTotalBytesRecv();
     uint64_t GetTotalBytesSent();
+    CNetRecvBufferPool::Stats GetRecvBufferPoolStats() const { return m_recv_buffer_pool.GetStats(); }
 
     void SetBestHeight(int height);
     int GetBestHeight() const;
@@ -317,6 +385,12 @@ public:
     unsigned int GetReceiveFloodSize() const;
 
     void WakeMessageHandler();
+    /** Wake up only the message handler thread that processes the given peer. */
+    void WakeMessageHandler(NodeId id);
+    /** The message handler thread that processes all messages of the given peer. */
+    int GetMessageHandlerThread(NodeId id) const;
+    /** Interrupt the socket handler's wait for events, e.g. because a peer may be read from again. */
+    void WakeSocketHandler();
 
     /** Attempts to obfuscate tx time through exponentially distributed emitting.
         Works assuming that a single interval is used.
@@ -339,14 +413,23 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int nShard);
     void AcceptConnection(const ListenSocket& hListenSocket);
     void DisconnectNodes();
     void NotifyNumConnectionsChanged();
     void InactivityCheck(CNode *pnode);
     bool GenerateSelectSet(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set);
     void SocketEvents(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set);
+    /** Read once from a peer's socket. Returns false if there was nothing to read. */
+    bool SocketReceiveData(CNode* pnode);
     void SocketHandler();
+#ifdef USE_EPOLL
+    bool InitSocketEvents();
+    void ShutdownSocketEvents();
+    void SocketHandlerEpoll();
+#endif
+    /** Start watching a newly added peer's socket for events. */
+    void RegisterSocketEvents(CNode* pnode);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -381,6 +464,9 @@ private:
     uint64_t nTotalBytesRecv GUARDED_BY(cs_totalBytesRecv);
     uint64_t nTotalBytesSent GUARDED_BY(cs_totalBytesSent);
 
+    // Receive buffers of processed messages, reused for new ones
+    CNetRecvBufferPool m_recv_buffer_pool;
+
     // outbound limit & stats
     uint64_t nMaxOutboundTotalBytesSentInCycle GUARDED_BY(cs_totalBytesSent);
     uint64_t nMaxOutboundCycleStartTime GUARDED_BY(cs_totalBytesSent);
@@ -398,6 +484,16 @@ private:
     unsigned int nReceiveFloodSize{0};
 
     std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+    //! epoll instance all sockets stay registered with while the network threads run, or -1 to fall back to poll()
+    int m_epoll_fd{-1};
+    //! eventfd used to wake up the socket handler's epoll_wait()
+    int m_wakeup_fd{-1};
+    //! Peers whose sockets were reported ready and may have work left; each holds a reference (socket handler thread only)
+    std::vector<CNode*> m_ready_nodes;
+    //! Last time (in seconds) all peers were checked for inactivity (socket handler thread only)
+    int64_t m_last_inactivity_check{0};
+#endif
     std::atomic<bool> fNetworkActive{true};
     bool fAddressesInitialized{false};
     CAddrMan addrman;
@@ -429,8 +525,15 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    /**
+     * Peers are spread over nMessageHandlerThreads message handler threads by
+     * their id, so the messages of a peer are still processed in order while
+     * different peers are handled concurrently.
+     */
+    int nMessageHandlerThreads{DEFAULT_MESSAGE_HANDLER_THREADS};
+
+    /** flags for waking the message processor threads, one per thread. */
+    std::vector<bool> vMsgProcWake;
 
     std::condition_variable condMsgProc;
     Mutex mutexMsgProc;
@@ -442,7 +545,7 @@ private:
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandler;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -452,6 +555,7 @@ private:
     std::atomic<int64_t> m_next_send_inv_to_incoming{0};
 
     friend struct CConnmanTest;
+    friend struct CConnmanSocketTest;
 };
 extern std::unique_ptr<CConnman> g_connman;
 extern std::unique_ptr<BanMan> g_banman;
@@ -569,6 +673,13 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    size_t nProcessQueueMsgs;
+    size_t nProcessQueueBytes;
+    uint64_t nProcessedMsgs;
+    int64_t nProcessTime;
+    mapMsgCmdSize mapProcessTimePerMsgCmd;
+    int64_t nQueueWaitTotal;
+    int64_t nQueueWaitMax;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -589,6 +700,7 @@ class CNetMessage {
 private:
     mutable CHash256 hasher;
     mutable uint256 data_hash;
+    CNetRecvBufferPool* m_recv_pool;    // where vRecv is taken from and returned to, if set
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
@@ -601,7 +713,7 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn, CNetRecvBufferPool* recv_pool = nullptr) : m_recv_pool(recv_pool), hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
@@ -609,6 +721,11 @@ public:
         nTime = 0;
     }
 
+    ~CNetMessage()
+    {
+        if (m_recv_pool) m_recv_pool->Release(vRecv);
+    }
+
     bool complete() const
     {
         if (!in_data)
@@ -640,7 +757,7 @@ public:
     size_t nSendSize{0}; // total size of all vSendMsg entries
     size_t nSendOffset{0}; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes GUARDED_BY(cs_vSend){0};
-    std::deque<std::vector<unsigned char>> vSendMsg GUARDED_BY(cs_vSend);
+    std::deque<CSendBufferRef> vSendMsg GUARDED_BY(cs_vSend);
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -648,6 +765,13 @@ public:
     CCriticalSection cs_vProcessMsg;
     std::list<CNetMessage> vProcessMsg GUARDED_BY(cs_vProcessMsg);
     size_t nProcessQueueSize{0};
+    // Message handler time spent on this peer, in microseconds
+    uint64_t nProcessedMsgs GUARDED_BY(cs_vProcessMsg){0};
+    int64_t nProcessTime GUARDED_BY(cs_vProcessMsg){0};
+    mapMsgCmdSize mapProcessTimePerMsgCmd GUARDED_BY(cs_vProcessMsg);
+    // Time messages spent queued between receipt and processing, in microseconds
+    int64_t nQueueWaitTotal GUARDED_BY(cs_vProcessMsg){0};
+    int64_t nQueueWaitMax GUARDED_BY(cs_vProcessMsg){0};
 
     CCriticalSection cs_sendProcessing;
 
@@ -705,9 +829,10 @@ public:
     uint256 hashContinue;
     std::atomic<int> nStartingHeight{-1};
 
-    // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    // flood relay; other peers' message handlers relay addresses to this peer
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend GUARDED_BY(cs_addrSend);
+    CRollingBloomFilter addrKnown GUARDED_BY(cs_addrSend);
     bool fGetAddr{false};
     std::set<uint256> setKnown;
     int64_t nNextAddrSend GUARDED_BY(cs_sendProcessing){0};
@@ -770,6 +895,10 @@ private:
     const int nMyStartingHeight;
     int nSendVersion{0};
     std::list<CNetMessage> vRecvMsg;  // Used only by SocketHandler thread
+    // Edge-triggered socket readiness seen by the epoll socket handler; used only by SocketHandler thread
+    bool fSocketRecvReady{false};
+    bool fSocketSendReady{false};
+    bool fSocketReadyListed{false};
 
     mutable CCriticalSection cs_addrName;
     std::string addrName GUARDED_BY(cs_addrName);
@@ -797,7 +926,7 @@ public:
         return nRefCount;
     }
 
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete, CNetRecvBufferPool* recv_pool = nullptr);
 
     void SetRecvVersion(int nVersionIn)
     {
@@ -829,11 +958,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -879,6 +1010,9 @@ public:
 
     void copyStats(CNodeStats &stats);
 
+    /** Account for a message of this peer the message handler finished with. */
+    void RecordMsgProcessed(const std::string& command, int64_t nQueueWait, int64_t nTime);
+
     ServiceFlags GetLocalServices() const
     {
         return nLocalServices;
@@ -8,10 +8,13 @@
 #include <addrman.h>
 #include <banman.h>
 #include <arith_uint256.h>
+#include <blockcache.h>
+#include <blockdownload.h>
 #include <blockencodings.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
+#include <headercache.h>
 #include <validation.h>
 #include <merkleblock.h>
 #include <netmessagemaker.h>
@@ -136,6 +139,7 @@ namespace {
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
+        int64_t nTimeRequested;                                  //!< When we asked for it (in microseconds).
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight GUARDED_BY(cs_main);
 
@@ -225,6 +229,8 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How fast this peer delivers blocks, which determines how many we keep in flight from it.
+    CBlockDownloadRate m_download_rate;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -347,11 +353,17 @@ static void PushNodeVersion(CNode *pnode, CConnman* connman, int64_t nTime)
 
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
-static bool MarkBlockAsReceived(const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+// If pfrom is the peer we requested the block from, the delivery counts towards its download rate.
+static bool MarkBlockAsReceived(const uint256& hash, const CNode* pfrom = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
         assert(state != nullptr);
+        if (pfrom && pfrom->GetId() == itInFlight->second.first) {
+            const int64_t nMinPing = pfrom->nMinPingUsecTime;
+            state->m_download_rate.BlockReceived(itInFlight->second.second->nTimeRequested, GetTimeMicros(),
+                nMinPing == std::numeric_limits<int64_t>::max() ? 0 : nMinPing);
+        }
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
             // Last validated block on the queue was received.
@@ -389,7 +401,7 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr), GetTimeMicros()});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -405,6 +417,24 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     return true;
 }
 
+/**
+ * Whether a block in flight from another peer has taken so much longer than that peer's
+ * usual delivery time that it should be requested from the peer with the given state instead.
+ */
+static bool MayReassignStalledBlock(const uint256& hash, const CNodeState& state, int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::const_iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end()) return false;
+    const QueuedBlock& queued = *itInFlight->second.second;
+    // Leave compact block reconstruction alone, it is bound to the peer that announced it
+    if (queued.partialBlock) return false;
+    const CNodeState* stallerState = State(itInFlight->second.first);
+    assert(stallerState != nullptr);
+    if (nNow - queued.nTimeRequested <= stallerState->m_download_rate.GetStallTimeout()) return false;
+    // Don't move it to a peer that is stalling itself
+    if (!state.vBlocksInFlight.empty() && nNow - state.vBlocksInFlight.front().nTimeRequested > state.m_download_rate.GetStallTimeout()) return false;
+    return true;
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 static void ProcessBlockAvailability(NodeId nodeid) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
     CNodeState *state = State(nodeid);
@@ -446,7 +476,7 @@ static void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) EXCLUSIV
  * lNodesAnnouncingHeaderAndIDs, and keeping that list under a certain size by
  * removing the first element if necessary.
  */
-static void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid, CConnman* connman) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+static void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid, CConnman* connman, size_t nMaxPeers) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     AssertLockHeld(cs_main);
     CNodeState* nodestate = State(nodeid);
@@ -462,12 +492,12 @@ static void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid, CConnman* connma
                 return;
             }
         }
-        connman->ForNode(nodeid, [connman](CNode* pfrom){
+        connman->ForNode(nodeid, [connman, nMaxPeers](CNode* pfrom){
             AssertLockHeld(cs_main);
             uint64_t nCMPCTBLOCKVersion = (pfrom->GetLocalServices() & NODE_WITNESS) ? 2 : 1;
-            if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+            if (lNodesAnnouncingHeaderAndIDs.size() >= nMaxPeers) {
                 // As per BIP152, we only get 3 of our peers to announce
-                // blocks using compact encodings.
+                // blocks using compact encodings (more with -blockrelaynode).
                 connman->ForNode(lNodesAnnouncingHeaderAndIDs.front(), [connman, nCMPCTBLOCKVersion](CNode* pnodeStop){
                     AssertLockHeld(cs_main);
                     connman->PushMessage(pnodeStop, CNetMsgMaker(pnodeStop->GetSendVersion()).Make(NetMsgType::SENDCMPCT, /*fAnnounceUsingCMPCTBLOCK=*/false, nCMPCTBLOCKVersion));
@@ -506,8 +536,9 @@ static bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex) EXCLUSIV
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+ *  at most count entries. If nothing can be fetched because the download window is held up by a
+ *  block in flight from another peer, that peer is returned in nodeStaller and the block in pindexStalled. */
+static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStalled, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     if (count == 0)
         return;
@@ -538,12 +569,13 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
 
     std::vector<const CBlockIndex*> vToFetch;
     const CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
-    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // Never fetch further than the best block we know the peer has, or more than the download window + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + GetBlockDownloadWindow(consensusParams);
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = nullptr;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -570,7 +602,8 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
                 return;
             }
             if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
-                if (pindex->HaveTxsDownloaded())
+                // Blocks below a UTXO snapshot are in the active chain without their transactions.
+                if (pindex->HaveTxsDownloaded() || chainActive.Contains(pindex))
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
@@ -579,6 +612,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -589,6 +623,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -605,6 +640,34 @@ void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds)
     if (state) state->m_last_block_announcement = time_in_seconds;
 }
 
+// The following two functions are also used for testing the selection of
+// high-bandwidth compact block peers, see denialofservice_tests.cpp
+void ProcessSendCmpct(CNode* pfrom, bool fAnnounceUsingCMPCTBLOCK, uint64_t nCMPCTBLOCKVersion)
+{
+    if (nCMPCTBLOCKVersion == 1 || ((pfrom->GetLocalServices() & NODE_WITNESS) && nCMPCTBLOCKVersion == 2)) {
+        LOCK(cs_main);
+        // fProvidesHeaderAndIDs is used to "lock in" version of compact blocks we send (fWantsCmpctWitness)
+        if (!State(pfrom->GetId())->fProvidesHeaderAndIDs) {
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fWantsCmpctWitness = nCMPCTBLOCKVersion == 2;
+        }
+        if (State(pfrom->GetId())->fWantsCmpctWitness == (nCMPCTBLOCKVersion == 2)) // ignore later version announces
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        if (!State(pfrom->GetId())->fSupportsDesiredCmpctVersion) {
+            if (pfrom->GetLocalServices() & NODE_WITNESS)
+                State(pfrom->GetId())->fSupportsDesiredCmpctVersion = (nCMPCTBLOCKVersion == 2);
+            else
+                State(pfrom->GetId())->fSupportsDesiredCmpctVersion = (nCMPCTBLOCKVersion == 1);
+        }
+    }
+}
+
+// Ask a peer that delivered a good block to announce new blocks to us as compact blocks
+void SelectHighBandwidthPeer(NodeId nodeid, CConnman* connman, bool fBlockRelayNode) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    MaybeSetPeerAsAnnouncingHeaderAndIDs(nodeid, connman, fBlockRelayNode ? MAX_RELAY_NODE_HB_CMPCT_PEERS : MAX_HB_CMPCT_PEERS);
+}
+
 // Returns true for outbound peers, excluding manual connections, feelers, and
 // one-shots
 static bool IsOutboundDisconnectionCandidate(const CNode *node)
@@ -671,9 +734,89 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlockWindow = state->m_download_rate.GetWindow();
+    stats.nBlockDeliveryInterval = state->m_download_rate.GetDeliveryInterval();
+    stats.nBlockLatency = state->m_download_rate.GetLatency();
     return true;
 }
 
+void MsgProcessingStats::Add(int64_t nTime, int64_t nMainWait, int64_t nQueueWait)
+{
+    nCount++;
+    nTotalTime += nTime;
+    nMaxTime = std::max(nMaxTime, nTime);
+    nMainWaitTime += nMainWait;
+    nQueueWaitTime += nQueueWait;
+    int nBucket = 0;
+    for (int64_t nBound = 10; nBucket + 1 < HISTOGRAM_BUCKETS && nTime >= nBound; nBound *= 10) nBucket++;
+    vHistogram[nBucket]++;
+}
+
+static CCriticalSection cs_msg_processing_stats;
+static std::map<std::string, MsgProcessingStats> g_msg_processing_stats GUARDED_BY(cs_msg_processing_stats);
+
+static void RecordMsgProcessing(const std::string& strCommand, int64_t nTime, int64_t nMainWait, int64_t nQueueWait)
+{
+    // Only known commands get an entry of their own, so that peers cannot grow the map
+    static const std::set<std::string> setKnownCommands(getAllNetMessageTypes().begin(), getAllNetMessageTypes().end());
+    const std::string& strKey = setKnownCommands.count(strCommand) ? strCommand : NET_MESSAGE_COMMAND_OTHER;
+    LOCK(cs_msg_processing_stats);
+    g_msg_processing_stats[strKey].Add(nTime, nMainWait, nQueueWait);
+}
+
+std::map<std::string, MsgProcessingStats> GetMsgProcessingStats()
+{
+    LOCK(cs_msg_processing_stats);
+    return g_msg_processing_stats;
+}
+
+static CCriticalSection cs_block_relay_stats;
+static BlockRelayStats g_block_relay_stats GUARDED_BY(cs_block_relay_stats);
+//! The block most recently received from a peer, and when its first message arrived
+static uint256 g_block_received_hash GUARDED_BY(cs_block_relay_stats);
+static int64_t g_block_received_time GUARDED_BY(cs_block_relay_stats) = 0;
+
+// RecordBlockReceived and RecordBlockRelayed are also used by denialofservice_tests.cpp
+void RecordBlockReceived(const uint256& hash, int64_t nTimeReceived)
+{
+    LOCK(cs_block_relay_stats);
+    if (g_block_received_hash == hash) return;
+    g_block_received_hash = hash;
+    g_block_received_time = nTimeReceived;
+}
+
+void RecordBlockRelayed(const uint256& hash, int nMsgsSent)
+{
+    LOCK(cs_block_relay_stats);
+    g_block_relay_stats.nBlocks++;
+    g_block_relay_stats.nMsgsSent += nMsgsSent;
+    if (g_block_received_hash != hash) {
+        LogPrint(BCLog::CMPCTBLOCK, "Announced block %s to %d peers\n", hash.ToString(), nMsgsSent);
+        return;
+    }
+    const int64_t nLatency = GetTimeMicros() - g_block_received_time;
+    g_block_relay_stats.nReceived++;
+    g_block_relay_stats.nTotalLatency += nLatency;
+    g_block_relay_stats.nMaxLatency = std::max(g_block_relay_stats.nMaxLatency, nLatency);
+    g_block_relay_stats.nLastLatency = nLatency;
+    LogPrint(BCLog::CMPCTBLOCK, "Announced block %s to %d peers %dus after receiving it\n", hash.ToString(), nMsgsSent, nLatency);
+}
+
+BlockRelayStats GetBlockRelayStats()
+{
+    BlockRelayStats stats;
+    {
+        LOCK(cs_block_relay_stats);
+        stats = g_block_relay_stats;
+    }
+    LOCK(cs_main);
+    stats.nHighBandwidthFrom = lNodesAnnouncingHeaderAndIDs.size();
+    for (const auto& entry : mapNodeState) {
+        if (entry.second.fPreferHeaderAndIDs) stats.nHighBandwidthTo++;
+    }
+    return stats;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -855,8 +998,8 @@ static bool BlockRequestAllowed(const CBlockIndex* pindex, const Consensus::Para
         (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) < STALE_RELAY_AGE_LIMIT);
 }
 
-PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, BanMan* banman, CScheduler &scheduler, bool enable_bip61)
-    : connman(connmanIn), m_banman(banman), m_stale_tip_check_time(0), m_enable_bip61(enable_bip61) {
+PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, BanMan* banman, CScheduler &scheduler, bool enable_bip61, bool block_relay_node)
+    : connman(connmanIn), m_banman(banman), m_stale_tip_check_time(0), m_enable_bip61(enable_bip61), m_block_relay_node(block_relay_node) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
 
@@ -909,16 +1052,23 @@ void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pb
 static CCriticalSection cs_most_recent_block;
 static std::shared_ptr<const CBlock> most_recent_block GUARDED_BY(cs_most_recent_block);
 static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block GUARDED_BY(cs_most_recent_block);
+//! most_recent_compact_block serialized with witnesses, as announced to peers that want compact witness blocks
+static std::shared_ptr<const CSharedNetMsg> most_recent_compact_block_msg GUARDED_BY(cs_most_recent_block);
 static uint256 most_recent_block_hash GUARDED_BY(cs_most_recent_block);
 static bool fWitnessesPresentInMostRecentCompactBlock GUARDED_BY(cs_most_recent_block);
 
 /**
  * Maintain state about the best-seen block and fast-announce a compact block
- * to compatible peers.
+ * to compatible peers. This happens once the block's header, PoW and merkle
+ * root check out, before it is connected. With -blockrelaynode, the block is
+ * pushed to all outbound peers that support compact blocks, not only those
+ * that asked for high-bandwidth announcements.
  */
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
     std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
     const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    // Serialized once and queued for every peer by reference
+    std::shared_ptr<const CSharedNetMsg> pcmpctblockmsg = std::make_shared<const CSharedNetMsg>(msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
 
     LOCK(cs_main);
 
@@ -935,28 +1085,34 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         most_recent_block_hash = hashBlock;
         most_recent_block = pblock;
         most_recent_compact_block = pcmpctblock;
+        most_recent_compact_block_msg = pcmpctblockmsg;
         fWitnessesPresentInMostRecentCompactBlock = fWitnessEnabled;
     }
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
+    int nMsgsSent = 0;
+    connman->ForEachNode([this, &pcmpctblockmsg, pindex, fWitnessEnabled, &hashBlock, &nMsgsSent](CNode* pnode) {
         AssertLockHeld(cs_main);
 
-        // TODO: Avoid the repeated-serialization here
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
         CNodeState &state = *State(pnode->GetId());
+        // Outbound peers that only asked for low-bandwidth compact blocks can
+        // still reconstruct an unsolicited one
+        const bool fAnnounce = state.fPreferHeaderAndIDs || (m_block_relay_node && !pnode->fInbound && state.fProvidesHeaderAndIDs);
         // If the peer has, or we announced to them the previous block already,
         // but we don't think they have this one, go ahead and announce it
-        if (state.fPreferHeaderAndIDs && (!fWitnessEnabled || state.fWantsCmpctWitness) &&
+        if (fAnnounce && (!fWitnessEnabled || state.fWantsCmpctWitness) &&
                 !PeerHasHeader(&state, pindex) && PeerHasHeader(&state, pindex->pprev)) {
 
             LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->GetId());
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            connman->PushMessage(pnode, *pcmpctblockmsg);
             state.pindexBestHeaderSent = pindex;
+            nMsgsSent++;
         }
     });
+    if (nMsgsSent > 0) RecordBlockRelayed(hashBlock, nMsgsSent);
 }
 
 /**
@@ -1025,7 +1181,7 @@ void PeerLogicValidation::BlockChecked(const CBlock& block, const CValidationSta
              !IsInitialBlockDownload() &&
              mapBlocksInFlight.count(hash) == mapBlocksInFlight.size()) {
         if (it != mapBlockSource.end()) {
-            MaybeSetPeerAsAnnouncingHeaderAndIDs(it->second.first, connman);
+            SelectHighBandwidthPeer(it->second.first, connman, m_block_relay_node);
         }
     }
     if (it != mapBlockSource.end())
@@ -1124,12 +1280,14 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
     bool send = false;
     std::shared_ptr<const CBlock> a_recent_block;
     std::shared_ptr<const CBlockHeaderAndShortTxIDs> a_recent_compact_block;
+    std::shared_ptr<const CSharedNetMsg> a_recent_compact_block_msg;
     bool fWitnessesPresentInARecentCompactBlock;
     const Consensus::Params& consensusParams = chainparams.GetConsensus();
     {
         LOCK(cs_most_recent_block);
         a_recent_block = most_recent_block;
         a_recent_compact_block = most_recent_compact_block;
+        a_recent_compact_block_msg = most_recent_compact_block_msg;
         fWitnessesPresentInARecentCompactBlock = fWitnessesPresentInMostRecentCompactBlock;
     }
 
@@ -1192,14 +1350,15 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
         std::shared_ptr<const CBlock> pblock;
         if (a_recent_block && a_recent_block->GetHash() == pindex->GetBlockHash()) {
             pblock = a_recent_block;
-        } else if (inv.type == MSG_WITNESS_BLOCK) {
-            // Fast-path: in this case it is possible to serve the block directly from disk,
-            // as the network format matches the format on disk
-            std::vector<uint8_t> block_data;
-            if (!ReadRawBlockFromDisk(block_data, pindex, chainparams.MessageStart())) {
+        } else if (inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_BLOCK) {
+            // Fast-path: in this case it is possible to serve the block directly from
+            // the raw block cache (or from disk, as the network format matches the
+            // format on disk) without deserializing it
+            CRawBlockCache::RawBlockRef block_data;
+            if (!ReadRawBlockCached(block_data, pindex, inv.type == MSG_WITNESS_BLOCK, chainparams)) {
                 assert(!"cannot load block from disk");
             }
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
+            connman->PushMessage(pfrom, CSharedNetMsg(NetMsgType::BLOCK, block_data));
             // Don't set pblock as we've sent the block
         } else {
             // Send block from disk
@@ -1249,7 +1408,11 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
                 int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
                 if (CanDirectFetch(consensusParams) && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
                     if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == pindex->GetBlockHash()) {
-                        connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
+                        if (fPeerWantsWitness) {
+                            connman->PushMessage(pfrom, *a_recent_compact_block_msg);
+                        } else {
+                            connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
+                        }
                     } else {
                         CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
                         connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
@@ -1504,7 +1667,8 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
             std::vector<const CBlockIndex*> vToFetch;
             const CBlockIndex *pindexWalk = pindexLast;
             // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
-            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            const int nMaxInFlight = nodestate->m_download_rate.GetWindow();
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (size_t)nMaxInFlight) {
                 if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
                         !mapBlocksInFlight.count(pindexWalk->GetBlockHash()) &&
                         (!IsWitnessEnabled(pindexWalk->pprev, chainparams.GetConsensus()) || State(pfrom->GetId())->fHaveWitness)) {
@@ -1525,7 +1689,7 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
                 std::vector<CInv> vGetData;
                 // Download as much as possible, from earliest to latest.
                 for (const CBlockIndex *pindex : reverse_iterate(vToFetch)) {
-                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    if (nodestate->nBlocksInFlight >= nMaxInFlight) {
                         // Can't download any more from this peer
                         break;
                     }
@@ -1644,6 +1808,277 @@ void static ProcessOrphanTx(CConnman* connman, std::set<uint256>& orphan_work_se
     }
 }
 
+/**
+ * Give transactions of a batch that were turned away for their fee another chance as a
+ * package, together with their children from the same batch or from the orphan pool, so
+ * that children can pay for their parents. Batch entries of a package that gets in are
+ * marked as accepted; orphans of it are relayed and queued up like accepted orphans.
+ * Invalid members of a package that does not get in are punished like any others: batch
+ * entries take over their state, and orphans are dropped as in ProcessOrphanTx().
+ */
+static bool AcceptLowFeePackages(std::vector<MempoolAcceptBatchEntry>& entries, CConnman* connman, std::set<uint256>& orphan_work_set, std::list<CTransactionRef>& removed_txn) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(g_cs_orphans);
+    bool fAcceptedOrphans = false;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].fAccepted || entries[i].state.GetRejectCode() != REJECT_INSUFFICIENTFEE) continue;
+        const CTransactionRef& parent = entries[i].tx;
+        const uint256& hash = parent->GetHash();
+
+        std::vector<MempoolAcceptBatchEntry> package{MempoolAcceptBatchEntry(parent)};
+        std::vector<size_t> vBatchChildren;
+        std::set<uint256> setChildren;
+        for (size_t j = i + 1; j < entries.size() && package.size() < MAX_PACKAGE_COUNT; j++) {
+            if (!entries[j].fMissingInputs) continue;
+            for (const CTxIn& txin : entries[j].tx->vin) {
+                if (txin.prevout.hash == hash) {
+                    vBatchChildren.push_back(j);
+                    setChildren.insert(entries[j].tx->GetHash());
+                    package.emplace_back(entries[j].tx);
+                    break;
+                }
+            }
+        }
+        const size_t nBatchChildren = package.size();
+        for (uint32_t n = 0; n < parent->vout.size() && package.size() < MAX_PACKAGE_COUNT; n++) {
+            auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(hash, n));
+            if (it_by_prev == mapOrphanTransactionsByPrev.end()) continue;
+            for (const auto& elem : it_by_prev->second) {
+                if (package.size() >= MAX_PACKAGE_COUNT) break;
+                if (setChildren.insert(elem->first).second) package.emplace_back(elem->second.tx);
+            }
+        }
+        if (package.size() == 1) continue;
+
+        CValidationState state;
+        if (!AcceptPackageToMemoryPool(mempool, state, package, 0 /* nAbsurdFee */)) {
+            LogPrint(BCLog::MEMPOOL, "   package of %s and %u children not accepted: %s\n", hash.ToString(), package.size() - 1, FormatStateMessage(state));
+            for (size_t k = 0; k < package.size(); k++) {
+                int nDos = 0;
+                if (!package[k].state.IsInvalid(nDos) || nDos == 0) continue;
+                if (k < nBatchChildren) {
+                    // The peer relaying the batch is punished along with its other invalid transactions
+                    MempoolAcceptBatchEntry& entry = k == 0 ? entries[i] : entries[vBatchChildren[k - 1]];
+                    entry.state = package[k].state;
+                    entry.fMissingInputs = false;
+                    continue;
+                }
+                const CTransaction& orphanTx = *package[k].tx;
+                const uint256& orphanHash = orphanTx.GetHash();
+                auto orphan_it = mapOrphanTransactions.find(orphanHash);
+                if (orphan_it == mapOrphanTransactions.end()) continue;
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(orphan_it->second.fromPeer, nDos);
+                LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
+                if (!orphanTx.HasWitness() && !package[k].state.CorruptionPossible()) {
+                    // Do not use rejection cache for witness transactions or
+                    // witness-stripped transactions, as they can have been malleated.
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+                EraseOrphanTx(orphanHash);
+            }
+            continue;
+        }
+        LogPrint(BCLog::MEMPOOL, "   accepted %s with %u children as a package\n", hash.ToString(), package.size() - 1);
+
+        entries[i].fAccepted = true;
+        entries[i].state = CValidationState();
+        entries[i].lReplaced.splice(entries[i].lReplaced.end(), package[0].lReplaced);
+        for (size_t k = 0; k < vBatchChildren.size(); k++) {
+            MempoolAcceptBatchEntry& child = entries[vBatchChildren[k]];
+            child.fAccepted = true;
+            child.fMissingInputs = false;
+            child.state = CValidationState();
+            child.lReplaced.splice(child.lReplaced.end(), package[k + 1].lReplaced);
+        }
+        for (size_t k = nBatchChildren; k < package.size(); k++) {
+            const CTransaction& orphanTx = *package[k].tx;
+            const uint256& orphanHash = orphanTx.GetHash();
+            removed_txn.splice(removed_txn.end(), package[k].lReplaced);
+            RelayTransaction(orphanTx, connman);
+            for (unsigned int n = 0; n < orphanTx.vout.size(); n++) {
+                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(orphanHash, n));
+                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
+                    for (const auto& elem : it_by_prev->second) {
+                        orphan_work_set.insert(elem->first);
+                    }
+                }
+            }
+            EraseOrphanTx(orphanHash);
+            fAcceptedOrphans = true;
+        }
+    }
+    return fAcceptedOrphans;
+}
+
+/**
+ * Try to add transactions relayed by a peer to the mempool, validating them as one batch,
+ * and follow up on the outcome for each of them: relay, orphan handling, rejects and DoS.
+ */
+void ProcessTransactions(CNode* pfrom, const std::vector<CTransactionRef>& vtx, CConnman* connman, bool enable_bip61) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(g_cs_orphans);
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+
+    // Transactions we already have, including repeats within the batch, are not validated again
+    std::vector<MempoolAcceptBatchEntry> entries;
+    std::vector<int> vEntryIndex(vtx.size(), -1);
+    std::set<uint256> setBatch;
+    for (size_t i = 0; i < vtx.size(); i++) {
+        CInv inv(MSG_TX, vtx[i]->GetHash());
+        pfrom->AddInventoryKnown(inv);
+        pfrom->setAskFor.erase(inv.hash);
+        mapAlreadyAskedFor.erase(inv.hash);
+        if (AlreadyHave(inv) || !setBatch.insert(inv.hash).second) continue;
+        vEntryIndex[i] = entries.size();
+        entries.emplace_back(vtx[i]);
+    }
+    std::list<CTransactionRef> lRemovedTxn;
+    bool fAcceptedAny = false;
+    if (!entries.empty()) {
+        AcceptToMemoryPoolBatch(mempool, entries);
+        fAcceptedAny = AcceptLowFeePackages(entries, connman, pfrom->orphan_work_set, lRemovedTxn);
+    }
+    for (size_t i = 0; i < vtx.size(); i++) {
+        const CTransactionRef& ptx = vtx[i];
+        const CTransaction& tx = *ptx;
+        CInv inv(MSG_TX, tx.GetHash());
+        CValidationState stateAlreadyHave;
+        const CValidationState& state = vEntryIndex[i] < 0 ? stateAlreadyHave : entries[vEntryIndex[i]].state;
+        const bool fAccepted = vEntryIndex[i] >= 0 && entries[vEntryIndex[i]].fAccepted;
+        const bool fMissingInputs = vEntryIndex[i] >= 0 && entries[vEntryIndex[i]].fMissingInputs;
+        if (vEntryIndex[i] >= 0) {
+            lRemovedTxn.insert(lRemovedTxn.end(), entries[vEntryIndex[i]].lReplaced.begin(), entries[vEntryIndex[i]].lReplaced.end());
+        }
+
+        if (fAccepted) {
+            mempool.check(pcoinsTip.get());
+            RelayTransaction(tx, connman);
+            for (unsigned int j = 0; j < tx.vout.size(); j++) {
+                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(inv.hash, j));
+                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
+                    for (const auto& elem : it_by_prev->second) {
+                        pfrom->orphan_work_set.insert(elem->first);
+                    }
+                }
+            }
+
+            pfrom->nLastTXTime = GetTime();
+
+            LogPrint(BCLog::MEMPOOL, "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
+                pfrom->GetId(),
+                tx.GetHash().ToString(),
+                mempool.size(), mempool.DynamicMemoryUsage() / 1000);
+            fAcceptedAny = true;
+        }
+        else if (fMissingInputs)
+        {
+            bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
+            for (const CTxIn& txin : tx.vin) {
+                if (recentRejects->contains(txin.prevout.hash)) {
+                    fRejectedParents = true;
+                    break;
+                }
+            }
+            if (!fRejectedParents) {
+                uint32_t nFetchFlags = GetFetchFlags(pfrom);
+                for (const CTxIn& txin : tx.vin) {
+                    CInv _inv(MSG_TX | nFetchFlags, txin.prevout.hash);
+                    pfrom->AddInventoryKnown(_inv);
+                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
+                }
+                AddOrphanTx(ptx, pfrom->GetId());
+
+                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, gArgs.GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                if (nEvicted > 0) {
+                    LogPrint(BCLog::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
+                }
+            } else {
+                LogPrint(BCLog::MEMPOOL, "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
+                // We will continue to reject this tx since it has rejected
+                // parents so avoid re-requesting it from other peers.
+                recentRejects->insert(tx.GetHash());
+            }
+        } else {
+            if (!tx.HasWitness() && !state.CorruptionPossible()) {
+                // Do not use rejection cache for witness transactions or
+                // witness-stripped transactions, as they can have been malleated.
+                // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                assert(recentRejects);
+                recentRejects->insert(tx.GetHash());
+                if (RecursiveDynamicUsage(*ptx) < 100000) {
+                    AddToCompactExtraTransactions(ptx);
+                }
+            } else if (tx.HasWitness() && RecursiveDynamicUsage(*ptx) < 100000) {
+                AddToCompactExtraTransactions(ptx);
+            }
+
+            if (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+                // Always relay transactions received from whitelisted peers, even
+                // if they were already in the mempool or rejected from it due
+                // to policy, allowing the node to function as a gateway for
+                // nodes hidden behind it.
+                //
+                // Never relay transactions that we would assign a non-zero DoS
+                // score for, as we expect peers to do the same with us in that
+                // case.
+                int nDoS = 0;
+                if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->GetId());
+                    RelayTransaction(tx, connman);
+                } else {
+                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->GetId(), FormatStateMessage(state));
+                }
+            }
+        }
+
+        // If a tx has been detected by recentRejects, we will have reached
+        // this point and the tx will have been ignored. Because we haven't run
+        // the tx through AcceptToMemoryPool, we won't have computed a DoS
+        // score for it or determined exactly why we consider it invalid.
+        //
+        // This means we won't penalize any peer subsequently relaying a DoSy
+        // tx (even if we penalized the first peer who gave it to us) because
+        // we have to account for recentRejects showing false positives. In
+        // other words, we shouldn't penalize a peer if we aren't *sure* they
+        // submitted a DoSy tx.
+        //
+        // Note that recentRejects doesn't just record DoSy or invalid
+        // transactions, but any tx not accepted by the mempool, which may be
+        // due to node policy (vs. consensus). So we can't blanket penalize a
+        // peer simply for relaying a tx that our recentRejects has caught,
+        // regardless of false positives.
+
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS))
+        {
+            LogPrint(BCLog::MEMPOOLREJ, "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
+                pfrom->GetId(),
+                FormatStateMessage(state));
+            if (enable_bip61 && state.GetRejectCode() > 0 && state.GetRejectCode() < REJECT_INTERNAL) { // Never send AcceptToMemoryPool's internal codes over P2P
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::REJECT, std::string(NetMsgType::TX), (unsigned char)state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash));
+            }
+            if (nDoS > 0) {
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+    // Recursively process any orphan transactions that depended on the accepted ones
+    if (fAcceptedAny) {
+        ProcessOrphanTx(connman, pfrom->orphan_work_set, lRemovedTxn);
+    }
+
+    for (const CTransactionRef& removedTx : lRemovedTxn)
+        AddToCompactExtraTransactions(removedTx);
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc, bool enable_bip61)
 {
     LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
@@ -1982,22 +2417,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         bool fAnnounceUsingCMPCTBLOCK = false;
         uint64_t nCMPCTBLOCKVersion = 0;
         vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
-        if (nCMPCTBLOCKVersion == 1 || ((pfrom->GetLocalServices() & NODE_WITNESS) && nCMPCTBLOCKVersion == 2)) {
-            LOCK(cs_main);
-            // fProvidesHeaderAndIDs is used to "lock in" version of compact blocks we send (fWantsCmpctWitness)
-            if (!State(pfrom->GetId())->fProvidesHeaderAndIDs) {
-                State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
-                State(pfrom->GetId())->fWantsCmpctWitness = nCMPCTBLOCKVersion == 2;
-            }
-            if (State(pfrom->GetId())->fWantsCmpctWitness == (nCMPCTBLOCKVersion == 2)) // ignore later version announces
-                State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
-            if (!State(pfrom->GetId())->fSupportsDesiredCmpctVersion) {
-                if (pfrom->GetLocalServices() & NODE_WITNESS)
-                    State(pfrom->GetId())->fSupportsDesiredCmpctVersion = (nCMPCTBLOCKVersion == 2);
-                else
-                    State(pfrom->GetId())->fSupportsDesiredCmpctVersion = (nCMPCTBLOCKVersion == 1);
-            }
-        }
+        ProcessSendCmpct(pfrom, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
         return true;
     }
 
@@ -2207,12 +2627,36 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             return true;
         }
 
-        LOCK(cs_main);
         if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
             LogPrint(BCLog::NET, "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->GetId());
             return true;
         }
 
+        // If the peer's best block is in the recent part of our active chain,
+        // serve the headers following it from the header cache, without
+        // holding cs_main for the lookup.
+        std::vector<CHeaderCache::HeaderRef> vCachedHeaders;
+        const CBlockIndex* pindexLastCached = nullptr;
+        if (!locator.IsNull() && g_header_cache.GetHeadersAfter(locator.vHave[0], hashStop, MAX_HEADERS_RESULTS, vCachedHeaders, pindexLastCached)) {
+            LogPrint(BCLog::NET, "getheaders %d to %s from peer=%d (cached)\n", pindexLastCached->nHeight - (int)vCachedHeaders.size() + 1, hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->GetId());
+            CSerializedNetMsg msg;
+            msg.command = NetMsgType::HEADERS;
+            CVectorWriter writer(SER_NETWORK, PROTOCOL_VERSION, msg.data, 0);
+            WriteCompactSize(writer, vCachedHeaders.size());
+            for (const CHeaderCache::HeaderRef& header : vCachedHeaders) {
+                msg.data.insert(msg.data.end(), header->begin(), header->end());
+                msg.data.push_back(0); // empty transaction list, as in a CBlock
+            }
+            {
+                LOCK(cs_main);
+                // See below on why this is reset rather than advanced
+                State(pfrom->GetId())->pindexBestHeaderSent = pindexLastCached;
+            }
+            connman->PushMessage(pfrom, std::move(msg));
+            return true;
+        }
+
+        LOCK(cs_main);
         CNodeState *nodestate = State(pfrom->GetId());
         const CBlockIndex* pindex = nullptr;
         if (locator.IsNull())
@@ -2274,141 +2718,9 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
         CTransactionRef ptx;
         vRecv >> ptx;
-        const CTransaction& tx = *ptx;
-
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
 
         LOCK2(cs_main, g_cs_orphans);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv.hash);
-
-        std::list<CTransactionRef> lRemovedTxn;
-
-        if (!AlreadyHave(inv) &&
-            AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
-            mempool.check(pcoinsTip.get());
-            RelayTransaction(tx, connman);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(inv.hash, i));
-                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
-                    for (const auto& elem : it_by_prev->second) {
-                        pfrom->orphan_work_set.insert(elem->first);
-                    }
-                }
-            }
-
-            pfrom->nLastTXTime = GetTime();
-
-            LogPrint(BCLog::MEMPOOL, "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
-                pfrom->GetId(),
-                tx.GetHash().ToString(),
-                mempool.size(), mempool.DynamicMemoryUsage() / 1000);
-
-            // Recursively process any orphan transactions that depended on this one
-            ProcessOrphanTx(connman, pfrom->orphan_work_set, lRemovedTxn);
-        }
-        else if (fMissingInputs)
-        {
-            bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
-            for (const CTxIn& txin : tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
-                }
-            }
-            if (!fRejectedParents) {
-                uint32_t nFetchFlags = GetFetchFlags(pfrom);
-                for (const CTxIn& txin : tx.vin) {
-                    CInv _inv(MSG_TX | nFetchFlags, txin.prevout.hash);
-                    pfrom->AddInventoryKnown(_inv);
-                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
-                }
-                AddOrphanTx(ptx, pfrom->GetId());
-
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, gArgs.GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-                if (nEvicted > 0) {
-                    LogPrint(BCLog::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
-                }
-            } else {
-                LogPrint(BCLog::MEMPOOL, "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
-                // We will continue to reject this tx since it has rejected
-                // parents so avoid re-requesting it from other peers.
-                recentRejects->insert(tx.GetHash());
-            }
-        } else {
-            if (!tx.HasWitness() && !state.CorruptionPossible()) {
-                // Do not use rejection cache for witness transactions or
-                // witness-stripped transactions, as they can have been malleated.
-                // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                assert(recentRejects);
-                recentRejects->insert(tx.GetHash());
-                if (RecursiveDynamicUsage(*ptx) < 100000) {
-                    AddToCompactExtraTransactions(ptx);
-                }
-            } else if (tx.HasWitness() && RecursiveDynamicUsage(*ptx) < 100000) {
-                AddToCompactExtraTransactions(ptx);
-            }
-
-            if (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->GetId());
-                    RelayTransaction(tx, connman);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->GetId(), FormatStateMessage(state));
-                }
-            }
-        }
-
-        for (const CTransactionRef& removedTx : lRemovedTxn)
-            AddToCompactExtraTransactions(removedTx);
-
-        // If a tx has been detected by recentRejects, we will have reached
-        // this point and the tx will have been ignored. Because we haven't run
-        // the tx through AcceptToMemoryPool, we won't have computed a DoS
-        // score for it or determined exactly why we consider it invalid.
-        //
-        // This means we won't penalize any peer subsequently relaying a DoSy
-        // tx (even if we penalized the first peer who gave it to us) because
-        // we have to account for recentRejects showing false positives. In
-        // other words, we shouldn't penalize a peer if we aren't *sure* they
-        // submitted a DoSy tx.
-        //
-        // Note that recentRejects doesn't just record DoSy or invalid
-        // transactions, but any tx not accepted by the mempool, which may be
-        // due to node policy (vs. consensus). So we can't blanket penalize a
-        // peer simply for relaying a tx that our recentRejects has caught,
-        // regardless of false positives.
-
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint(BCLog::MEMPOOLREJ, "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
-                pfrom->GetId(),
-                FormatStateMessage(state));
-            if (enable_bip61 && state.GetRejectCode() > 0 && state.GetRejectCode() < REJECT_INTERNAL) { // Never send AcceptToMemoryPool's internal codes over P2P
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
-                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash));
-            }
-            if (nDoS > 0) {
-                Misbehaving(pfrom->GetId(), nDoS);
-            }
-        }
+        ProcessTransactions(pfrom, {ptx}, connman, enable_bip61);
         return true;
     }
 
@@ -2416,6 +2728,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     {
         CBlockHeaderAndShortTxIDs cmpctblock;
         vRecv >> cmpctblock;
+        RecordBlockReceived(cmpctblock.header.GetHash(), nTimeReceived);
 
         bool received_new_header = false;
 
@@ -2510,7 +2823,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         // We want to be a bit conservative just to be extra careful about DoS
         // possibilities in compact block processing...
         if (pindex->nHeight <= chainActive.Height() + 2) {
-            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < nodestate->m_download_rate.GetWindow()) ||
                  (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
                 std::list<QueuedBlock>::iterator* queuedBlockIt = nullptr;
                 if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex, &queuedBlockIt)) {
@@ -2679,7 +2992,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 // though the block was successfully read, and rely on the
                 // handling in ProcessNewBlock to ensure the block index is
                 // updated, reject messages go out, etc.
-                MarkBlockAsReceived(resp.blockhash); // it is now an empty pointer
+                MarkBlockAsReceived(resp.blockhash, pfrom); // it is now an empty pointer
                 fBlockRead = true;
                 // mapBlockSource is only used for sending reject messages and DoS scores,
                 // so the race between here and cs_main in ProcessNewBlock is fine.
@@ -2742,11 +3055,12 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
         bool forceProcessing = false;
         const uint256 hash(pblock->GetHash());
+        RecordBlockReceived(hash, nTimeReceived);
         {
             LOCK(cs_main);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
-            forceProcessing |= MarkBlockAsReceived(hash);
+            forceProcessing |= MarkBlockAsReceived(hash, pfrom);
             // mapBlockSource is only used for sending reject messages and DoS scores,
             // so the race between here and cs_main in ProcessNewBlock is fine.
             mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
@@ -2781,7 +3095,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman->GetAddresses();
         FastRandomContext insecure_rand;
         for (const CAddress &addr : vAddr) {
@@ -3000,6 +3317,85 @@ bool PeerLogicValidation::SendRejectsAndCheckIfBanned(CNode* pnode, bool enable_
     return false;
 }
 
+/** Check the header and checksum of a received message. */
+static bool CheckMessageIntegrity(const CNode* pfrom, const CNetMessage& msg, const CChainParams& chainparams)
+{
+    // Read header
+    const CMessageHeader& hdr = msg.hdr;
+    if (!hdr.IsValid(chainparams.MessageStart()))
+    {
+        LogPrint(BCLog::NET, "PROCESSMESSAGE: ERRORS IN HEADER %s peer=%d\n", SanitizeString(hdr.GetCommand()), pfrom->GetId());
+        return false;
+    }
+
+    // Checksum
+    const uint256& hash = msg.GetMessageHash();
+    if (memcmp(hash.begin(), hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) != 0)
+    {
+        LogPrint(BCLog::NET, "%s(%s, %u bytes): CHECKSUM ERROR expected %s was %s\n", __func__,
+           SanitizeString(hdr.GetCommand()), hdr.nMessageSize,
+           HexStr(hash.begin(), hash.begin()+CMessageHeader::CHECKSUM_SIZE),
+           HexStr(hdr.pchChecksum, hdr.pchChecksum+CMessageHeader::CHECKSUM_SIZE));
+        return false;
+    }
+    return true;
+}
+
+bool PeerLogicValidation::ProcessTxMessages(CNode* pfrom, std::list<CNetMessage>& msgs, bool fMoreWork, std::atomic<bool>& interruptMsgProc)
+{
+    const CChainParams& chainparams = Params();
+    std::vector<CTransactionRef> vtx;
+    std::vector<const CNetMessage*> vMsgs;
+    for (CNetMessage& msg : msgs) {
+        msg.SetVersion(pfrom->GetRecvVersion());
+        if (memcmp(msg.hdr.pchMessageStart, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0) {
+            LogPrint(BCLog::NET, "PROCESSMESSAGE: INVALID MESSAGESTART %s peer=%d\n", SanitizeString(msg.hdr.GetCommand()), pfrom->GetId());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+        if (!CheckMessageIntegrity(pfrom, msg, chainparams)) continue;
+        LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(msg.hdr.GetCommand()), msg.vRecv.size(), pfrom->GetId());
+        try {
+            CTransactionRef ptx;
+            msg.vRecv >> ptx;
+            vtx.push_back(std::move(ptx));
+            vMsgs.push_back(&msg);
+        } catch (const std::exception& e) {
+            LogPrint(BCLog::NET, "%s(%s, %u bytes): Exception '%s' (%s) caught\n", __func__, SanitizeString(msg.hdr.GetCommand()), msg.hdr.nMessageSize, e.what(), typeid(e).name());
+        }
+    }
+    if (vtx.empty()) return fMoreWork;
+
+    const int64_t nProcessStart = GetTimeMicros();
+    int64_t nMainWait;
+    {
+        LockWaitTimer main_wait(&cs_main);
+        try {
+            LOCK2(cs_main, g_cs_orphans);
+            ProcessTransactions(pfrom, vtx, connman, m_enable_bip61);
+        } catch (const std::exception& e) {
+            LogPrint(BCLog::NET, "%s(%u transactions): Exception '%s' (%s) caught\n", __func__, vtx.size(), e.what(), typeid(e).name());
+        }
+        nMainWait = main_wait.GetWaitMicros();
+    }
+    if (interruptMsgProc)
+        return false;
+
+    // Share the time out evenly between the messages of the batch
+    const int64_t nProcessTime = (GetTimeMicros() - nProcessStart) / vMsgs.size();
+    for (const CNetMessage* msg : vMsgs) {
+        const int64_t nQueueWait = std::max<int64_t>(nProcessStart - msg->nTime, 0);
+        RecordMsgProcessing(NetMsgType::TX, nProcessTime, nMainWait / (int64_t)vMsgs.size(), nQueueWait);
+        pfrom->RecordMsgProcessed(NetMsgType::TX, nQueueWait, nProcessTime);
+    }
+    LogPrint(BCLog::NET, "processed %u transactions as a batch peer=%d\n", vtx.size(), pfrom->GetId());
+
+    LOCK(cs_main);
+    SendRejectsAndCheckIfBanned(pfrom, m_enable_bip61);
+
+    return fMoreWork;
+}
+
 bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& interruptMsgProc)
 {
     const CChainParams& chainparams = Params();
@@ -3036,17 +3432,29 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (pfrom->fPauseSend)
         return false;
 
+    // Transactions queued back to back are validated as one batch
+    const bool fBatchTxs = pfrom->fSuccessfullyConnected && (g_relay_txes || (pfrom->fWhitelisted && gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY)));
+
     std::list<CNetMessage> msgs;
     {
         LOCK(pfrom->cs_vProcessMsg);
         if (pfrom->vProcessMsg.empty())
             return false;
-        // Just take one message
-        msgs.splice(msgs.begin(), pfrom->vProcessMsg, pfrom->vProcessMsg.begin());
-        pfrom->nProcessQueueSize -= msgs.front().vRecv.size() + CMessageHeader::HEADER_SIZE;
+        // Just take one message, or a run of transactions
+        do {
+            pfrom->nProcessQueueSize -= pfrom->vProcessMsg.front().vRecv.size() + CMessageHeader::HEADER_SIZE;
+            msgs.splice(msgs.end(), pfrom->vProcessMsg, pfrom->vProcessMsg.begin());
+        } while (fBatchTxs && msgs.size() < MAX_MEMPOOL_ACCEPT_BATCH && !pfrom->vProcessMsg.empty() &&
+                 msgs.front().hdr.GetCommand() == NetMsgType::TX && pfrom->vProcessMsg.front().hdr.GetCommand() == NetMsgType::TX);
+        const bool fWasPaused = pfrom->fPauseRecv;
         pfrom->fPauseRecv = pfrom->nProcessQueueSize > connman->GetReceiveFloodSize();
+        // The socket may have had data waiting all along; let the socket handler read it now
+        if (fWasPaused && !pfrom->fPauseRecv) connman->WakeSocketHandler();
         fMoreWork = !pfrom->vProcessMsg.empty();
     }
+    if (msgs.size() > 1) {
+        return ProcessTxMessages(pfrom, msgs, fMoreWork, interruptMsgProc);
+    }
     CNetMessage& msg(msgs.front());
 
     msg.SetVersion(pfrom->GetRecvVersion());
@@ -3057,44 +3465,38 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
         return false;
     }
 
-    // Read header
-    CMessageHeader& hdr = msg.hdr;
-    if (!hdr.IsValid(chainparams.MessageStart()))
-    {
-        LogPrint(BCLog::NET, "PROCESSMESSAGE: ERRORS IN HEADER %s peer=%d\n", SanitizeString(hdr.GetCommand()), pfrom->GetId());
+    if (!CheckMessageIntegrity(pfrom, msg, chainparams)) {
         return fMoreWork;
     }
+    CMessageHeader& hdr = msg.hdr;
     std::string strCommand = hdr.GetCommand();
-
-    // Message size
     unsigned int nMessageSize = hdr.nMessageSize;
-
-    // Checksum
     CDataStream& vRecv = msg.vRecv;
-    const uint256& hash = msg.GetMessageHash();
-    if (memcmp(hash.begin(), hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) != 0)
-    {
-        LogPrint(BCLog::NET, "%s(%s, %u bytes): CHECKSUM ERROR expected %s was %s\n", __func__,
-           SanitizeString(strCommand), nMessageSize,
-           HexStr(hash.begin(), hash.begin()+CMessageHeader::CHECKSUM_SIZE),
-           HexStr(hdr.pchChecksum, hdr.pchChecksum+CMessageHeader::CHECKSUM_SIZE));
-        return fMoreWork;
-    }
 
     // Process message
     bool fRet = false;
-    try
+    const int64_t nProcessStart = GetTimeMicros();
+    int64_t nMainWait;
     {
-        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc, m_enable_bip61);
-        if (interruptMsgProc)
-            return false;
-        if (!pfrom->vRecvGetData.empty())
-            fMoreWork = true;
-    } catch (const std::exception& e) {
-        LogPrint(BCLog::NET, "%s(%s, %u bytes): Exception '%s' (%s) caught\n", __func__, SanitizeString(strCommand), nMessageSize, e.what(), typeid(e).name());
-    } catch (...) {
-        LogPrint(BCLog::NET, "%s(%s, %u bytes): Unknown exception caught\n", __func__, SanitizeString(strCommand), nMessageSize);
+        LockWaitTimer main_wait(&cs_main);
+        try
+        {
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc, m_enable_bip61);
+            if (interruptMsgProc)
+                return false;
+            if (!pfrom->vRecvGetData.empty())
+                fMoreWork = true;
+        } catch (const std::exception& e) {
+            LogPrint(BCLog::NET, "%s(%s, %u bytes): Exception '%s' (%s) caught\n", __func__, SanitizeString(strCommand), nMessageSize, e.what(), typeid(e).name());
+        } catch (...) {
+            LogPrint(BCLog::NET, "%s(%s, %u bytes): Unknown exception caught\n", __func__, SanitizeString(strCommand), nMessageSize);
+        }
+        nMainWait = main_wait.GetWaitMicros();
     }
+    const int64_t nProcessTime = GetTimeMicros() - nProcessStart;
+    const int64_t nQueueWait = std::max<int64_t>(nProcessStart - msg.nTime, 0);
+    RecordMsgProcessing(strCommand, nProcessTime, nMainWait, nQueueWait);
+    pfrom->RecordMsgProcessed(strCommand, nQueueWait, nProcessTime);
 
     if (!fRet) {
         LogPrint(BCLog::NET, "%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->GetId());
@@ -3318,27 +3720,27 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             std::vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            for (const CAddress& addr : pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_addrSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                for (const CAddress& addr : pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        connman->PushMessage(pto, msgMaker.Make(NetMsgType::ADDR, vAddr));
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+                // we only send the big addr message once
+                if (pto->vAddrToSend.capacity() > 40)
+                    pto->vAddrToSend.shrink_to_fit();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000) {
+                const std::vector<CAddress> vAddrPart(vAddr.begin() + i, vAddr.begin() + std::min(vAddr.size(), i + 1000));
+                connman->PushMessage(pto, msgMaker.Make(NetMsgType::ADDR, vAddrPart));
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                connman->PushMessage(pto, msgMaker.Make(NetMsgType::ADDR, vAddr));
-            // we only send the big addr message once
-            if (pto->vAddrToSend.capacity() > 40)
-                pto->vAddrToSend.shrink_to_fit();
         }
 
         // Start block sync
@@ -3453,7 +3855,9 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                     {
                         LOCK(cs_most_recent_block);
                         if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
-                            if (state.fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock)
+                            if (state.fWantsCmpctWitness)
+                                connman->PushMessage(pto, *most_recent_compact_block_msg);
+                            else if (!fWitnessesPresentInMostRecentCompactBlock)
                                 connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
                             else {
                                 CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness);
@@ -3716,10 +4120,21 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        const int nMaxInFlight = state.m_download_rate.GetWindow();
+        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < nMaxInFlight) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStalled = nullptr;
+            FindNextBlocksToDownload(pto->GetId(), nMaxInFlight - state.nBlocksInFlight, vToDownload, staller, pindexStalled, consensusParams);
+            if (vToDownload.empty() && pindexStalled != nullptr && MayReassignStalledBlock(pindexStalled->GetBlockHash(), state, nNow)) {
+                // The window is held up by a block that another peer is taking much longer to deliver than
+                // it usually does. Rather than waiting for it to time out, ask this peer for it as well.
+                LogPrint(BCLog::NET, "Reassigning stalled block %s (%d) from peer=%d to peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                    pindexStalled->nHeight, staller, pto->GetId());
+                State(staller)->m_download_rate.BlockStalled();
+                vToDownload.push_back(pindexStalled);
+                staller = -1;
+            }
             for (const CBlockIndex *pindex : vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
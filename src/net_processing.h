@@ -19,6 +19,12 @@ static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Default for BIP61 (sending reject messages) */
 static constexpr bool DEFAULT_ENABLE_BIP61{true};
+/** Number of peers asked to announce new blocks to us using compact blocks, as per BIP152 */
+static const unsigned int MAX_HB_CMPCT_PEERS = 3;
+/** Number of peers asked to announce new blocks to us using compact blocks, with -blockrelaynode */
+static const unsigned int MAX_RELAY_NODE_HB_CMPCT_PEERS = 8;
+/** Default for -blockrelaynode, relaying new blocks to all compact block peers as soon as their PoW checks out */
+static const bool DEFAULT_BLOCK_RELAY_NODE = false;
 
 class PeerLogicValidation final : public CValidationInterface, public NetEventsInterface {
 private:
@@ -26,8 +32,10 @@ private:
     BanMan* const m_banman;
 
     bool SendRejectsAndCheckIfBanned(CNode* pnode, bool enable_bip61) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    /** Process a run of tx messages from one peer together, validating the transactions as a batch */
+    bool ProcessTxMessages(CNode* pfrom, std::list<CNetMessage>& msgs, bool fMoreWork, std::atomic<bool>& interrupt);
 public:
-    PeerLogicValidation(CConnman* connman, BanMan* banman, CScheduler &scheduler, bool enable_bip61);
+    PeerLogicValidation(CConnman* connman, BanMan* banman, CScheduler &scheduler, bool enable_bip61, bool block_relay_node);
 
     /**
      * Overridden from CValidationInterface.
@@ -77,6 +85,9 @@ private:
 
     /** Enable BIP61 (sending reject messages) */
     const bool m_enable_bip61;
+
+    /** Send compact blocks to all outbound peers that support them and ask more peers for them */
+    const bool m_block_relay_node;
 };
 
 struct CNodeStateStats {
@@ -84,9 +95,51 @@ struct CNodeStateStats {
     int nSyncHeight = -1;
     int nCommonHeight = -1;
     std::vector<int> vHeightInFlight;
+    int nBlockWindow = 0;
+    int64_t nBlockDeliveryInterval = 0;
+    int64_t nBlockLatency = 0;
 };
 
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 
+/** Message handler time spent on one message type, across all peers (times in microseconds) */
+struct MsgProcessingStats {
+    /** Processing times are histogrammed in powers of ten, starting below 10us and ending at 1s and over */
+    static const int HISTOGRAM_BUCKETS = 7;
+
+    uint64_t nCount = 0;
+    int64_t nTotalTime = 0;
+    int64_t nMaxTime = 0;
+    /** Time spent blocked on acquiring cs_main while processing */
+    int64_t nMainWaitTime = 0;
+    /** Time spent queued between receipt and processing */
+    int64_t nQueueWaitTime = 0;
+    uint64_t vHistogram[HISTOGRAM_BUCKETS] = {};
+
+    void Add(int64_t nTime, int64_t nMainWait, int64_t nQueueWait);
+};
+
+/** Get message processing statistics by message type */
+std::map<std::string, MsgProcessingStats> GetMsgProcessingStats();
+
+/** Fast announcements of new blocks as compact blocks (times in microseconds) */
+struct BlockRelayStats {
+    /** Blocks announced before being connected */
+    uint64_t nBlocks = 0;
+    /** Compact block messages sent for them */
+    uint64_t nMsgsSent = 0;
+    /** Of those blocks, the ones received from a peer, and the time from receipt to announcement */
+    uint64_t nReceived = 0;
+    int64_t nTotalLatency = 0;
+    int64_t nMaxLatency = 0;
+    int64_t nLastLatency = 0;
+    /** Peers that asked us for high-bandwidth announcements, and peers we asked for them */
+    int nHighBandwidthTo = 0;
+    int nHighBandwidthFrom = 0;
+};
+
+/** Get statistics on the relay of new blocks */
+BlockRelayStats GetBlockRelayStats();
+
 #endif // BITCOIN_NET_PROCESSING_H
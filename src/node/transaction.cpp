@@ -101,3 +101,44 @@ TransactionError BroadcastTransaction(const CTransactionRef tx, uint256& hashTx,
 
     return TransactionError::OK;
 }
+
+TransactionError BroadcastPackage(const std::vector<CTransactionRef>& package, std::string& err_string, const CAmount& highfee)
+{
+    std::promise<void> promise;
+
+    { // cs_main scope
+    LOCK(cs_main);
+    std::vector<MempoolAcceptBatchEntry> entries(package.begin(), package.end());
+    CValidationState state;
+    if (!AcceptPackageToMemoryPool(mempool, state, entries, highfee)) {
+        err_string = FormatStateMessage(state);
+        for (const MempoolAcceptBatchEntry& entry : entries) {
+            if (entry.fMissingInputs || !entry.state.IsValid()) {
+                err_string += strprintf(" for %s", entry.tx->GetHash().ToString());
+                if (entry.fMissingInputs) return TransactionError::MISSING_INPUTS;
+                break;
+            }
+        }
+        return state.IsInvalid() ? TransactionError::MEMPOOL_REJECTED : TransactionError::MEMPOOL_ERROR;
+    }
+    // As in BroadcastTransaction, let wallets catch up before returning
+    CallFunctionInValidationInterfaceQueue([&promise] {
+        promise.set_value();
+    });
+    } // cs_main
+
+    promise.get_future().wait();
+
+    if (!g_connman) {
+        return TransactionError::P2P_DISABLED;
+    }
+
+    for (const CTransactionRef& tx : package) {
+        CInv inv(MSG_TX, tx->GetHash());
+        g_connman->ForEachNode([&inv](CNode* pnode) {
+            pnode->PushInventory(inv);
+        });
+    }
+
+    return TransactionError::OK;
+}
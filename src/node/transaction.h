@@ -9,6 +9,8 @@
 #include <primitives/transaction.h>
 #include <uint256.h>
 
+#include <vector>
+
 enum class TransactionError {
     OK, //!< No error
     MISSING_INPUTS,
@@ -34,4 +36,15 @@ std::string TransactionErrorString(const TransactionError error);
  */
 NODISCARD TransactionError BroadcastTransaction(CTransactionRef tx, uint256& txid, std::string& err_string, const CAmount& highfee);
 
+/**
+ * Accept a package of transactions to the mempool as one, so that children can pay for
+ * their parents, and broadcast them
+ *
+ * @param[in]  package the transactions to broadcast, parents first
+ * @param[out] &err_string reference to std::string to fill with error string if available
+ * @param[in]  highfee Reject txs with fees higher than this (if 0, accept any fee)
+ * return error
+ */
+NODISCARD TransactionError BroadcastPackage(const std::vector<CTransactionRef>& package, std::string& err_string, const CAmount& highfee);
+
 #endif // BITCOIN_NODE_TRANSACTION_H
@@ -0,0 +1,235 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/utxo_snapshot.h>
+
+#include <chain.h>
+#include <hash.h>
+#include <index/txindex.h>
+#include <streams.h>
+#include <txdb.h>
+#include <util/system.h>
+#include <validation.h>
+
+#include <boost/thread.hpp>
+
+#include <string.h>
+
+static const unsigned char UTXO_SNAPSHOT_MAGIC[] = {'u', 't', 'x', 'o', 0xff};
+//! Serialized coins are buffered up to this size before being hashed and written out
+static const size_t UTXO_SNAPSHOT_WRITE_CHUNK = 1 << 20;
+
+static void WriteSnapshotChunk(CAutoFile& file, CHashWriter& hasher, CDataStream& chunk)
+{
+    hasher.write(chunk.data(), chunk.size());
+    file.write(chunk.data(), chunk.size());
+    chunk.clear();
+}
+
+bool WriteUTXOSnapshot(CCoinsViewCursor& cursor, CAutoFile& file, const SnapshotMetadata& metadata, uint64_t& coins_written, uint256& hash)
+{
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    CDataStream chunk(SER_DISK, CLIENT_VERSION);
+    coins_written = 0;
+
+    chunk.write((const char*)UTXO_SNAPSHOT_MAGIC, sizeof(UTXO_SNAPSHOT_MAGIC));
+    chunk << UTXO_SNAPSHOT_VERSION << metadata;
+    WriteSnapshotChunk(file, hasher, chunk);
+
+    // The cursor yields coins ordered by outpoint, so all outputs of a
+    // transaction are adjacent and can share a single txid.
+    uint256 txid;
+    std::vector<std::pair<uint32_t, Coin>> outputs;
+    auto flush_outputs = [&]() {
+        uint64_t count = outputs.size();
+        chunk << VARINT(count) << txid;
+        for (auto& output : outputs) {
+            chunk << VARINT(output.first) << output.second;
+        }
+        outputs.clear();
+        if (chunk.size() >= UTXO_SNAPSHOT_WRITE_CHUNK) {
+            WriteSnapshotChunk(file, hasher, chunk);
+        }
+    };
+
+    COutPoint key;
+    Coin coin;
+    while (cursor.Valid()) {
+        boost::this_thread::interruption_point();
+        if (!cursor.GetKey(key) || !cursor.GetValue(coin)) {
+            return error("%s: unable to read value", __func__);
+        }
+        if (!outputs.empty() && key.hash != txid) {
+            flush_outputs();
+        }
+        txid = key.hash;
+        outputs.emplace_back(key.n, std::move(coin));
+        ++coins_written;
+        cursor.Next();
+    }
+    if (!outputs.empty()) {
+        flush_outputs();
+    }
+
+    uint64_t terminator = 0;
+    chunk << VARINT(terminator) << coins_written;
+    WriteSnapshotChunk(file, hasher, chunk);
+
+    hash = hasher.GetHash();
+    file << hash;
+    return true;
+}
+
+bool ReadUTXOSnapshot(CAutoFile& file, SnapshotMetadata& metadata, uint64_t& coins_read, uint256& hash, std::string& strError,
+                      const std::function<bool(const SnapshotCoinsBatch&)>& fnBatch)
+{
+    CHashVerifier<CAutoFile> verifier(&file);
+    coins_read = 0;
+    try {
+        unsigned char magic[sizeof(UTXO_SNAPSHOT_MAGIC)];
+        verifier.read((char*)magic, sizeof(magic));
+        if (memcmp(magic, UTXO_SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+            strError = "Not a UTXO snapshot file";
+            return false;
+        }
+        uint16_t version;
+        verifier >> version;
+        if (version != UTXO_SNAPSHOT_VERSION) {
+            strError = strprintf("Unsupported UTXO snapshot version %u", version);
+            return false;
+        }
+        verifier >> metadata;
+
+        SnapshotCoinsBatch batch;
+        while (true) {
+            boost::this_thread::interruption_point();
+            uint64_t count;
+            verifier >> VARINT(count);
+            if (count == 0) break;
+            uint256 txid;
+            verifier >> txid;
+            for (uint64_t i = 0; i < count; i++) {
+                uint32_t n;
+                Coin coin;
+                verifier >> VARINT(n) >> coin;
+                if (coin.IsSpent() || (int)coin.nHeight > metadata.m_base_height) {
+                    strError = strprintf("Bad coin %s:%u in UTXO snapshot", txid.ToString(), n);
+                    return false;
+                }
+                batch.emplace_back(COutPoint(txid, n), std::move(coin));
+                ++coins_read;
+            }
+            if (batch.size() >= UTXO_SNAPSHOT_BATCH_COINS) {
+                if (fnBatch && !fnBatch(batch)) {
+                    strError = "Failed to import UTXO snapshot coins";
+                    return false;
+                }
+                batch.clear();
+            }
+        }
+        if (!batch.empty() && fnBatch && !fnBatch(batch)) {
+            strError = "Failed to import UTXO snapshot coins";
+            return false;
+        }
+
+        uint64_t coins_count;
+        verifier >> coins_count;
+        if (coins_count != coins_read) {
+            strError = strprintf("UTXO snapshot claims %u coins but contains %u", coins_count, coins_read);
+            return false;
+        }
+        hash = verifier.GetHash();
+
+        uint256 committed_hash;
+        file >> committed_hash;
+        if (committed_hash != hash) {
+            strError = "UTXO snapshot is corrupt (hash mismatch)";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to read UTXO snapshot: %s", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool LoadUTXOSnapshot(const fs::path& path, const uint256& expected_hash, SnapshotMetadata& metadata, uint64_t& coins_loaded, uint256& hash, std::string& strError)
+{
+    // First pass: make sure the whole file is intact before touching the chainstate.
+    {
+        CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            strError = "Couldn't open " + path.string();
+            return false;
+        }
+        if (!ReadUTXOSnapshot(file, metadata, coins_loaded, hash, strError)) {
+            return false;
+        }
+    }
+    if (!expected_hash.IsNull() && hash != expected_hash) {
+        strError = strprintf("UTXO snapshot hash %s does not match the expected %s", hash.ToString(), expected_hash.ToString());
+        return false;
+    }
+
+    LOCK(cs_main);
+    CBlockIndex* pindex = LookupBlockIndex(metadata.m_base_blockhash);
+    if (!pindex || pindex->nHeight != metadata.m_base_height) {
+        strError = strprintf("Header of the snapshot base block %s (height %d) is not known; sync headers first",
+                             metadata.m_base_blockhash.ToString(), metadata.m_base_height);
+        return false;
+    }
+    if ((pindex->nStatus & BLOCK_FAILED_MASK) || !pindex->IsValid(BLOCK_VALID_TREE)) {
+        strError = "The snapshot base block is invalid";
+        return false;
+    }
+    if (chainActive.Height() != 0) {
+        strError = "A UTXO snapshot can only be loaded into an empty chainstate (only the genesis block connected)";
+        return false;
+    }
+    if (fReindex || fImporting) {
+        strError = "Can't load a UTXO snapshot while reindexing or importing blocks";
+        return false;
+    }
+    if (g_txindex) {
+        strError = "-txindex requires the full block history and can't be used with a UTXO snapshot";
+        return false;
+    }
+
+    FlushStateToDisk();
+    {
+        std::unique_ptr<CCoinsViewCursor> pcursor(pcoinsdbview->Cursor());
+        if (pcursor->Valid()) {
+            strError = "The coins database is not empty";
+            return false;
+        }
+    }
+
+    // Second pass: stream the coins straight into the database.
+    if (!pcoinsdbview->StartBulkImport(metadata.m_base_blockhash)) {
+        strError = "Failed to write to the coins database";
+        return false;
+    }
+    {
+        CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        SnapshotMetadata metadata_reread;
+        uint64_t coins_reread;
+        uint256 hash_reread;
+        bool fOk = !file.IsNull() && ReadUTXOSnapshot(file, metadata_reread, coins_reread, hash_reread, strError,
+            [](const SnapshotCoinsBatch& batch) { return pcoinsdbview->BulkImportCoins(batch); });
+        if (!fOk || hash_reread != hash) {
+            strError = "Importing the UTXO snapshot failed, restart with -reindex-chainstate: " + strError;
+            return false;
+        }
+    }
+    if (!pcoinsdbview->FinishBulkImport(metadata.m_base_blockhash)) {
+        strError = "Failed to write to the coins database";
+        return false;
+    }
+
+    if (!ActivateUTXOSnapshot(pindex, metadata.m_chain_tx, strError)) {
+        return false;
+    }
+    LogPrintf("Loaded UTXO snapshot with %u coins at block %s (height %d)\n", coins_loaded, pindex->GetBlockHash().ToString(), pindex->nHeight);
+    return true;
+}
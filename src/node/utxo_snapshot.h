@@ -0,0 +1,81 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NODE_UTXO_SNAPSHOT_H
+#define BITCOIN_NODE_UTXO_SNAPSHOT_H
+
+#include <coins.h>
+#include <fs.h>
+#include <serialize.h>
+#include <uint256.h>
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+class CAutoFile;
+
+/** Version of the UTXO snapshot file format written by dumptxoutset */
+static const uint16_t UTXO_SNAPSHOT_VERSION = 1;
+/** Number of coins handed to the consumer at once while reading a snapshot */
+static const size_t UTXO_SNAPSHOT_BATCH_COINS = 50000;
+
+/**
+ * Describes the chain state a UTXO snapshot was taken at.
+ *
+ * A snapshot file is laid out as
+ *   magic ("utxo" 0xff), version, SnapshotMetadata,
+ *   groups of coins sharing a txid: VARINT(count), txid, count * (VARINT(vout), Coin),
+ *   VARINT(0), coins count (uint64), SHA256d of everything before it.
+ * Coins use their compact disk serialization (see CTxOutCompressor).
+ */
+class SnapshotMetadata
+{
+public:
+    uint256 m_base_blockhash;
+    int m_base_height;
+    //! nChainTx of the base block, needed to connect blocks on top of it
+    unsigned int m_chain_tx;
+
+    SnapshotMetadata() : m_base_height(0), m_chain_tx(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(m_base_blockhash);
+        READWRITE(m_base_height);
+        READWRITE(m_chain_tx);
+    }
+};
+
+typedef std::vector<std::pair<COutPoint, Coin>> SnapshotCoinsBatch;
+
+/**
+ * Stream every coin of a database cursor into a snapshot file.
+ * @param[out] coins_written  Number of coins in the snapshot
+ * @param[out] hash           Hash committing to the snapshot contents
+ */
+bool WriteUTXOSnapshot(CCoinsViewCursor& cursor, CAutoFile& file, const SnapshotMetadata& metadata, uint64_t& coins_written, uint256& hash);
+
+/**
+ * Read a snapshot file, verifying its structure and content hash. Coins are
+ * passed to fnBatch (if given) in batches as they are read; reading stops
+ * when it returns false. Note that the hash can only be checked after all
+ * coins have been handed out.
+ */
+bool ReadUTXOSnapshot(CAutoFile& file, SnapshotMetadata& metadata, uint64_t& coins_read, uint256& hash, std::string& strError,
+                      const std::function<bool(const SnapshotCoinsBatch&)>& fnBatch = nullptr);
+
+/**
+ * Replace the (empty) chainstate of a node still at the genesis block with
+ * the contents of a snapshot file. The snapshot is verified fully before
+ * anything is written; coins are then bulk-imported into the chainstate
+ * database and the snapshot's base block becomes the chain tip. The blocks
+ * below the base are not downloaded or validated.
+ */
+bool LoadUTXOSnapshot(const fs::path& path, const uint256& expected_hash, SnapshotMetadata& metadata, uint64_t& coins_loaded, uint256& hash, std::string& strError);
+
+#endif // BITCOIN_NODE_UTXO_SNAPSHOT_H
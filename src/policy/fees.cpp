@@ -12,7 +12,12 @@
 #include <txmempool.h>
 #include <util/system.h>
 
+#include <algorithm>
+#include <limits>
+
 static constexpr double INF_FEERATE = 1e99;
+/** Largest factor by which the stored moving averages may exceed their actual values */
+static constexpr double MAX_STORED_SCALE = 1e50;
 
 std::string StringForFeeEstimateHorizon(FeeEstimateHorizon horizon) {
     static const std::map<FeeEstimateHorizon, std::string> horizon_strings = {
@@ -80,13 +85,15 @@ private:
     // Track the historical moving average of this total over blocks
     std::vector<double> txCtAvg;
 
-    // Count the total # of txs confirmed within Y blocks in each bucket
+    // Count the total # of txs confirmed within Y periods in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double>> confAvg; // confAvg[Y][X]
+    // The periods of a bucket are stored next to each other, as a
+    // confirmed transaction is recorded for all of them.
+    std::vector<double> confAvg; // confAvg[X * maxPeriods + Y]
 
     // Track moving avg of txs which have been evicted from the mempool
-    // after failing to be confirmed within Y blocks
-    std::vector<std::vector<double>> failAvg; // failAvg[Y][X]
+    // after failing to be confirmed within Y periods
+    std::vector<double> failAvg; // failAvg[X * maxPeriods + Y]
 
     // Sum the total feerate of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -100,6 +107,15 @@ private:
     // Resolution (# of blocks) with which confirmations are tracked
     unsigned int scale;
 
+    // Number of periods confirmations are tracked for
+    unsigned int maxPeriods;
+
+    // All moving averages are stored multiplied by this factor. Rather than
+    // decaying every average on each block, the factor is grown and new data
+    // points are added at its scale, so that a block only costs as much as the
+    // transactions in it. The averages are scaled back down once in a while.
+    double storedScale;
+
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
@@ -109,6 +125,12 @@ private:
 
     void resizeInMemoryCounters(size_t newbuckets);
 
+    /** Bring the stored averages back to their actual values */
+    void ResetStoredScale();
+
+    /** The averages of one kind, by period then bucket, as they are written to disk */
+    std::vector<std::vector<double>> PeriodAverages(const std::vector<double>& values) const;
+
 public:
     /**
      * Create new TxConfirmStats. This is called by BlockPolicyEstimator's
@@ -158,7 +180,7 @@ public:
                              EstimationResult *result = nullptr) const;
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() const { return scale * confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return scale * maxPeriods; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout) const;
@@ -173,20 +195,16 @@ public:
 
 TxConfirmStats::TxConfirmStats(const std::vector<double>& defaultBuckets,
                                 const std::map<double, unsigned int>& defaultBucketMap,
-                               unsigned int maxPeriods, double _decay, unsigned int _scale)
+                               unsigned int _maxPeriods, double _decay, unsigned int _scale)
     : buckets(defaultBuckets), bucketMap(defaultBucketMap)
 {
     decay = _decay;
     assert(_scale != 0 && "_scale must be non-zero");
     scale = _scale;
-    confAvg.resize(maxPeriods);
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        confAvg[i].resize(buckets.size());
-    }
-    failAvg.resize(maxPeriods);
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        failAvg[i].resize(buckets.size());
-    }
+    maxPeriods = _maxPeriods;
+    storedScale = 1;
+    confAvg.resize(buckets.size() * maxPeriods);
+    failAvg.resize(buckets.size() * maxPeriods);
 
     txCtAvg.resize(buckets.size());
     avg.resize(buckets.size());
@@ -220,25 +238,44 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
         return;
     int periodsToConfirm = (blocksToConfirm + scale - 1)/scale;
     unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = periodsToConfirm; i <= confAvg.size(); i++) {
-        confAvg[i - 1][bucketindex]++;
+    double* bucketConf = &confAvg[bucketindex * maxPeriods];
+    for (size_t i = periodsToConfirm; i <= maxPeriods; i++) {
+        bucketConf[i - 1] += storedScale;
     }
-    txCtAvg[bucketindex]++;
-    avg[bucketindex] += val;
+    txCtAvg[bucketindex] += storedScale;
+    avg[bucketindex] += val * storedScale;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay;
-        for (unsigned int i = 0; i < failAvg.size(); i++)
-            failAvg[i][j] = failAvg[i][j] * decay;
-        avg[j] = avg[j] * decay;
-        txCtAvg[j] = txCtAvg[j] * decay;
+    storedScale /= decay;
+    if (storedScale > MAX_STORED_SCALE) {
+        ResetStoredScale();
     }
 }
 
+void TxConfirmStats::ResetStoredScale()
+{
+    const double factor = 1 / storedScale;
+    for (double& value : confAvg) value *= factor;
+    for (double& value : failAvg) value *= factor;
+    for (double& value : avg) value *= factor;
+    for (double& value : txCtAvg) value *= factor;
+    storedScale = 1;
+}
+
+std::vector<std::vector<double>> TxConfirmStats::PeriodAverages(const std::vector<double>& values) const
+{
+    const size_t numBuckets = values.size() / maxPeriods;
+    std::vector<std::vector<double>> result(maxPeriods, std::vector<double>(numBuckets));
+    for (unsigned int j = 0; j < numBuckets; j++) {
+        for (unsigned int i = 0; i < maxPeriods; i++) {
+            result[i][j] = values[j * maxPeriods + i] / storedScale;
+        }
+    }
+    return result;
+}
+
 // returns -1 on error conditions
 double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
                                          double successBreakPoint, bool requireGreater,
@@ -250,6 +287,8 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     int extraNum = 0;  // Number of tx's still in mempool for confTarget or longer
     double failNum = 0; // Number of tx's that were never confirmed but removed from the mempool after confTarget
     int periodTarget = (confTarget + scale - 1)/scale;
+    // The stored averages are scaled up
+    const double unscale = 1 / storedScale;
 
     int maxbucketindex = buckets.size() - 1;
 
@@ -284,9 +323,9 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
             newBucketRange = false;
         }
         curFarBucket = bucket;
-        nConf += confAvg[periodTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
-        failNum += failAvg[periodTarget - 1][bucket];
+        nConf += confAvg[bucket * maxPeriods + periodTarget - 1] * unscale;
+        totalNum += txCtAvg[bucket] * unscale;
+        failNum += failAvg[bucket * maxPeriods + periodTarget - 1] * unscale;
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
             extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
         extraNum += oldUnconfTxs[bucket];
@@ -341,6 +380,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     // Find the bucket with the median transaction and then report the average feerate from that bucket
     // This is a compromise between finding the median which we can't since we don't save all tx's
     // and reporting the average which is less accurate
+    // (Only ratios of stored averages are used here, so they need no unscaling)
     unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
     unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
     for (unsigned int j = minBucket; j <= maxBucket; j++) {
@@ -394,12 +434,17 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout) const
 {
+    std::vector<double> avgOut(avg.size()), txCtAvgOut(txCtAvg.size());
+    for (unsigned int j = 0; j < avg.size(); j++) {
+        avgOut[j] = avg[j] / storedScale;
+        txCtAvgOut[j] = txCtAvg[j] / storedScale;
+    }
     fileout << decay;
     fileout << scale;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
-    fileout << failAvg;
+    fileout << avgOut;
+    fileout << txCtAvgOut;
+    fileout << PeriodAverages(confAvg);
+    fileout << PeriodAverages(failAvg);
 }
 
 void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets)
@@ -407,7 +452,8 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
     // Read data file and do some very basic sanity checking
     // buckets and bucketMap are not updated yet, so don't access them
     // If there is a read failure, we'll just discard this entire object anyway
-    size_t maxConfirms, maxPeriods;
+    size_t maxConfirms;
+    std::vector<std::vector<double>> fileConfAvg, fileFailAvg;
 
     // The current version will store the decay with each individual TxConfirmStats and also keep a scale factor
     filein >> decay;
@@ -427,29 +473,39 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
     if (txCtAvg.size() != numBuckets) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     }
-    filein >> confAvg;
-    maxPeriods = confAvg.size();
+    filein >> fileConfAvg;
+    maxPeriods = fileConfAvg.size();
     maxConfirms = scale * maxPeriods;
 
     if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) { // one week
         throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
     }
     for (unsigned int i = 0; i < maxPeriods; i++) {
-        if (confAvg[i].size() != numBuckets) {
+        if (fileConfAvg[i].size() != numBuckets) {
             throw std::runtime_error("Corrupt estimates file. Mismatch in feerate conf average bucket count");
         }
     }
 
-    filein >> failAvg;
-    if (maxPeriods != failAvg.size()) {
+    filein >> fileFailAvg;
+    if (maxPeriods != fileFailAvg.size()) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in confirms tracked for failures");
     }
     for (unsigned int i = 0; i < maxPeriods; i++) {
-        if (failAvg[i].size() != numBuckets) {
+        if (fileFailAvg[i].size() != numBuckets) {
             throw std::runtime_error("Corrupt estimates file. Mismatch in one of failure average bucket counts");
         }
     }
 
+    storedScale = 1;
+    confAvg.resize(numBuckets * maxPeriods);
+    failAvg.resize(numBuckets * maxPeriods);
+    for (unsigned int j = 0; j < numBuckets; j++) {
+        for (unsigned int i = 0; i < maxPeriods; i++) {
+            confAvg[j * maxPeriods + i] = fileConfAvg[i][j];
+            failAvg[j * maxPeriods + i] = fileFailAvg[i][j];
+        }
+    }
+
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
     resizeInMemoryCounters(numBuckets);
@@ -497,8 +553,9 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
     if (!inBlock && (unsigned int)blocksAgo >= scale) { // Only counts as a failure if not confirmed for entire period
         assert(scale != 0);
         unsigned int periodsAgo = blocksAgo / scale;
-        for (size_t i = 0; i < periodsAgo && i < failAvg.size(); i++) {
-            failAvg[i][bucketindex]++;
+        double* bucketFail = &failAvg[bucketindex * maxPeriods];
+        for (size_t i = 0; i < periodsAgo && i < maxPeriods; i++) {
+            bucketFail[i] += storedScale;
         }
     }
 }
@@ -524,7 +581,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash, bool inBlock)
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator()
-    : nBestSeenHeight(0), firstRecordedHeight(0), historicalFirst(0), historicalBest(0), trackedTxs(0), untrackedTxs(0)
+    : nBestSeenHeight(0), firstRecordedHeight(0), historicalFirst(0), historicalBest(0), nBlockInterval(0), trackedTxs(0), untrackedTxs(0)
 {
     static_assert(MIN_BUCKET_FEERATE > 0, "Min feerate must be nonzero");
     size_t bucketIndex = 0;
@@ -726,6 +783,35 @@ unsigned int CBlockPolicyEstimator::HighestTargetTracked(FeeEstimateHorizon hori
     }
 }
 
+void CBlockPolicyEstimator::SetBlockInterval(int64_t nSeconds)
+{
+    LOCK(m_cs_fee_estimator);
+    nBlockInterval = nSeconds;
+}
+
+int64_t CBlockPolicyEstimator::GetBlockInterval() const
+{
+    LOCK(m_cs_fee_estimator);
+    return nBlockInterval;
+}
+
+unsigned int CBlockPolicyEstimator::BlocksForMinutes(int64_t nMinutes) const
+{
+    LOCK(m_cs_fee_estimator);
+    if (nBlockInterval <= 0) return 0;
+    // Longer targets are estimated as the longest one tracked anyway; this also
+    // keeps the conversion to seconds from overflowing
+    const unsigned int nMaxBlocks = longStats->GetMaxConfirms();
+    if (nMinutes > (int64_t)nMaxBlocks * nBlockInterval / 60) return nMaxBlocks;
+    return (unsigned int)std::max<int64_t>(nMinutes * 60 / nBlockInterval, 1);
+}
+
+int64_t CBlockPolicyEstimator::MinutesForBlocks(unsigned int nBlocks) const
+{
+    LOCK(m_cs_fee_estimator);
+    return (nBlocks * nBlockInterval + 59) / 60;
+}
+
 unsigned int CBlockPolicyEstimator::BlockSpan() const
 {
     if (firstRecordedHeight == 0) return 0;
@@ -226,6 +226,15 @@ public:
     /** Calculation of highest target that estimates are tracked for */
     unsigned int HighestTargetTracked(FeeEstimateHorizon horizon) const;
 
+    /** Record the average time (in seconds) between recent blocks, of all algorithms together */
+    void SetBlockInterval(int64_t nSeconds);
+    /** Average time between recent blocks in seconds, or 0 if not known yet */
+    int64_t GetBlockInterval() const;
+    /** Number of blocks expected within nMinutes (at least 1, at most the highest target tracked), or 0 if the block interval is not known */
+    unsigned int BlocksForMinutes(int64_t nMinutes) const;
+    /** Minutes expected for nBlocks to be mined, or 0 if the block interval is not known */
+    int64_t MinutesForBlocks(unsigned int nBlocks) const;
+
 private:
     mutable CCriticalSection m_cs_fee_estimator;
 
@@ -249,6 +258,8 @@ private:
     std::unique_ptr<TxConfirmStats> shortStats PT_GUARDED_BY(m_cs_fee_estimator);
     std::unique_ptr<TxConfirmStats> longStats PT_GUARDED_BY(m_cs_fee_estimator);
 
+    int64_t nBlockInterval GUARDED_BY(m_cs_fee_estimator);
+
     unsigned int trackedTxs GUARDED_BY(m_cs_fee_estimator);
     unsigned int untrackedTxs GUARDED_BY(m_cs_fee_estimator);
 
@@ -7,6 +7,7 @@
 
 #include <amount.h>
 #include <base58.h>
+#include <blockcache.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
@@ -14,22 +15,27 @@
 #include <consensus/validation.h>
 #include <core_io.h>
 #include <hash.h>
+#include <headercache.h>
 #include <index/txindex.h>
 #include <key_io.h>
+#include <node/utxo_snapshot.h>
 #include <policy/feerate.h>
 #include <policy/policy.h>
 #include <policy/rbf.h>
 #include <primitives/transaction.h>
+#include <rpc/jsonwriter.h>
 #include <rpc/server.h>
 #include <rpc/rawtransaction.h>
 #include <rpc/util.h>
 #include <script/descriptor.h>
+#include <shutdown.h>
 #include <streams.h>
 #include <sync.h>
 #include <txdb.h>
 #include <txmempool.h>
 #include <util/strencodings.h>
 #include <util/system.h>
+#include <utxocommitment.h>
 #include <validation.h>
 #include <validationinterface.h>
 #include <versionbitsinfo.h>
@@ -44,6 +50,7 @@
 
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <condition_variable>
 
 struct CUpdatedBlock
@@ -486,39 +493,50 @@ static std::string EntryDescriptionString()
            "    \"bip125-replaceable\" : true|false,  (boolean) Whether this transaction could be replaced due to BIP125 (replace-by-fee)\n";
 }
 
-static void entryToJSON(UniValue &info, const CTxMemPoolEntry &e) EXCLUSIVE_LOCKS_REQUIRED(::mempool.cs)
+/** An entry to be written out once the mempool lock is released */
+static MempoolSnapshot::Entry GetEntry(CTxMemPool::txiter it) EXCLUSIVE_LOCKS_REQUIRED(::mempool.cs)
 {
     AssertLockHeld(mempool.cs);
+    MempoolSnapshot::Entry entry = mempool.GetSnapshotEntry(it);
+    entry.fReplaceable = IsRBFOptIn(it->GetTx(), mempool) == RBFTransactionState::REPLACEABLE_BIP125;
+    return entry;
+}
+
+/** Parent txids in the order they are listed, which is by their hex strings */
+static std::set<std::string> DependsStrings(const MempoolSnapshot::Entry& e)
+{
+    std::set<std::string> setDepends;
+    for (const uint256& parent : e.vParents) {
+        setDepends.insert(parent.ToString());
+    }
+    return setDepends;
+}
 
+// Keep in sync with entryToJSONStream
+static void entryToJSON(UniValue &info, const MempoolSnapshot::Entry &e)
+{
     UniValue fees(UniValue::VOBJ);
-    fees.pushKV("base", ValueFromAmount(e.GetFee()));
-    fees.pushKV("modified", ValueFromAmount(e.GetModifiedFee()));
-    fees.pushKV("ancestor", ValueFromAmount(e.GetModFeesWithAncestors()));
-    fees.pushKV("descendant", ValueFromAmount(e.GetModFeesWithDescendants()));
+    fees.pushKV("base", ValueFromAmount(e.nFee));
+    fees.pushKV("modified", ValueFromAmount(e.nModifiedFee));
+    fees.pushKV("ancestor", ValueFromAmount(e.nModFeesWithAncestors));
+    fees.pushKV("descendant", ValueFromAmount(e.nModFeesWithDescendants));
     info.pushKV("fees", fees);
 
-    info.pushKV("size", (int)e.GetTxSize());
-    info.pushKV("fee", ValueFromAmount(e.GetFee()));
-    info.pushKV("modifiedfee", ValueFromAmount(e.GetModifiedFee()));
-    info.pushKV("time", e.GetTime());
-    info.pushKV("height", (int)e.GetHeight());
-    info.pushKV("descendantcount", e.GetCountWithDescendants());
-    info.pushKV("descendantsize", e.GetSizeWithDescendants());
-    info.pushKV("descendantfees", e.GetModFeesWithDescendants());
-    info.pushKV("ancestorcount", e.GetCountWithAncestors());
-    info.pushKV("ancestorsize", e.GetSizeWithAncestors());
-    info.pushKV("ancestorfees", e.GetModFeesWithAncestors());
-    info.pushKV("wtxid", mempool.vTxHashes[e.vTxHashesIdx].first.ToString());
-    const CTransaction& tx = e.GetTx();
-    std::set<std::string> setDepends;
-    for (const CTxIn& txin : tx.vin)
-    {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
-    }
+    info.pushKV("size", (int)e.nTxSize);
+    info.pushKV("fee", ValueFromAmount(e.nFee));
+    info.pushKV("modifiedfee", ValueFromAmount(e.nModifiedFee));
+    info.pushKV("time", e.nTime);
+    info.pushKV("height", (int)e.nHeight);
+    info.pushKV("descendantcount", e.nCountWithDescendants);
+    info.pushKV("descendantsize", e.nSizeWithDescendants);
+    info.pushKV("descendantfees", e.nModFeesWithDescendants);
+    info.pushKV("ancestorcount", e.nCountWithAncestors);
+    info.pushKV("ancestorsize", e.nSizeWithAncestors);
+    info.pushKV("ancestorfees", e.nModFeesWithAncestors);
+    info.pushKV("wtxid", e.wtxid.ToString());
 
     UniValue depends(UniValue::VARR);
-    for (const std::string& dep : setDepends)
+    for (const std::string& dep : DependsStrings(e))
     {
         depends.push_back(dep);
     }
@@ -526,38 +544,87 @@ static void entryToJSON(UniValue &info, const CTxMemPoolEntry &e) EXCLUSIVE_LOCK
     info.pushKV("depends", depends);
 
     UniValue spent(UniValue::VARR);
-    const CTxMemPool::txiter &it = mempool.mapTx.find(tx.GetHash());
-    const CTxMemPool::setEntries &setChildren = mempool.GetMemPoolChildren(it);
-    for (CTxMemPool::txiter childiter : setChildren) {
-        spent.push_back(childiter->GetTx().GetHash().ToString());
+    for (const uint256& child : e.vChildren) {
+        spent.push_back(child.ToString());
     }
 
     info.pushKV("spentby", spent);
 
     // Add opt-in RBF status
-    bool rbfStatus = false;
-    RBFTransactionState rbfState = IsRBFOptIn(tx, mempool);
-    if (rbfState == RBFTransactionState::UNKNOWN) {
-        throw JSONRPCError(RPC_MISC_ERROR, "Transaction is not in mempool");
-    } else if (rbfState == RBFTransactionState::REPLACEABLE_BIP125) {
-        rbfStatus = true;
-    }
+    info.pushKV("bip125-replaceable", e.fReplaceable);
+}
 
-    info.pushKV("bip125-replaceable", rbfStatus);
+// Keep in sync with entryToJSON
+static void entryToJSONStream(JSONStreamWriter& writer, const MempoolSnapshot::Entry& e)
+{
+    writer.BeginObject();
+    writer.Key("fees");
+    writer.BeginObject();
+    writer.Key("base");
+    writer.Amount(e.nFee);
+    writer.Key("modified");
+    writer.Amount(e.nModifiedFee);
+    writer.Key("ancestor");
+    writer.Amount(e.nModFeesWithAncestors);
+    writer.Key("descendant");
+    writer.Amount(e.nModFeesWithDescendants);
+    writer.EndObject();
+
+    writer.Key("size");
+    writer.Int((int)e.nTxSize);
+    writer.Key("fee");
+    writer.Amount(e.nFee);
+    writer.Key("modifiedfee");
+    writer.Amount(e.nModifiedFee);
+    writer.Key("time");
+    writer.Int(e.nTime);
+    writer.Key("height");
+    writer.Int((int)e.nHeight);
+    writer.Key("descendantcount");
+    writer.UInt(e.nCountWithDescendants);
+    writer.Key("descendantsize");
+    writer.UInt(e.nSizeWithDescendants);
+    writer.Key("descendantfees");
+    writer.Int(e.nModFeesWithDescendants);
+    writer.Key("ancestorcount");
+    writer.UInt(e.nCountWithAncestors);
+    writer.Key("ancestorsize");
+    writer.UInt(e.nSizeWithAncestors);
+    writer.Key("ancestorfees");
+    writer.Int(e.nModFeesWithAncestors);
+    writer.Key("wtxid");
+    writer.String(e.wtxid.ToString());
+
+    writer.Key("depends");
+    writer.BeginArray();
+    for (const std::string& dep : DependsStrings(e)) {
+        writer.String(dep);
+    }
+    writer.EndArray();
+
+    writer.Key("spentby");
+    writer.BeginArray();
+    for (const uint256& child : e.vChildren) {
+        writer.String(child.ToString());
+    }
+    writer.EndArray();
+
+    writer.Key("bip125-replaceable");
+    writer.Bool(e.fReplaceable);
+    writer.EndObject();
 }
 
 UniValue mempoolToJSON(bool fVerbose)
 {
     if (fVerbose)
     {
-        LOCK(mempool.cs);
+        std::shared_ptr<const MempoolSnapshot> snapshot = mempool.GetSnapshot();
         UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : mempool.mapTx)
+        for (const MempoolSnapshot::Entry& e : snapshot->vEntries)
         {
-            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             entryToJSON(info, e);
-            o.pushKV(hash.ToString(), info);
+            o.pushKV(e.txid.ToString(), info);
         }
         return o;
     }
@@ -574,6 +641,17 @@ UniValue mempoolToJSON(bool fVerbose)
     }
 }
 
+void mempoolToJSONStream(JSONStreamWriter& writer)
+{
+    std::shared_ptr<const MempoolSnapshot> snapshot = mempool.GetSnapshot();
+    writer.BeginObject();
+    for (const MempoolSnapshot::Entry& e : snapshot->vEntries) {
+        writer.Key(e.txid.ToString());
+        entryToJSONStream(writer, e);
+    }
+    writer.EndObject();
+}
+
 static UniValue getrawmempool(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() > 1)
@@ -647,36 +725,40 @@ static UniValue getmempoolancestors(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::vector<MempoolSnapshot::Entry> vEntries;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
-    }
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
 
-    CTxMemPool::setEntries setAncestors;
-    uint64_t noLimit = std::numeric_limits<uint64_t>::max();
-    std::string dummy;
-    mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
+        CTxMemPool::setEntries setAncestors;
+        uint64_t noLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
 
-    if (!fVerbose) {
-        UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            o.push_back(ancestorIt->GetTx().GetHash().ToString());
-        }
+        if (!fVerbose) {
+            UniValue o(UniValue::VARR);
+            for (CTxMemPool::txiter ancestorIt : setAncestors) {
+                o.push_back(ancestorIt->GetTx().GetHash().ToString());
+            }
 
-        return o;
-    } else {
-        UniValue o(UniValue::VOBJ);
+            return o;
+        }
         for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            const CTxMemPoolEntry &e = *ancestorIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.pushKV(_hash.ToString(), info);
+            vEntries.push_back(GetEntry(ancestorIt));
         }
-        return o;
     }
+
+    UniValue o(UniValue::VOBJ);
+    for (const MempoolSnapshot::Entry& e : vEntries) {
+        UniValue info(UniValue::VOBJ);
+        entryToJSON(info, e);
+        o.pushKV(e.txid.ToString(), info);
+    }
+    return o;
 }
 
 static UniValue getmempooldescendants(const JSONRPCRequest& request)
@@ -717,36 +799,40 @@ static UniValue getmempooldescendants(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::vector<MempoolSnapshot::Entry> vEntries;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
-    }
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
 
-    CTxMemPool::setEntries setDescendants;
-    mempool.CalculateDescendants(it, setDescendants);
-    // CTxMemPool::CalculateDescendants will include the given tx
-    setDescendants.erase(it);
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(it, setDescendants);
+        // CTxMemPool::CalculateDescendants will include the given tx
+        setDescendants.erase(it);
 
-    if (!fVerbose) {
-        UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter descendantIt : setDescendants) {
-            o.push_back(descendantIt->GetTx().GetHash().ToString());
-        }
+        if (!fVerbose) {
+            UniValue o(UniValue::VARR);
+            for (CTxMemPool::txiter descendantIt : setDescendants) {
+                o.push_back(descendantIt->GetTx().GetHash().ToString());
+            }
 
-        return o;
-    } else {
-        UniValue o(UniValue::VOBJ);
+            return o;
+        }
         for (CTxMemPool::txiter descendantIt : setDescendants) {
-            const CTxMemPoolEntry &e = *descendantIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.pushKV(_hash.ToString(), info);
+            vEntries.push_back(GetEntry(descendantIt));
         }
-        return o;
     }
+
+    UniValue o(UniValue::VOBJ);
+    for (const MempoolSnapshot::Entry& e : vEntries) {
+        UniValue info(UniValue::VOBJ);
+        entryToJSON(info, e);
+        o.pushKV(e.txid.ToString(), info);
+    }
+    return o;
 }
 
 static UniValue getmempoolentry(const JSONRPCRequest& request)
@@ -772,14 +858,17 @@ static UniValue getmempoolentry(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    MempoolSnapshot::Entry e;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
+        e = GetEntry(it);
     }
 
-    const CTxMemPoolEntry &e = *it;
     UniValue info(UniValue::VOBJ);
     entryToJSON(info, e);
     return info;
@@ -862,6 +951,11 @@ static UniValue getblockheader(const JSONRPCRequest& request)
     if (!request.params[1].isNull())
         fVerbose = request.params[1].get_bool();
 
+    if (!fVerbose) {
+        CHeaderCache::HeaderRef header = g_header_cache.Get(hash);
+        if (header) return HexStr(header->begin(), header->end());
+    }
+
     const CBlockIndex* pblockindex;
     const CBlockIndex* tip;
     {
@@ -904,6 +998,21 @@ static CBlock GetBlockChecked(const CBlockIndex* pblockindex)
     return block;
 }
 
+static CRawBlockCache::RawBlockRef GetRawBlockChecked(const CBlockIndex* pblockindex)
+{
+    if (IsBlockPruned(pblockindex)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
+    }
+
+    CRawBlockCache::RawBlockRef block;
+    const bool fWitness = !(RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS);
+    if (!ReadRawBlockCached(block, pblockindex, fWitness, Params())) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+    }
+
+    return block;
+}
+
 static UniValue getblock(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
@@ -983,16 +1092,13 @@ static UniValue getblock(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
     }
 
-    const CBlock block = GetBlockChecked(pblockindex);
-
     if (verbosity <= 0)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        return HexStr(*GetRawBlockChecked(pblockindex));
     }
 
+    const CBlock block = GetBlockChecked(pblockindex);
+
     return blockToJSON(block, chainActive.Tip(), pblockindex, verbosity >= 2);
 }
 
@@ -1127,32 +1233,82 @@ static UniValue pruneblockchain(const JSONRPCRequest& request)
 
 static UniValue gettxoutsetinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 2)
         throw std::runtime_error(
             RPCHelpMan{"gettxoutsetinfo",
                 "\nReturns statistics about the unspent transaction output set.\n"
-                "Note this call may take some time.\n",
-                {},
+                "Note this call may take some time, unless hash_type is \"muhash\" and -utxocommitment is enabled.\n",
+                {
+                    {"hash_type", RPCArg::Type::STR, /* default */ "hash_serialized_2", "Which UTXO set hash should be calculated. Options: 'hash_serialized_2' (a full scan of the UTXO set), 'muhash' (the rolling MuHash3072 maintained at the tip)."},
+                    {"verify", RPCArg::Type::BOOL, /* default */ "false", "With 'muhash', recompute the hash from a full (multi-threaded) scan of the UTXO set and check it against the rolling one."},
+                },
                 RPCResult{
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) The hash of the block at the tip of the chain\n"
-            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs\n"
+            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs (only with 'hash_serialized_2')\n"
             "  \"txouts\": n,            (numeric) The number of unspent transaction outputs\n"
             "  \"bogosize\": n,          (numeric) A meaningless metric for UTXO set size\n"
-            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash\n"
+            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash (only with 'hash_serialized_2')\n"
+            "  \"muhash\": \"hash\",      (string) The MuHash3072 of the UTXO set (only with 'muhash')\n"
             "  \"disk_size\": n,         (numeric) The estimated size of the chainstate on disk\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
                 },
                 RPCExamples{
                     HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"muhash\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
                 },
             }.ToString());
 
     UniValue ret(UniValue::VOBJ);
 
+    const std::string hash_type = request.params[0].isNull() ? "hash_serialized_2" : request.params[0].get_str();
+    if (hash_type == "muhash") {
+        const bool fVerify = !request.params[1].isNull() && request.params[1].get_bool();
+        CUTXOCommitment commitment;
+        uint256 hashBlock;
+        std::vector<std::unique_ptr<CCoinsViewCursor>> cursors;
+        bool fHaveRolling;
+        {
+            LOCK(cs_main);
+            fHaveRolling = GetUTXOCommitment(commitment, hashBlock);
+            if (!fHaveRolling || fVerify) {
+                // After the flush the database describes the same block as the rolling commitment.
+                FlushStateToDisk();
+                cursors = pcoinsdbview->CursorRanges(std::max(1, std::min(GetNumCores(), MAX_COINS_SCAN_THREADS)));
+            }
+        }
+        if (!cursors.empty()) {
+            CUTXOCommitment computed;
+            if (!ComputeUTXOCommitment(cursors, computed)) {
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+            }
+            if (fHaveRolling && (computed.GetHash() != commitment.GetHash() || computed.nTransactionOutputs != commitment.nTransactionOutputs ||
+                                 computed.nTotalAmount != commitment.nTotalAmount)) {
+                throw JSONRPCError(RPC_DATABASE_ERROR, strprintf("Rolling UTXO set hash at block %s does not match the UTXO set", hashBlock.GetHex()));
+            }
+            hashBlock = cursors[0]->GetBestBlock();
+            commitment = computed;
+            SeedUTXOCommitment(commitment, hashBlock);
+        }
+        {
+            LOCK(cs_main);
+            ret.pushKV("height", LookupBlockIndex(hashBlock)->nHeight);
+        }
+        ret.pushKV("bestblock", hashBlock.GetHex());
+        ret.pushKV("txouts", (int64_t)commitment.nTransactionOutputs);
+        ret.pushKV("bogosize", (int64_t)commitment.nBogoSize);
+        ret.pushKV("muhash", commitment.GetHash().GetHex());
+        ret.pushKV("disk_size", (int64_t)pcoinsdbview->EstimateSize());
+        ret.pushKV("total_amount", ValueFromAmount(commitment.nTotalAmount));
+        return ret;
+    }
+    if (hash_type != "hash_serialized_2") {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("%s is not a valid hash_type", hash_type));
+    }
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (GetUTXOStats(pcoinsdbview.get(), stats)) {
@@ -1591,6 +1747,26 @@ static UniValue getchaintips(const JSONRPCRequest& request)
     return res;
 }
 
+static UniValue GraphOpStatsToJSON(const MempoolGraphOpStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("calls", stats.nCalls);
+    ret.pushKV("entries", stats.nEntries);
+    ret.pushKV("time", stats.nTime);
+    ret.pushKV("maxtime", stats.nMaxTime);
+    ret.pushKV("maxchain", stats.nMaxChain);
+    return ret;
+}
+
+static UniValue GraphHistogramToJSON(const uint64_t (&vHistogram)[MempoolGraphStats::HISTOGRAM_BUCKETS])
+{
+    UniValue ret(UniValue::VOBJ);
+    for (int i = 0; i < MempoolGraphStats::HISTOGRAM_BUCKETS; i++) {
+        ret.pushKV(i == 0 ? "0" : std::to_string(uint64_t{1} << i), vHistogram[i]);
+    }
+    return ret;
+}
+
 UniValue mempoolInfoToJSON()
 {
     UniValue ret(UniValue::VOBJ);
@@ -1602,6 +1778,18 @@ UniValue mempoolInfoToJSON()
     ret.pushKV("mempoolminfee", ValueFromAmount(std::max(mempool.GetMinFee(maxmempool), ::minRelayTxFee).GetFeePerK()));
     ret.pushKV("minrelaytxfee", ValueFromAmount(::minRelayTxFee.GetFeePerK()));
 
+    const MempoolGraphStats stats = mempool.GetGraphStats();
+    UniValue graph(UniValue::VOBJ);
+    graph.pushKV("calculateancestors", GraphOpStatsToJSON(stats.calculateAncestors));
+    graph.pushKV("updatefordescendants", GraphOpStatsToJSON(stats.updateForDescendants));
+    graph.pushKV("removerecursive", GraphOpStatsToJSON(stats.removeRecursive));
+    graph.pushKV("removeforblock", GraphOpStatsToJSON(stats.removeForBlock));
+    graph.pushKV("trimtosize", GraphOpStatsToJSON(stats.trimToSize));
+    graph.pushKV("ancestorcounts", GraphHistogramToJSON(stats.vAncestorCounts));
+    graph.pushKV("descendantsizes", GraphHistogramToJSON(stats.vDescendantSizes));
+    graph.pushKV("evictedcounts", GraphHistogramToJSON(stats.vEvictedCounts));
+    ret.pushKV("graphstats", graph);
+
     return ret;
 }
 
@@ -1620,6 +1808,27 @@ static UniValue getmempoolinfo(const JSONRPCRequest& request)
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
             "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate in " + CURRENCY_UNIT + "/kB for tx to be accepted. Is the maximum of minrelaytxfee and minimum mempool fee\n"
             "  \"minrelaytxfee\": xxxxx       (numeric) Current minimum relay fee for transactions\n"
+            "  \"graphstats\": {              (json object) Work done to keep ancestor and descendant state up to date since startup, and the shape of the packages seen\n"
+            "    \"calculateancestors\": {    (json object) Ancestor walks of transactions entering the mempool. Likewise for updatefordescendants (descendant walks after a reorg),\n"
+            "                                removerecursive (removal of transactions with their descendants), removeforblock (removal of confirmed transactions)\n"
+            "                                and trimtosize (eviction down to the size limit)\n"
+            "      \"calls\": xxxxx,          (numeric) The number of calls\n"
+            "      \"entries\": xxxxx,        (numeric) The total number of entries walked or removed\n"
+            "      \"time\": xxxxx,           (numeric) The total time spent, in microseconds\n"
+            "      \"maxtime\": xxxxx,        (numeric) The longest call, in microseconds\n"
+            "      \"maxchain\": xxxxx        (numeric) The largest set of ancestors or descendants handled in one call, including the transaction itself\n"
+            "    },\n"
+            "    ...\n"
+            "    \"ancestorcounts\": {        (json object) The number of transactions added by their ancestor count, including themselves,\n"
+            "                                in power of two buckets keyed by their lower bound\n"
+            "      \"0\": xxxxx,\n"
+            "      \"2\": xxxxx,\n"
+            "      ...\n"
+            "      \"128\": xxxxx\n"
+            "    },\n"
+            "    \"descendantsizes\": {...}, (json object) The number of transactions added by the largest descendant package among them and their ancestors, in kvB\n"
+            "    \"evictedcounts\": {...}    (json object) The number of packages evicted to stay below the size limit, by transaction count\n"
+            "  }\n"
             "}\n"
                 },
                 RPCExamples{
@@ -2175,31 +2384,65 @@ static UniValue savemempool(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
-//! Search for a given set of pubkey scripts
-bool FindScriptPubKey(std::atomic<int>& scan_progress, const std::atomic<bool>& should_abort, int64_t& count, CCoinsViewCursor* cursor, const std::set<CScript>& needles, std::map<COutPoint, Coin>& out_results) {
-    scan_progress = 0;
+//! Search one range of the UTXO set for a given set of pubkey scripts
+static bool FindScriptPubKeyInRange(std::atomic<int>& scan_progress, std::atomic<uint32_t>& prefixes_done, const std::atomic<bool>& should_abort, int64_t& count, CCoinsViewCursor* cursor, const std::set<CScript>& needles, std::map<COutPoint, Coin>& out_results) {
     count = 0;
+    bool first = true;
+    uint32_t last_prefix = 0;
     while (cursor->Valid()) {
         COutPoint key;
         Coin coin;
         if (!cursor->GetKey(key) || !cursor->GetValue(coin)) return false;
         if (++count % 8192 == 0) {
-            boost::this_thread::interruption_point();
-            if (should_abort) {
+            if (should_abort || ShutdownRequested()) {
                 // allow to abort the scan via the abort reference
                 return false;
             }
         }
-        if (count % 256 == 0) {
-            // update progress reference every 256 item
-            uint32_t high = 0x100 * *key.hash.begin() + *(key.hash.begin() + 1);
-            scan_progress = (int)(high * 100.0 / 65536.0 + 0.5);
+        if (first) {
+            last_prefix = CCoinsViewDBCursor::GetPrefix(key);
+            first = false;
+        } else if (count % 256 == 0) {
+            // update progress reference every 256 item, counting the txid prefixes all ranges are past
+            const uint32_t prefix = CCoinsViewDBCursor::GetPrefix(key);
+            const uint32_t done = (prefixes_done += prefix - last_prefix);
+            last_prefix = prefix;
+            scan_progress = (int)(done * 100.0 / CCoinsViewDBCursor::PREFIX_COUNT + 0.5);
         }
         if (needles.count(coin.out.scriptPubKey)) {
             out_results.emplace(key, coin);
         }
         cursor->Next();
     }
+    return true;
+}
+
+//! Search for a given set of pubkey scripts, walking each cursor on its own thread
+bool FindScriptPubKey(std::atomic<int>& scan_progress, const std::atomic<bool>& should_abort, int64_t& count, const std::vector<std::unique_ptr<CCoinsViewCursor>>& cursors, const std::set<CScript>& needles, std::map<COutPoint, Coin>& out_results) {
+    scan_progress = 0;
+    count = 0;
+    std::atomic<uint32_t> prefixes_done(0);
+    std::atomic<bool> failed(false);
+    std::vector<int64_t> counts(cursors.size(), 0);
+    std::vector<std::map<COutPoint, Coin>> results(cursors.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cursors.size(); i++) {
+        threads.emplace_back([&, i]() {
+            RenameThread("myriadcoin-scantxout");
+            try {
+                if (!FindScriptPubKeyInRange(scan_progress, prefixes_done, should_abort, counts[i], cursors[i].get(), needles, results[i])) failed = true;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+                failed = true;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    for (size_t i = 0; i < cursors.size(); i++) {
+        count += counts[i];
+        out_results.insert(results[i].begin(), results[i].end());
+    }
+    if (failed) return false;
     scan_progress = 100;
     return true;
 }
@@ -2367,14 +2610,13 @@ UniValue scantxoutset(const JSONRPCRequest& request)
         g_should_abort_scan = false;
         g_scan_progress = 0;
         int64_t count = 0;
-        std::unique_ptr<CCoinsViewCursor> pcursor;
+        std::vector<std::unique_ptr<CCoinsViewCursor>> cursors;
         {
             LOCK(cs_main);
             FlushStateToDisk();
-            pcursor = std::unique_ptr<CCoinsViewCursor>(pcoinsdbview->Cursor());
-            assert(pcursor);
+            cursors = pcoinsdbview->CursorRanges(std::max(1, std::min(GetNumCores(), MAX_COINS_SCAN_THREADS)));
         }
-        bool res = FindScriptPubKey(g_scan_progress, g_should_abort_scan, count, pcursor.get(), needles, coins);
+        bool res = FindScriptPubKey(g_scan_progress, g_should_abort_scan, count, cursors, needles, coins);
         result.pushKV("success", res);
         result.pushKV("searched_items", count);
 
@@ -2403,6 +2645,132 @@ UniValue scantxoutset(const JSONRPCRequest& request)
     return result;
 }
 
+static UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw std::runtime_error(
+            RPCHelpMan{"dumptxoutset",
+                "\nWrite the serialized UTXO set at the current tip to disk.\n"
+                "The result can be loaded into a fresh node with loadtxoutset.\n"
+                "Note this call may take some time.\n",
+                {
+                    {"path", RPCArg::Type::STR, RPCArg::Optional::NO, "Path to the output file. If relative, will be prefixed by datadir."},
+                },
+                RPCResult{
+            "{\n"
+            "  \"coins_written\": n,   (numeric) The number of coins written in the snapshot\n"
+            "  \"base_hash\": \"hash\",  (string) The hash of the block at the tip of the chain the snapshot was taken at\n"
+            "  \"base_height\": n,     (numeric) The height of that block\n"
+            "  \"path\": \"path\",       (string) The absolute path that the snapshot was written to\n"
+            "  \"hash\": \"hash\",       (string) The hash committing to the snapshot contents, to be passed to loadtxoutset\n"
+            "}\n"
+                },
+                RPCExamples{
+                    HelpExampleCli("dumptxoutset", "utxo.dat")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+                },
+            }.ToString());
+
+    const fs::path path = fs::absolute(request.params[0].get_str(), GetDataDir());
+    // Write to a temporary path and then move into `path` on completion
+    // to avoid confusion due to an interruption.
+    const fs::path temppath = fs::absolute(request.params[0].get_str() + ".incomplete", GetDataDir());
+
+    if (fs::exists(path)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER,
+            path.string() + " already exists. If you are sure this is what you want, "
+            "move it out of the way first");
+    }
+
+    FILE* file{fsbridge::fopen(temppath, "wb")};
+    CAutoFile afile{file, SER_DISK, CLIENT_VERSION};
+    if (afile.IsNull()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Couldn't open " + temppath.string() + " for writing");
+    }
+
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    SnapshotMetadata metadata;
+    {
+        // The cursor reads from a consistent database snapshot, so the lock
+        // is only needed to tie it to the block it describes.
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor = std::unique_ptr<CCoinsViewCursor>(pcoinsdbview->Cursor());
+        assert(pcursor);
+        const CBlockIndex* tip = LookupBlockIndex(pcursor->GetBestBlock());
+        assert(tip);
+        metadata.m_base_blockhash = tip->GetBlockHash();
+        metadata.m_base_height = tip->nHeight;
+        metadata.m_chain_tx = tip->nChainTx;
+    }
+
+    uint64_t coins_written;
+    uint256 hash;
+    if (!WriteUTXOSnapshot(*pcursor, afile, metadata, coins_written, hash)) {
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    }
+    afile.fclose();
+    fs::rename(temppath, path);
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("coins_written", (int64_t)coins_written);
+    result.pushKV("base_hash", metadata.m_base_blockhash.GetHex());
+    result.pushKV("base_height", metadata.m_base_height);
+    result.pushKV("path", path.string());
+    result.pushKV("hash", hash.GetHex());
+    return result;
+}
+
+static UniValue loadtxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            RPCHelpMan{"loadtxoutset",
+                "\nReplace the chainstate of a node that has only the genesis block connected with a UTXO snapshot\n"
+                "written by dumptxoutset. The header of the snapshot's base block must already be known.\n"
+                "The base block becomes the chain tip; blocks below it are not downloaded or validated, so the\n"
+                "snapshot must come from a trusted source. -txindex is not supported.\n"
+                "Note this call may take some time.\n",
+                {
+                    {"path", RPCArg::Type::STR, RPCArg::Optional::NO, "Path to the snapshot file. If relative, will be prefixed by datadir."},
+                    {"expected_hash", RPCArg::Type::STR_HEX, RPCArg::Optional::OMITTED, "The snapshot hash reported by dumptxoutset. If given, the snapshot is rejected on mismatch."},
+                },
+                RPCResult{
+            "{\n"
+            "  \"coins_loaded\": n,    (numeric) The number of coins loaded from the snapshot\n"
+            "  \"base_hash\": \"hash\",  (string) The hash of the new chain tip\n"
+            "  \"base_height\": n,     (numeric) The height of the new chain tip\n"
+            "  \"hash\": \"hash\",       (string) The hash committing to the snapshot contents\n"
+            "}\n"
+                },
+                RPCExamples{
+                    HelpExampleCli("loadtxoutset", "utxo.dat")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\"")
+                },
+            }.ToString());
+
+    const fs::path path = fs::absolute(request.params[0].get_str(), GetDataDir());
+    uint256 expected_hash;
+    if (!request.params[1].isNull()) {
+        expected_hash = ParseHashV(request.params[1], "expected_hash");
+    }
+
+    SnapshotMetadata metadata;
+    uint64_t coins_loaded;
+    uint256 hash;
+    std::string strError;
+    if (!LoadUTXOSnapshot(path, expected_hash, metadata, coins_loaded, hash, strError)) {
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("coins_loaded", (int64_t)coins_loaded);
+    result.pushKV("base_hash", metadata.m_base_blockhash.GetHex());
+    result.pushKV("base_height", metadata.m_base_height);
+    result.pushKV("hash", hash.GetHex());
+    return result;
+}
+
 // clang-format off
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
@@ -2423,13 +2791,15 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {"hash_type", "verify"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
 
     { "blockchain",         "preciousblock",          &preciousblock,          {"blockhash"} },
     { "blockchain",         "scantxoutset",           &scantxoutset,           {"action", "scanobjects"} },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           {"path"} },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           {"path", "expected_hash"} },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        {"blockhash"} },
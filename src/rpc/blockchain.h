@@ -11,6 +11,7 @@
 
 class CBlock;
 class CBlockIndex;
+class JSONStreamWriter;
 class UniValue;
 
 static constexpr int NUM_GETBLOCKSTATS_PERCENTILES = 5;
@@ -35,6 +36,9 @@ UniValue mempoolInfoToJSON();
 /** Mempool to JSON */
 UniValue mempoolToJSON(bool fVerbose = false);
 
+/** Verbose mempool to JSON text, written as it goes rather than built up as a UniValue */
+void mempoolToJSONStream(JSONStreamWriter& writer);
+
 /** Block header to JSON */
 UniValue blockheaderToJSON(const CBlockIndex* tip, const CBlockIndex* blockindex);
 
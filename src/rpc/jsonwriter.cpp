@@ -0,0 +1,106 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <rpc/jsonwriter.h>
+
+#include <tinyformat.h>
+
+void JSONStreamWriter::Separate()
+{
+    if (m_after_key) {
+        m_after_key = false;
+    } else if (!m_first) {
+        m_out += ',';
+    }
+    m_first = false;
+}
+
+void JSONStreamWriter::WriteEscaped(const std::string& str)
+{
+    m_out += '"';
+    for (unsigned char ch : str) {
+        switch (ch) {
+        case '"': m_out += "\\\""; break;
+        case '\\': m_out += "\\\\"; break;
+        case '\b': m_out += "\\b"; break;
+        case '\f': m_out += "\\f"; break;
+        case '\n': m_out += "\\n"; break;
+        case '\r': m_out += "\\r"; break;
+        case '\t': m_out += "\\t"; break;
+        default:
+            if (ch < 0x20 || ch == 0x7f) {
+                m_out += strprintf("\\u%04x", ch);
+            } else {
+                m_out += ch;
+            }
+        }
+    }
+    m_out += '"';
+}
+
+void JSONStreamWriter::BeginObject()
+{
+    Separate();
+    m_out += '{';
+    m_first = true;
+}
+
+void JSONStreamWriter::EndObject()
+{
+    m_out += '}';
+    m_first = false;
+}
+
+void JSONStreamWriter::BeginArray()
+{
+    Separate();
+    m_out += '[';
+    m_first = true;
+}
+
+void JSONStreamWriter::EndArray()
+{
+    m_out += ']';
+    m_first = false;
+}
+
+void JSONStreamWriter::Key(const std::string& key)
+{
+    Separate();
+    WriteEscaped(key);
+    m_out += ':';
+    m_after_key = true;
+}
+
+void JSONStreamWriter::String(const std::string& str)
+{
+    Separate();
+    WriteEscaped(str);
+}
+
+void JSONStreamWriter::Int(int64_t n)
+{
+    Separate();
+    m_out += std::to_string(n);
+}
+
+void JSONStreamWriter::UInt(uint64_t n)
+{
+    Separate();
+    m_out += std::to_string(n);
+}
+
+void JSONStreamWriter::Bool(bool f)
+{
+    Separate();
+    m_out += f ? "true" : "false";
+}
+
+void JSONStreamWriter::Amount(CAmount amount)
+{
+    Separate();
+    const bool sign = amount < 0;
+    const int64_t n_abs = (sign ? -amount : amount);
+    m_out += strprintf("%s%d.%08d", sign ? "-" : "", n_abs / COIN, n_abs % COIN);
+}
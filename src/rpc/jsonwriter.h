@@ -0,0 +1,50 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPC_JSONWRITER_H
+#define BITCOIN_RPC_JSONWRITER_H
+
+#include <amount.h>
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Writes JSON text straight to a string as values come, for output too
+ * large to be worth building up as a UniValue first. The text is the same
+ * as UniValue::write() gives for the same values, without indentation.
+ *
+ * Calls must nest properly; nothing is checked.
+ */
+class JSONStreamWriter
+{
+public:
+    explicit JSONStreamWriter(std::string& out) : m_out(out) {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    /** The key of the next value in an object */
+    void Key(const std::string& key);
+
+    void String(const std::string& str);
+    void Int(int64_t n);
+    void UInt(uint64_t n);
+    void Bool(bool f);
+    /** An amount, written like ValueFromAmount() */
+    void Amount(CAmount amount);
+
+private:
+    std::string& m_out;
+    //! Nothing was written yet in the current object or array
+    bool m_first = true;
+    //! A key was just written, so its value comes without a separator
+    bool m_after_key = false;
+
+    void Separate();
+    void WriteEscaped(const std::string& str);
+};
+
+#endif // BITCOIN_RPC_JSONWRITER_H
@@ -843,7 +843,7 @@ static UniValue submitheader(const JSONRPCRequest& request)
 
 static UniValue estimatesmartfee(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
         throw std::runtime_error(
             RPCHelpMan{"estimatesmartfee",
                 "\nEstimates the approximate fee per kilobyte needed for a transaction to begin\n"
@@ -851,7 +851,7 @@ static UniValue estimatesmartfee(const JSONRPCRequest& request)
                 "for which the estimate is valid. Uses virtual transaction size as defined\n"
                 "in BIP 141 (witness data is discounted).\n",
                 {
-                    {"conf_target", RPCArg::Type::NUM, RPCArg::Optional::NO, "Confirmation target in blocks (1 - 1008)"},
+                    {"conf_target", RPCArg::Type::NUM, RPCArg::Optional::NO, "Confirmation target in blocks (1 - 1008), or in minutes"},
                     {"estimate_mode", RPCArg::Type::STR, /* default */ "CONSERVATIVE", "The fee estimate mode.\n"
             "                   Whether to return a more conservative estimate which also satisfies\n"
             "                   a longer history. A conservative estimate potentially returns a\n"
@@ -861,12 +861,15 @@ static UniValue estimatesmartfee(const JSONRPCRequest& request)
             "       \"UNSET\"\n"
             "       \"ECONOMICAL\"\n"
             "       \"CONSERVATIVE\""},
+                    {"target_unit", RPCArg::Type::STR, /* default */ "blocks", "The unit of conf_target: \"blocks\", or \"minutes\" to convert it to blocks\n"
+            "                   at the recent rate of blocks of all algorithms together"},
                 },
                 RPCResult{
             "{\n"
             "  \"feerate\" : x.x,     (numeric, optional) estimate fee rate in " + CURRENCY_UNIT + "/kB\n"
             "  \"errors\": [ str... ] (json array of strings, optional) Errors encountered during processing\n"
             "  \"blocks\" : n         (numeric) block number where estimate was found\n"
+            "  \"minutes\" : n        (numeric, optional) expected time for that many blocks to be mined\n"
             "}\n"
             "\n"
             "The request target will be clamped between 2 and the highest target\n"
@@ -876,12 +879,28 @@ static UniValue estimatesmartfee(const JSONRPCRequest& request)
                 },
                 RPCExamples{
                     HelpExampleCli("estimatesmartfee", "6")
+            + HelpExampleCli("estimatesmartfee", "30 ECONOMICAL minutes")
                 },
             }.ToString());
 
-    RPCTypeCheck(request.params, {UniValue::VNUM, UniValue::VSTR});
+    RPCTypeCheck(request.params, {UniValue::VNUM, UniValue::VSTR, UniValue::VSTR});
     RPCTypeCheckArgument(request.params[0], UniValue::VNUM);
-    unsigned int conf_target = ParseConfirmTarget(request.params[0]);
+    unsigned int conf_target;
+    const std::string target_unit = request.params[2].isNull() ? "blocks" : request.params[2].get_str();
+    if (target_unit == "minutes") {
+        const int64_t minutes = request.params[0].get_int64();
+        if (minutes < 1) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid conf_target, must be at least 1 minute");
+        }
+        conf_target = ::feeEstimator.BlocksForMinutes(minutes);
+        if (conf_target == 0) {
+            throw JSONRPCError(RPC_MISC_ERROR, "Block interval not known yet");
+        }
+    } else if (target_unit == "blocks") {
+        conf_target = ParseConfirmTarget(request.params[0]);
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid target_unit parameter");
+    }
     bool conservative = true;
     if (!request.params[1].isNull()) {
         FeeEstimateMode fee_mode;
@@ -902,6 +921,9 @@ static UniValue estimatesmartfee(const JSONRPCRequest& request)
         result.pushKV("errors", errors);
     }
     result.pushKV("blocks", feeCalc.returnedTarget);
+    if (::feeEstimator.GetBlockInterval() > 0) {
+        result.pushKV("minutes", ::feeEstimator.MinutesForBlocks(feeCalc.returnedTarget));
+    }
     return result;
 }
 
@@ -1097,7 +1119,7 @@ static const CRPCCommand commands[] =
 
     { "generating",         "generatetoaddress",      &generatetoaddress,      {"nblocks","address","maxtries"} },
 
-    { "util",               "estimatesmartfee",       &estimatesmartfee,       {"conf_target", "estimate_mode"} },
+    { "util",               "estimatesmartfee",       &estimatesmartfee,       {"conf_target", "estimate_mode", "target_unit"} },
 
     { "hidden",             "estimaterawfee",         &estimaterawfee,         {"conf_target", "threshold"} },
 };
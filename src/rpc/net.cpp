@@ -110,8 +110,17 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"blockwindow\": n,          (numeric) The number of blocks we are willing to have in flight from this peer\n"
+            "    \"blockinterval\": n,        (numeric) The average time between block deliveries from this peer while busy, in microseconds (0 if unknown)\n"
+            "    \"blocklatency\": n,         (numeric) The average time from requesting a block to its delivery, in microseconds (0 if unknown)\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
             "    \"minfeefilter\": n,         (numeric) The minimum fee rate for transactions this peer accepts\n"
+            "    \"msgqueue\": n,             (numeric) The number of received messages waiting to be processed\n"
+            "    \"msgqueuebytes\": n,        (numeric) The total size of the messages waiting to be processed\n"
+            "    \"msgsprocessed\": n,        (numeric) The number of messages processed\n"
+            "    \"processtime\": n,          (numeric) The total time spent processing messages, in microseconds\n"
+            "    \"queuewait_avg\": n,        (numeric) The average time from receipt of a message to its processing, in microseconds\n"
+            "    \"queuewait_max\": n,        (numeric) The longest time from receipt of a message to its processing, in microseconds\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"msg\": n,               (numeric) The total bytes sent aggregated by message type\n"
             "                               When a message type is not listed in this json object, the bytes sent are 0.\n"
@@ -123,6 +132,11 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             "                               When a message type is not listed in this json object, the bytes received are 0.\n"
             "                               Only known message types can appear as keys in the object and all bytes received of unknown message types are listed under '"+NET_MESSAGE_COMMAND_OTHER+"'.\n"
             "       ...\n"
+            "    },\n"
+            "    \"processtime_per_msg\": {\n"
+            "       \"msg\": n,               (numeric) The total time spent processing messages in microseconds, aggregated by message type\n"
+            "                               As for bytesrecv_per_msg, message types with no time are left out.\n"
+            "       ...\n"
             "    }\n"
             "  }\n"
             "  ,...\n"
@@ -183,9 +197,18 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            obj.pushKV("blockwindow", statestats.nBlockWindow);
+            obj.pushKV("blockinterval", statestats.nBlockDeliveryInterval);
+            obj.pushKV("blocklatency", statestats.nBlockLatency);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
         obj.pushKV("minfeefilter", ValueFromAmount(stats.minFeeFilter));
+        obj.pushKV("msgqueue", (uint64_t)stats.nProcessQueueMsgs);
+        obj.pushKV("msgqueuebytes", (uint64_t)stats.nProcessQueueBytes);
+        obj.pushKV("msgsprocessed", stats.nProcessedMsgs);
+        obj.pushKV("processtime", stats.nProcessTime);
+        obj.pushKV("queuewait_avg", stats.nProcessedMsgs > 0 ? stats.nQueueWaitTotal / (int64_t)stats.nProcessedMsgs : 0);
+        obj.pushKV("queuewait_max", stats.nQueueWaitMax);
 
         UniValue sendPerMsgCmd(UniValue::VOBJ);
         for (const auto& i : stats.mapSendBytesPerMsgCmd) {
@@ -201,6 +224,13 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
         }
         obj.pushKV("bytesrecv_per_msg", recvPerMsgCmd);
 
+        UniValue processTimePerMsgCmd(UniValue::VOBJ);
+        for (const auto& i : stats.mapProcessTimePerMsgCmd) {
+            if (i.second > 0)
+                processTimePerMsgCmd.pushKV(i.first, i.second);
+        }
+        obj.pushKV("processtime_per_msg", processTimePerMsgCmd);
+
         ret.push_back(obj);
     }
 
@@ -394,6 +424,13 @@ static UniValue getnettotals(const JSONRPCRequest& request)
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"recvbufferpool\":\n"
+            "  {\n"
+            "    \"hits\": n,                              (numeric) Received messages that reused a pooled buffer\n"
+            "    \"misses\": n,                            (numeric) Received messages that needed a new buffer\n"
+            "    \"buffers\": n,                           (numeric) Buffers currently kept for reuse\n"
+            "    \"bytes\": n                              (numeric) Bytes currently kept for reuse\n"
             "  }\n"
             "}\n"
                 },
@@ -418,6 +455,111 @@ static UniValue getnettotals(const JSONRPCRequest& request)
     outboundLimit.pushKV("bytes_left_in_cycle", g_connman->GetOutboundTargetBytesLeft());
     outboundLimit.pushKV("time_left_in_cycle", g_connman->GetMaxOutboundTimeLeftInCycle());
     obj.pushKV("uploadtarget", outboundLimit);
+
+    const CNetRecvBufferPool::Stats pool_stats = g_connman->GetRecvBufferPoolStats();
+    UniValue recvBufferPool(UniValue::VOBJ);
+    recvBufferPool.pushKV("hits", pool_stats.nHits);
+    recvBufferPool.pushKV("misses", pool_stats.nMisses);
+    recvBufferPool.pushKV("buffers", (uint64_t)pool_stats.nBuffers);
+    recvBufferPool.pushKV("bytes", (uint64_t)pool_stats.nBytesRetained);
+    obj.pushKV("recvbufferpool", recvBufferPool);
+    return obj;
+}
+
+static UniValue getnetprocessingstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            RPCHelpMan{"getnetprocessingstats",
+                "\nReturns statistics about the time spent processing P2P messages, by message type.\n"
+                "All times are in microseconds and accumulated over all peers since startup.\n",
+                {},
+                RPCResult{
+            "{\n"
+            "  \"msg\": {                 (json object) Statistics for one message type. Unknown message types are listed under '"+NET_MESSAGE_COMMAND_OTHER+"'.\n"
+            "    \"count\": n,              (numeric) The number of messages processed\n"
+            "    \"total\": n,              (numeric) The total processing time\n"
+            "    \"avg\": n,                (numeric) The average processing time\n"
+            "    \"max\": n,                (numeric) The longest processing time\n"
+            "    \"cs_main_wait\": n,       (numeric) The total time spent waiting to acquire cs_main while processing\n"
+            "    \"queue_wait\": n,         (numeric) The total time from receipt of the messages to their processing\n"
+            "    \"histogram\": {           (json object) The number of messages by processing time\n"
+            "      \"<10us\": n,\n"
+            "      \"<100us\": n,\n"
+            "      \"<1ms\": n,\n"
+            "      \"<10ms\": n,\n"
+            "      \"<100ms\": n,\n"
+            "      \"<1s\": n,\n"
+            "      \">=1s\": n\n"
+            "    }\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+                },
+                RPCExamples{
+                    HelpExampleCli("getnetprocessingstats", "")
+            + HelpExampleRpc("getnetprocessingstats", "")
+                },
+            }.ToString());
+
+    static const char* const HISTOGRAM_LABELS[MsgProcessingStats::HISTOGRAM_BUCKETS] = {"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"};
+
+    UniValue ret(UniValue::VOBJ);
+    for (const auto& i : GetMsgProcessingStats()) {
+        const MsgProcessingStats& stats = i.second;
+        UniValue obj(UniValue::VOBJ);
+        obj.pushKV("count", stats.nCount);
+        obj.pushKV("total", stats.nTotalTime);
+        obj.pushKV("avg", stats.nCount > 0 ? stats.nTotalTime / (int64_t)stats.nCount : 0);
+        obj.pushKV("max", stats.nMaxTime);
+        obj.pushKV("cs_main_wait", stats.nMainWaitTime);
+        obj.pushKV("queue_wait", stats.nQueueWaitTime);
+        UniValue histogram(UniValue::VOBJ);
+        for (int bucket = 0; bucket < MsgProcessingStats::HISTOGRAM_BUCKETS; bucket++) {
+            histogram.pushKV(HISTOGRAM_LABELS[bucket], stats.vHistogram[bucket]);
+        }
+        obj.pushKV("histogram", histogram);
+        ret.pushKV(i.first, obj);
+    }
+    return ret;
+}
+
+static UniValue getblockrelaystats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            RPCHelpMan{"getblockrelaystats",
+                "\nReturns statistics about the announcement of new blocks as compact blocks, which happens before they are connected.\n"
+                "All times are in microseconds and accumulated since startup.\n",
+                {},
+                RPCResult{
+            "{\n"
+            "  \"blocks\": n,             (numeric) The number of blocks announced\n"
+            "  \"cmpctblocks_sent\": n,   (numeric) The number of compact block messages sent for them\n"
+            "  \"received\": n,           (numeric) The number of those blocks that were received from a peer\n"
+            "  \"latency_avg\": n,        (numeric) The average time from receiving one of those blocks to announcing it\n"
+            "  \"latency_max\": n,        (numeric) The longest time from receiving one of those blocks to announcing it\n"
+            "  \"latency_last\": n,       (numeric) The time from receiving the last of those blocks to announcing it\n"
+            "  \"highbandwidth_to\": n,   (numeric) The number of peers that asked us for high-bandwidth compact block announcements\n"
+            "  \"highbandwidth_from\": n  (numeric) The number of peers we asked for high-bandwidth compact block announcements\n"
+            "}\n"
+                },
+                RPCExamples{
+                    HelpExampleCli("getblockrelaystats", "")
+            + HelpExampleRpc("getblockrelaystats", "")
+                },
+            }.ToString());
+
+    const BlockRelayStats stats = GetBlockRelayStats();
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("blocks", stats.nBlocks);
+    obj.pushKV("cmpctblocks_sent", stats.nMsgsSent);
+    obj.pushKV("received", stats.nReceived);
+    obj.pushKV("latency_avg", stats.nReceived > 0 ? stats.nTotalLatency / (int64_t)stats.nReceived : 0);
+    obj.pushKV("latency_max", stats.nMaxLatency);
+    obj.pushKV("latency_last", stats.nLastLatency);
+    obj.pushKV("highbandwidth_to", stats.nHighBandwidthTo);
+    obj.pushKV("highbandwidth_from", stats.nHighBandwidthFrom);
     return obj;
 }
 
@@ -749,6 +891,8 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         {"address", "nodeid"} },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       {"node"} },
     { "network",            "getnettotals",           &getnettotals,           {} },
+    { "network",            "getnetprocessingstats",  &getnetprocessingstats,  {} },
+    { "network",            "getblockrelaystats",     &getblockrelaystats,     {} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         {} },
     { "network",            "setban",                 &setban,                 {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             {} },
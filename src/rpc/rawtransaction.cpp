@@ -1174,6 +1174,70 @@ static UniValue testmempoolaccept(const JSONRPCRequest& request)
     return result;
 }
 
+static UniValue submitpackage(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2) {
+        throw std::runtime_error(
+            RPCHelpMan{"submitpackage",
+                "\nSubmits a package of raw transactions (serialized, hex-encoded) to local node and network.\n"
+                "\nThe package is accepted to the mempool as a whole or not at all. Its fees are checked against\n"
+                "the mempool minimum fee together, so that a child can pay for a parent that would be rejected on its own.\n"
+                "Transactions already in the mempool are left in and do not count towards the package fees.\n"
+                "\nSee sendrawtransaction call.\n",
+                {
+                    {"rawtxs", RPCArg::Type::ARR, RPCArg::Optional::NO, "An array of hex strings of raw transactions, parents before their children.\n"
+            "                                        Length must be at most " + std::to_string(MAX_PACKAGE_COUNT) + ".",
+                        {
+                            {"rawtx", RPCArg::Type::STR_HEX, RPCArg::Optional::OMITTED, ""},
+                        },
+                        },
+                    {"allowhighfees", RPCArg::Type::BOOL, /* default */ "false", "Allow high fees"},
+                },
+                RPCResult{
+            "[                   (array) The transaction hashes in hex, in the order given\n"
+            "  \"hex\"\n"
+            "]\n"
+                },
+                RPCExamples{
+            "\nSubmit a parent and a child that pays for it\n"
+            + HelpExampleCli("submitpackage", "'[\"signedparenthex\",\"signedchildhex\"]'") +
+            "\nAs a JSON-RPC call\n"
+            + HelpExampleRpc("submitpackage", "[\"signedparenthex\",\"signedchildhex\"]")
+                },
+            }.ToString());
+    }
+
+    RPCTypeCheck(request.params, {UniValue::VARR, UniValue::VBOOL});
+    const UniValue& rawtxs = request.params[0].get_array();
+    if (rawtxs.empty() || rawtxs.size() > MAX_PACKAGE_COUNT) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Array must contain between 1 and %u raw transactions", MAX_PACKAGE_COUNT));
+    }
+
+    std::vector<CTransactionRef> package;
+    for (size_t i = 0; i < rawtxs.size(); i++) {
+        CMutableTransaction mtx;
+        if (!DecodeHexTx(mtx, rawtxs[i].get_str())) {
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("TX decode failed for transaction %u", i));
+        }
+        package.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+
+    bool allowhighfees = false;
+    if (!request.params[1].isNull()) allowhighfees = request.params[1].get_bool();
+    const CAmount highfee{allowhighfees ? 0 : ::maxTxFee};
+    std::string err_string;
+    const TransactionError err = BroadcastPackage(package, err_string, highfee);
+    if (TransactionError::OK != err) {
+        throw JSONRPCTransactionError(err, err_string);
+    }
+
+    UniValue result(UniValue::VARR);
+    for (const CTransactionRef& tx : package) {
+        result.push_back(tx->GetHash().GetHex());
+    }
+    return result;
+}
+
 static std::string WriteHDKeypath(std::vector<uint32_t>& keypath)
 {
     std::string keypath_str = "m";
@@ -2096,6 +2160,7 @@ static const CRPCCommand commands[] =
     { "hidden",             "signrawtransaction",           &signrawtransaction,        {"hexstring","prevtxs","privkeys","sighashtype"} },
     { "rawtransactions",    "signrawtransactionwithkey",    &signrawtransactionwithkey, {"hexstring","privkeys","prevtxs","sighashtype"} },
     { "rawtransactions",    "testmempoolaccept",            &testmempoolaccept,         {"rawtxs","allowhighfees"} },
+    { "rawtransactions",    "submitpackage",                &submitpackage,             {"rawtxs","allowhighfees"} },
     { "rawtransactions",    "decodepsbt",                   &decodepsbt,                {"psbt"} },
     { "rawtransactions",    "combinepsbt",                  &combinepsbt,               {"txs"} },
     { "rawtransactions",    "finalizepsbt",                 &finalizepsbt,              {"psbt", "extract"} },
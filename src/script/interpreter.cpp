@@ -10,6 +10,7 @@
 #include <crypto/sha256.h>
 #include <pubkey.h>
 #include <script/script.h>
+#include <streams.h>
 #include <uint256.h>
 
 typedef std::vector<unsigned char> valtype;
@@ -1182,6 +1183,40 @@ public:
     }
 };
 
+/** Minimal stream feeding serialized data into a SHA256 state */
+class SHA256Serializer
+{
+private:
+    CSHA256& sha;
+
+public:
+    explicit SHA256Serializer(CSHA256& shaIn) : sha(shaIn) {}
+
+    int GetType() const { return SER_GETHASH; }
+    int GetVersion() const { return 0; }
+
+    void write(const char* pch, size_t size)
+    {
+        sha.Write((const unsigned char*)pch, size);
+    }
+
+    template <typename T>
+    SHA256Serializer& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj);
+        return *this;
+    }
+};
+
+template <class T>
+bool HasLegacyInputs(const T& txTo)
+{
+    for (const auto& txin : txTo.vin) {
+        if (txin.scriptWitness.IsNull()) return true;
+    }
+    return false;
+}
+
 template <class T>
 uint256 GetPrevoutHash(const T& txTo)
 {
@@ -1226,9 +1261,39 @@ PrecomputedTransactionData::PrecomputedTransactionData(const T& txTo)
     }
 }
 
+template <class T>
+void PrecomputedTransactionData::PrecomputeLegacy(const T& txTo)
+{
+    if (legacyReady || txTo.vin.size() < LEGACY_SIGHASH_MIDSTATE_MIN_INPUTS || !HasLegacyInputs(txTo)) return;
+
+    // The SIGHASH_ALL serialization of any input, with all scriptSigs blanked
+    CVectorWriter s(SER_GETHASH, 0, legacyData, 0);
+    s << txTo.nVersion;
+    ::WriteCompactSize(s, txTo.vin.size());
+    legacyOffsets.reserve(txTo.vin.size() + 1);
+    for (const auto& txin : txTo.vin) {
+        legacyOffsets.push_back(legacyData.size());
+        s << txin.prevout << CScript() << txin.nSequence;
+    }
+    legacyOffsets.push_back(legacyData.size());
+    s << txTo.vout << txTo.nLockTime;
+
+    legacyMidstates.reserve(txTo.vin.size());
+    CSHA256 sha;
+    size_t nHashed = 0;
+    for (size_t i = 0; i < txTo.vin.size(); i++) {
+        sha.Write(legacyData.data() + nHashed, legacyOffsets[i] - nHashed);
+        nHashed = legacyOffsets[i];
+        legacyMidstates.push_back(sha);
+    }
+    legacyReady = true;
+}
+
 // explicit instantiation
 template PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo);
 template PrecomputedTransactionData::PrecomputedTransactionData(const CMutableTransaction& txTo);
+template void PrecomputedTransactionData::PrecomputeLegacy(const CTransaction& txTo);
+template void PrecomputedTransactionData::PrecomputeLegacy(const CMutableTransaction& txTo);
 
 template <class T>
 uint256 SignatureHash(const CScript& scriptCode, const T& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1294,6 +1359,22 @@ uint256 SignatureHash(const CScript& scriptCode, const T& txTo, unsigned int nIn
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer<T> txTmp(txTo, scriptCode, nIn, nHashType);
 
+    if (cache && cache->legacyReady && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        // Resume from the state before the signed input, and hash what follows it as is
+        CSHA256 sha(cache->legacyMidstates[nIn]);
+        SHA256Serializer s(sha);
+        txTmp.SerializeInput(s, nIn);
+        const size_t nNext = cache->legacyOffsets[nIn + 1];
+        sha.Write(cache->legacyData.data() + nNext, cache->legacyData.size() - nNext);
+        s << nHashType;
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        sha.Finalize(buf);
+        uint256 result;
+        CSHA256().Write(buf, sizeof(buf)).Finalize(result.begin());
+        return result;
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include <crypto/sha256.h>
 #include <script/script_error.h>
 #include <primitives/transaction.h>
 
@@ -119,13 +120,37 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
+/** Number of inputs from which the legacy signature hash midstates of a transaction are precomputed */
+static constexpr size_t LEGACY_SIGHASH_MIDSTATE_MIN_INPUTS = 8;
+
 struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
     bool ready = false;
 
+    /**
+     * Legacy (non-segwit) SIGHASH_ALL hashes cover the whole transaction, with
+     * every scriptSig but the signed input's blanked out, so hashing them one
+     * input at a time is quadratic in the number of inputs. For transactions
+     * with many inputs, the blanked serialization is kept along with the
+     * SHA256 state up to the start of each input: a signature hash then only
+     * serializes the input it signs and hashes the bytes that follow it.
+     * Only built by PrecomputeLegacy(), for transactions whose scripts are
+     * about to be run.
+     */
+    std::vector<unsigned char> legacyData;
+    //! Offset of each input in legacyData, and of the outputs after the last one
+    std::vector<size_t> legacyOffsets;
+    //! SHA256 state after the bytes of legacyData before each input
+    std::vector<CSHA256> legacyMidstates;
+    bool legacyReady = false;
+
     template <class T>
     explicit PrecomputedTransactionData(const T& tx);
+
+    /** Build the legacy signature hash midstates, if tx has enough inputs that are not segwit */
+    template <class T>
+    void PrecomputeLegacy(const T& tx);
 };
 
 enum class SigVersion
@@ -53,4 +53,13 @@ public:
 
 void InitSignatureCache();
 
+/** The nonce of the signature cache and the entries it still holds, to save them. */
+void GetSignatureCacheEntries(uint256& nonce, std::vector<uint256>& entries);
+/**
+ * Switch the signature cache over to a saved nonce and insert the entries
+ * saved with it. Entries of the previous nonce no longer match anything, so
+ * this is only meant to be called before any signature is checked.
+ */
+void LoadSignatureCacheEntries(const uint256& nonce, const std::vector<uint256>& entries);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
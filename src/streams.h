@@ -468,6 +468,12 @@ public:
         clear();
     }
 
+    /** Exchange the underlying buffer with d, e.g. to reuse its allocation. Resets the read position. */
+    void swap(vector_type& d) {
+        vch.swap(d);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
@@ -2,10 +2,15 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
 #include <sync.h>
 
 #include <logging.h>
 #include <util/strencodings.h>
+#include <util/time.h>
 
 #include <stdio.h>
 
@@ -24,6 +29,40 @@ void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+#ifdef HAVE_THREAD_LOCAL
+static thread_local LockWaitTimer* g_lock_wait_timer = nullptr;
+#endif
+
+LockWaitTimer::LockWaitTimer(const void* mutex) : m_mutex(mutex), m_wait_micros(0), m_prev(nullptr)
+{
+#ifdef HAVE_THREAD_LOCAL
+    m_prev = g_lock_wait_timer;
+    g_lock_wait_timer = this;
+#endif
+}
+
+LockWaitTimer::~LockWaitTimer()
+{
+#ifdef HAVE_THREAD_LOCAL
+    g_lock_wait_timer = m_prev;
+#endif
+}
+
+LockWaitTimer* LockWaitTimer::Find(const void* mutex)
+{
+#ifdef HAVE_THREAD_LOCAL
+    for (LockWaitTimer* timer = g_lock_wait_timer; timer != nullptr; timer = timer->m_prev) {
+        if (timer->m_mutex == mutex) return timer;
+    }
+#endif
+    return nullptr;
+}
+
+int64_t LockWaitTimer::NowMicros()
+{
+    return GetTimeMicros();
+}
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
@@ -9,6 +9,7 @@
 #include <threadsafety.h>
 
 #include <condition_variable>
+#include <stdint.h>
 #include <thread>
 #include <mutex>
 
@@ -114,6 +115,33 @@ typedef AnnotatedMixin<std::mutex> Mutex;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * While in scope, adds up the time the current thread spends blocked on
+ * acquiring the given mutex, e.g. to attribute cs_main contention to the
+ * work being done. Timers for different mutexes may be nested. Without
+ * thread_local support nothing is measured.
+ */
+class LockWaitTimer
+{
+public:
+    explicit LockWaitTimer(const void* mutex);
+    ~LockWaitTimer();
+    LockWaitTimer(const LockWaitTimer&) = delete;
+    LockWaitTimer& operator=(const LockWaitTimer&) = delete;
+
+    int64_t GetWaitMicros() const { return m_wait_micros; }
+
+    /** The innermost timer of this thread for the given mutex, if any */
+    static LockWaitTimer* Find(const void* mutex);
+    static int64_t NowMicros();
+    void AddWait(int64_t micros) { m_wait_micros += micros; }
+
+private:
+    const void* const m_mutex;
+    int64_t m_wait_micros;
+    LockWaitTimer* m_prev;
+};
+
 /** Wrapper around std::unique_lock style lock for Mutex. */
 template <typename Mutex, typename Base = typename Mutex::UniqueLock>
 class SCOPED_LOCKABLE UniqueLock : public Base
@@ -122,14 +150,15 @@ private:
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(Base::mutex()));
-#ifdef DEBUG_LOCKCONTENTION
         if (!Base::try_lock()) {
+#ifdef DEBUG_LOCKCONTENTION
             PrintLockContention(pszName, pszFile, nLine);
 #endif
+            LockWaitTimer* timer = LockWaitTimer::Find(Base::mutex());
+            const int64_t nWaitStart = timer ? LockWaitTimer::NowMicros() : 0;
             Base::lock();
-#ifdef DEBUG_LOCKCONTENTION
+            if (timer) timer->AddWait(LockWaitTimer::NowMicros() - nWaitStart);
         }
-#endif
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
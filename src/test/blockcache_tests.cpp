@@ -0,0 +1,93 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockcache.h>
+#include <chainparams.h>
+#include <streams.h>
+#include <validation.h>
+#include <version.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+static CRawBlockCache::RawBlockRef MakeRaw(size_t size)
+{
+    return std::make_shared<const std::vector<uint8_t>>(size, 0x42);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    CRawBlockCache cache(1 << 20);
+    const uint256 a = InsecureRand256();
+    const uint256 b = InsecureRand256();
+    const uint256 c = InsecureRand256();
+
+    BOOST_CHECK(!cache.Get(a, true));
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 1U);
+
+    // Both forms of a block are cached independently
+    cache.Insert(a, true, MakeRaw(1000));
+    cache.Insert(a, false, MakeRaw(800));
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    BOOST_CHECK_EQUAL(cache.Get(a, true)->size(), 1000U);
+    BOOST_CHECK_EQUAL(cache.Get(a, false)->size(), 800U);
+    BOOST_CHECK_EQUAL(cache.GetHits(), 2U);
+    cache.Erase(a);
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0U);
+
+    // Room for two 400k blocks but not three
+    cache.Insert(a, true, MakeRaw(400000));
+    cache.Insert(b, true, MakeRaw(400000));
+    BOOST_CHECK(cache.Get(a, true)); // a is now the most recently used
+    cache.Insert(c, true, MakeRaw(400000));
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    BOOST_CHECK(cache.Get(a, true));
+    BOOST_CHECK(!cache.Get(b, true));
+    BOOST_CHECK(cache.Get(c, true));
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= cache.GetMaxBytes());
+
+    // Entries larger than the whole budget are never admitted
+    cache.Insert(b, true, MakeRaw(2 << 20));
+    BOOST_CHECK(!cache.Get(b, true));
+
+    // Evicted data stays valid for holders of a reference
+    CRawBlockCache::RawBlockRef held = cache.Get(c, true);
+    cache.SetMaxBytes(0);
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+    BOOST_CHECK_EQUAL(held->size(), 400000U);
+}
+
+BOOST_FIXTURE_TEST_CASE(blockcache_read, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = chainActive.Tip();
+    }
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()));
+
+    g_raw_block_cache.Clear();
+    for (bool fWitness : {true, false}) {
+        CDataStream expected(SER_NETWORK, PROTOCOL_VERSION | (fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+        expected << block;
+
+        CRawBlockCache::RawBlockRef raw;
+        BOOST_REQUIRE(ReadRawBlockCached(raw, pindex, fWitness, chainparams));
+        BOOST_CHECK(std::vector<uint8_t>(expected.begin(), expected.end()) == *raw);
+
+        // The tip is hot, so a second read is served from the cache
+        CRawBlockCache::RawBlockRef cached = g_raw_block_cache.Get(pindex->GetBlockHash(), fWitness);
+        BOOST_CHECK(cached == raw);
+    }
+
+    g_raw_block_cache.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
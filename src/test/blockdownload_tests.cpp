@@ -0,0 +1,101 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockdownload.h>
+#include <chainparams.h>
+#include <consensus/params.h>
+#include <validation.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockdownload_tests, BasicTestingSetup)
+
+// Request nBlocks at nStart and have them delivered one every nInterval after nLatency
+static int64_t Deliver(CBlockDownloadRate& rate, int nBlocks, int64_t nStart, int64_t nLatency, int64_t nInterval, int64_t nPing)
+{
+    int64_t nNow = nStart + nLatency;
+    for (int i = 0; i < nBlocks; i++) {
+        rate.BlockReceived(nStart, nNow, nPing);
+        nNow += nInterval;
+    }
+    return nNow;
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_window)
+{
+    // Until something has been delivered, the fixed defaults apply
+    CBlockDownloadRate rate;
+    BOOST_CHECK_EQUAL(rate.GetWindow(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(rate.GetStallTimeout(), BLOCK_STALLING_TIMEOUT * 1000000);
+
+    // Isolated requests say nothing about throughput
+    int64_t nNow = 1000000;
+    for (int i = 0; i < 5; i++) {
+        rate.BlockReceived(nNow, nNow + 200000, 0);
+        nNow += 60000000;
+    }
+    BOOST_CHECK_EQUAL(rate.GetWindow(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(rate.GetDeliveryInterval(), 0);
+    BOOST_CHECK_EQUAL(rate.GetLatency(), 200000);
+    BOOST_CHECK_EQUAL(rate.GetStallTimeout(), BLOCK_REASSIGN_DELAY_FACTOR * 200000);
+
+    // A fast peer on a long link gets the largest window
+    CBlockDownloadRate fast;
+    Deliver(fast, 64, 0, 100000, 1000, 100000);
+    BOOST_CHECK_EQUAL(fast.GetDeliveryInterval(), 1000);
+    BOOST_CHECK_EQUAL(fast.GetWindow(), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A slow peer is kept to a few blocks: two round trips of 50ms plus delivery, at 500ms per block
+    CBlockDownloadRate slow;
+    Deliver(slow, 16, 0, 500000, 500000, 50000);
+    BOOST_CHECK_EQUAL(slow.GetDeliveryInterval(), 500000);
+    BOOST_CHECK_EQUAL(slow.GetWindow(), 3);
+    // Its usual delivery time is long, but blocks are reassigned before the stalling timeout
+    BOOST_CHECK_EQUAL(slow.GetStallTimeout(), BLOCK_STALLING_TIMEOUT * 1000000);
+
+    // In between, the window covers two round trips worth of deliveries
+    CBlockDownloadRate medium;
+    Deliver(medium, 64, 0, 20000, 10000, 20000);
+    BOOST_CHECK_EQUAL(medium.GetWindow(), 6);
+
+    // Blocks are not reassigned from a quick peer too eagerly
+    CBlockDownloadRate quick;
+    quick.BlockReceived(0, 10000, 0);
+    BOOST_CHECK_EQUAL(quick.GetStallTimeout(), BLOCK_REASSIGN_MIN_TIMEOUT);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_stall)
+{
+    CBlockDownloadRate rate;
+    int64_t nNow = Deliver(rate, 64, 0, 100000, 1000, 100000);
+    BOOST_CHECK_EQUAL(rate.GetWindow(), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Every stall halves the window, down to the minimum
+    rate.BlockStalled();
+    BOOST_CHECK_EQUAL(rate.GetWindow(), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER / 2);
+    BOOST_CHECK_EQUAL(rate.GetDeliveryInterval(), 2000);
+    for (int i = 0; i < 10; i++) rate.BlockStalled();
+    BOOST_CHECK_EQUAL(rate.GetWindow(), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Good deliveries grow it back
+    Deliver(rate, 64, nNow, 100000, 1000, 100000);
+    BOOST_CHECK_EQUAL(rate.GetWindow(), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_chain_window)
+{
+    Consensus::Params params = Params().GetConsensus();
+    params.nPowTargetSpacing = 10 * 60;
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(params), (int)BLOCK_DOWNLOAD_WINDOW);
+    params.nPowTargetSpacing = 5 * 60;
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(params), 2 * (int)BLOCK_DOWNLOAD_WINDOW);
+    params.nPowTargetSpacing = 60;
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(params), BLOCK_DOWNLOAD_WINDOW_MAX_SCALE * (int)BLOCK_DOWNLOAD_WINDOW);
+    params.nPowTargetSpacing = 20 * 60;
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(params), (int)BLOCK_DOWNLOAD_WINDOW);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
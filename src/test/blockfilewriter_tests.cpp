@@ -0,0 +1,83 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockfilewriter.h>
+
+#include <test/test_bitcoin.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilewriter_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockfilewriter_inline)
+{
+    // Without a writer thread jobs run synchronously
+    CBlockFileWriter writer;
+    bool fRan = false;
+    writer.Enqueue(0, [&fRan]() { fRan = true; return true; });
+    BOOST_CHECK(fRan);
+    BOOST_CHECK_EQUAL(writer.GetPending(), 0U);
+    BOOST_CHECK(!writer.HasFailed());
+
+    writer.Enqueue(0, []() { return false; });
+    BOOST_CHECK(writer.HasFailed());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilewriter_ordering)
+{
+    CBlockFileWriter writer(4);
+    writer.Start();
+
+    std::mutex order_mutex;
+    std::vector<int> order;
+    std::atomic<bool> release{false};
+
+    // Hold the writer thread on the first job so the rest pile up
+    writer.Enqueue(1, [&release]() {
+        while (!release) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return true;
+    });
+    for (int i = 0; i < 3; i++) {
+        writer.Enqueue(i % 2 ? 1 : 2, [i, &order, &order_mutex]() {
+            std::lock_guard<std::mutex> lock(order_mutex);
+            order.push_back(i);
+            return true;
+        });
+    }
+    BOOST_CHECK(writer.GetPending() > 0);
+    release = true;
+
+    // Waiting for file 1 covers its last write (i == 1) and everything queued before it
+    writer.WaitForFile(1);
+    {
+        std::lock_guard<std::mutex> lock(order_mutex);
+        BOOST_CHECK(order.size() >= 2);
+        BOOST_CHECK_EQUAL(order[0], 0);
+        BOOST_CHECK_EQUAL(order[1], 1);
+    }
+
+    writer.WaitForAll();
+    BOOST_CHECK_EQUAL(writer.GetPending(), 0U);
+    BOOST_CHECK(order == std::vector<int>({0, 1, 2}));
+
+    // Files without pending writes never block
+    writer.WaitForFile(7);
+
+    // Stop drains whatever is still queued
+    int nDone = 0;
+    for (int i = 0; i < 10; i++) {
+        writer.Enqueue(3, [&nDone]() { ++nDone; return true; });
+    }
+    writer.Stop();
+    BOOST_CHECK_EQUAL(nDone, 10);
+    BOOST_CHECK(!writer.HasFailed());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
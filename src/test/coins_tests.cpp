@@ -7,12 +7,14 @@
 #include <consensus/validation.h>
 #include <script/standard.h>
 #include <test/test_bitcoin.h>
+#include <txdb.h>
 #include <uint256.h>
 #include <undo.h>
 #include <util/strencodings.h>
 #include <validation.h>
 
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
@@ -858,4 +860,71 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+static std::vector<COutPoint> ReadCursor(CCoinsViewCursor& cursor)
+{
+    std::vector<COutPoint> outpoints;
+    while (cursor.Valid()) {
+        COutPoint outpoint;
+        Coin coin;
+        BOOST_CHECK(cursor.GetKey(outpoint));
+        BOOST_CHECK(cursor.GetValue(coin));
+        outpoints.push_back(outpoint);
+        cursor.Next();
+    }
+    return outpoints;
+}
+
+BOOST_AUTO_TEST_CASE(coins_cursor_ranges)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCache cache(&db);
+    for (int i = 0; i < 1000; i++) {
+        uint256 txid = InsecureRand256();
+        // Put some coins right at the edges of the keyspace and of the ranges below
+        if (i < 4) {
+            txid.begin()[0] = i == 3 ? 0x80 : (i == 2 ? 0x7f : (i == 1 ? 0xff : 0x00));
+            txid.begin()[1] = i % 2 ? 0xff : 0x00;
+        }
+        Coin coin;
+        coin.out.nValue = InsecureRand32();
+        coin.nHeight = 1;
+        cache.AddCoin(COutPoint(txid, InsecureRandBits(2)), std::move(coin), false);
+    }
+    const uint256 hashBest = InsecureRand256();
+    cache.SetBestBlock(hashBest);
+    BOOST_CHECK(cache.Flush());
+
+    std::unique_ptr<CCoinsViewCursor> cursor(db.Cursor());
+    const std::vector<COutPoint> expected = ReadCursor(*cursor);
+    BOOST_CHECK_EQUAL(expected.size(), 1000U);
+
+    for (size_t nRanges : {1, 2, 3, 7, 64}) {
+        std::vector<std::unique_ptr<CCoinsViewCursor>> ranges = db.CursorRanges(nRanges);
+        BOOST_CHECK_EQUAL(ranges.size(), nRanges);
+
+        // Coins written after the ranges were created are not visible to them
+        Coin coin;
+        coin.out.nValue = 1;
+        coin.nHeight = 2;
+        const COutPoint extra(InsecureRand256(), 0);
+        cache.AddCoin(extra, std::move(coin), false);
+        cache.SetBestBlock(InsecureRand256());
+        BOOST_CHECK(cache.Flush());
+
+        // Together the ranges yield every coin exactly once, in key order
+        std::vector<COutPoint> found;
+        for (const auto& range : ranges) {
+            BOOST_CHECK(range->GetBestBlock() == hashBest);
+            const std::vector<COutPoint> part = ReadCursor(*range);
+            found.insert(found.end(), part.begin(), part.end());
+        }
+        BOOST_CHECK(found == expected);
+
+        // Undo the extra write for the next round
+        cache.SpendCoin(extra);
+        cache.SetBestBlock(hashBest);
+        BOOST_CHECK(cache.Flush());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
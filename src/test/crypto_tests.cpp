@@ -4,6 +4,8 @@
 
 #include <crypto/aes.h>
 #include <crypto/chacha20.h>
+#include <crypto/common.h>
+#include <crypto/muhash.h>
 #include <crypto/ripemd160.h>
 #include <crypto/sha1.h>
 #include <crypto/sha256.h>
@@ -11,6 +13,7 @@
 #include <crypto/hmac_sha256.h>
 #include <crypto/hmac_sha512.h>
 #include <random.h>
+#include <streams.h>
 #include <util/strencodings.h>
 #include <test/test_bitcoin.h>
 
@@ -562,4 +565,109 @@ BOOST_AUTO_TEST_CASE(sha256d64)
     }
 }
 
+static Num3072 Num3072FromInt(uint32_t x)
+{
+    unsigned char data[Num3072::BYTE_SIZE] = {0};
+    WriteLE32(data, x);
+    return Num3072(data);
+}
+
+static std::vector<unsigned char> Num3072Bytes(const Num3072& num)
+{
+    unsigned char data[Num3072::BYTE_SIZE];
+    num.ToBytes(data);
+    return std::vector<unsigned char>(data, data + sizeof(data));
+}
+
+BOOST_AUTO_TEST_CASE(num3072_arithmetic)
+{
+    // 2^3071 * 2 wraps around to 2^3072 - p = 1103717
+    unsigned char top[Num3072::BYTE_SIZE] = {0};
+    top[Num3072::BYTE_SIZE - 1] = 0x80;
+    Num3072 wrapped(top);
+    wrapped.Multiply(Num3072FromInt(2));
+    BOOST_CHECK(Num3072Bytes(wrapped) == Num3072Bytes(Num3072FromInt(1103717)));
+
+    // (p - 1)^2 = (-1)^2 = 1
+    unsigned char minus_one[Num3072::BYTE_SIZE];
+    memset(minus_one, 0xff, sizeof(minus_one));
+    WriteLE32(minus_one, 0xffffffff - 1103717);
+    Num3072 square(minus_one);
+    square.Multiply(Num3072(minus_one));
+    BOOST_CHECK(Num3072Bytes(square) == Num3072Bytes(Num3072()));
+
+    // p itself reduces to zero
+    unsigned char prime[Num3072::BYTE_SIZE];
+    memcpy(prime, minus_one, sizeof(prime));
+    prime[0]++;
+    BOOST_CHECK(Num3072Bytes(Num3072(prime)) == std::vector<unsigned char>(Num3072::BYTE_SIZE, 0));
+
+    for (int i = 0; i < 4; ++i) {
+        unsigned char data_a[Num3072::BYTE_SIZE], data_b[Num3072::BYTE_SIZE];
+        for (size_t j = 0; j < Num3072::BYTE_SIZE; ++j) {
+            data_a[j] = InsecureRandBits(8);
+            data_b[j] = InsecureRandBits(8);
+        }
+        const Num3072 a(data_a), b(data_b);
+        // a * b / b = a, and a * a^-1 = 1
+        Num3072 c = a;
+        c.Multiply(b);
+        c.Divide(b);
+        BOOST_CHECK(Num3072Bytes(c) == Num3072Bytes(a));
+        Num3072 d = a;
+        d.Multiply(a.GetInverse());
+        BOOST_CHECK(Num3072Bytes(d) == Num3072Bytes(Num3072()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(muhash_set_operations)
+{
+    unsigned char hash_empty[32], hash_ab[32], hash_ba[32], hash_a[32];
+    const unsigned char a[] = {'a'}, b[] = {'b'}, c[] = {'c'};
+
+    // The empty set hashes to SHA256 of the number one
+    MuHash3072().Finalize(hash_empty);
+    unsigned char one[Num3072::BYTE_SIZE] = {1};
+    unsigned char expected[32];
+    CSHA256().Write(one, sizeof(one)).Finalize(expected);
+    BOOST_CHECK(memcmp(hash_empty, expected, 32) == 0);
+
+    // Order does not matter
+    MuHash3072 ab, ba;
+    ab.Insert(a, 1).Insert(b, 1);
+    ba.Insert(b, 1).Insert(a, 1);
+    ab.Finalize(hash_ab);
+    ba.Finalize(hash_ba);
+    BOOST_CHECK(memcmp(hash_ab, hash_ba, 32) == 0);
+
+    // Removal cancels insertion, even before the element was inserted
+    MuHash3072 acb;
+    acb.Remove(c, 1).Insert(a, 1).Insert(c, 1).Insert(b, 1);
+    acb.Finalize(hash_ba);
+    BOOST_CHECK(memcmp(hash_ab, hash_ba, 32) == 0);
+    acb.Remove(b, 1);
+    acb.Finalize(hash_ba);
+    MuHash3072(a, 1).Finalize(hash_a);
+    BOOST_CHECK(memcmp(hash_a, hash_ba, 32) == 0);
+    BOOST_CHECK(memcmp(hash_a, hash_ab, 32) != 0);
+
+    // Combining sets
+    MuHash3072 set_a(a, 1), set_b(b, 1);
+    set_a *= set_b;
+    set_a.Finalize(hash_ba);
+    BOOST_CHECK(memcmp(hash_ab, hash_ba, 32) == 0);
+    set_a /= set_b;
+    set_a.Finalize(hash_ba);
+    BOOST_CHECK(memcmp(hash_a, hash_ba, 32) == 0);
+
+    // Serialization keeps the state
+    CDataStream ss(SER_DISK, 0);
+    ss << ab;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 ab_copy;
+    ss >> ab_copy;
+    ab_copy.Finalize(hash_ba);
+    BOOST_CHECK(memcmp(hash_ab, hash_ba, 32) == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -362,4 +362,28 @@ BOOST_AUTO_TEST_CASE(cuckoocache_generations)
     test_cache_generations<CuckooCache::cache<uint256, SignatureCacheHasher>>();
 }
 
+/* Test that get_live returns what was inserted, except what was erased.
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_get_live)
+{
+    SeedInsecureRand(true);
+    CuckooCache::cache<uint256, SignatureCacheHasher> cc{};
+    cc.setup_bytes(1 << 20);
+    std::vector<uint256> hashes;
+    for (int x = 0; x < 1000; ++x) {
+        hashes.push_back(InsecureRand256());
+        cc.insert(hashes.back());
+    }
+    for (int x = 0; x < 500; ++x) {
+        BOOST_CHECK(cc.contains(hashes[x], true));
+    }
+
+    std::vector<uint256> live;
+    cc.get_live(live);
+    std::sort(live.begin(), live.end());
+    std::vector<uint256> expected(hashes.begin() + 500, hashes.end());
+    std::sort(expected.begin(), expected.end());
+    BOOST_CHECK(live == expected);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
@@ -62,6 +62,11 @@ static CService ip(uint32_t i)
 static NodeId id = 0;
 
 void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds);
+void ProcessSendCmpct(CNode* pfrom, bool fAnnounceUsingCMPCTBLOCK, uint64_t nCMPCTBLOCKVersion);
+void SelectHighBandwidthPeer(NodeId nodeid, CConnman* connman, bool fBlockRelayNode);
+void RecordBlockReceived(const uint256& hash, int64_t nTimeReceived);
+void RecordBlockRelayed(const uint256& hash, int nMsgsSent);
+void ProcessTransactions(CNode* pfrom, const std::vector<CTransactionRef>& vtx, CConnman* connman, bool enable_bip61);
 
 BOOST_FIXTURE_TEST_SUITE(denialofservice_tests, TestingSetup)
 
@@ -76,7 +81,7 @@ BOOST_FIXTURE_TEST_SUITE(denialofservice_tests, TestingSetup)
 BOOST_AUTO_TEST_CASE(outbound_slow_chain_eviction)
 {
     auto connman = MakeUnique<CConnman>(0x1337, 0x1337);
-    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), nullptr, scheduler, false);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), nullptr, scheduler, false, false);
 
     // Mock an outbound peer
     CAddress addr1(ip(0xa0b0c001), NODE_NONE);
@@ -146,7 +151,7 @@ static void AddRandomOutboundPeer(std::vector<CNode *> &vNodes, PeerLogicValidat
 BOOST_AUTO_TEST_CASE(stale_tip_peer_management)
 {
     auto connman = MakeUnique<CConnmanTest>(0x1337, 0x1337);
-    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), nullptr, scheduler, false);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), nullptr, scheduler, false, false);
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
     constexpr int nMaxOutbound = 8;
@@ -217,11 +222,73 @@ BOOST_AUTO_TEST_CASE(stale_tip_peer_management)
     connman->ClearNodes();
 }
 
+BOOST_AUTO_TEST_CASE(block_relay_high_bandwidth_peers)
+{
+    auto connman = MakeUnique<CConnmanTest>(0x1337, 0x1337);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), nullptr, scheduler, false, true);
+    BOOST_REQUIRE_EQUAL(GetBlockRelayStats().nHighBandwidthFrom, 0);
+
+    // Peers that support compact witness blocks, and one that doesn't
+    std::vector<CNode*> vNodes;
+    for (unsigned int i = 0; i < MAX_RELAY_NODE_HB_CMPCT_PEERS + 2; ++i) {
+        AddRandomOutboundPeer(vNodes, *peerLogic, connman.get());
+        ProcessSendCmpct(vNodes.back(), /*fAnnounceUsingCMPCTBLOCK=*/ i == 0, 2);
+    }
+    AddRandomOutboundPeer(vNodes, *peerLogic, connman.get());
+    ProcessSendCmpct(vNodes.back(), false, 1);
+    BOOST_CHECK_EQUAL(GetBlockRelayStats().nHighBandwidthTo, 1);
+    size_t nQueued;
+    {
+        LOCK(vNodes.back()->cs_vSend);
+        nQueued = vNodes.back()->vSendMsg.size();
+    }
+
+    {
+        LOCK(cs_main);
+        // Only a few peers are asked to announce blocks to us...
+        for (CNode* node : vNodes) {
+            SelectHighBandwidthPeer(node->GetId(), connman.get(), false);
+        }
+        BOOST_CHECK_EQUAL(GetBlockRelayStats().nHighBandwidthFrom, (int)MAX_HB_CMPCT_PEERS);
+        // ...but more of them with -blockrelaynode, never the one without witness support
+        for (CNode* node : vNodes) {
+            SelectHighBandwidthPeer(node->GetId(), connman.get(), true);
+        }
+        BOOST_CHECK_EQUAL(GetBlockRelayStats().nHighBandwidthFrom, (int)MAX_RELAY_NODE_HB_CMPCT_PEERS);
+    }
+    {
+        LOCK(vNodes.back()->cs_vSend);
+        BOOST_CHECK_EQUAL(vNodes.back()->vSendMsg.size(), nQueued);
+    }
+
+    // Announcements are counted, with the latency of those received from a peer
+    const BlockRelayStats before = GetBlockRelayStats();
+    const uint256 hashMined = InsecureRand256();
+    const uint256 hashReceived = InsecureRand256();
+    RecordBlockRelayed(hashMined, 3);
+    RecordBlockReceived(hashReceived, GetTimeMicros() - 1000000);
+    RecordBlockReceived(hashReceived, GetTimeMicros());
+    RecordBlockRelayed(hashReceived, 2);
+    const BlockRelayStats after = GetBlockRelayStats();
+    BOOST_CHECK_EQUAL(after.nBlocks, before.nBlocks + 2);
+    BOOST_CHECK_EQUAL(after.nMsgsSent, before.nMsgsSent + 5);
+    BOOST_CHECK_EQUAL(after.nReceived, before.nReceived + 1);
+    BOOST_CHECK(after.nLastLatency >= 1000000);
+    BOOST_CHECK(after.nMaxLatency >= after.nLastLatency);
+    BOOST_CHECK_EQUAL(after.nTotalLatency, before.nTotalLatency + after.nLastLatency);
+
+    bool dummy;
+    for (const CNode *node : vNodes) {
+        peerLogic->FinalizeNode(node->GetId(), dummy);
+    }
+    connman->ClearNodes();
+}
+
 BOOST_AUTO_TEST_CASE(DoS_banning)
 {
     auto banman = MakeUnique<BanMan>(GetDataDir() / "banlist.dat", nullptr, DEFAULT_MISBEHAVING_BANTIME);
     auto connman = MakeUnique<CConnman>(0x1337, 0x1337);
-    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false, false);
 
     banman->ClearBanned();
     CAddress addr1(ip(0xa0b0c001), NODE_NONE);
@@ -276,7 +343,7 @@ BOOST_AUTO_TEST_CASE(DoS_banscore)
 {
     auto banman = MakeUnique<BanMan>(GetDataDir() / "banlist.dat", nullptr, DEFAULT_MISBEHAVING_BANTIME);
     auto connman = MakeUnique<CConnman>(0x1337, 0x1337);
-    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false, false);
 
     banman->ClearBanned();
     gArgs.ForceSetArg("-banscore", "111"); // because 11 is my favorite number
@@ -323,7 +390,7 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
 {
     auto banman = MakeUnique<BanMan>(GetDataDir() / "banlist.dat", nullptr, DEFAULT_MISBEHAVING_BANTIME);
     auto connman = MakeUnique<CConnman>(0x1337, 0x1337);
-    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false, false);
 
     banman->ClearBanned();
     int64_t nStartTime = GetTime();
@@ -366,6 +433,76 @@ static CTransactionRef RandomOrphan()
     return it->second.tx;
 }
 
+static CTransactionRef SpendP2PK(const CKey& key, const COutPoint& prevout, CAmount nValue, bool fValidSignature = true, int nOutputs = 1)
+{
+    const CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(nOutputs);
+    for (CTxOut& txout : tx.vout) {
+        txout.nValue = nValue / nOutputs;
+        txout.scriptPubKey = scriptPubKey;
+    }
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    if (!fValidSignature) hash = uint256S("0x01");
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return MakeTransactionRef(tx);
+}
+
+BOOST_FIXTURE_TEST_CASE(DoS_invalid_package, TestChain100Setup)
+{
+    auto banman = MakeUnique<BanMan>(GetDataDir() / "banlist.dat", nullptr, DEFAULT_MISBEHAVING_BANTIME);
+    auto connman = MakeUnique<CConnman>(0x1337, 0x1337);
+    auto peerLogic = MakeUnique<PeerLogicValidation>(connman.get(), banman.get(), scheduler, false, false);
+
+    CAddress addr1(ip(0xa0b0c001), NODE_NONE);
+    CNode dummyNode1(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr1, 0, 0, CAddress(), "", true);
+    dummyNode1.SetSendVersion(PROTOCOL_VERSION);
+    peerLogic->InitializeNode(&dummyNode1);
+    CAddress addr2(ip(0xa0b0c002), NODE_NONE);
+    CNode dummyNode2(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr2, 1, 1, CAddress(), "", true);
+    dummyNode2.SetSendVersion(PROTOCOL_VERSION);
+    peerLogic->InitializeNode(&dummyNode2);
+
+    // Parents paying no fee, each with a child paying for it but failing its signature check
+    const CAmount nFee = 100000;
+    const CTransactionRef funding = SpendP2PK(coinbaseKey, COutPoint(m_coinbase_txns[0]->GetHash(), 0), m_coinbase_txns[0]->vout[0].nValue - nFee, true, 2);
+    const CTransactionRef parent1 = SpendP2PK(coinbaseKey, COutPoint(funding->GetHash(), 0), funding->vout[0].nValue);
+    const CTransactionRef badorphan = SpendP2PK(coinbaseKey, COutPoint(parent1->GetHash(), 0), parent1->vout[0].nValue - nFee, false);
+    const CTransactionRef parent2 = SpendP2PK(coinbaseKey, COutPoint(funding->GetHash(), 1), funding->vout[1].nValue);
+    const CTransactionRef badchild = SpendP2PK(coinbaseKey, COutPoint(parent2->GetHash(), 0), parent2->vout[0].nValue - nFee, false);
+
+    LOCK2(cs_main, g_cs_orphans);
+    CValidationState state;
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, funding, nullptr, nullptr, false, 0));
+
+    // The peer an invalid orphan came from is punished, not the one relaying its parent
+    BOOST_CHECK(AddOrphanTx(badorphan, dummyNode2.GetId()));
+    ProcessTransactions(&dummyNode1, {parent1}, connman.get(), false);
+    BOOST_CHECK(!mempool.exists(parent1->GetHash()));
+    BOOST_CHECK(!mapOrphanTransactions.count(badorphan->GetHash()));
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(dummyNode1.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.nMisbehavior, 0);
+    BOOST_CHECK(GetNodeStateStats(dummyNode2.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.nMisbehavior, 100);
+
+    // An invalid child relayed along with its parent is not kept as an orphan
+    ProcessTransactions(&dummyNode1, {parent2, badchild}, connman.get(), false);
+    BOOST_CHECK(!mempool.exists(parent2->GetHash()));
+    BOOST_CHECK(!mapOrphanTransactions.count(badchild->GetHash()));
+    BOOST_CHECK(GetNodeStateStats(dummyNode1.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.nMisbehavior, 100);
+
+    bool dummy;
+    peerLogic->FinalizeNode(dummyNode1.GetId(), dummy);
+    peerLogic->FinalizeNode(dummyNode2.GetId(), dummy);
+}
+
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
     CKey key;
@@ -146,6 +146,24 @@ BOOST_AUTO_TEST_CASE(siphash)
         BOOST_CHECK_EQUAL(SipHashUint256(k1, k2, x), sip256.Finalize());
         BOOST_CHECK_EQUAL(SipHashUint256Extra(k1, k2, x, n), sip288.Finalize());
     }
+
+    // Check consistency between SipHashUint256 and SipHashUint256Batch, for
+    // batches that do and do not fill up the lanes.
+    for (size_t n = 0; n < 11; ++n) {
+        uint64_t k1 = ctx.rand64();
+        uint64_t k2 = ctx.rand64();
+        std::vector<uint256> vals(n);
+        std::vector<const uint256*> ptrs(n);
+        for (size_t i = 0; i < n; ++i) {
+            vals[i] = InsecureRand256();
+            ptrs[i] = &vals[i];
+        }
+        std::vector<uint64_t> out(n);
+        SipHashUint256Batch(k1, k2, ptrs.data(), out.data(), n);
+        for (size_t i = 0; i < n; ++i) {
+            BOOST_CHECK_EQUAL(out[i], SipHashUint256(k1, k2, vals[i]));
+        }
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,117 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <headercache.h>
+#include <streams.h>
+#include <validation.h>
+#include <version.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(headercache_tests, TestChain100Setup)
+
+static std::vector<unsigned char> SerializedHeader(const CBlockIndex* pindex)
+{
+    std::vector<unsigned char> data;
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, data, 0) << pindex->GetBlockHeader(Params().GetConsensus());
+    return data;
+}
+
+BOOST_AUTO_TEST_CASE(headercache_follows_chain)
+{
+    LOCK(cs_main);
+    const CBlockIndex* tip = chainActive.Tip();
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), (size_t)chainActive.Height() + 1);
+    for (int nHeight : {0, 1, 50, chainActive.Height()}) {
+        CHeaderCache::HeaderRef header = g_header_cache.Get(chainActive[nHeight]->GetBlockHash());
+        BOOST_REQUIRE(header);
+        BOOST_CHECK(*header == SerializedHeader(chainActive[nHeight]));
+    }
+    BOOST_CHECK(!g_header_cache.Get(uint256S("0x01")));
+
+    // Headers following a block, up to the tip, a limit or a stop hash
+    std::vector<CHeaderCache::HeaderRef> headers;
+    const CBlockIndex* pindexLast = nullptr;
+    BOOST_REQUIRE(g_header_cache.GetHeadersAfter(chainActive[50]->GetBlockHash(), uint256(), 2000, headers, pindexLast));
+    BOOST_CHECK_EQUAL(headers.size(), (size_t)(tip->nHeight - 50));
+    BOOST_CHECK(*headers.front() == SerializedHeader(chainActive[51]));
+    BOOST_CHECK(pindexLast == tip);
+    BOOST_REQUIRE(g_header_cache.GetHeadersAfter(chainActive[50]->GetBlockHash(), uint256(), 5, headers, pindexLast));
+    BOOST_CHECK_EQUAL(headers.size(), 5U);
+    BOOST_CHECK(pindexLast == chainActive[55]);
+    BOOST_REQUIRE(g_header_cache.GetHeadersAfter(chainActive[50]->GetBlockHash(), chainActive[60]->GetBlockHash(), 2000, headers, pindexLast));
+    BOOST_CHECK_EQUAL(headers.size(), 10U);
+    BOOST_CHECK(pindexLast == chainActive[60]);
+    BOOST_REQUIRE(g_header_cache.GetHeadersAfter(tip->GetBlockHash(), uint256(), 2000, headers, pindexLast));
+    BOOST_CHECK(headers.empty());
+    BOOST_CHECK(pindexLast == tip);
+    BOOST_CHECK(!g_header_cache.GetHeadersAfter(uint256S("0x01"), uint256(), 2000, headers, pindexLast));
+
+    BOOST_REQUIRE(g_header_cache.GetHeadersFrom(chainActive[90]->GetBlockHash(), 2000, headers));
+    BOOST_CHECK_EQUAL(headers.size(), (size_t)(tip->nHeight - 89));
+    BOOST_CHECK(*headers.front() == SerializedHeader(chainActive[90]));
+}
+
+BOOST_AUTO_TEST_CASE(headercache_reorg)
+{
+    CBlockIndex* tip;
+    {
+        LOCK(cs_main);
+        tip = chainActive.Tip();
+    }
+    const size_t nSize = g_header_cache.Size();
+
+    CValidationState state;
+    BOOST_REQUIRE(InvalidateBlock(state, Params(), tip));
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), nSize - 1);
+    BOOST_CHECK(!g_header_cache.Get(tip->GetBlockHash()));
+    BOOST_CHECK(g_header_cache.Get(tip->pprev->GetBlockHash()));
+
+    {
+        LOCK(cs_main);
+        ResetBlockFailureFlags(tip);
+    }
+    BOOST_REQUIRE(ActivateBestChain(state, Params()));
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), nSize);
+    BOOST_CHECK(g_header_cache.Get(tip->GetBlockHash()));
+}
+
+BOOST_AUTO_TEST_CASE(headercache_budget)
+{
+    LOCK(cs_main);
+    const size_t nSize = g_header_cache.Size();
+
+    // Shrinking the budget drops the oldest headers
+    g_header_cache.SetMaxBytes(g_header_cache.DynamicMemoryUsage() / 2);
+    BOOST_CHECK(g_header_cache.Size() < nSize);
+    BOOST_CHECK(g_header_cache.Size() > 0);
+    BOOST_CHECK(!g_header_cache.Get(chainActive.Genesis()->GetBlockHash()));
+    BOOST_CHECK(g_header_cache.Get(chainActive.Tip()->GetBlockHash()));
+
+    // Backfilling brings them back once there is room again
+    g_header_cache.SetMaxBytes(DEFAULT_HEADER_CACHE_SIZE << 20);
+    g_header_cache.Backfill(chainActive, Params().GetConsensus());
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), nSize);
+    CHeaderCache::HeaderRef header = g_header_cache.Get(chainActive.Genesis()->GetBlockHash());
+    BOOST_REQUIRE(header);
+    BOOST_CHECK(*header == SerializedHeader(chainActive.Genesis()));
+
+    // Starting from scratch works the same
+    g_header_cache.Clear();
+    g_header_cache.Backfill(chainActive, Params().GetConsensus());
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), nSize);
+
+    // A disabled cache stays empty
+    g_header_cache.SetMaxBytes(0);
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), 0U);
+    g_header_cache.Backfill(chainActive, Params().GetConsensus());
+    BOOST_CHECK_EQUAL(g_header_cache.Size(), 0U);
+    g_header_cache.SetMaxBytes(DEFAULT_HEADER_CACHE_SIZE << 20);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,10 +5,12 @@
 #include <policy/policy.h>
 #include <txmempool.h>
 #include <util/system.h>
+#include <validation.h>
 
 #include <test/test_bitcoin.h>
 
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
 #include <list>
 #include <vector>
 
@@ -749,4 +751,346 @@ BOOST_AUTO_TEST_CASE(MempoolAncestryTests)
     BOOST_CHECK_EQUAL(descendants, 6ULL);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    pool.SetClusterTracking(true);
+    TestMemPoolEntryHelper entry;
+
+    // A low fee parent with a high fee child, and an unrelated transaction
+    CTransactionRef tx1 = make_tx(/* output_values */ {10 * COIN});
+    pool.addUnchecked(entry.Fee(1000LL).FromTx(tx1));
+    CTransactionRef tx2 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx1});
+    pool.addUnchecked(entry.Fee(30000LL).FromTx(tx2));
+    CTransactionRef tx3 = make_tx(/* output_values */ {20 * COIN});
+    pool.addUnchecked(entry.Fee(2000LL).FromTx(tx3));
+
+    pool.UpdateClusters();
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    const uint64_t nId = pool.mapTx.find(tx1->GetHash())->nClusterId;
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2->GetHash())->nClusterId, nId);
+    {
+        // The child pays for its parent, so they form a single chunk
+        const CTxMemPool::Cluster& cluster = pool.GetClusters().at(nId);
+        BOOST_CHECK(!cluster.fDirty);
+        BOOST_CHECK_EQUAL(cluster.vTx.size(), 2U);
+        BOOST_CHECK(cluster.vTx[0]->GetTx().GetHash() == tx1->GetHash());
+        BOOST_CHECK_EQUAL(cluster.vChunks.size(), 1U);
+        BOOST_CHECK_EQUAL(cluster.vChunks[0].nFee, 31000);
+        BOOST_CHECK_EQUAL(cluster.vChunks[0].nEnd, 2U);
+    }
+
+    // A transaction spending both joins the clusters
+    CTransactionRef tx4 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx2, tx3});
+    pool.addUnchecked(entry.Fee(0LL).FromTx(tx4));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+    pool.UpdateClusters();
+    {
+        const CTxMemPool::Cluster& cluster = pool.GetClusters().begin()->second;
+        BOOST_CHECK_EQUAL(cluster.vTx.size(), 4U);
+        BOOST_CHECK(cluster.vTx.back()->GetTx().GetHash() == tx4->GetHash());
+        BOOST_CHECK_EQUAL(cluster.vChunks.size(), 3U);
+        BOOST_CHECK_EQUAL(cluster.vChunks.back().nFee, 0);
+    }
+
+    // Prioritisation is reflected in the chunks
+    pool.PrioritiseTransaction(tx3->GetHash(), 100000LL);
+    pool.UpdateClusters();
+    {
+        const CTxMemPool::Cluster& cluster = pool.GetClusters().begin()->second;
+        BOOST_CHECK(cluster.vTx[0]->GetTx().GetHash() == tx3->GetHash());
+        BOOST_CHECK_EQUAL(cluster.vChunks[0].nFee, 102000);
+    }
+    pool.PrioritiseTransaction(tx3->GetHash(), -100000LL);
+
+    // Removing the transaction that joined them splits the cluster again
+    pool.removeRecursive(*tx4);
+    pool.UpdateClusters();
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK(pool.mapTx.find(tx1->GetHash())->nClusterId != pool.mapTx.find(tx3->GetHash())->nClusterId);
+
+    // Confirming the parents leaves the remaining descendant with correct ancestor state
+    pool.addUnchecked(entry.Fee(0LL).FromTx(tx4));
+    pool.removeForBlock({tx1, tx2}, 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    CTxMemPool::txiter it4 = pool.mapTx.find(tx4->GetHash());
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3->GetHash());
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(it4->GetSizeWithAncestors(), it3->GetTxSize() + it4->GetTxSize());
+    BOOST_CHECK_EQUAL(it4->GetModFeesWithAncestors(), 2000);
+    BOOST_CHECK_EQUAL(it4->GetSigOpCostWithAncestors(), it3->GetSigOpCost() + it4->GetSigOpCost());
+    BOOST_CHECK_EQUAL(it4->nClusterId, it3->nClusterId);
+    pool.UpdateClusters();
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+
+    // Tracking can be turned off and back on with transactions in the pool
+    pool.SetClusterTracking(false);
+    BOOST_CHECK(pool.GetClusters().empty());
+    pool.SetClusterTracking(true);
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterSizeLimitTest)
+{
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    pool.SetClusterTracking(true);
+    TestMemPoolEntryHelper entry;
+
+    // A zero fee child of a high fee parent is evicted on its own
+    CTransactionRef tx1 = make_tx(/* output_values */ {10 * COIN});
+    pool.addUnchecked(entry.Fee(50000LL).FromTx(tx1));
+    CTransactionRef tx2 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx1});
+    pool.addUnchecked(entry.Fee(0LL).FromTx(tx2));
+    CTransactionRef tx3 = make_tx(/* output_values */ {5 * COIN, 5 * COIN});
+    pool.addUnchecked(entry.Fee(5000LL).FromTx(tx3));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1->GetHash()));
+    BOOST_CHECK(!pool.exists(tx2->GetHash()));
+    BOOST_CHECK(pool.exists(tx3->GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), incrementalRelayFee.GetFeePerK());
+
+    // A low fee parent is kept while its child pays for it
+    CTransactionRef tx4 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx3});
+    pool.addUnchecked(entry.Fee(500000LL).FromTx(tx4));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx1->GetHash()));
+    BOOST_CHECK(pool.exists(tx3->GetHash()));
+    BOOST_CHECK(pool.exists(tx4->GetHash()));
+    CFeeRate removed(50000, GetVirtualTransactionSize(*tx1));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), removed.GetFeePerK() + incrementalRelayFee.GetFeePerK());
+
+    // Everything goes when nothing fits
+    pool.TrimToSize(1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(pool.GetClusters().empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLinksTest)
+{
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    TestMemPoolEntryHelper entry;
+
+    // Two chains and a lone transaction, so that removing the first entry
+    // moves a linked one into its slot
+    CTransactionRef txA = make_tx(/* output_values */ {10 * COIN});
+    CTransactionRef txB = make_tx(/* output_values */ {9 * COIN}, /* inputs */ {txA});
+    CTransactionRef txC = make_tx(/* output_values */ {8 * COIN});
+    CTransactionRef txD = make_tx(/* output_values */ {7 * COIN}, /* inputs */ {txC});
+    CTransactionRef txE = make_tx(/* output_values */ {6 * COIN});
+    for (const CTransactionRef& tx : {txA, txC, txE, txD, txB}) {
+        pool.addUnchecked(entry.Fee(1000LL).FromTx(tx));
+    }
+
+    pool.removeRecursive(*txA);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    CTxMemPool::txiter itC = pool.mapTx.find(txC->GetHash());
+    CTxMemPool::txiter itD = pool.mapTx.find(txD->GetHash());
+    CTxMemPool::txiter itE = pool.mapTx.find(txE->GetHash());
+    BOOST_CHECK(pool.GetMemPoolParents(itC).empty());
+    BOOST_CHECK(pool.GetMemPoolChildren(itC) == CTxMemPool::setEntries({itD}));
+    BOOST_CHECK(pool.GetMemPoolParents(itD) == CTxMemPool::setEntries({itC}));
+    BOOST_CHECK(pool.GetMemPoolChildren(itD).empty());
+    BOOST_CHECK(pool.GetMemPoolParents(itE).empty());
+    BOOST_CHECK(pool.GetMemPoolChildren(itE).empty());
+
+    // Churn through many chains of two and check the survivors each time
+    std::vector<std::pair<CTransactionRef, CTransactionRef>> chains;
+    for (int i = 0; i < 100; i++) {
+        CTransactionRef parent = make_tx(/* output_values */ {(i + 1) * COIN, COIN});
+        CTransactionRef child = make_tx(/* output_values */ {COIN}, /* inputs */ {parent});
+        pool.addUnchecked(entry.FromTx(parent));
+        pool.addUnchecked(entry.FromTx(child));
+        chains.emplace_back(parent, child);
+    }
+    for (int i = 0; i < 100; i += 3) {
+        pool.removeRecursive(*chains[i].first);
+    }
+    for (int i = 0; i < 100; i++) {
+        CTxMemPool::txiter itParent = pool.mapTx.find(chains[i].first->GetHash());
+        CTxMemPool::txiter itChild = pool.mapTx.find(chains[i].second->GetHash());
+        if (i % 3 == 0) {
+            BOOST_CHECK(itParent == pool.mapTx.end());
+            BOOST_CHECK(itChild == pool.mapTx.end());
+            continue;
+        }
+        BOOST_CHECK(pool.GetMemPoolChildren(itParent) == CTxMemPool::setEntries({itChild}));
+        BOOST_CHECK(pool.GetMemPoolParents(itChild) == CTxMemPool::setEntries({itParent}));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolTrimTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    const int64_t nNow = GetTime();
+    const unsigned long age = 60 * 60;
+
+    std::vector<CTransactionRef> vtx;
+    {
+        LOCK2(cs_main, pool.cs);
+        for (int i = 0; i < 20; i++) {
+            vtx.push_back(make_tx(/* output_values */ {(i + 1) * COIN}));
+            pool.addUnchecked(entry.Fee(1000LL * (i + 1)).Time(nNow).FromTx(vtx.back()));
+        }
+        vtx.push_back(make_tx(/* output_values */ {50 * COIN}));
+        pool.addUnchecked(entry.Fee(1000000LL).Time(nNow - 2 * age).FromTx(vtx.back()));
+    }
+
+    // Old transactions are expired whatever the size of the mempool
+    TrimMempool(pool, std::numeric_limits<size_t>::max(), age);
+    BOOST_CHECK_EQUAL(pool.size(), 20U);
+    BOOST_CHECK(!pool.exists(vtx.back()->GetHash()));
+
+    // Nothing is evicted below the high watermark
+    const size_t nUsage = pool.DynamicMemoryUsage();
+    TrimMempool(pool, nUsage / MEMPOOL_TRIM_HIGH_PERCENT * 100 + 100, age);
+    BOOST_CHECK_EQUAL(pool.size(), 20U);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Past it, the lowest feerate transactions go until the low watermark is reached
+    TrimMempool(pool, nUsage, age);
+    BOOST_CHECK(pool.DynamicMemoryUsage() <= nUsage / 100 * MEMPOOL_TRIM_LOW_PERCENT);
+    BOOST_CHECK(pool.size() < 20U);
+    BOOST_CHECK(!pool.exists(vtx[0]->GetHash()));
+    BOOST_CHECK(pool.exists(vtx[19]->GetHash()));
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolGraphStatsTest)
+{
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    TestMemPoolEntryHelper entry;
+
+    BOOST_CHECK_EQUAL(MempoolGraphStats::HistogramBucket(0), 0);
+    BOOST_CHECK_EQUAL(MempoolGraphStats::HistogramBucket(1), 0);
+    BOOST_CHECK_EQUAL(MempoolGraphStats::HistogramBucket(3), 1);
+    BOOST_CHECK_EQUAL(MempoolGraphStats::HistogramBucket(64), 6);
+    BOOST_CHECK_EQUAL(MempoolGraphStats::HistogramBucket(1000), MempoolGraphStats::HISTOGRAM_BUCKETS - 1);
+
+    // A chain of three walks one and then two ancestors
+    CTransactionRef tx1 = make_tx(/* output_values */ {10 * COIN});
+    pool.addUnchecked(entry.Fee(1000LL).FromTx(tx1));
+    CTransactionRef tx2 = make_tx(/* output_values */ {9 * COIN}, /* inputs */ {tx1});
+    pool.addUnchecked(entry.FromTx(tx2));
+    CTransactionRef tx3 = make_tx(/* output_values */ {8 * COIN}, /* inputs */ {tx2});
+    pool.addUnchecked(entry.FromTx(tx3));
+    MempoolGraphStats stats = pool.GetGraphStats();
+    BOOST_CHECK_EQUAL(stats.calculateAncestors.nCalls, 3U);
+    BOOST_CHECK_EQUAL(stats.calculateAncestors.nEntries, 3U);
+    BOOST_CHECK_EQUAL(stats.calculateAncestors.nMaxChain, 3U);
+    BOOST_CHECK_EQUAL(stats.vAncestorCounts[0], 1U);
+    BOOST_CHECK_EQUAL(stats.vAncestorCounts[1], 2U);
+    BOOST_CHECK_EQUAL(stats.vDescendantSizes[0], 3U);
+
+    pool.removeRecursive(*tx2);
+    stats = pool.GetGraphStats();
+    BOOST_CHECK_EQUAL(stats.removeRecursive.nCalls, 1U);
+    BOOST_CHECK_EQUAL(stats.removeRecursive.nEntries, 2U);
+    BOOST_CHECK_EQUAL(stats.removeRecursive.nMaxChain, 2U);
+
+    pool.TrimToSize(1);
+    stats = pool.GetGraphStats();
+    BOOST_CHECK_EQUAL(stats.trimToSize.nCalls, 1U);
+    BOOST_CHECK_EQUAL(stats.trimToSize.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.trimToSize.nMaxChain, 1U);
+    BOOST_CHECK_EQUAL(stats.vEvictedCounts[0], 1U);
+
+    // Confirming a parent counts its descendants towards the chain
+    CTransactionRef tx4 = make_tx(/* output_values */ {7 * COIN});
+    pool.addUnchecked(entry.FromTx(tx4));
+    CTransactionRef tx5 = make_tx(/* output_values */ {6 * COIN}, /* inputs */ {tx4});
+    pool.addUnchecked(entry.FromTx(tx5));
+    pool.removeForBlock({tx4}, 1);
+    stats = pool.GetGraphStats();
+    BOOST_CHECK_EQUAL(stats.removeForBlock.nCalls, 1U);
+    BOOST_CHECK_EQUAL(stats.removeForBlock.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.removeForBlock.nMaxChain, 2U);
+
+    // A transaction back from a disconnected block picks up its child
+    CTransactionRef tx6 = make_tx(/* output_values */ {5 * COIN});
+    CTransactionRef tx7 = make_tx(/* output_values */ {4 * COIN}, /* inputs */ {tx6});
+    pool.addUnchecked(entry.FromTx(tx7));
+    pool.addUnchecked(entry.FromTx(tx6));
+    pool.UpdateTransactionsFromBlock({tx6->GetHash()});
+    stats = pool.GetGraphStats();
+    BOOST_CHECK_EQUAL(stats.updateForDescendants.nCalls, 1U);
+    BOOST_CHECK_EQUAL(stats.updateForDescendants.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.updateForDescendants.nMaxChain, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    TestMemPoolEntryHelper entry;
+
+    // A replaceable parent with two children, one of which has a child too,
+    // and an unrelated transaction
+    CMutableTransaction mtxParent;
+    mtxParent.vin.resize(1);
+    mtxParent.vin[0].nSequence = 0;
+    mtxParent.vout.resize(2);
+    for (CTxOut& txout : mtxParent.vout) {
+        txout.scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txout.nValue = 10 * COIN;
+    }
+    CTransactionRef tx1 = MakeTransactionRef(mtxParent);
+    pool.addUnchecked(entry.Fee(1000LL).Time(100).FromTx(tx1));
+    CTransactionRef tx2 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx1}, /* input_indices */ {0});
+    pool.addUnchecked(entry.Fee(2000LL).FromTx(tx2));
+    CTransactionRef tx3 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx1}, /* input_indices */ {1});
+    pool.addUnchecked(entry.Fee(3000LL).FromTx(tx3));
+    CTransactionRef tx4 = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {tx3});
+    pool.addUnchecked(entry.Fee(4000LL).FromTx(tx4));
+    CTransactionRef tx5 = make_tx(/* output_values */ {20 * COIN});
+    pool.addUnchecked(entry.Fee(5000LL).FromTx(tx5));
+
+    std::shared_ptr<const MempoolSnapshot> snapshot = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 5U);
+    for (size_t i = 1; i < snapshot->vEntries.size(); i++) {
+        BOOST_CHECK(snapshot->vEntries[i - 1].txid < snapshot->vEntries[i].txid);
+    }
+    BOOST_CHECK(!snapshot->Find(uint256S("0x01")));
+
+    const MempoolSnapshot::Entry* e1 = snapshot->Find(tx1->GetHash());
+    BOOST_REQUIRE(e1);
+    BOOST_CHECK_EQUAL(e1->nFee, 1000);
+    BOOST_CHECK_EQUAL(e1->nTime, 100);
+    BOOST_CHECK_EQUAL(e1->nCountWithDescendants, 4U);
+    BOOST_CHECK_EQUAL(e1->nModFeesWithDescendants, 10000);
+    BOOST_CHECK(e1->vParents.empty());
+    BOOST_CHECK_EQUAL(e1->vChildren.size(), 2U);
+    BOOST_CHECK(std::is_sorted(e1->vChildren.begin(), e1->vChildren.end()));
+    const MempoolSnapshot::Entry* e4 = snapshot->Find(tx4->GetHash());
+    BOOST_REQUIRE(e4);
+    BOOST_CHECK_EQUAL(e4->nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(e4->nModFeesWithAncestors, 8000);
+    BOOST_CHECK(e4->vParents == std::vector<uint256>{tx3->GetHash()});
+
+    // Replaceability is passed down from the parent
+    BOOST_CHECK(e1->fReplaceable);
+    BOOST_CHECK(snapshot->Find(tx2->GetHash())->fReplaceable);
+    BOOST_CHECK(e4->fReplaceable);
+    BOOST_CHECK(!snapshot->Find(tx5->GetHash())->fReplaceable);
+
+    // The snapshot is shared until the mempool changes
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+    pool.PrioritiseTransaction(tx4->GetHash(), 1000LL);
+    std::shared_ptr<const MempoolSnapshot> snapshot2 = pool.GetSnapshot();
+    BOOST_CHECK(snapshot2 != snapshot);
+    BOOST_CHECK_EQUAL(snapshot2->Find(tx1->GetHash())->nModFeesWithDescendants, 11000);
+    BOOST_CHECK_EQUAL(snapshot->Find(tx1->GetHash())->nModFeesWithDescendants, 10000);
+
+    pool.removeRecursive(*tx3);
+    snapshot2 = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot2->vEntries.size(), 3U);
+    BOOST_CHECK_EQUAL(snapshot2->Find(tx1->GetHash())->vChildren.size(), 1U);
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 5U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,102 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <mempooljournal.h>
+#include <primitives/transaction.h>
+#include <script/script.h>
+
+#include <test/test_bitcoin.h>
+
+#include <stdio.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mempooljournal_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(int n)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].scriptSig = CScript() << n;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = n;
+    return MakeTransactionRef(mtx);
+}
+
+BOOST_AUTO_TEST_CASE(mempooljournal_replay)
+{
+    const fs::path path = SetDataDir("mempooljournal") / "mempool.journal";
+    CMempoolJournal journal(path);
+    std::vector<CMempoolJournal::Entry> vAdded;
+    std::set<uint256> setRemoved;
+    CTransactionRef tx1 = MakeTx(1), tx2 = MakeTx(2), tx3 = MakeTx(3), tx4 = MakeTx(4);
+
+    // Nothing is written before the first dump
+    journal.TransactionAdded(tx1, 100);
+    BOOST_CHECK(journal.NeedsDump());
+    BOOST_CHECK(journal.Flush());
+    BOOST_CHECK(!fs::exists(path));
+
+    // Changes made after the dump's snapshot are kept
+    journal.DumpStarted();
+    journal.TransactionAdded(tx2, 200);
+    journal.DumpFinished(true);
+    BOOST_CHECK(!journal.NeedsDump());
+    journal.TransactionAdded(tx3, 300);
+    journal.TransactionRemoved(tx1->GetHash());
+    BOOST_CHECK(journal.Flush());
+    BOOST_REQUIRE(ReadMempoolJournal(path, vAdded, setRemoved));
+    BOOST_REQUIRE_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK(vAdded[0].tx->GetHash() == tx2->GetHash());
+    BOOST_CHECK_EQUAL(vAdded[0].nTime, 200);
+    BOOST_CHECK(vAdded[1].tx->GetHash() == tx3->GetHash());
+    BOOST_CHECK_EQUAL(vAdded[1].nTime, 300);
+    BOOST_CHECK(setRemoved == std::set<uint256>{tx1->GetHash()});
+
+    // Removed transactions are dropped, and the last addition counts
+    journal.TransactionRemoved(tx2->GetHash());
+    journal.TransactionRemoved(tx3->GetHash());
+    journal.TransactionAdded(tx3, 400);
+    journal.TransactionAdded(tx1, 500);
+    BOOST_CHECK(journal.Flush());
+    BOOST_REQUIRE(ReadMempoolJournal(path, vAdded, setRemoved));
+    BOOST_REQUIRE_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK(vAdded[0].tx->GetHash() == tx3->GetHash());
+    BOOST_CHECK_EQUAL(vAdded[0].nTime, 400);
+    BOOST_CHECK(vAdded[1].tx->GetHash() == tx1->GetHash());
+    BOOST_CHECK(setRemoved == std::set<uint256>{tx2->GetHash()});
+
+    // A failed dump loses nothing
+    journal.TransactionAdded(tx4, 600);
+    journal.DumpStarted();
+    BOOST_CHECK(journal.Flush());
+    journal.TransactionRemoved(tx1->GetHash());
+    journal.DumpFinished(false);
+    BOOST_CHECK(journal.Flush());
+    BOOST_REQUIRE(ReadMempoolJournal(path, vAdded, setRemoved));
+    BOOST_REQUIRE_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK(vAdded[1].tx->GetHash() == tx4->GetHash());
+    BOOST_CHECK_EQUAL(setRemoved.size(), 2U);
+
+    // A record cut short ends the journal
+    const uint64_t nSize = journal.GetFileSize();
+    BOOST_CHECK_EQUAL(nSize, fs::file_size(path));
+    FILE* file = fsbridge::fopen(path, "ab");
+    BOOST_REQUIRE(file);
+    const unsigned char partial[] = {1, 2, 0, 0};
+    BOOST_CHECK_EQUAL(fwrite(partial, 1, sizeof(partial), file), sizeof(partial));
+    fclose(file);
+    BOOST_REQUIRE(ReadMempoolJournal(path, vAdded, setRemoved));
+    BOOST_CHECK_EQUAL(vAdded.size(), 2U);
+
+    // A successful dump starts it over
+    journal.DumpStarted();
+    journal.DumpFinished(true);
+    BOOST_CHECK(journal.GetFileSize() < nSize);
+    BOOST_REQUIRE(ReadMempoolJournal(path, vAdded, setRemoved));
+    BOOST_CHECK(vAdded.empty());
+    BOOST_CHECK(setRemoved.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
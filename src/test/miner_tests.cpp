@@ -520,6 +520,12 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 
     TestPackageSelection(chainparams, scriptPubKey, txFirst);
 
+    // Selecting cluster chunks by feerate gives the same blocks
+    mempool.clear();
+    mempool.SetClusterTracking(true);
+    TestPackageSelection(chainparams, scriptPubKey, txFirst);
+    mempool.SetClusterTracking(false);
+
     fCheckpointsEnabled = true;
 }
 
@@ -10,10 +10,13 @@
 #include <streams.h>
 #include <net.h>
 #include <netbase.h>
+#include <netmessagemaker.h>
 #include <chainparams.h>
 #include <util/system.h>
 
+#include <algorithm>
 #include <memory>
+#include <set>
 
 class CAddrManSerializationMock : public CAddrMan
 {
@@ -73,6 +76,46 @@ static CDataStream AddrmanToStream(CAddrManSerializationMock& _addrman)
     return CDataStream(vchData, SER_DISK, CLIENT_VERSION);
 }
 
+struct CConnmanSocketTest : public CConnman {
+    using CConnman::CConnman;
+    ~CConnmanSocketTest()
+    {
+#ifdef USE_EPOLL
+        ShutdownSocketEvents();
+#endif
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            pnode->CloseSocketDisconnect();
+            delete pnode;
+        }
+        vNodes.clear();
+    }
+#ifdef USE_EPOLL
+    bool InitEpoll() { return InitSocketEvents(); }
+    bool UsingEpoll() const { return m_epoll_fd != -1; }
+    bool IsReadyListed(CNode* pnode) const { return std::count(m_ready_nodes.begin(), m_ready_nodes.end(), pnode) > 0; }
+#endif
+    /** Add a peer on the given socket, as AcceptConnection() does */
+    CNode* AddSocketNode(NodeId id, SOCKET hSocket)
+    {
+        CNode* pnode = new CNode(id, NODE_NETWORK, 0, hSocket, CAddress(), 0, 0, CAddress(), "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterSocketEvents(pnode);
+        return pnode;
+    }
+    void RunSocketHandler() { SocketHandler(); }
+};
+
+static size_t ProcessQueueCount(CNode* pnode)
+{
+    LOCK(pnode->cs_vProcessMsg);
+    return pnode->vProcessMsg.size();
+}
+
 BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
 
 BOOST_AUTO_TEST_CASE(cnode_listen_port)
@@ -303,4 +346,263 @@ BOOST_AUTO_TEST_CASE(LocalAddress_BasicLifecycle)
 }
 
 
+static std::vector<unsigned char> MessageBytes(const std::string& command, const std::vector<unsigned char>& payload)
+{
+    CMessageHeader hdr(Params().MessageStart(), command.c_str(), payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    std::vector<unsigned char> bytes;
+    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, bytes, 0, hdr};
+    bytes.insert(bytes.end(), payload.begin(), payload.end());
+    return bytes;
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CNetRecvBufferPool pool(3 * 1024);
+    CDataStream stream(SER_NETWORK, INIT_PROTO_VERSION);
+
+    // Fresh buffers are rounded up to their size class
+    pool.Get(stream, 300);
+    BOOST_CHECK(stream.empty());
+    stream.resize(300);
+    const char* data = stream.data();
+    pool.Release(stream);
+    BOOST_CHECK(stream.empty());
+    CNetRecvBufferPool::Stats stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.nHits, 0U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nBuffers, 1U);
+    BOOST_CHECK_EQUAL(stats.nBytesRetained, 512U);
+
+    // ... and handed out again to requests of the same class
+    pool.Get(stream, 400);
+    stream.resize(400);
+    BOOST_CHECK(stream.data() == data);
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.nHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nBuffers, 0U);
+    BOOST_CHECK_EQUAL(stats.nBytesRetained, 0U);
+    pool.Release(stream);
+
+    // Buffers that outgrew the largest class are not kept
+    pool.Get(stream, 100);
+    stream.resize(CNetRecvBufferPool::MAX_CLASS_SIZE + 1);
+    pool.Release(stream);
+    BOOST_CHECK_EQUAL(pool.GetStats().nBuffers, 1U);
+    pool.Get(stream, CNetRecvBufferPool::MAX_CLASS_SIZE + 1);
+    BOOST_CHECK(stream.empty());
+    BOOST_CHECK_EQUAL(pool.GetStats().nMisses, 2U);
+
+    // The retained capacity is bounded
+    std::vector<CDataStream> streams(8, CDataStream(SER_NETWORK, INIT_PROTO_VERSION));
+    for (CDataStream& s : streams) {
+        pool.Get(s, 1000);
+    }
+    for (CDataStream& s : streams) {
+        pool.Release(s);
+    }
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBuffers, 3U);
+    BOOST_CHECK_EQUAL(stats.nBytesRetained, 2048U + 512U);
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool_messages)
+{
+    CNetRecvBufferPool pool;
+    const std::vector<unsigned char> payload(1000, 0x55);
+    const std::vector<unsigned char> bytes = MessageBytes(NetMsgType::TX, payload);
+    for (int i = 0; i < 3; i++) {
+        CNetMessage msg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION, &pool);
+        const char* pch = (const char*)bytes.data();
+        unsigned int nBytes = bytes.size();
+        while (nBytes > 0 && !msg.complete()) {
+            // Feed the data in small pieces, as it may arrive from the socket
+            const int handled = msg.in_data ? msg.readData(pch, std::min(nBytes, 100U)) : msg.readHeader(pch, std::min(nBytes, 100U));
+            BOOST_REQUIRE(handled > 0);
+            pch += handled;
+            nBytes -= handled;
+        }
+        BOOST_REQUIRE(msg.complete());
+        BOOST_CHECK(std::equal(payload.begin(), payload.end(), (const unsigned char*)msg.vRecv.data()));
+        BOOST_CHECK_EQUAL(msg.vRecv.size(), payload.size());
+    }
+    // The first message allocated, the others reused its buffer
+    const CNetRecvBufferPool::Stats stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nBuffers, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(message_handler_threads)
+{
+    CConnman connman(0x1337, 0x1337);
+    CConnman::Options options;
+    options.nMessageHandlerThreads = 4;
+    connman.Init(options);
+
+    // Every peer has one thread, and consecutive peers are spread over all of them
+    std::set<int> setThreads;
+    for (NodeId id = 0; id < 100; id++) {
+        const int nThread = connman.GetMessageHandlerThread(id);
+        BOOST_CHECK(nThread >= 0 && nThread < 4);
+        BOOST_CHECK_EQUAL(connman.GetMessageHandlerThread(id), nThread);
+        BOOST_CHECK_EQUAL(connman.GetMessageHandlerThread(id + 4), nThread);
+        setThreads.insert(nThread);
+    }
+    BOOST_CHECK_EQUAL(setThreads.size(), 4U);
+
+    // Out of range thread counts are clamped
+    options.nMessageHandlerThreads = 0;
+    connman.Init(options);
+    BOOST_CHECK_EQUAL(connman.GetMessageHandlerThread(7), 0);
+    options.nMessageHandlerThreads = 1000;
+    connman.Init(options);
+    BOOST_CHECK_EQUAL(connman.GetMessageHandlerThread(MAX_MESSAGE_HANDLER_THREADS + 1), 1);
+}
+
+#ifndef WIN32
+static std::vector<unsigned char> ReadAvailable(SOCKET hSocket)
+{
+    std::vector<unsigned char> data;
+    unsigned char buf[4096];
+    ssize_t nBytes;
+    while ((nBytes = recv(hSocket, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        data.insert(data.end(), buf, buf + nBytes);
+    }
+    return data;
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_send)
+{
+    CConnman connman(0x1337, 0x1337);
+    CConnman::Options options;
+    options.nSendBufferMaxSize = 1000 * DEFAULT_MAXSENDBUFFER;
+    connman.Init(options);
+
+    SOCKET sockets[2][2];
+    std::vector<std::unique_ptr<CNode>> nodes;
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        sockets[i][0] = fds[0];
+        sockets[i][1] = fds[1];
+        nodes.emplace_back(MakeUnique<CNode>(i, NODE_NETWORK, 0, sockets[i][0], CAddress(), 0, 0, CAddress(), "", false));
+    }
+
+    // Messages are written out back to back as header and payload
+    const CNetMsgMaker msgMaker(INIT_PROTO_VERSION);
+    connman.PushMessage(nodes[0].get(), msgMaker.Make(NetMsgType::PING, (uint64_t)42));
+    connman.PushMessage(nodes[0].get(), msgMaker.Make(NetMsgType::VERACK));
+    std::vector<unsigned char> expected = MessageBytes(NetMsgType::PING, {42, 0, 0, 0, 0, 0, 0, 0});
+    const std::vector<unsigned char> verack = MessageBytes(NetMsgType::VERACK, {});
+    expected.insert(expected.end(), verack.begin(), verack.end());
+    BOOST_CHECK(ReadAvailable(sockets[0][1]) == expected);
+
+    // A shared message is queued by reference for every peer. Make it large
+    // enough that it cannot be written out at once.
+    std::vector<unsigned char> payload(4 * 1000 * 1000);
+    for (size_t i = 0; i < payload.size(); i++) payload[i] = i % 251;
+    CSharedNetMsg msg(NetMsgType::BLOCK, std::make_shared<const std::vector<unsigned char>>(payload));
+    for (const auto& node : nodes) {
+        connman.PushMessage(node.get(), msg);
+    }
+    BOOST_CHECK_EQUAL(msg.data.use_count(), 3);
+    expected = MessageBytes(NetMsgType::BLOCK, payload);
+    for (int i = 0; i < 2; i++) {
+        const std::vector<unsigned char> sent = ReadAvailable(sockets[i][1]);
+        BOOST_CHECK(sent.size() > 0 && sent.size() < expected.size());
+        BOOST_CHECK(std::equal(sent.begin(), sent.end(), expected.begin()));
+    }
+
+    // Dropping the peers releases their references
+    nodes.clear();
+    BOOST_CHECK_EQUAL(msg.data.use_count(), 1);
+    for (int i = 0; i < 2; i++) {
+        close(sockets[i][1]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(socket_handler_fallback)
+{
+    // Without an epoll instance, sockets are polled on every iteration
+    CConnmanSocketTest connman(0x1337, 0x1337);
+    CConnman::Options options;
+    options.nReceiveFloodSize = 1000 * DEFAULT_MAXRECEIVEBUFFER;
+    connman.Init(options);
+#ifdef USE_EPOLL
+    BOOST_CHECK(!connman.UsingEpoll());
+#endif
+
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode* pnode = connman.AddSocketNode(0, fds[0]);
+#ifdef USE_EPOLL
+    BOOST_CHECK(!connman.IsReadyListed(pnode));
+#endif
+
+    const std::vector<unsigned char> ping = MessageBytes(NetMsgType::PING, {42, 0, 0, 0, 0, 0, 0, 0});
+    BOOST_REQUIRE_EQUAL(send(fds[1], ping.data(), ping.size(), 0), (ssize_t)ping.size());
+    connman.RunSocketHandler();
+    BOOST_CHECK_EQUAL(ProcessQueueCount(pnode), 1U);
+
+    close(fds[1]);
+    connman.RunSocketHandler();
+    BOOST_CHECK(pnode->fDisconnect);
+}
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(socket_handler_epoll)
+{
+    CConnmanSocketTest connman(0x1337, 0x1337);
+    CConnman::Options options;
+    options.nSendBufferMaxSize = 1000 * DEFAULT_MAXSENDBUFFER;
+    options.nReceiveFloodSize = 1000 * DEFAULT_MAXRECEIVEBUFFER;
+    connman.Init(options);
+    BOOST_REQUIRE(connman.InitEpoll());
+
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode* pnode = connman.AddSocketNode(0, fds[0]);
+
+    // A registered socket is reported once the peer sends something
+    const std::vector<unsigned char> ping = MessageBytes(NetMsgType::PING, {42, 0, 0, 0, 0, 0, 0, 0});
+    BOOST_REQUIRE_EQUAL(send(fds[1], ping.data(), ping.size(), 0), (ssize_t)ping.size());
+    connman.RunSocketHandler();
+    BOOST_CHECK(connman.IsReadyListed(pnode));
+    BOOST_CHECK_EQUAL(ProcessQueueCount(pnode), 1U);
+    BOOST_CHECK_EQUAL(pnode->GetRefCount(), 2);
+
+    // A message that does not fit in the socket buffer is written out as the
+    // peer reads it, each time the socket becomes writable again
+    std::vector<unsigned char> payload(4 * 1000 * 1000);
+    for (size_t i = 0; i < payload.size(); i++) payload[i] = i % 251;
+    const std::vector<unsigned char> expected = MessageBytes(NetMsgType::BLOCK, payload);
+    CSerializedNetMsg msg;
+    msg.data = payload;
+    msg.command = NetMsgType::BLOCK;
+    connman.PushMessage(pnode, std::move(msg));
+    std::vector<unsigned char> received;
+    for (int i = 0; i < 10000 && received.size() < expected.size(); i++) {
+        const std::vector<unsigned char> data = ReadAvailable(fds[1]);
+        received.insert(received.end(), data.begin(), data.end());
+        connman.RunSocketHandler();
+    }
+    BOOST_CHECK(received == expected);
+    {
+        LOCK(pnode->cs_vSend);
+        BOOST_CHECK(pnode->vSendMsg.empty());
+    }
+
+    // A peer that hangs up is disconnected, and let go of once its socket is closed
+    close(fds[1]);
+    connman.RunSocketHandler();
+    BOOST_CHECK(pnode->fDisconnect);
+    connman.RunSocketHandler();
+    BOOST_CHECK(!connman.IsReadyListed(pnode));
+    BOOST_CHECK_EQUAL(pnode->GetRefCount(), 1);
+}
+#endif
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,11 +2,16 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <chain.h>
+#include <chainparams.h>
+#include <clientversion.h>
 #include <policy/policy.h>
 #include <policy/fees.h>
+#include <streams.h>
 #include <txmempool.h>
 #include <uint256.h>
 #include <util/system.h>
+#include <validation.h>
 
 #include <test/test_bitcoin.h>
 
@@ -178,6 +183,54 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     for (int i = 2; i < 9; i++) { // At 9, the original estimate was already at the bottom (b/c scale = 2)
         BOOST_CHECK(feeEst.estimateFee(i).GetFeePerK() < origFeeEst[i-1] - deltaFee);
     }
+
+    // The estimates are the same after writing them out and reading them back
+    const fs::path est_path = SetDataDir("policyestimator") / "fee_estimates.dat";
+    {
+        CAutoFile est_fileout(fsbridge::fopen(est_path, "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(feeEst.Write(est_fileout));
+    }
+    CBlockPolicyEstimator feeEstRead;
+    {
+        CAutoFile est_filein(fsbridge::fopen(est_path, "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(feeEstRead.Read(est_filein));
+    }
+    for (int i = 2; i < 48; i++) {
+        BOOST_CHECK(feeEstRead.estimateFee(i) == feeEst.estimateFee(i));
+        BOOST_CHECK(feeEstRead.estimateSmartFee(i, nullptr, true) == feeEst.estimateSmartFee(i, nullptr, true));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyTimeTargets)
+{
+    CBlockPolicyEstimator feeEst;
+    BOOST_CHECK_EQUAL(feeEst.BlocksForMinutes(60), 0U);
+    BOOST_CHECK_EQUAL(feeEst.MinutesForBlocks(6), 0);
+
+    feeEst.SetBlockInterval(2 * 60);
+    BOOST_CHECK_EQUAL(feeEst.BlocksForMinutes(60), 30U);
+    BOOST_CHECK_EQUAL(feeEst.BlocksForMinutes(1), 1U);
+    BOOST_CHECK_EQUAL(feeEst.MinutesForBlocks(30), 60);
+    feeEst.SetBlockInterval(90);
+    BOOST_CHECK_EQUAL(feeEst.BlocksForMinutes(10), 6U);
+    const unsigned int nMaxTarget = feeEst.HighestTargetTracked(FeeEstimateHorizon::LONG_HALFLIFE);
+    BOOST_CHECK_EQUAL(feeEst.BlocksForMinutes(nMaxTarget * 90 / 60), nMaxTarget);
+    BOOST_CHECK_EQUAL(feeEst.BlocksForMinutes(std::numeric_limits<int64_t>::max()), nMaxTarget);
+    BOOST_CHECK_EQUAL(feeEst.MinutesForBlocks(3), 5);
+
+    // The interval is measured over recent blocks of all algorithms, once there are enough
+    const Consensus::Params& params = Params().GetConsensus();
+    std::vector<CBlockIndex> blocks(500);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i].pprev = i ? &blocks[i - 1] : nullptr;
+        blocks[i].nHeight = i;
+        // Out of order timestamps, at 45 seconds a block on average
+        blocks[i].nTime = 1500000000 + i * 45 + (i % 2) * 60;
+        blocks[i].BuildSkip();
+    }
+    BOOST_CHECK_EQUAL(GetRecentBlockInterval(nullptr, params), 0);
+    BOOST_CHECK_EQUAL(GetRecentBlockInterval(&blocks[10], params), params.TargetSpacing(10));
+    BOOST_CHECK_EQUAL(GetRecentBlockInterval(&blocks.back(), params), 45);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -20,6 +20,9 @@
 #include <univalue.h>
 
 #include <rpc/blockchain.h>
+#include <rpc/jsonwriter.h>
+#include <txmempool.h>
+#include <validation.h>
 
 UniValue CallRPC(std::string args)
 {
@@ -342,6 +345,76 @@ BOOST_AUTO_TEST_CASE(rpc_convert_values_generatetoaddress)
     BOOST_CHECK_EQUAL(result[2].get_int(), 9);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_json_stream_writer)
+{
+    std::string str;
+    JSONStreamWriter writer(str);
+    writer.BeginObject();
+    writer.Key("a\"\\\n\x01\x7f/");
+    writer.BeginArray();
+    writer.Amount(-123456789);
+    writer.Amount(0);
+    writer.Bool(false);
+    writer.BeginObject();
+    writer.EndObject();
+    writer.BeginArray();
+    writer.EndArray();
+    writer.EndArray();
+    writer.Key("b");
+    writer.Int(-5);
+    writer.Key("c");
+    writer.UInt(std::numeric_limits<uint64_t>::max());
+    writer.EndObject();
+
+    UniValue arr(UniValue::VARR);
+    arr.push_back(ValueFromAmount(-123456789));
+    arr.push_back(ValueFromAmount(0));
+    arr.push_back(UniValue(false));
+    arr.push_back(UniValue(UniValue::VOBJ));
+    arr.push_back(UniValue(UniValue::VARR));
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("a\"\\\n\x01\x7f/", arr);
+    obj.pushKV("b", -5);
+    obj.pushKV("c", std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK_EQUAL(str, obj.write());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_mempool_json_stream)
+{
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].nSequence = 0;
+    mtx.vout.resize(2);
+    for (CTxOut& txout : mtx.vout) {
+        txout.scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txout.nValue = 10 * COIN;
+    }
+    const CTransactionRef parent = MakeTransactionRef(mtx);
+    mtx.vin[0].prevout = COutPoint(parent->GetHash(), 0);
+    mtx.vin[0].nSequence = CTxIn::SEQUENCE_FINAL;
+    const CTransactionRef child = MakeTransactionRef(mtx);
+    mtx.vin.resize(2);
+    mtx.vin[0].prevout = COutPoint(child->GetHash(), 0);
+    mtx.vin[1].prevout = COutPoint(parent->GetHash(), 1);
+    const CTransactionRef grandchild = MakeTransactionRef(mtx);
+
+    {
+        LOCK2(cs_main, mempool.cs);
+        mempool.addUnchecked(entry.Fee(1000LL).Time(1).Height(10).FromTx(parent));
+        mempool.addUnchecked(entry.Fee(20000LL).FromTx(child));
+        mempool.addUnchecked(entry.Fee(0LL).FromTx(grandchild));
+    }
+    mempool.PrioritiseTransaction(parent->GetHash(), -5000LL);
+
+    std::string str;
+    JSONStreamWriter writer(str);
+    mempoolToJSONStream(writer);
+    BOOST_CHECK_EQUAL(str, mempoolToJSON(true).write());
+    BOOST_CHECK_EQUAL(mempoolToJSON(true).size(), 3U);
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_CASE(rpc_getblockstats_calculate_percentiles_by_weight)
 {
     int64_t total_weight = 200;
@@ -161,6 +161,56 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+BOOST_AUTO_TEST_CASE(sighash_legacy_midstate)
+{
+    SeedInsecureRand(false);
+
+    for (int i = 0; i < 200; i++) {
+        int nHashType = InsecureRand32();
+        if (InsecureRandBool()) nHashType = SIGHASH_ALL;
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        // Enough inputs for the midstates to be precomputed
+        while (txTo.vin.size() < LEGACY_SIGHASH_MIDSTATE_MIN_INPUTS + InsecureRandBits(4)) {
+            txTo.vin.push_back(txTo.vin.back());
+            txTo.vin.back().prevout.n++;
+            RandomScript(txTo.vin.back().scriptSig);
+        }
+        if ((nHashType & 0x1f) == SIGHASH_SINGLE && InsecureRandBool()) {
+            txTo.vout.resize(txTo.vin.size(), txTo.vout.back());
+        }
+        const CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        BOOST_CHECK(!txdata.legacyReady);
+        txdata.PrecomputeLegacy(tx);
+        BOOST_CHECK(txdata.legacyReady);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            uint256 sho = SignatureHashOld(scriptCode, tx, nIn, nHashType);
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, 0, SigVersion::BASE, &txdata) == sho);
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, 0, SigVersion::BASE) == sho);
+        }
+    }
+
+    // Nothing is precomputed for small or segwit only transactions
+    CMutableTransaction txTo;
+    RandomTransaction(txTo, false);
+    auto legacy_ready = [](const CMutableTransaction& tx) {
+        PrecomputedTransactionData txdata(tx);
+        txdata.PrecomputeLegacy(tx);
+        return txdata.legacyReady;
+    };
+    BOOST_CHECK(!legacy_ready(txTo));
+    txTo.vin.resize(LEGACY_SIGHASH_MIDSTATE_MIN_INPUTS);
+    BOOST_CHECK(legacy_ready(txTo));
+    for (CTxIn& txin : txTo.vin) {
+        txin.scriptWitness.stack.push_back({1});
+    }
+    BOOST_CHECK(!legacy_ready(txTo));
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
@@ -4,6 +4,10 @@
 
 #include <sync.h>
 #include <test/test_bitcoin.h>
+#include <util/time.h>
+
+#include <atomic>
+#include <thread>
 
 #include <boost/test/unit_test.hpp>
 
@@ -49,4 +53,41 @@ BOOST_AUTO_TEST_CASE(potential_deadlock_detected)
     #endif
 }
 
+BOOST_AUTO_TEST_CASE(lock_wait_timer)
+{
+    Mutex mutex, other;
+    {
+        LockWaitTimer timer(&mutex);
+        LockWaitTimer other_timer(&other);
+#ifdef HAVE_THREAD_LOCAL
+        BOOST_CHECK(LockWaitTimer::Find(&mutex) == &timer);
+#endif
+
+        // Taking a free lock is not counted as waiting
+        {
+            LOCK(mutex);
+        }
+        BOOST_CHECK_EQUAL(timer.GetWaitMicros(), 0);
+
+        std::atomic<bool> locked(false);
+        std::thread holder([&] {
+            LOCK(mutex);
+            locked = true;
+            MilliSleep(50);
+        });
+        while (!locked) std::this_thread::yield();
+        {
+            LOCK(mutex);
+        }
+        holder.join();
+#ifdef HAVE_THREAD_LOCAL
+        BOOST_CHECK(timer.GetWaitMicros() >= 10 * 1000);
+#else
+        BOOST_CHECK_EQUAL(timer.GetWaitMicros(), 0);
+#endif
+        BOOST_CHECK_EQUAL(other_timer.GetWaitMicros(), 0);
+    }
+    BOOST_CHECK(LockWaitTimer::Find(&mutex) == nullptr);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include <test/test_bitcoin.h>
 
 #include <banman.h>
+#include <blockfilewriter.h>
 #include <chainparams.h>
 #include <consensus/consensus.h>
 #include <consensus/params.h>
@@ -77,6 +78,8 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         threadGroup.create_thread(std::bind(&CScheduler::serviceQueue, &scheduler));
         GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
 
+        g_block_file_writer.Start();
+
         mempool.setSanityCheck(1.0);
         pblocktree.reset(new CBlockTreeDB(1 << 20, true));
         pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
@@ -102,6 +105,7 @@ TestingSetup::~TestingSetup()
 {
     threadGroup.interrupt_all();
     threadGroup.join_all();
+    g_block_file_writer.Stop();
     GetMainSignals().FlushBackgroundCallbacks();
     GetMainSignals().UnregisterBackgroundSignalScheduler();
     g_connman.reset();
@@ -7,7 +7,9 @@
 #include <amount.h>
 #include <consensus/validation.h>
 #include <primitives/transaction.h>
+#include <script/interpreter.h>
 #include <script/script.h>
+#include <script/sigcache.h>
 #include <test/test_bitcoin.h>
 
 #include <boost/test/unit_test.hpp>
@@ -58,4 +60,183 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK_EQUAL(nDoS, 100);
 }
 
+static CTransactionRef SpendP2PK(const CKey& key, const COutPoint& prevout, CAmount nValue, bool fValidSignature = true, int nOutputs = 1)
+{
+    const CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(nOutputs);
+    for (CTxOut& txout : tx.vout) {
+        txout.nValue = nValue / nOutputs;
+        txout.scriptPubKey = scriptPubKey;
+    }
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    if (!fValidSignature) hash = uint256S("0x01");
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return MakeTransactionRef(tx);
+}
+
+/**
+ * A batch gives every transaction the outcome it would have had on its own, in order.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_batch, TestChain100Setup)
+{
+    const CAmount nFee = 100000;
+    // Only the first coinbase is mature, so the parent's outputs fund the rest
+    const CTransactionRef parent = SpendP2PK(coinbaseKey, COutPoint(m_coinbase_txns[0]->GetHash(), 0), m_coinbase_txns[0]->vout[0].nValue - nFee, true, 3);
+    const CTransactionRef child = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 0), parent->vout[0].nValue - nFee);
+    const CTransactionRef badsig = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 1), parent->vout[1].nValue - nFee, false);
+    const CTransactionRef orphan = SpendP2PK(coinbaseKey, COutPoint(uint256S("0x01"), 0), 1 * CENT);
+    const CTransactionRef other = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 2), parent->vout[2].nValue - nFee);
+
+    LOCK(cs_main);
+    const unsigned int initialPoolSize = mempool.size();
+
+    std::vector<MempoolAcceptBatchEntry> entries;
+    for (const CTransactionRef& tx : {parent, badsig, child, parent, orphan, other}) {
+        entries.emplace_back(tx);
+    }
+    AcceptToMemoryPoolBatch(mempool, entries);
+
+    BOOST_CHECK(entries[0].fAccepted);
+    BOOST_CHECK(!entries[1].fAccepted);
+    int nDoS = 0;
+    BOOST_CHECK(entries[1].state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK(entries[2].fAccepted);
+    BOOST_CHECK(!entries[3].fAccepted);
+    BOOST_CHECK_EQUAL(entries[3].state.GetRejectReason(), "txn-already-in-mempool");
+    BOOST_CHECK(!entries[4].fAccepted);
+    BOOST_CHECK(entries[4].fMissingInputs);
+    BOOST_CHECK(!entries[4].state.IsInvalid());
+    BOOST_CHECK(entries[5].fAccepted);
+
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 3);
+    BOOST_CHECK(mempool.exists(parent->GetHash()));
+    BOOST_CHECK(mempool.exists(child->GetHash()));
+    BOOST_CHECK(mempool.exists(other->GetHash()));
+    BOOST_CHECK(!mempool.exists(badsig->GetHash()));
+
+    // A transaction can be validated again on its own after failing in a batch
+    CValidationState state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, state, badsig, nullptr, nullptr, false, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), entries[1].state.GetRejectReason());
+}
+
+/**
+ * Scripts of batch members are only verified ahead of time once the cheaper checks pass.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_batch_prevalidation, TestChain100Setup)
+{
+    const CAmount nFee = 100000;
+    const CTransactionRef parent = SpendP2PK(coinbaseKey, COutPoint(m_coinbase_txns[0]->GetHash(), 0), m_coinbase_txns[0]->vout[0].nValue - nFee, true, 2);
+    const CTransactionRef child = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 0), parent->vout[0].nValue - nFee);
+    const CTransactionRef cheapchild = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 1), parent->vout[1].nValue);
+
+    LOCK(cs_main);
+    BOOST_CHECK(nScriptCheckThreads > 0);
+    auto CountSignatures = [] {
+        uint256 nonce;
+        std::vector<uint256> entries;
+        GetSignatureCacheEntries(nonce, entries);
+        return entries.size();
+    };
+    const size_t nSignatures = CountSignatures();
+
+    std::vector<MempoolAcceptBatchEntry> entries;
+    for (const CTransactionRef& tx : {parent, cheapchild, child}) {
+        entries.emplace_back(tx);
+    }
+    AcceptToMemoryPoolBatch(mempool, entries);
+
+    BOOST_CHECK(entries[0].fAccepted);
+    BOOST_CHECK(!entries[1].fAccepted);
+    BOOST_CHECK_EQUAL(entries[1].state.GetRejectReason(), "min relay fee not met");
+    BOOST_CHECK(entries[2].fAccepted);
+    // Only the signatures of the accepted transactions were verified and cached
+    BOOST_CHECK_EQUAL(CountSignatures(), nSignatures + 2);
+}
+
+/**
+ * A package is accepted on its combined feerate, all of it or none of it.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_package, TestChain100Setup)
+{
+    const CAmount nFee = 100000;
+    // A parent paying no fee, children spending its outputs
+    const CTransactionRef parent = SpendP2PK(coinbaseKey, COutPoint(m_coinbase_txns[0]->GetHash(), 0), m_coinbase_txns[0]->vout[0].nValue, true, 3);
+    const CTransactionRef child = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 0), parent->vout[0].nValue - nFee);
+    const CTransactionRef cheapchild = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 1), parent->vout[1].nValue);
+    const CTransactionRef badsig = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 2), parent->vout[2].nValue - nFee, false);
+
+    LOCK(cs_main);
+    const unsigned int initialPoolSize = mempool.size();
+
+    CValidationState state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, state, parent, nullptr, nullptr, false, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectCode(), REJECT_INSUFFICIENTFEE);
+
+    auto Package = [](std::initializer_list<CTransactionRef> txs) {
+        return std::vector<MempoolAcceptBatchEntry>(txs.begin(), txs.end());
+    };
+
+    // The package has to be sorted and pay for itself
+    std::vector<MempoolAcceptBatchEntry> entries = Package({child, parent});
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-sorted");
+    entries = Package({parent, cheapchild});
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package min relay fee not met");
+
+    // A transaction failing its own checks takes the whole package down
+    entries = Package({parent, child, badsig});
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    int nDoS = 0;
+    BOOST_CHECK(entries[2].state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK(!entries[0].fAccepted);
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize);
+
+    // The child pays for its parent, but not for a cheap sibling
+    entries = Package({parent, cheapchild, child});
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-fee-not-covered");
+    BOOST_CHECK_EQUAL(state.GetDebugMessage(), cheapchild->GetHash().ToString());
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize);
+
+    entries = Package({parent, child});
+    state = CValidationState();
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    for (const MempoolAcceptBatchEntry& entry : entries) {
+        BOOST_CHECK(entry.fAccepted);
+        BOOST_CHECK(mempool.exists(entry.tx->GetHash()));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 2);
+
+    // Transactions already in the mempool do not count towards a package
+    entries = Package({parent, child});
+    state = CValidationState();
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    BOOST_CHECK(!entries[0].fAccepted);
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 2);
+
+    // A package cannot replace mempool transactions, however much it pays
+    const CTransactionRef replacement = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 0), parent->vout[0].nValue - 10 * nFee);
+    entries = Package({replacement});
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, entries, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-mempool-conflict");
+    BOOST_CHECK(mempool.exists(child->GetHash()));
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
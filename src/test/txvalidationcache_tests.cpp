@@ -9,6 +9,7 @@
 #include <pubkey.h>
 #include <txmempool.h>
 #include <random.h>
+#include <script/sigcache.h>
 #include <script/standard.h>
 #include <script/sign.h>
 #include <test/test_bitcoin.h>
@@ -367,4 +368,54 @@ BOOST_FIXTURE_TEST_CASE(checkinputs_test, TestChain100Setup)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(sigcache_persist, TestingSetup)
+{
+    uint256 sig_nonce, script_nonce, nonce;
+    std::vector<uint256> entries;
+    GetSignatureCacheEntries(sig_nonce, entries);
+    {
+        LOCK(cs_main);
+        GetScriptExecutionCacheEntries(script_nonce, entries);
+    }
+
+    // Entries are saved along with the nonces they were computed with
+    const uint256 sig_entry = InsecureRand256();
+    const uint256 script_entry = InsecureRand256();
+    LoadSignatureCacheEntries(sig_nonce, {sig_entry});
+    {
+        LOCK(cs_main);
+        LoadScriptExecutionCacheEntries(script_nonce, {script_entry});
+    }
+    BOOST_CHECK(DumpSignatureCaches());
+
+    // A restart picks new nonces, which loading replaces with the saved ones
+    LoadSignatureCacheEntries(InsecureRand256(), {});
+    {
+        LOCK(cs_main);
+        LoadScriptExecutionCacheEntries(InsecureRand256(), {});
+    }
+    BOOST_CHECK(LoadSignatureCaches());
+
+    entries.clear();
+    GetSignatureCacheEntries(nonce, entries);
+    BOOST_CHECK(nonce == sig_nonce);
+    BOOST_CHECK_EQUAL(std::count(entries.begin(), entries.end(), sig_entry), 1);
+    entries.clear();
+    {
+        LOCK(cs_main);
+        GetScriptExecutionCacheEntries(nonce, entries);
+    }
+    BOOST_CHECK(nonce == script_nonce);
+    BOOST_CHECK_EQUAL(std::count(entries.begin(), entries.end(), script_entry), 1);
+
+    // Nothing is loaded from a file cut short
+    const fs::path path = GetDataDir() / "sigcache.dat";
+    fs::resize_file(path, fs::file_size(path) - 1);
+    LoadSignatureCacheEntries(InsecureRand256(), {});
+    BOOST_CHECK(!LoadSignatureCaches());
+    GetSignatureCacheEntries(nonce, entries);
+    BOOST_CHECK(nonce != sig_nonce);
+    LoadSignatureCacheEntries(sig_nonce, {});
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,109 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/utxo_snapshot.h>
+#include <streams.h>
+#include <txdb.h>
+#include <util/system.h>
+#include <validation.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxo_snapshot_tests, TestChain100Setup)
+
+static uint256 DumpSnapshot(const fs::path& path, SnapshotMetadata& metadata, uint64_t& coins_written)
+{
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor = std::unique_ptr<CCoinsViewCursor>(pcoinsdbview->Cursor());
+        metadata.m_base_blockhash = chainActive.Tip()->GetBlockHash();
+        metadata.m_base_height = chainActive.Height();
+        metadata.m_chain_tx = chainActive.Tip()->nChainTx;
+    }
+    CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+    uint256 hash;
+    BOOST_REQUIRE(WriteUTXOSnapshot(*pcursor, file, metadata, coins_written, hash));
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(utxo_snapshot_roundtrip)
+{
+    const fs::path path = GetDataDir() / "utxo.dat";
+    SnapshotMetadata metadata;
+    uint64_t coins_written;
+    const uint256 hash = DumpSnapshot(path, metadata, coins_written);
+    // Every block in the test chain left its coinbase output unspent
+    BOOST_CHECK_EQUAL(coins_written, 100U);
+
+    SnapshotMetadata metadata_read;
+    uint64_t coins_read;
+    uint256 hash_read;
+    std::string strError;
+    size_t nBatches = 0;
+    std::vector<std::pair<COutPoint, Coin>> coins;
+    {
+        CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(ReadUTXOSnapshot(file, metadata_read, coins_read, hash_read, strError,
+            [&](const SnapshotCoinsBatch& batch) { ++nBatches; coins.insert(coins.end(), batch.begin(), batch.end()); return true; }));
+    }
+    BOOST_CHECK_EQUAL(coins_read, coins_written);
+    BOOST_CHECK_EQUAL(nBatches, 1U);
+    BOOST_CHECK(hash_read == hash);
+    BOOST_CHECK(metadata_read.m_base_blockhash == metadata.m_base_blockhash);
+    BOOST_CHECK_EQUAL(metadata_read.m_base_height, metadata.m_base_height);
+    BOOST_CHECK_EQUAL(metadata_read.m_chain_tx, metadata.m_chain_tx);
+
+    LOCK(cs_main);
+    BOOST_CHECK_EQUAL(coins.size(), coins_written);
+    for (const auto& entry : coins) {
+        const Coin& coin = pcoinsTip->AccessCoin(entry.first);
+        BOOST_CHECK(!coin.IsSpent());
+        BOOST_CHECK(coin.out == entry.second.out);
+        BOOST_CHECK_EQUAL(coin.nHeight, entry.second.nHeight);
+        BOOST_CHECK_EQUAL(coin.fCoinBase, entry.second.fCoinBase);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(utxo_snapshot_corrupt)
+{
+    const fs::path path = GetDataDir() / "utxo.dat";
+    SnapshotMetadata metadata;
+    uint64_t coins_written;
+    const uint256 hash = DumpSnapshot(path, metadata, coins_written);
+
+    // Flip a byte in the middle of the coins
+    {
+        FILE* file = fsbridge::fopen(path, "r+b");
+        BOOST_REQUIRE(file);
+        BOOST_REQUIRE(fseek(file, fs::file_size(path) / 2, SEEK_SET) == 0);
+        int c = fgetc(file);
+        BOOST_REQUIRE(fseek(file, -1, SEEK_CUR) == 0);
+        fputc(c ^ 0x01, file);
+        fclose(file);
+    }
+
+    SnapshotMetadata metadata_read;
+    uint64_t coins_read;
+    uint256 hash_read;
+    std::string strError;
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(!ReadUTXOSnapshot(file, metadata_read, coins_read, hash_read, strError));
+    BOOST_CHECK(!strError.empty());
+
+    // A snapshot can't be loaded on top of an existing chain
+    fs::remove(path);
+    DumpSnapshot(path, metadata, coins_written);
+    uint64_t coins_loaded;
+    BOOST_CHECK(!LoadUTXOSnapshot(path, uint256(), metadata_read, coins_loaded, hash_read, strError));
+    BOOST_CHECK(strError.find("empty chainstate") != std::string::npos);
+    BOOST_CHECK(!LoadUTXOSnapshot(path, InsecureRand256(), metadata_read, coins_loaded, hash_read, strError));
+    BOOST_CHECK(strError.find("does not match") != std::string::npos);
+    BOOST_CHECK(hash_read == hash);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
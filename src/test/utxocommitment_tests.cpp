@@ -0,0 +1,100 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <consensus/validation.h>
+#include <chainparams.h>
+#include <key.h>
+#include <script/interpreter.h>
+#include <script/standard.h>
+#include <txdb.h>
+#include <utxocommitment.h>
+#include <validation.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxocommitment_tests, TestChain100Setup)
+
+static CUTXOCommitment ComputeFromDisk(size_t nRanges)
+{
+    std::vector<std::unique_ptr<CCoinsViewCursor>> cursors;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        cursors = pcoinsdbview->CursorRanges(nRanges);
+    }
+    CUTXOCommitment commitment;
+    BOOST_REQUIRE(ComputeUTXOCommitment(cursors, commitment));
+    return commitment;
+}
+
+static void CheckRollingCommitment()
+{
+    CUTXOCommitment rolling;
+    uint256 hashBlock;
+    BOOST_REQUIRE(GetUTXOCommitment(rolling, hashBlock));
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(hashBlock == chainActive.Tip()->GetBlockHash());
+    }
+    const CUTXOCommitment computed = ComputeFromDisk(3);
+    BOOST_CHECK(rolling.GetHash() == computed.GetHash());
+    BOOST_CHECK_EQUAL(rolling.nTransactionOutputs, computed.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(rolling.nBogoSize, computed.nBogoSize);
+    BOOST_CHECK_EQUAL(rolling.nTotalAmount, computed.nTotalAmount);
+}
+
+BOOST_AUTO_TEST_CASE(utxocommitment_rolling)
+{
+    CheckRollingCommitment();
+    CUTXOCommitment before;
+    uint256 hashBefore;
+    BOOST_REQUIRE(GetUTXOCommitment(before, hashBefore));
+
+    // The result of a full scan does not depend on how it was split up
+    BOOST_CHECK(ComputeFromDisk(1).GetHash() == ComputeFromDisk(4).GetHash());
+
+    // Spend a coinbase output in a new block
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(m_coinbase_txns[0]->GetHash(), 0);
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = 0;
+    spend.vout[1].scriptPubKey = CScript() << OP_RETURN;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptPubKey);
+    {
+        LOCK(cs_main);
+        BOOST_REQUIRE(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    }
+    CheckRollingCommitment();
+
+    // Disconnecting the block restores the previous commitment
+    CValidationState state;
+    CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = chainActive.Tip();
+    }
+    BOOST_CHECK(InvalidateBlock(state, Params(), pindex));
+    CheckRollingCommitment();
+    CUTXOCommitment after;
+    uint256 hashAfter;
+    BOOST_REQUIRE(GetUTXOCommitment(after, hashAfter));
+    BOOST_CHECK(hashAfter == hashBefore);
+    BOOST_CHECK(after.GetHash() == before.GetHash());
+    BOOST_CHECK_EQUAL(after.nTransactionOutputs, before.nTransactionOutputs);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -25,9 +25,11 @@ static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_HEAD_BLOCKS = 'H';
+static const char DB_UTXO_COMMITMENT = 'M';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_SNAPSHOT_BASE = 'S';
 
 namespace {
 
@@ -134,6 +136,10 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     // In the last batch, mark the database as consistent with hashBlock again.
     batch.Erase(DB_HEAD_BLOCKS);
     batch.Write(DB_BEST_BLOCK, hashBlock);
+    if (m_pending_commitment && m_pending_commitment->first == hashBlock) {
+        batch.Write(DB_UTXO_COMMITMENT, *m_pending_commitment);
+    }
+    m_pending_commitment = nullopt;
 
     LogPrint(BCLog::COINDB, "Writing final batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
     bool ret = db.WriteBatch(batch);
@@ -146,6 +152,48 @@ size_t CCoinsViewDB::EstimateSize() const
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
+bool CCoinsViewDB::StartBulkImport(const uint256& hashBlock)
+{
+    CDBBatch batch(db);
+    batch.Erase(DB_BEST_BLOCK);
+    batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, GetBestBlock()});
+    return db.WriteBatch(batch, true);
+}
+
+bool CCoinsViewDB::BulkImportCoins(const std::vector<std::pair<COutPoint, Coin>>& coins)
+{
+    CDBBatch batch(db);
+    for (const auto& coin : coins) {
+        batch.Write(CoinEntry(&coin.first), coin.second);
+    }
+    LogPrint(BCLog::COINDB, "Importing batch of %u coins (%.2f MiB)\n", (unsigned int)coins.size(), batch.SizeEstimate() * (1.0 / 1048576.0));
+    return db.WriteBatch(batch);
+}
+
+bool CCoinsViewDB::FinishBulkImport(const uint256& hashBlock)
+{
+    CDBBatch batch(db);
+    batch.Erase(DB_HEAD_BLOCKS);
+    batch.Write(DB_BEST_BLOCK, hashBlock);
+    return db.WriteBatch(batch, true);
+}
+
+void CCoinsViewDB::SetCommitmentForNextWrite(const uint256& hashBlock, const CUTXOCommitment& commitment)
+{
+    m_pending_commitment = std::make_pair(hashBlock, commitment);
+}
+
+bool CCoinsViewDB::ReadCommitment(uint256& hashBlock, CUTXOCommitment& commitment) const
+{
+    std::pair<uint256, CUTXOCommitment> stored;
+    if (!db.Read(DB_UTXO_COMMITMENT, stored)) {
+        return false;
+    }
+    hashBlock = stored.first;
+    commitment = stored.second;
+    return true;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(gArgs.IsArgSet("-blocksdir") ? GetDataDir() / "blocks" / "index" : GetBlocksDir() / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -176,16 +224,41 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
        that restriction.  */
     i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    if (i->pcursor->Valid()) {
-        CoinEntry entry(&i->keyTmp.second);
-        i->pcursor->GetKey(entry);
-        i->keyTmp.first = entry.key;
-    } else {
-        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
-    }
+    i->ReadKey();
     return i;
 }
 
+std::vector<std::unique_ptr<CCoinsViewCursor>> CCoinsViewDB::CursorRanges(size_t nRanges) const
+{
+    nRanges = std::max<size_t>(1, std::min<size_t>(nRanges, CCoinsViewDBCursor::PREFIX_COUNT));
+    CDBWrapper& dbw = const_cast<CDBWrapper&>(db);
+    std::shared_ptr<const leveldb::Snapshot> snapshot = db.GetSnapshot();
+
+    // Read the best block from the snapshot too, so it matches the coins.
+    uint256 hashBestChain;
+    {
+        std::unique_ptr<CDBIterator> pcursor(dbw.NewIterator(snapshot.get()));
+        pcursor->Seek(DB_BEST_BLOCK);
+        char key;
+        if (!pcursor->Valid() || !pcursor->GetKey(key) || key != DB_BEST_BLOCK || !pcursor->GetValue(hashBestChain)) {
+            hashBestChain.SetNull();
+        }
+    }
+
+    std::vector<std::unique_ptr<CCoinsViewCursor>> ranges;
+    for (size_t n = 0; n < nRanges; n++) {
+        const uint32_t nBegin = n * CCoinsViewDBCursor::PREFIX_COUNT / nRanges;
+        CCoinsViewDBCursor *i = new CCoinsViewDBCursor(dbw.NewIterator(snapshot.get()), hashBestChain);
+        i->snapshot = snapshot;
+        i->nPrefixEnd = (n + 1) * CCoinsViewDBCursor::PREFIX_COUNT / nRanges;
+        // The key 'C' followed by the prefix sorts before every coin with that prefix.
+        i->pcursor->Seek(std::make_pair(DB_COIN, std::make_pair((unsigned char)(nBegin >> 8), (unsigned char)(nBegin & 0xff))));
+        i->ReadKey();
+        ranges.emplace_back(i);
+    }
+    return ranges;
+}
+
 bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
@@ -214,8 +287,13 @@ bool CCoinsViewDBCursor::Valid() const
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
+    ReadKey();
+}
+
+void CCoinsViewDBCursor::ReadKey()
+{
     CoinEntry entry(&keyTmp.second);
-    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
+    if (!pcursor->Valid() || !pcursor->GetKey(entry) || (entry.key == DB_COIN && GetPrefix(keyTmp.second) >= nPrefixEnd)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
     } else {
         keyTmp.first = entry.key;
@@ -246,6 +324,19 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteSnapshotBase(const uint256& hash, unsigned int nChainTx) {
+    return Write(DB_SNAPSHOT_BASE, std::make_pair(hash, nChainTx));
+}
+
+bool CBlockTreeDB::ReadSnapshotBase(uint256& hash, unsigned int& nChainTx) {
+    std::pair<uint256, unsigned int> base;
+    if (!Read(DB_SNAPSHOT_BASE, base))
+        return false;
+    hash = base.first;
+    nChainTx = base.second;
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
@@ -9,7 +9,9 @@
 #include <coins.h>
 #include <dbwrapper.h>
 #include <chain.h>
+#include <optional.h>
 #include <primitives/block.h>
+#include <utxocommitment.h>
 
 #include <map>
 #include <memory>
@@ -39,12 +41,16 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Maximum number of threads used to walk the coins database in parallel
+static const int MAX_COINS_SCAN_THREADS = 8;
 
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB final : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    //! UTXO set commitment to store along with the next write of the given best block
+    Optional<std::pair<uint256, CUTXOCommitment>> m_pending_commitment;
 public:
     explicit CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -55,9 +61,35 @@ public:
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
     CCoinsViewCursor *Cursor() const override;
 
+    /**
+     * Split the coins into nRanges cursors by the first two bytes of the
+     * txid, in key order. All cursors read from the same database snapshot,
+     * so together they yield exactly the coins Cursor() would, and can be
+     * walked concurrently from different threads.
+     */
+    std::vector<std::unique_ptr<CCoinsViewCursor>> CursorRanges(size_t nRanges) const;
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
+
+    /**
+     * Bulk import of a UTXO snapshot, bypassing the coins cache. Between
+     * StartBulkImport() and FinishBulkImport() the database is marked as
+     * being in transition to hashBlock (just like a partial BatchWrite), so
+     * an interrupted import is detected at startup.
+     */
+    bool StartBulkImport(const uint256& hashBlock);
+    bool BulkImportCoins(const std::vector<std::pair<COutPoint, Coin>>& coins);
+    bool FinishBulkImport(const uint256& hashBlock);
+
+    /**
+     * The commitment is written in the same batch that makes hashBlock the
+     * best block, so a stored commitment always matches the coins on disk
+     * when its block hash equals GetBestBlock().
+     */
+    void SetCommitmentForNextWrite(const uint256& hashBlock, const CUTXOCommitment& commitment);
+    bool ReadCommitment(uint256& hashBlock, CUTXOCommitment& commitment) const;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -73,11 +105,22 @@ public:
     bool Valid() const override;
     void Next() override;
 
+    //! Number of distinct txid prefixes CCoinsViewDB::CursorRanges splits the coins by
+    static const uint32_t PREFIX_COUNT = 0x10000;
+    //! The two byte txid prefix the ranges are split by
+    static uint32_t GetPrefix(const COutPoint& outpoint) { return 0x100 * outpoint.hash.begin()[0] + outpoint.hash.begin()[1]; }
+
 private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), nPrefixEnd(PREFIX_COUNT) {}
+    void ReadKey();
+
+    //! Keeps the snapshot a range cursor reads from alive; declared first so it outlives pcursor
+    std::shared_ptr<const leveldb::Snapshot> snapshot;
     std::unique_ptr<CDBIterator> pcursor;
     std::pair<char, COutPoint> keyTmp;
+    //! The cursor stops before the first coin whose txid prefix is at least this
+    uint32_t nPrefixEnd;
 
     friend class CCoinsViewDB;
 };
@@ -95,6 +138,9 @@ public:
     void ReadReindexing(bool &fReindexing);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! Block and nChainTx the chainstate was bootstrapped at with loadtxoutset
+    bool WriteSnapshotBase(const uint256& hash, unsigned int nChainTx);
+    bool ReadSnapshotBase(uint256& hash, unsigned int& nChainTx);
     bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
 };
 
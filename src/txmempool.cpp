@@ -11,6 +11,7 @@
 #include <validation.h>
 #include <policy/policy.h>
 #include <policy/fees.h>
+#include <policy/rbf.h>
 #include <reverse_iterator.h>
 #include <streams.h>
 #include <timedata.h>
@@ -18,6 +19,10 @@
 #include <util/moneystr.h>
 #include <util/time.h>
 
+#include <algorithm>
+#include <queue>
+#include <tuple>
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp)
@@ -53,19 +58,57 @@ size_t CTxMemPoolEntry::GetTxSize() const
     return GetVirtualTransactionSize(nTxWeight, sigOpCost);
 }
 
+void MempoolGraphOpStats::Add(uint64_t nEntriesIn, uint64_t nChain, int64_t nTimeIn)
+{
+    nCalls++;
+    nEntries += nEntriesIn;
+    nTime += nTimeIn;
+    nMaxTime = std::max(nMaxTime, nTimeIn);
+    nMaxChain = std::max(nMaxChain, nChain);
+}
+
+int MempoolGraphStats::HistogramBucket(uint64_t n)
+{
+    int nBucket = 0;
+    while (n > 1 && nBucket < HISTOGRAM_BUCKETS - 1) {
+        n >>= 1;
+        nBucket++;
+    }
+    return nBucket;
+}
+
+namespace {
+/** Accounts for a mempool graph operation in its stats once it goes out of scope */
+class GraphOpTimer
+{
+public:
+    uint64_t nEntries{0};
+    uint64_t nChain{0};
+
+    explicit GraphOpTimer(MempoolGraphOpStats& statsIn) : stats(statsIn), nStart(GetTimeMicros()) {}
+    ~GraphOpTimer() { stats.Add(nEntries, nChain, GetTimeMicros() - nStart); }
+
+private:
+    MempoolGraphOpStats& stats;
+    const int64_t nStart;
+};
+} // namespace
+
 // Update the given tx for any in-mempool descendants.
 // Assumes that setMemPoolChildren is correct for the given tx and all
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
+    GraphOpTimer timer(m_graph_stats.updateForDescendants);
     setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const TxLinkSet &setUpdateChildren = GetMemPoolChildren(updateIt);
+    stageEntries.insert(setUpdateChildren.begin(), setUpdateChildren.end());
 
     while (!stageEntries.empty()) {
         const txiter cit = *stageEntries.begin();
         setAllDescendants.insert(cit);
         stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
+        const TxLinkSet &setChildren = GetMemPoolChildren(cit);
         for (txiter childEntry : setChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
@@ -82,6 +125,8 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
     }
     // setAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
+    timer.nEntries = setAllDescendants.size();
+    timer.nChain = setAllDescendants.size() + 1;
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
@@ -140,14 +185,18 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
                 UpdateChild(it, childIter, true);
                 UpdateParent(childIter, it, true);
+                if (m_track_clusters) MergeClusters(it, childIter);
             }
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+    // The descendant and ancestor state changed under existing entries
+    nTransactionsUpdated++;
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
+    GraphOpTimer timer(m_graph_stats.calculateAncestors);
     setEntries parentHashes;
     const CTransaction &tx = entry.GetTx();
 
@@ -169,7 +218,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        const TxLinkSet &setMemPoolParents = GetMemPoolParents(it);
+        parentHashes.insert(setMemPoolParents.begin(), setMemPoolParents.end());
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -180,6 +230,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         setAncestors.insert(stageit);
         parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
+        timer.nEntries = setAncestors.size();
+        timer.nChain = setAncestors.size() + 1;
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
             errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
@@ -192,7 +244,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
+        const TxLinkSet & setMemPoolParents = GetMemPoolParents(stageit);
         for (txiter phash : setMemPoolParents) {
             // If this is a new ancestor, add it.
             if (setAncestors.count(phash) == 0) {
@@ -210,7 +262,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const TxLinkSet &parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     for (txiter piter : parentIters) {
         UpdateChild(piter, it, add);
@@ -239,7 +291,7 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
+    const TxLinkSet &setMemPoolChildren = GetMemPoolChildren(it);
     for (txiter updateIt : setMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
@@ -251,10 +303,62 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
     // transaction
     const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
     if (updateDescendants) {
+        // A block's transactions are removed together with their in-mempool
+        // parents, which must be in the block as well. In that case each
+        // remaining descendant is updated once for all of its removed
+        // ancestors, and the ancestors' descendant state needs no update as
+        // they are all going away.
+        bool fAncestorsIncluded = true;
+        for (txiter removeIt : entriesToRemove) {
+            for (txiter parentIt : GetMemPoolParents(removeIt)) {
+                if (!entriesToRemove.count(parentIt)) {
+                    fAncestorsIncluded = false;
+                    break;
+                }
+            }
+            if (!fAncestorsIncluded) break;
+        }
+        if (fAncestorsIncluded) {
+            setEntries setDescendants;
+            for (txiter removeIt : entriesToRemove) {
+                for (txiter childIt : GetMemPoolChildren(removeIt)) {
+                    if (!entriesToRemove.count(childIt)) {
+                        CalculateDescendants(childIt, setDescendants);
+                    }
+                }
+            }
+            for (txiter dit : setDescendants) {
+                setEntries setAncestors;
+                std::string dummy;
+                CalculateMemPoolAncestors(*dit, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+                int64_t modifySize = 0;
+                CAmount modifyFee = 0;
+                int64_t modifyCount = 0;
+                int64_t modifySigOps = 0;
+                for (txiter ancestorIt : setAncestors) {
+                    if (!entriesToRemove.count(ancestorIt)) continue;
+                    modifySize -= ancestorIt->GetTxSize();
+                    modifyFee -= ancestorIt->GetModifiedFee();
+                    modifyCount--;
+                    modifySigOps -= ancestorIt->GetSigOpCost();
+                }
+                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, modifyCount, modifySigOps));
+            }
+            for (txiter removeIt : entriesToRemove) {
+                for (txiter parentIt : GetMemPoolParents(removeIt)) {
+                    UpdateChild(parentIt, removeIt, false);
+                }
+            }
+            for (txiter removeIt : entriesToRemove) {
+                UpdateChildrenForRemoval(removeIt);
+            }
+            return;
+        }
+
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
+        // Here we only update statistics and not data in vLinks (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
         for (txiter removeIt : entriesToRemove) {
@@ -279,16 +383,16 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // should be a bit faster.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of
+        // of ancestors reachable via vLinks will be the same as the set of
         // ancestors whose packages include this transaction, because when we
         // add a new transaction to the mempool in addUnchecked(), we assume it
         // has no children, and in the case of a reorg where that assumption is
         // false, the in-mempool children aren't linked to the in-block tx's
         // until UpdateTransactionsFromBlock() is called.
         // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
+        // UpdateTransactionsFromBlock() has been called, then vLinks will
         // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
+        // and it's important that we use the vLinks notion of ancestor
         // transactions as the set of things to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
         // Note that UpdateAncestorsOf severs the child links that point to
@@ -324,7 +428,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), m_track_clusters(false)
 {
     _clear(); //lock free clear
 
@@ -359,7 +463,9 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, setEntries &setAnces
     // Used by AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
+    newit->nLinksIdx = vLinks.size();
+    vLinks.emplace_back();
+    vLinks.back().entry = newit;
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -394,6 +500,13 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, setEntries &setAnces
     }
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
+    uint64_t nMaxDescendantSize = newit->GetSizeWithDescendants();
+    for (txiter ancestorIt : setAncestors) {
+        nMaxDescendantSize = std::max(nMaxDescendantSize, ancestorIt->GetSizeWithDescendants());
+    }
+    m_graph_stats.vAncestorCounts[MempoolGraphStats::HistogramBucket(newit->GetCountWithAncestors())]++;
+    m_graph_stats.vDescendantSizes[MempoolGraphStats::HistogramBucket(nMaxDescendantSize / 1000)]++;
+    if (m_track_clusters) AddToCluster(newit);
 
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
@@ -419,10 +532,24 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     } else
         vTxHashes.clear();
 
+    if (m_track_clusters) RemoveFromCluster(it);
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    TxLinks &links = vLinks[it->nLinksIdx];
+    cachedInnerUsage -= links.parents.DynamicMemoryUsage() + links.children.DynamicMemoryUsage();
+    if (it->nLinksIdx + 1 < vLinks.size()) {
+        TxLinks &last = vLinks.back();
+        links.entry = last.entry;
+        links.parents.swap(last.parents);
+        links.children.swap(last.children);
+        links.entry->nLinksIdx = it->nLinksIdx;
+    }
+    vLinks.pop_back();
+    // Only give back room once three quarters of the slab is unused, so that
+    // the reallocation on the next add cannot immediately trigger another one
+    if (vLinks.size() * 4 < vLinks.capacity())
+        vLinks.shrink_to_fit();
     mapTx.erase(it);
     nTransactionsUpdated++;
     if (minerPolicyEstimator) {minerPolicyEstimator->removeTx(hash, false);}
@@ -448,7 +575,7 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
+        const TxLinkSet &setChildren = GetMemPoolChildren(it);
         for (txiter childiter : setChildren) {
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
@@ -462,6 +589,7 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReaso
     // Remove transaction from memory pool
     {
         LOCK(cs);
+        GraphOpTimer timer(m_graph_stats.removeRecursive);
         setEntries txToRemove;
         txiter origit = mapTx.find(origTx.GetHash());
         if (origit != mapTx.end()) {
@@ -484,6 +612,7 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReaso
         for (txiter it : txToRemove) {
             CalculateDescendants(it, setAllRemoves);
         }
+        timer.nEntries = timer.nChain = setAllRemoves.size();
 
         RemoveStaged(setAllRemoves, false, reason);
     }
@@ -549,6 +678,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx)
 void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight)
 {
     LOCK(cs);
+    GraphOpTimer timer(m_graph_stats.removeForBlock);
     std::vector<const CTxMemPoolEntry*> entries;
     for (const auto& tx : vtx)
     {
@@ -560,14 +690,21 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
     }
     // Before the txs in the new block have been removed from the mempool, update policy estimates
     if (minerPolicyEstimator) {minerPolicyEstimator->processBlock(nBlockHeight, entries);}
+    // Remove all of the block's transactions at once, so that their
+    // in-mempool descendants are updated once rather than once per ancestor
+    setEntries stage;
     for (const auto& tx : vtx)
     {
         txiter it = mapTx.find(tx->GetHash());
         if (it != mapTx.end()) {
-            setEntries stage;
             stage.insert(it);
-            RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
+            timer.nChain = std::max(timer.nChain, it->GetCountWithDescendants());
         }
+    }
+    timer.nEntries = stage.size();
+    RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
+    for (const auto& tx : vtx)
+    {
         removeConflicts(*tx);
         ClearPrioritisation(tx->GetHash());
     }
@@ -577,9 +714,11 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
+    vLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapClusters.clear();
+    nNextClusterId = 1;
     totalTxSize = 0;
     cachedInnerUsage = 0;
     lastRollingFeeUpdate = GetTime();
@@ -626,10 +765,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        assert(it->nLinksIdx < vLinks.size());
+        const TxLinks &links = vLinks[it->nLinksIdx];
+        assert(links.entry == it);
+        innerUsage += links.parents.DynamicMemoryUsage() + links.children.DynamicMemoryUsage();
         bool fDependsWait = false;
         setEntries setParentCheck;
         for (const CTxIn &txin : tx.vin) {
@@ -650,7 +789,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(GetMemPoolParents(it) == setParentCheck);
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -683,7 +822,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 child_sizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(GetMemPoolChildren(it) == setChildrenCheck);
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= child_sizes + it->GetTxSize());
@@ -717,6 +856,30 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+
+    if (m_track_clusters) {
+        // Connected transactions share a cluster, which knows where they are
+        size_t nClustered = 0;
+        for (const auto& entry : mapClusters) {
+            const Cluster& cluster = entry.second;
+            assert(!cluster.vTx.empty());
+            for (size_t i = 0; i < cluster.vTx.size(); i++) {
+                txiter it = cluster.vTx[i];
+                assert(it->nClusterId == entry.first);
+                assert(it->nClusterPos == i);
+                for (txiter parentIt : GetMemPoolParents(it)) {
+                    assert(parentIt->nClusterId == entry.first);
+                    if (!cluster.fDirty) assert(parentIt->nClusterPos < i);
+                }
+            }
+            if (!cluster.fDirty) {
+                assert(!cluster.vChunks.empty());
+                assert(cluster.vChunks.back().nEnd == cluster.vTx.size());
+            }
+            nClustered += cluster.vTx.size();
+        }
+        assert(nClustered == mapTx.size());
+    }
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -795,6 +958,90 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     return ret;
 }
 
+const MempoolSnapshot::Entry* MempoolSnapshot::Find(const uint256& txid) const
+{
+    auto it = std::lower_bound(vEntries.begin(), vEntries.end(), txid, [](const Entry& entry, const uint256& hash) {
+        return entry.txid < hash;
+    });
+    if (it == vEntries.end() || it->txid != txid) return nullptr;
+    return &*it;
+}
+
+MempoolSnapshot::Entry CTxMemPool::GetSnapshotEntry(txiter it) const
+{
+    AssertLockHeld(cs);
+    MempoolSnapshot::Entry entry;
+    entry.txid = it->GetTx().GetHash();
+    entry.wtxid = it->GetTx().GetWitnessHash();
+    entry.nFee = it->GetFee();
+    entry.nModifiedFee = it->GetModifiedFee();
+    entry.nTxSize = it->GetTxSize();
+    entry.nTime = it->GetTime();
+    entry.nHeight = it->GetHeight();
+    entry.nCountWithDescendants = it->GetCountWithDescendants();
+    entry.nSizeWithDescendants = it->GetSizeWithDescendants();
+    entry.nModFeesWithDescendants = it->GetModFeesWithDescendants();
+    entry.nCountWithAncestors = it->GetCountWithAncestors();
+    entry.nSizeWithAncestors = it->GetSizeWithAncestors();
+    entry.nModFeesWithAncestors = it->GetModFeesWithAncestors();
+    const TxLinks& links = vLinks[it->nLinksIdx];
+    entry.vParents.reserve(links.parents.size());
+    for (txiter parent : links.parents) {
+        entry.vParents.push_back(parent->GetTx().GetHash());
+    }
+    entry.vChildren.reserve(links.children.size());
+    for (txiter child : links.children) {
+        entry.vChildren.push_back(child->GetTx().GetHash());
+    }
+    entry.fReplaceable = false;
+    return entry;
+}
+
+std::shared_ptr<const MempoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    auto snapshot = std::make_shared<MempoolSnapshot>();
+    {
+        LOCK(cs);
+        if (m_snapshot && m_snapshot->nTransactionsUpdated == nTransactionsUpdated) {
+            return m_snapshot;
+        }
+        snapshot->nTransactionsUpdated = nTransactionsUpdated;
+        snapshot->vEntries.reserve(mapTx.size());
+        for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+            snapshot->vEntries.push_back(GetSnapshotEntry(it));
+            // Whether the transaction itself signals, for now
+            snapshot->vEntries.back().fReplaceable = SignalsOptInRBF(it->GetTx());
+        }
+    }
+
+    std::vector<MempoolSnapshot::Entry>& vEntries = snapshot->vEntries;
+    std::sort(vEntries.begin(), vEntries.end(), [](const MempoolSnapshot::Entry& a, const MempoolSnapshot::Entry& b) {
+        return a.txid < b.txid;
+    });
+    // A transaction is replaceable if any of its ancestors signals, so go
+    // through parents before their children and pass it down.
+    std::vector<MempoolSnapshot::Entry*> vByDepth;
+    vByDepth.reserve(vEntries.size());
+    for (MempoolSnapshot::Entry& entry : vEntries) {
+        if (!entry.vParents.empty()) vByDepth.push_back(&entry);
+    }
+    std::sort(vByDepth.begin(), vByDepth.end(), [](const MempoolSnapshot::Entry* a, const MempoolSnapshot::Entry* b) {
+        return a->nCountWithAncestors < b->nCountWithAncestors;
+    });
+    for (MempoolSnapshot::Entry* entry : vByDepth) {
+        for (const uint256& parent : entry->vParents) {
+            if (entry->fReplaceable) break;
+            entry->fReplaceable = snapshot->Find(parent)->fReplaceable;
+        }
+    }
+
+    LOCK(cs);
+    if (snapshot->nTransactionsUpdated == nTransactionsUpdated) {
+        m_snapshot = snapshot;
+    }
+    return snapshot;
+}
+
 CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
@@ -837,6 +1084,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
             for (txiter descendantIt : setDescendants) {
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
+            if (m_track_clusters) MarkClusterDirty(it);
             ++nTransactionsUpdated;
         }
     }
@@ -911,7 +1159,14 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // Cluster vectors are estimated at one position and one chunk per transaction.
+    size_t nClusterUsage = m_track_clusters ? memusage::DynamicUsage(mapClusters) + (sizeof(txiter) + sizeof(ClusterChunk)) * mapTx.size() : 0;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vLinks) + memusage::DynamicUsage(vTxHashes) + nClusterUsage + cachedInnerUsage;
+}
+
+size_t CTxMemPool::CompactedMemoryUsage(size_t nLinksSlack) const {
+    AssertLockHeld(cs);
+    return DynamicMemoryUsage() - memusage::DynamicUsage(vLinks) + memusage::MallocUsage(std::min(vLinks.size() + nLinksSlack, vLinks.capacity()) * sizeof(TxLinks));
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
@@ -947,40 +1202,79 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, bool validFeeEstimat
     return addUnchecked(entry, setAncestors, validFeeEstimate);
 }
 
+size_t CTxMemPool::TxLinkSet::count(txiter it) const
+{
+    const_iterator pos = std::lower_bound(v.begin(), v.end(), it, CompareIteratorByHash());
+    return pos != v.end() && *pos == it;
+}
+
+bool CTxMemPool::TxLinkSet::insert(txiter it)
+{
+    auto pos = std::lower_bound(v.begin(), v.end(), it, CompareIteratorByHash());
+    if (pos != v.end() && *pos == it) return false;
+    v.insert(pos, it);
+    return true;
+}
+
+bool CTxMemPool::TxLinkSet::erase(txiter it)
+{
+    auto pos = std::lower_bound(v.begin(), v.end(), it, CompareIteratorByHash());
+    if (pos == v.end() || *pos != it) return false;
+    v.erase(pos);
+    return true;
+}
+
+void CTxMemPool::TxLinkSet::swap(TxLinkSet& other)
+{
+    v.swap(other.v);
+}
+
+size_t CTxMemPool::TxLinkSet::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(v);
+}
+
+bool CTxMemPool::TxLinkSet::operator==(const setEntries& other) const
+{
+    return v.size() == other.size() && std::equal(v.begin(), v.end(), other.begin());
+}
+
 void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    TxLinkSet &children = vLinks[entry->nLinksIdx].children;
+    cachedInnerUsage -= children.DynamicMemoryUsage();
+    if (add) {
+        children.insert(child);
+    } else {
+        children.erase(child);
     }
+    cachedInnerUsage += children.DynamicMemoryUsage();
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    TxLinkSet &parents = vLinks[entry->nLinksIdx].parents;
+    cachedInnerUsage -= parents.DynamicMemoryUsage();
+    if (add) {
+        parents.insert(parent);
+    } else {
+        parents.erase(parent);
     }
+    cachedInnerUsage += parents.DynamicMemoryUsage();
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::TxLinkSet & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    assert(entry->nLinksIdx < vLinks.size());
+    return vLinks[entry->nLinksIdx].parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::TxLinkSet & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    assert(entry->nLinksIdx < vLinks.size());
+    return vLinks[entry->nLinksIdx].children;
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1015,12 +1309,25 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
+void CTxMemPool::trackPackageEvicted(size_t nCount) {
+    AssertLockHeld(cs);
+    m_graph_stats.vEvictedCounts[MempoolGraphStats::HistogramBucket(nCount)]++;
+    m_graph_stats.trimToSize.nMaxChain = std::max<uint64_t>(m_graph_stats.trimToSize.nMaxChain, nCount);
+}
+
 void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
     LOCK(cs);
+    GraphOpTimer timer(m_graph_stats.trimToSize);
 
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+    // Room in vLinks freed by the evictions is given back below rather than
+    // paid for with more evictions
+    const size_t nLinksSlack = vLinks.capacity() - vLinks.size();
+    if (m_track_clusters) {
+        TrimClustersToSize(sizelimit, nLinksSlack, pvNoSpendsRemaining, nTxnRemoved, maxFeeRateRemoved);
+    }
+    while (!mapTx.empty() && CompactedMemoryUsage(nLinksSlack) > sizelimit) {
         indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
@@ -1035,6 +1342,7 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
         setEntries stage;
         CalculateDescendants(mapTx.project<0>(it), stage);
         nTxnRemoved += stage.size();
+        trackPackageEvicted(stage.size());
 
         std::vector<CTransaction> txn;
         if (pvNoSpendsRemaining) {
@@ -1053,6 +1361,11 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
         }
     }
 
+    if (nTxnRemoved > 0 && vLinks.size() < vLinks.capacity())
+        vLinks.shrink_to_fit();
+
+    timer.nEntries = nTxnRemoved;
+
     if (maxFeeRateRemoved > CFeeRate(0)) {
         LogPrint(BCLog::MEMPOOL, "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
     }
@@ -1068,7 +1381,7 @@ uint64_t CTxMemPool::CalculateDescendantMaximum(txiter entry) const {
         txiter candidate = candidates.back();
         candidates.pop_back();
         if (!counted.insert(candidate).second) continue;
-        const setEntries& parents = GetMemPoolParents(candidate);
+        const TxLinkSet& parents = GetMemPoolParents(candidate);
         if (parents.size() == 0) {
             maximum = std::max(maximum, candidate->GetCountWithDescendants());
         } else {
@@ -1090,4 +1403,289 @@ void CTxMemPool::GetTransactionAncestry(const uint256& txid, size_t& ancestors,
     }
 }
 
+void CTxMemPool::SetClusterTracking(bool fTrack)
+{
+    LOCK(cs);
+    if (fTrack == m_track_clusters) return;
+    m_track_clusters = fTrack;
+    mapClusters.clear();
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+        it->nClusterId = 0;
+        if (fTrack) {
+            it->nClusterId = nNextClusterId++;
+            it->nClusterPos = 0;
+            mapClusters[it->nClusterId].vTx.push_back(it);
+        }
+    }
+    if (!fTrack) return;
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+        for (txiter parentIt : GetMemPoolParents(it)) {
+            MergeClusters(it, parentIt);
+        }
+    }
+}
+
+void CTxMemPool::AddToCluster(txiter entry)
+{
+    entry->nClusterId = nNextClusterId++;
+    entry->nClusterPos = 0;
+    mapClusters[entry->nClusterId].vTx.push_back(entry);
+    for (txiter parentIt : GetMemPoolParents(entry)) {
+        MergeClusters(entry, parentIt);
+    }
+}
+
+void CTxMemPool::RemoveFromCluster(txiter entry)
+{
+    auto clusterIt = mapClusters.find(entry->nClusterId);
+    assert(clusterIt != mapClusters.end());
+    std::vector<txiter>& vTx = clusterIt->second.vTx;
+    const size_t nPos = entry->nClusterPos;
+    assert(nPos < vTx.size() && vTx[nPos] == entry);
+    vTx[nPos] = vTx.back();
+    vTx[nPos]->nClusterPos = nPos;
+    vTx.pop_back();
+    if (vTx.empty()) {
+        mapClusters.erase(clusterIt);
+    } else {
+        clusterIt->second.fDirty = true;
+    }
+    entry->nClusterId = 0;
+}
+
+void CTxMemPool::MergeClusters(txiter a, txiter b)
+{
+    if (a->nClusterId == b->nClusterId) return;
+    auto itA = mapClusters.find(a->nClusterId);
+    auto itB = mapClusters.find(b->nClusterId);
+    assert(itA != mapClusters.end() && itB != mapClusters.end());
+    // Move the smaller cluster into the larger one
+    if (itA->second.vTx.size() < itB->second.vTx.size()) std::swap(itA, itB);
+    std::vector<txiter>& vTx = itA->second.vTx;
+    for (txiter it : itB->second.vTx) {
+        it->nClusterId = itA->first;
+        it->nClusterPos = vTx.size();
+        vTx.push_back(it);
+    }
+    itA->second.fDirty = true;
+    mapClusters.erase(itB);
+}
+
+void CTxMemPool::MarkClusterDirty(txiter entry)
+{
+    auto clusterIt = mapClusters.find(entry->nClusterId);
+    assert(clusterIt != mapClusters.end());
+    clusterIt->second.fDirty = true;
+}
+
+void CTxMemPool::LinearizeCluster(Cluster& cluster) const
+{
+    std::vector<txiter>& vTx = cluster.vTx;
+    const size_t n = vTx.size();
+
+    // Order the cluster topologically, so that ancestors come first
+    std::vector<size_t> vParentsLeft(n);
+    std::vector<txiter> vOrder;
+    vOrder.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        vTx[i]->nClusterPos = i;
+        vParentsLeft[i] = GetMemPoolParents(vTx[i]).size();
+        if (vParentsLeft[i] == 0) vOrder.push_back(vTx[i]);
+    }
+    for (size_t i = 0; i < vOrder.size(); i++) {
+        for (txiter childIt : GetMemPoolChildren(vOrder[i])) {
+            if (--vParentsLeft[childIt->nClusterPos] == 0) vOrder.push_back(childIt);
+        }
+    }
+    assert(vOrder.size() == n);
+
+    if (n > 1 && n <= MAX_CLUSTER_LINEARIZATION) {
+        // Repeatedly pick the transaction whose not yet picked ancestors have
+        // the highest feerate, and append those ancestors in topological
+        // order. Ancestor and descendant sets are bitmaps over vOrder, and the
+        // fee and size of each transaction's remaining ancestors are kept up
+        // to date as transactions are picked.
+        const size_t nWords = (n + 63) / 64;
+        std::vector<uint64_t> vAncestors(n * nWords, 0);
+        std::vector<uint64_t> vDescendants(n * nWords, 0);
+        std::vector<CAmount> vAncestorFee(n, 0);
+        std::vector<int64_t> vAncestorSize(n, 0);
+        for (size_t i = 0; i < n; i++) {
+            vOrder[i]->nClusterPos = i;
+            uint64_t* ancestors = &vAncestors[i * nWords];
+            ancestors[i / 64] |= uint64_t{1} << (i % 64);
+            for (txiter parentIt : GetMemPoolParents(vOrder[i])) {
+                const uint64_t* parentAncestors = &vAncestors[parentIt->nClusterPos * nWords];
+                for (size_t w = 0; w < nWords; w++) ancestors[w] |= parentAncestors[w];
+            }
+            for (size_t j = 0; j <= i; j++) {
+                if ((ancestors[j / 64] >> (j % 64)) & 1) {
+                    vAncestorFee[i] += vOrder[j]->GetModifiedFee();
+                    vAncestorSize[i] += vOrder[j]->GetTxSize();
+                    vDescendants[j * nWords + i / 64] |= uint64_t{1} << (i % 64);
+                }
+            }
+        }
+
+        std::vector<uint64_t> vPicked(nWords, 0);
+        std::vector<txiter> vLinear;
+        vLinear.reserve(n);
+        while (vLinear.size() < n) {
+            size_t nBest = n;
+            for (size_t i = 0; i < n; i++) {
+                if ((vPicked[i / 64] >> (i % 64)) & 1) continue;
+                if (nBest == n || (double)vAncestorFee[i] * vAncestorSize[nBest] > (double)vAncestorFee[nBest] * vAncestorSize[i]) {
+                    nBest = i;
+                }
+            }
+            const uint64_t* ancestors = &vAncestors[nBest * nWords];
+            for (size_t j = 0; j <= nBest; j++) {
+                if (!((ancestors[j / 64] & ~vPicked[j / 64]) >> (j % 64) & 1)) continue;
+                vPicked[j / 64] |= uint64_t{1} << (j % 64);
+                vLinear.push_back(vOrder[j]);
+                const uint64_t* descendants = &vDescendants[j * nWords];
+                for (size_t k = j; k < n; k++) {
+                    if ((descendants[k / 64] >> (k % 64)) & 1) {
+                        vAncestorFee[k] -= vOrder[j]->GetModifiedFee();
+                        vAncestorSize[k] -= vOrder[j]->GetTxSize();
+                    }
+                }
+            }
+        }
+        vOrder.swap(vLinear);
+    }
+
+    // Chunk the linearization: a transaction that would raise the feerate of
+    // the chunk before it is merged into it.
+    vTx.swap(vOrder);
+    cluster.vChunks.clear();
+    for (size_t i = 0; i < n; i++) {
+        vTx[i]->nClusterPos = i;
+        cluster.vChunks.push_back(ClusterChunk{vTx[i]->GetModifiedFee(), (int64_t)vTx[i]->GetTxSize(), i + 1});
+        while (cluster.vChunks.size() > 1) {
+            ClusterChunk& last = cluster.vChunks.back();
+            ClusterChunk& prev = cluster.vChunks[cluster.vChunks.size() - 2];
+            if ((double)last.nFee * prev.nSize <= (double)prev.nFee * last.nSize) break;
+            prev.nFee += last.nFee;
+            prev.nSize += last.nSize;
+            prev.nEnd = last.nEnd;
+            cluster.vChunks.pop_back();
+        }
+    }
+    cluster.fDirty = false;
+}
+
+std::vector<uint64_t> CTxMemPool::RefreshCluster(uint64_t nId)
+{
+    std::vector<uint64_t> vIds;
+    auto clusterIt = mapClusters.find(nId);
+    assert(clusterIt != mapClusters.end());
+    if (!clusterIt->second.fDirty) {
+        vIds.push_back(nId);
+        return vIds;
+    }
+
+    // Removals may have split the cluster: walk its links to find the
+    // connected parts, the first of which keeps the cluster's id.
+    std::vector<txiter> vAll;
+    vAll.swap(clusterIt->second.vTx);
+    for (txiter it : vAll) it->nClusterId = 0;
+    for (txiter start : vAll) {
+        if (start->nClusterId != 0) continue;
+        const uint64_t nPartId = vIds.empty() ? nId : nNextClusterId++;
+        Cluster& part = mapClusters[nPartId];
+        start->nClusterId = nPartId;
+        part.vTx.push_back(start);
+        for (size_t i = 0; i < part.vTx.size(); i++) {
+            txiter it = part.vTx[i];
+            for (const TxLinkSet* links : {&GetMemPoolParents(it), &GetMemPoolChildren(it)}) {
+                for (txiter linkedIt : *links) {
+                    if (linkedIt->nClusterId != 0) continue;
+                    linkedIt->nClusterId = nPartId;
+                    part.vTx.push_back(linkedIt);
+                }
+            }
+        }
+        LinearizeCluster(part);
+        vIds.push_back(nPartId);
+    }
+    return vIds;
+}
+
+void CTxMemPool::UpdateClusters()
+{
+    AssertLockHeld(cs);
+    std::vector<uint64_t> vDirty;
+    for (const auto& entry : mapClusters) {
+        if (entry.second.fDirty) vDirty.push_back(entry.first);
+    }
+    for (uint64_t nId : vDirty) {
+        RefreshCluster(nId);
+    }
+}
+
+void CTxMemPool::TrimClustersToSize(size_t sizelimit, size_t nLinksSlack, std::vector<COutPoint>* pvNoSpendsRemaining, unsigned& nTxnRemoved, CFeeRate& maxFeeRateRemoved)
+{
+    AssertLockHeld(cs);
+    if (CompactedMemoryUsage(nLinksSlack) <= sizelimit) return;
+    UpdateClusters();
+
+    // The last chunk of each cluster by feerate, with the cluster's size to
+    // recognise entries that went stale when the cluster shrank.
+    typedef std::tuple<double, uint64_t, size_t> LastChunk;
+    std::priority_queue<LastChunk, std::vector<LastChunk>, std::greater<LastChunk>> queue;
+    auto push_cluster = [&](uint64_t nId) {
+        const Cluster& cluster = mapClusters[nId];
+        const ClusterChunk& chunk = cluster.vChunks.back();
+        queue.emplace((double)chunk.nFee / chunk.nSize, nId, cluster.vTx.size());
+    };
+    for (const auto& entry : mapClusters) {
+        push_cluster(entry.first);
+    }
+
+    while (!queue.empty() && CompactedMemoryUsage(nLinksSlack) > sizelimit) {
+        const uint64_t nId = std::get<1>(queue.top());
+        const size_t nSize = std::get<2>(queue.top());
+        queue.pop();
+        auto clusterIt = mapClusters.find(nId);
+        if (clusterIt == mapClusters.end() || clusterIt->second.vTx.size() != nSize) continue;
+        const Cluster& cluster = clusterIt->second;
+
+        // The last chunk is a suffix of a topological order, so it includes
+        // all of its in-mempool descendants.
+        const ClusterChunk& chunk = cluster.vChunks.back();
+        const size_t nBegin = cluster.vChunks.size() > 1 ? cluster.vChunks[cluster.vChunks.size() - 2].nEnd : 0;
+        CFeeRate removed(chunk.nFee, chunk.nSize);
+        removed += incrementalRelayFee;
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries stage(cluster.vTx.begin() + nBegin, cluster.vTx.end());
+        nTxnRemoved += stage.size();
+        trackPackageEvicted(stage.size());
+        const bool fRemaining = nBegin > 0;
+
+        std::vector<CTransaction> txn;
+        if (pvNoSpendsRemaining) {
+            txn.reserve(stage.size());
+            for (txiter iter : stage)
+                txn.push_back(iter->GetTx());
+        }
+        RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
+        if (pvNoSpendsRemaining) {
+            for (const CTransaction& tx : txn) {
+                for (const CTxIn& txin : tx.vin) {
+                    if (exists(txin.prevout.hash)) continue;
+                    pvNoSpendsRemaining->push_back(txin.prevout);
+                }
+            }
+        }
+        if (fRemaining) {
+            for (uint64_t nPartId : RefreshCluster(nId)) {
+                push_cluster(nPartId);
+            }
+        }
+    }
+}
+
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
@@ -18,6 +18,7 @@
 #include <crypto/siphash.h>
 #include <indirectmap.h>
 #include <policy/feerate.h>
+#include <prevector.h>
 #include <primitives/transaction.h>
 #include <sync.h>
 #include <random.h>
@@ -34,6 +35,11 @@ extern CCriticalSection cs_main;
 /** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const uint32_t MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
+/** Default for -mempoolclusters, whether the mempool groups connected transactions into clusters */
+static const bool DEFAULT_MEMPOOL_CLUSTERS = false;
+/** Largest cluster that is linearized by ancestor feerate; larger ones are chunked in topological order */
+static const unsigned int MAX_CLUSTER_LINEARIZATION = 200;
+
 struct LockPoints
 {
     // Will be set to the blockchain height and median time past
@@ -130,6 +136,9 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable size_t nLinksIdx;    //!< Index of the entry's parents and children in mempool's vLinks
+    mutable uint64_t nClusterId = 0; //!< Cluster in mempool's mapClusters, if clusters are tracked
+    mutable size_t nClusterPos = 0;  //!< Index in that cluster's vTx
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -340,6 +349,42 @@ struct TxMempoolInfo
     int64_t nFeeDelta;
 };
 
+/**
+ * A copy of every mempool entry as of one point in time, for readers that go
+ * through the whole mempool, such as RPC and REST, to use without holding the
+ * mempool lock. Entries are sorted by txid.
+ */
+struct MempoolSnapshot
+{
+    struct Entry
+    {
+        uint256 txid;
+        uint256 wtxid;
+        CAmount nFee;
+        CAmount nModifiedFee;
+        size_t nTxSize;
+        int64_t nTime;
+        unsigned int nHeight;
+        uint64_t nCountWithDescendants;
+        uint64_t nSizeWithDescendants;
+        CAmount nModFeesWithDescendants;
+        uint64_t nCountWithAncestors;
+        uint64_t nSizeWithAncestors;
+        CAmount nModFeesWithAncestors;
+        //! In-mempool parents and children, sorted by txid
+        std::vector<uint256> vParents;
+        std::vector<uint256> vChildren;
+        //! Replaceable through BIP125, signalled by the transaction or one of its ancestors
+        bool fReplaceable;
+    };
+
+    std::vector<Entry> vEntries;
+    //! The mempool's GetTransactionsUpdated() at the time
+    unsigned int nTransactionsUpdated;
+
+    const Entry* Find(const uint256& txid) const;
+};
+
 /** Reason why a transaction was removed from the mempool,
  * this is passed to the notification signal.
  */
@@ -367,6 +412,45 @@ public:
     }
 };
 
+/** Work done by one kind of mempool graph operation since startup (times in microseconds) */
+struct MempoolGraphOpStats
+{
+    uint64_t nCalls = 0;
+    //! Entries walked or updated
+    uint64_t nEntries = 0;
+    int64_t nTime = 0;
+    int64_t nMaxTime = 0;
+    //! Largest chain of ancestors or descendants walked in one call
+    uint64_t nMaxChain = 0;
+
+    void Add(uint64_t nEntriesIn, uint64_t nChain, int64_t nTimeIn);
+};
+
+/**
+ * Cost of keeping the ancestor and descendant state of the mempool up to
+ * date, and the shape of the packages it holds, to tune the ancestor and
+ * descendant limits with.
+ */
+struct MempoolGraphStats
+{
+    /** Histograms are in powers of two, from the first bucket of 0-1 to the last of 128 and over */
+    static const int HISTOGRAM_BUCKETS = 8;
+
+    MempoolGraphOpStats calculateAncestors;
+    MempoolGraphOpStats updateForDescendants;
+    MempoolGraphOpStats removeRecursive;
+    MempoolGraphOpStats removeForBlock;
+    MempoolGraphOpStats trimToSize;
+    //! Ancestor counts, including themselves, of the transactions added
+    uint64_t vAncestorCounts[HISTOGRAM_BUCKETS] = {};
+    //! Largest descendant package size (in kvB) among the ancestors of each transaction added, including itself
+    uint64_t vDescendantSizes[HISTOGRAM_BUCKETS] = {};
+    //! Transaction counts of the packages evicted by TrimToSize
+    uint64_t vEvictedCounts[HISTOGRAM_BUCKETS] = {};
+
+    static int HistogramBucket(uint64_t n);
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain transactions
  * that may be included in the next block.
@@ -394,7 +478,7 @@ public:
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
+ * the set of in-mempool direct parents and direct children in vLinks.  Within
  * each CTxMemPoolEntry, we track the size and fees of all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
@@ -427,7 +511,7 @@ public:
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * vLinks may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -454,6 +538,13 @@ private:
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
     void trackPackageRemoved(const CFeeRate& rate) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void trackPackageEvicted(size_t nCount) EXCLUSIVE_LOCKS_REQUIRED(cs);
+
+    //! Last snapshot taken, until the mempool changes
+    mutable std::shared_ptr<const MempoolSnapshot> m_snapshot GUARDED_BY(cs);
+
+    //! Mutable so that the const CalculateMemPoolAncestors can account for itself
+    mutable MempoolGraphStats m_graph_stats GUARDED_BY(cs);
 
 public:
 
@@ -534,23 +625,93 @@ public:
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const EXCLUSIVE_LOCKS_REQUIRED(cs);
-    const setEntries & GetMemPoolChildren(txiter entry) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /**
+     * The in-mempool parents or children of an entry. Sorted like setEntries,
+     * but kept in a flat vector that stores the first two inline, as most
+     * transactions have no more parents or children than that.
+     */
+    class TxLinkSet
+    {
+    public:
+        typedef prevector<2, txiter>::const_iterator const_iterator;
+
+        const_iterator begin() const { return v.begin(); }
+        const_iterator end() const { return v.end(); }
+        size_t size() const { return v.size(); }
+        bool empty() const { return v.empty(); }
+        size_t count(txiter it) const;
+        /** Returns false if it was already present */
+        bool insert(txiter it);
+        /** Returns false if it was not present */
+        bool erase(txiter it);
+        void swap(TxLinkSet& other);
+        size_t DynamicMemoryUsage() const;
+        bool operator==(const setEntries& other) const;
+
+    private:
+        prevector<2, txiter> v;
+    };
+
+    const TxLinkSet & GetMemPoolParents(txiter entry) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+    const TxLinkSet & GetMemPoolChildren(txiter entry) const EXCLUSIVE_LOCKS_REQUIRED(cs);
     uint64_t CalculateDescendantMaximum(txiter entry) const EXCLUSIVE_LOCKS_REQUIRED(cs);
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        txiter entry;
+        TxLinkSet parents;
+        TxLinkSet children;
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+    //! Links of every entry, at the entry's nLinksIdx, so that they need no
+    //! allocation of their own and are found without a lookup. Kept dense
+    //! like vTxHashes: a removed entry's slot is filled with the last one.
+    std::vector<TxLinks> vLinks;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+public:
+    /** A run of a cluster's linearization that is best mined together */
+    struct ClusterChunk {
+        CAmount nFee;    //!< modified fees of the chunk
+        int64_t nSize;   //!< virtual size of the chunk
+        size_t nEnd;     //!< position in the linearization one past the chunk's last transaction
+    };
+
+    /**
+     * A set of mempool transactions connected by spending each other's
+     * outputs. vTx is a topological order of the cluster picked greedily by
+     * ancestor feerate, and vChunks partitions it into runs of non-increasing
+     * feerate, so that mining a cluster means taking a prefix of its chunks
+     * and evicting from it means dropping its last chunk.
+     */
+    struct Cluster {
+        std::vector<txiter> vTx;
+        std::vector<ClusterChunk> vChunks;
+        //! Transactions were added, removed or reprioritised since vTx and vChunks were computed
+        bool fDirty = true;
+    };
+
+private:
+    bool m_track_clusters GUARDED_BY(cs);
+    uint64_t nNextClusterId GUARDED_BY(cs);
+    std::map<uint64_t, Cluster> mapClusters GUARDED_BY(cs);
+
+    /** Put a new entry in a cluster of its own and merge it with its parents' */
+    void AddToCluster(txiter entry) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void RemoveFromCluster(txiter entry) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void MergeClusters(txiter a, txiter b) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void MarkClusterDirty(txiter entry) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Split a dirty cluster into its connected parts and relinearize them, returning their ids */
+    std::vector<uint64_t> RefreshCluster(uint64_t nId) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void LinearizeCluster(Cluster& cluster) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** TrimToSize() by evicting the lowest feerate chunk of any cluster */
+    void TrimClustersToSize(size_t sizelimit, size_t nLinksSlack, std::vector<COutPoint>* pvNoSpendsRemaining, unsigned& nTxnRemoved, CFeeRate& maxFeeRateRemoved) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** DynamicMemoryUsage() once vLinks has been shrunk to leave nLinksSlack unused entries */
+    size_t CompactedMemoryUsage(size_t nLinksSlack) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const EXCLUSIVE_LOCKS_REQUIRED(cs);
 
 public:
@@ -570,6 +731,20 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(double dFrequency = 1.0) { LOCK(cs); nCheckFrequency = static_cast<uint32_t>(dFrequency * 4294967295.0); }
 
+    /**
+     * Group connected transactions into clusters (-mempoolclusters). Size
+     * limiting then evicts the lowest feerate chunk of any cluster, and block
+     * assembly selects whole chunks in feerate order. The ancestor and
+     * descendant aggregates are still maintained, as policy limits and
+     * replacement depend on them.
+     */
+    void SetClusterTracking(bool fTrack);
+    bool IsTrackingClusters() const { LOCK(cs); return m_track_clusters; }
+    /** Relinearize all clusters that changed since they were last used */
+    void UpdateClusters() EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Clusters by id, which are only up to date after UpdateClusters() */
+    const std::map<uint64_t, Cluster>& GetClusters() const EXCLUSIVE_LOCKS_REQUIRED(cs) { return mapClusters; }
+
     // addUnchecked must updated state for all ancestors of a given transaction,
     // to track size/count of descendant transactions.  First version of
     // addUnchecked can be used to have it call CalculateMemPoolAncestors(), and
@@ -640,7 +815,7 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from vLinks. Must be true for entries not in the mempool
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const EXCLUSIVE_LOCKS_REQUIRED(cs);
 
@@ -694,8 +869,23 @@ public:
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
+    /**
+     * The current snapshot of the mempool. It is shared by all readers until
+     * the mempool changes, and the mempool lock is only held to copy the
+     * entries, not to sort them or work out their BIP125 status.
+     */
+    std::shared_ptr<const MempoolSnapshot> GetSnapshot() const;
+    /** A single entry as it would be in a snapshot, except for fReplaceable */
+    MempoolSnapshot::Entry GetSnapshotEntry(txiter it) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+
     size_t DynamicMemoryUsage() const;
 
+    MempoolGraphStats GetGraphStats() const
+    {
+        LOCK(cs);
+        return m_graph_stats;
+    }
+
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
 
@@ -0,0 +1,123 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <utxocommitment.h>
+
+#include <coins.h>
+#include <primitives/block.h>
+#include <shutdown.h>
+#include <streams.h>
+#include <undo.h>
+#include <util/system.h>
+#include <version.h>
+
+#include <atomic>
+#include <thread>
+
+static void HashCoin(MuHash3072& muhash, const COutPoint& outpoint, const Coin& coin, bool fRemove)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << outpoint;
+    ss << static_cast<uint32_t>(coin.nHeight * 2 + coin.fCoinBase);
+    ss << coin.out;
+    const unsigned char* data = (const unsigned char*)ss.data();
+    if (fRemove) {
+        muhash.Remove(data, ss.size());
+    } else {
+        muhash.Insert(data, ss.size());
+    }
+}
+
+static uint64_t BogoSize(const Coin& coin)
+{
+    return 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
+           2 /* scriptPubKey len */ + coin.out.scriptPubKey.size() /* scriptPubKey */;
+}
+
+void CUTXOCommitment::AddCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    HashCoin(muhash, outpoint, coin, false);
+    nTransactionOutputs++;
+    nBogoSize += BogoSize(coin);
+    nTotalAmount += coin.out.nValue;
+}
+
+// The counters of a delta may wrap around; adding it to a full commitment brings them back into range.
+void CUTXOCommitment::RemoveCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    HashCoin(muhash, outpoint, coin, true);
+    nTransactionOutputs--;
+    nBogoSize -= BogoSize(coin);
+    nTotalAmount -= coin.out.nValue;
+}
+
+void CUTXOCommitment::ConnectBlock(const CBlock& block, const CBlockUndo& blockundo, int nHeight)
+{
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            if (tx.vout[j].scriptPubKey.IsUnspendable()) continue;
+            AddCoin(COutPoint(tx.GetHash(), j), Coin(tx.vout[j], nHeight, tx.IsCoinBase()));
+        }
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (size_t j = 0; j < tx.vin.size(); j++) {
+                RemoveCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+            }
+        }
+    }
+}
+
+CUTXOCommitment& CUTXOCommitment::operator+=(const CUTXOCommitment& other)
+{
+    muhash *= other.muhash;
+    nTransactionOutputs += other.nTransactionOutputs;
+    nBogoSize += other.nBogoSize;
+    nTotalAmount += other.nTotalAmount;
+    return *this;
+}
+
+uint256 CUTXOCommitment::GetHash() const
+{
+    uint256 hash;
+    muhash.Finalize(hash.begin());
+    return hash;
+}
+
+bool ComputeUTXOCommitment(const std::vector<std::unique_ptr<CCoinsViewCursor>>& cursors, CUTXOCommitment& commitment)
+{
+    std::vector<CUTXOCommitment> partial(cursors.size());
+    std::atomic<bool> fFailed(false);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cursors.size(); i++) {
+        CCoinsViewCursor* cursor = cursors[i].get();
+        CUTXOCommitment* result = &partial[i];
+        threads.emplace_back([cursor, result, &fFailed]() {
+            RenameThread("myriadcoin-utxohash");
+            try {
+                while (cursor->Valid() && !fFailed) {
+                    COutPoint key;
+                    Coin coin;
+                    if (!cursor->GetKey(key) || !cursor->GetValue(coin)) {
+                        fFailed = error("ComputeUTXOCommitment: unable to read value");
+                        break;
+                    }
+                    result->AddCoin(key, coin);
+                    if (ShutdownRequested()) fFailed = true;
+                    cursor->Next();
+                }
+            } catch (const std::exception& e) {
+                fFailed = error("ComputeUTXOCommitment: %s", e.what());
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    if (fFailed) return false;
+
+    commitment = CUTXOCommitment();
+    for (const CUTXOCommitment& result : partial) {
+        commitment += result;
+    }
+    return true;
+}
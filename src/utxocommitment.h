@@ -0,0 +1,69 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOCOMMITMENT_H
+#define BITCOIN_UTXOCOMMITMENT_H
+
+#include <amount.h>
+#include <crypto/muhash.h>
+#include <serialize.h>
+#include <uint256.h>
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+class CCoinsViewCursor;
+class COutPoint;
+class Coin;
+
+/**
+ * A commitment to the UTXO set that can be updated one coin at a time:
+ * a MuHash3072 of the serialized coins together with the statistics
+ * gettxoutsetinfo reports. Since the hash is order independent, it can be
+ * maintained while blocks are connected and disconnected, and the same
+ * value results from hashing a full scan of the chainstate.
+ */
+class CUTXOCommitment
+{
+public:
+    MuHash3072 muhash;
+    uint64_t nTransactionOutputs;
+    uint64_t nBogoSize;
+    CAmount nTotalAmount;
+
+    CUTXOCommitment() : nTransactionOutputs(0), nBogoSize(0), nTotalAmount(0) {}
+
+    void AddCoin(const COutPoint& outpoint, const Coin& coin);
+    void RemoveCoin(const COutPoint& outpoint, const Coin& coin);
+
+    /** Apply the UTXO set changes of connecting a block, given the coins it spent. */
+    void ConnectBlock(const CBlock& block, const CBlockUndo& blockundo, int nHeight);
+
+    /** Merge the changes recorded in another commitment (e.g. a per-block delta) into this one. */
+    CUTXOCommitment& operator+=(const CUTXOCommitment& other);
+
+    uint256 GetHash() const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(muhash);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nBogoSize);
+        READWRITE(nTotalAmount);
+    }
+};
+
+/**
+ * Hash every coin the given cursors yield, walking each cursor on its own
+ * thread. The cursors must cover disjoint parts of the UTXO set, such as
+ * the ranges returned by CCoinsViewDB::CursorRanges().
+ */
+bool ComputeUTXOCommitment(const std::vector<std::unique_ptr<CCoinsViewCursor>>& cursors, CUTXOCommitment& commitment);
+
+#endif // BITCOIN_UTXOCOMMITMENT_H
@@ -7,6 +7,7 @@
 
 #include <arith_uint256.h>
 #include <auxpow.h>
+#include <blockfilewriter.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
@@ -17,7 +18,9 @@
 #include <consensus/validation.h>
 #include <cuckoocache.h>
 #include <hash.h>
+#include <headercache.h>
 #include <index/txindex.h>
+#include <mempooljournal.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
 #include <policy/rbf.h>
@@ -36,12 +39,14 @@
 #include <txmempool.h>
 #include <ui_interface.h>
 #include <undo.h>
+#include <utxocommitment.h>
 #include <util/system.h>
 #include <util/moneystr.h>
 #include <util/strencodings.h>
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <algorithm>
 #include <future>
 #include <sstream>
 
@@ -156,6 +161,19 @@ public:
     BlockMap mapBlockIndex GUARDED_BY(cs_main);
     std::multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
     CBlockIndex *pindexBestInvalid = nullptr;
+    //! Block the chainstate was bootstrapped at with a UTXO snapshot, if any. Blocks at and below it have no data.
+    CBlockIndex* pindexSnapshotBase = nullptr;
+
+    //! Rolling commitment to the coins in pcoinsTip, valid if m_utxo_commitment_known
+    CUTXOCommitment m_utxo_commitment GUARDED_BY(cs_main);
+    //! Best block of the coins m_utxo_commitment describes (null for the empty set before genesis)
+    uint256 m_utxo_commitment_block GUARDED_BY(cs_main);
+    bool m_utxo_commitment_known GUARDED_BY(cs_main) = true;
+
+    /** Pick up the commitment stored with the coins database, if it matches pcoinsTip. */
+    void LoadUTXOCommitment() EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    /** Apply the changes of a block (dis)connected on top of hashFrom to the rolling commitment. */
+    void UpdateUTXOCommitment(const uint256& hashFrom, const uint256& hashTo, const CUTXOCommitment& delta) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     bool LoadBlockIndex(const Consensus::Params& consensus_params, CBlockTreeDB& blocktree) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
@@ -169,9 +187,10 @@ public:
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     // Block (dis)connection on a given view:
-    DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view);
+    // If pcommitment is given, the changes to the UTXO set are recorded in it.
+    DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, CUTXOCommitment* pcommitment = nullptr);
     bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                      CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+                      CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false, CUTXOCommitment* pcommitment = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     // Block disconnection on our pcoinsTip:
     bool DisconnectTip(CValidationState& state, const CChainParams& chainparams, DisconnectedBlockTransactions* disconnectpool) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
@@ -184,6 +203,7 @@ public:
     bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
     bool RewindBlockIndex(const CChainParams& params);
     bool LoadGenesisBlock(const CChainParams& chainparams);
+    bool ActivateSnapshot(const CChainParams& chainparams, CBlockIndex* pindex, unsigned int nChainTx, std::string& strError) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     void PruneBlockIndexCandidates();
 
@@ -239,6 +259,7 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+bool fMaintainUTXOCommitment = DEFAULT_UTXO_COMMITMENT;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -459,6 +480,46 @@ static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
         pcoinsTip->Uncache(removed);
 }
 
+/**
+ * Trim the mempool from acceptance only once it is past the hard cap of
+ * -maxmempool. Below that, it is kept in check by TrimMempool() from the
+ * scheduler, so a burst of transactions does not pay for eviction one by one.
+ */
+static void LimitMempoolSizeIfFull(CTxMemPool& pool)
+{
+    const size_t nMaxMempool = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    if (pool.DynamicMemoryUsage() > nMaxMempool) {
+        LimitMempoolSize(pool, nMaxMempool, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    }
+}
+
+void TrimMempool(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    const size_t nHigh = limit / 100 * MEMPOOL_TRIM_HIGH_PERCENT;
+    const size_t nLow = limit / 100 * MEMPOOL_TRIM_LOW_PERCENT;
+    {
+        LOCK(cs_main);
+        int expired = pool.Expire(GetTime() - age);
+        if (expired != 0) {
+            LogPrint(BCLog::MEMPOOL, "Expired %i transactions from the memory pool\n", expired);
+        }
+        if (pool.DynamicMemoryUsage() <= nHigh) return;
+    }
+
+    // Evict a step at a time, letting acceptance and block connection in between
+    while (!ShutdownRequested()) {
+        LOCK(cs_main);
+        const size_t nUsage = pool.DynamicMemoryUsage();
+        if (nUsage <= nLow) break;
+        std::vector<COutPoint> vNoSpendsRemaining;
+        pool.TrimToSize(nUsage > nLow + MEMPOOL_TRIM_STEP ? nUsage - MEMPOOL_TRIM_STEP : nLow, &vNoSpendsRemaining);
+        for (const COutPoint& removed : vNoSpendsRemaining)
+            pcoinsTip->Uncache(removed);
+        // The indexes of an emptied mempool keep their memory
+        if (pool.DynamicMemoryUsage() >= nUsage) break;
+    }
+}
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state)
 {
@@ -568,17 +629,29 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
     return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
 }
 
-static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
-                              bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache, bool test_accept) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+/** What PreScriptChecks() learnt about a transaction that AcceptToMemoryPoolWorker goes on to use */
+struct PreScriptCheckResult
 {
-    const CTransaction& tx = *ptx;
-    const uint256 hash = tx.GetHash();
-    AssertLockHeld(cs_main);
-    LOCK(pool.cs); // mempool "read lock" (held through GetMainSignals().TransactionAddedToMempool())
-    if (pfMissingInputs) {
-        *pfMissingInputs = false;
-    }
+    std::set<uint256> setConflicts;
+    LockPoints lp;
+    CAmount nFees = 0;
+    CAmount nModifiedFees = 0;
+    int64_t nSigOpsCost = 0;
+};
+
+/**
+ * The checks AcceptToMemoryPoolWorker makes on a transaction before it verifies its scripts:
+ * consensus and standardness rules, conflicts, inputs, sequence locks, sigops and the fee
+ * floors. Inputs are looked up through view, which must have the mempool behind it.
+ * Conflicts with replaceable mempool transactions are collected in result unless
+ * !fAllowReplacement. Sequence locks are skipped (!fCheckSequenceLocks) when the parents
+ * are yet to be added to the mempool, and the fee floors (!fCheckFees) when the fees are
+ * checked elsewhere.
+ */
+static bool PreScriptChecks(const CTxMemPool& pool, CValidationState& state, const CTransaction& tx, CCoinsViewCache& view, bool fAllowReplacement, bool fCheckSequenceLocks, bool fCheckFees,
+                            bool* pfMissingInputs, std::vector<COutPoint>& coins_to_uncache, PreScriptCheckResult& result) EXCLUSIVE_LOCKS_REQUIRED(cs_main, pool.cs)
+{
+    const uint256& hash = tx.GetHash();
 
     if (!CheckTransaction(tx, state))
         return false; // state filled in by CheckTransaction
@@ -610,12 +683,11 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
     }
 
     // Check for conflicts with in-memory transactions
-    std::set<uint256> setConflicts;
     for (const CTxIn &txin : tx.vin)
     {
         const CTransaction* ptxConflicting = pool.GetConflictTx(txin.prevout);
         if (ptxConflicting) {
-            if (!setConflicts.count(ptxConflicting->GetHash()))
+            if (!result.setConflicts.count(ptxConflicting->GetHash()))
             {
                 // Allow opt-out of transaction replacement by setting
                 // nSequence > MAX_BIP125_RBF_SEQUENCE (SEQUENCE_FINAL-2) on all inputs.
@@ -630,7 +702,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                 // unconfirmed ancestors anyway; doing otherwise is hopelessly
                 // insecure.
                 bool fReplacementOptOut = true;
-                if (fEnableReplacement)
+                if (fAllowReplacement && fEnableReplacement)
                 {
                     for (const CTxIn &_txin : ptxConflicting->vin)
                     {
@@ -645,72 +717,117 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                     return state.Invalid(false, REJECT_DUPLICATE, "txn-mempool-conflict");
                 }
 
-                setConflicts.insert(ptxConflicting->GetHash());
+                result.setConflicts.insert(ptxConflicting->GetHash());
             }
         }
     }
 
+    // do all inputs exist?
+    for (const CTxIn& txin : tx.vin) {
+        if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+            coins_to_uncache.push_back(txin.prevout);
+        }
+        if (!view.HaveCoin(txin.prevout)) {
+            // Are inputs missing because we already have the tx?
+            for (size_t out = 0; out < tx.vout.size(); out++) {
+                // Optimistically just do efficient check of cache for outputs
+                if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out))) {
+                    return state.Invalid(false, REJECT_DUPLICATE, "txn-already-known");
+                }
+            }
+            // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
+            if (pfMissingInputs) {
+                *pfMissingInputs = true;
+            }
+            return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
+        }
+    }
+
+    // Bring the best block into scope
+    view.GetBestBlock();
+
+    // Only accept BIP68 sequence locked transactions that can be mined in the next
+    // block; we don't want our mempool filled up with transactions that can't
+    // be mined yet.
+    // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
+    // CoinsViewCache instead of create its own
+    if (fCheckSequenceLocks && !CheckSequenceLocks(pool, tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &result.lp))
+        return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
+
+    if (!Consensus::CheckTxInputs(tx, state, view, GetSpendHeight(view), result.nFees)) {
+        return error("%s: Consensus::CheckTxInputs: %s, %s", __func__, tx.GetHash().ToString(), FormatStateMessage(state));
+    }
+
+    // Check for non-standard pay-to-script-hash in inputs
+    if (fRequireStandard && !AreInputsStandard(tx, view))
+        return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
+
+    // Check for non-standard witness in P2WSH
+    if (tx.HasWitness() && fRequireStandard && !IsWitnessStandard(tx, view))
+        return state.DoS(0, false, REJECT_NONSTANDARD, "bad-witness-nonstandard", true);
+
+    const int64_t nSigOpsCost = GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS);
+    result.nSigOpsCost = nSigOpsCost;
+
+    // nModifiedFees includes any fee deltas from PrioritiseTransaction
+    CAmount nModifiedFees = result.nFees;
+    pool.ApplyDelta(hash, nModifiedFees);
+    result.nModifiedFees = nModifiedFees;
+    const int64_t nSize = GetVirtualTransactionSize(tx, nSigOpsCost);
+
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
+    // merely non-standard transaction.
+    if (nSigOpsCost > MAX_STANDARD_TX_SIGOPS_COST)
+        return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
+            strprintf("%d", nSigOpsCost));
+
+    CAmount mempoolRejectFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+    if (fCheckFees && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nModifiedFees, mempoolRejectFee));
+    }
+
+    // No transactions are allowed below minRelayTxFee except from disconnected blocks
+    if (fCheckFees && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met", false, strprintf("%d < %d", nModifiedFees, ::minRelayTxFee.GetFee(nSize)));
+    }
+
+    return true;
+}
+
+static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
+                              bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache, bool test_accept) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const CTransaction& tx = *ptx;
+    const uint256 hash = tx.GetHash();
+    AssertLockHeld(cs_main);
+    LOCK(pool.cs); // mempool "read lock" (held through GetMainSignals().TransactionAddedToMempool())
+    if (pfMissingInputs) {
+        *pfMissingInputs = false;
+    }
+
     {
         CCoinsView dummy;
         CCoinsViewCache view(&dummy);
 
-        LockPoints lp;
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
         view.SetBackend(viewMemPool);
 
-        // do all inputs exist?
-        for (const CTxIn& txin : tx.vin) {
-            if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
-                coins_to_uncache.push_back(txin.prevout);
-            }
-            if (!view.HaveCoin(txin.prevout)) {
-                // Are inputs missing because we already have the tx?
-                for (size_t out = 0; out < tx.vout.size(); out++) {
-                    // Optimistically just do efficient check of cache for outputs
-                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out))) {
-                        return state.Invalid(false, REJECT_DUPLICATE, "txn-already-known");
-                    }
-                }
-                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
-                if (pfMissingInputs) {
-                    *pfMissingInputs = true;
-                }
-                return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
-            }
+        PreScriptCheckResult checked;
+        if (!PreScriptChecks(pool, state, tx, view, true /* fAllowReplacement */, true /* fCheckSequenceLocks */, !bypass_limits /* fCheckFees */,
+                             pfMissingInputs, coins_to_uncache, checked)) {
+            return false; // state filled in by PreScriptChecks
         }
 
-        // Bring the best block into scope
-        view.GetBestBlock();
-
         // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
         view.SetBackend(dummy);
 
-        // Only accept BIP68 sequence locked transactions that can be mined in the next
-        // block; we don't want our mempool filled up with transactions that can't
-        // be mined yet.
-        // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
-        // CoinsViewCache instead of create its own
-        if (!CheckSequenceLocks(pool, tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
-            return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
-
-        CAmount nFees = 0;
-        if (!Consensus::CheckTxInputs(tx, state, view, GetSpendHeight(view), nFees)) {
-            return error("%s: Consensus::CheckTxInputs: %s, %s", __func__, tx.GetHash().ToString(), FormatStateMessage(state));
-        }
-
-        // Check for non-standard pay-to-script-hash in inputs
-        if (fRequireStandard && !AreInputsStandard(tx, view))
-            return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
-
-        // Check for non-standard witness in P2WSH
-        if (tx.HasWitness() && fRequireStandard && !IsWitnessStandard(tx, view))
-            return state.DoS(0, false, REJECT_NONSTANDARD, "bad-witness-nonstandard", true);
-
-        int64_t nSigOpsCost = GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS);
-
-        // nModifiedFees includes any fee deltas from PrioritiseTransaction
-        CAmount nModifiedFees = nFees;
-        pool.ApplyDelta(hash, nModifiedFees);
+        const std::set<uint256>& setConflicts = checked.setConflicts;
+        const CAmount nFees = checked.nFees;
+        const CAmount nModifiedFees = checked.nModifiedFees;
 
         // Keep track of transactions that spend a coinbase, which we re-scan
         // during reorgs to ensure COINBASE_MATURITY is still met.
@@ -724,28 +841,9 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         }
 
         CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, chainActive.Height(),
-                              fSpendsCoinbase, nSigOpsCost, lp);
+                              fSpendsCoinbase, checked.nSigOpsCost, checked.lp);
         unsigned int nSize = entry.GetTxSize();
 
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
-        // merely non-standard transaction.
-        if (nSigOpsCost > MAX_STANDARD_TX_SIGOPS_COST)
-            return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
-                strprintf("%d", nSigOpsCost));
-
-        CAmount mempoolRejectFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
-        if (!bypass_limits && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nModifiedFees, mempoolRejectFee));
-        }
-
-        // No transactions are allowed below minRelayTxFee except from disconnected blocks
-        if (!bypass_limits && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met", false, strprintf("%d < %d", nModifiedFees, ::minRelayTxFee.GetFee(nSize)));
-        }
-
         if (nAbsurdFee && nFees > nAbsurdFee)
             return state.Invalid(false,
                 REJECT_HIGHFEE, "absurdly-high-fee",
@@ -965,7 +1063,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 
         // trim mempool and check if tx was trimmed
         if (!bypass_limits) {
-            LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            LimitMempoolSizeIfFull(pool);
             if (!pool.exists(hash))
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
         }
@@ -1128,6 +1226,9 @@ static bool ReadBlockOrHeader(T& block, const CDiskBlockPos& pos, const Consensu
 {
     block.SetNull();
 
+    // The block may still be queued for writing
+    g_block_file_writer.WaitForFile(pos.nFile);
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1183,6 +1284,8 @@ bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CBlockIndex* pindex, con
 
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start)
 {
+    g_block_file_writer.WaitForFile(pos.nFile);
+
     CDiskBlockPos hpos = pos;
     hpos.nPos -= 8; // Seek back 8 bytes for meta header
     CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
@@ -1449,6 +1552,21 @@ void InitScriptExecutionCache() {
             (nElems*sizeof(uint256)) >>20, (nMaxCacheSize*2)>>20, nElems);
 }
 
+void GetScriptExecutionCacheEntries(uint256& nonce, std::vector<uint256>& entries)
+{
+    AssertLockHeld(cs_main);
+    nonce = scriptExecutionCacheNonce;
+    scriptExecutionCache.get_live(entries);
+}
+
+void LoadScriptExecutionCacheEntries(const uint256& nonce, const std::vector<uint256>& entries)
+{
+    AssertLockHeld(cs_main);
+    scriptExecutionCacheNonce = nonce;
+    for (const uint256& entry : entries)
+        scriptExecutionCache.insert(entry);
+}
+
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set.
@@ -1494,6 +1612,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
                 return true;
             }
+            // Only transactions whose scripts are run pay for hashing them in bulk
+            txdata.PrecomputeLegacy(tx);
 
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
@@ -1582,6 +1702,9 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
         return error("%s: no undo data available", __func__);
     }
 
+    // The undo data may still be queued for writing
+    g_block_file_writer.WaitForFile(pos.nFile);
+
     // Open history file to read
     CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1662,7 +1785,7 @@ int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  When FAILED is returned, view is left in an indeterminate state. */
-DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view)
+DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, CUTXOCommitment* pcommitment)
 {
     bool fClean = true;
 
@@ -1693,6 +1816,7 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
                 if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != coin.nHeight || is_coinbase != coin.fCoinBase) {
                     fClean = false; // transaction output mismatch
                 }
+                if (is_spent && pcommitment) pcommitment->RemoveCoin(out, coin);
             }
         }
 
@@ -1708,6 +1832,8 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
                 int res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
                 if (res == DISCONNECT_FAILED) return DISCONNECT_FAILED;
                 fClean = fClean && res != DISCONNECT_UNCLEAN;
+                // Record the coin as restored (ApplyTxInUndo may have filled in its height)
+                if (pcommitment) pcommitment->AddCoin(out, view.AccessCoin(out));
             }
             // At this point, all of txundo.vprevout should have been moved out.
         }
@@ -1721,6 +1847,9 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
 
 void static FlushBlockFile(bool fFinalize = false)
 {
+    // Everything queued so far must hit the files before they are synced
+    g_block_file_writer.WaitForAll();
+
     LOCK(cs_LastBlockFile);
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
@@ -1749,18 +1878,30 @@ void static FlushBlockFile(bool fFinalize = false)
 
 static bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams)
+static bool WriteUndoDataForBlock(CBlockUndo&& blockundo, CValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams)
 {
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull()) {
         CDiskBlockPos _pos;
         if (!FindUndoPos(state, pindex->nFile, _pos, ::GetSerializeSize(blockundo, CLIENT_VERSION) + 40))
             return error("ConnectBlock(): FindUndoPos failed");
-        if (!UndoWriteToDisk(blockundo, _pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
-            return AbortNode(state, "Failed to write undo data");
+
+        // The actual write happens on the block file writer thread. Its
+        // position is already known: the data follows the 8-byte index header.
+        std::shared_ptr<const CBlockUndo> pblockundo = std::make_shared<const CBlockUndo>(std::move(blockundo));
+        const uint256 hashPrev = pindex->pprev->GetBlockHash();
+        g_block_file_writer.Enqueue(_pos.nFile, [pblockundo, _pos, hashPrev, &chainparams]() {
+            CDiskBlockPos pos = _pos;
+            try {
+                if (UndoWriteToDisk(*pblockundo, pos, hashPrev, chainparams.MessageStart())) return true;
+            } catch (const std::exception& e) {
+                LogPrintf("WriteUndoDataForBlock: %s\n", e.what());
+            }
+            return AbortNode("Failed to write undo data");
+        });
 
         // update nUndoPos in block index
-        pindex->nUndoPos = _pos.nPos;
+        pindex->nUndoPos = _pos.nPos + 8;
         pindex->nStatus |= BLOCK_HAVE_UNDO;
         setDirtyBlockIndex.insert(pindex);
     }
@@ -1775,6 +1916,263 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Look up the inputs of a group of transactions about to go through AcceptToMemoryPool and
+ * verify their scripts in parallel, leaving the signatures in the signature cache. Nothing
+ * is decided here: a transaction that fails is simply checked again (and rejected) later.
+ * Only transactions that pass every cheaper check first are verified, so that a peer cannot
+ * have us verify signatures of transactions AcceptToMemoryPool would turn down for free.
+ * Coins pulled into the coins cache are recorded per transaction in coins_to_uncache.
+ */
+static void PrevalidateMemPoolScripts(CTxMemPool& pool, const std::vector<MempoolAcceptBatchEntry>& entries, std::vector<std::vector<COutPoint>>& coins_to_uncache, bool fCheckFees) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    AssertLockHeld(cs_main);
+    LOCK(pool.cs);
+    CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
+    // Outputs of earlier transactions in the group are added to this view, so that chains of
+    // transactions relayed together are covered too.
+    CCoinsViewCache view(&viewMemPool);
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(entries.size());
+    std::vector<CScriptCheck> vChecks;
+    std::set<uint256> setSeen;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const CTransaction& tx = *entries[i].tx;
+        const uint256& hash = tx.GetHash();
+        if (!setSeen.insert(hash).second) continue;
+        // Sequence locks on the outputs of earlier transactions in the group are only
+        // evaluated once those are in the mempool
+        bool fSpendsGroup = false;
+        for (const CTxIn& txin : tx.vin) {
+            if (setSeen.count(txin.prevout.hash)) fSpendsGroup = true;
+        }
+        // Replacements are left to AcceptToMemoryPoolWorker
+        CValidationState state;
+        PreScriptCheckResult checked;
+        if (!PreScriptChecks(pool, state, tx, view, false /* fAllowReplacement */, !fSpendsGroup /* fCheckSequenceLocks */, fCheckFees,
+                             nullptr /* pfMissingInputs */, coins_to_uncache[i], checked)) {
+            continue;
+        }
+
+        txdata.emplace_back(tx);
+        CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, false, txdata.back(), &vChecks);
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            const COutPoint outpoint(hash, j);
+            if (!view.HaveCoinInCache(outpoint)) view.AddCoin(outpoint, Coin(tx.vout[j], MEMPOOL_HEIGHT, false), false);
+        }
+    }
+
+    // The queue stops at the first failing check, which is fine: the remaining
+    // scripts are verified when their transactions are accepted.
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<MempoolAcceptBatchEntry>& entries)
+{
+    AssertLockHeld(cs_main);
+    const CChainParams& chainparams = Params();
+    std::vector<std::vector<COutPoint>> coins_to_uncache(entries.size());
+    if (nScriptCheckThreads && entries.size() > 1) {
+        PrevalidateMemPoolScripts(pool, entries, coins_to_uncache, true /* fCheckFees */);
+    }
+
+    const int64_t nAcceptTime = GetTime();
+    for (size_t i = 0; i < entries.size(); i++) {
+        MempoolAcceptBatchEntry& entry = entries[i];
+        entry.fAccepted = AcceptToMemoryPoolWorker(chainparams, pool, entry.state, entry.tx, &entry.fMissingInputs, entry.nAcceptTime ? entry.nAcceptTime : nAcceptTime, &entry.lReplaced,
+                                                   false /* bypass_limits */, 0 /* nAbsurdFee */, coins_to_uncache[i], false /* test_accept */);
+        if (!entry.fAccepted) {
+            for (const COutPoint& outpoint : coins_to_uncache[i])
+                pcoinsTip->Uncache(outpoint);
+        }
+    }
+    // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FlushStateMode::PERIODIC);
+}
+
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, std::vector<MempoolAcceptBatchEntry>& entries, const CAmount nAbsurdFee)
+{
+    AssertLockHeld(cs_main);
+    const CChainParams& chainparams = Params();
+    if (entries.empty() || entries.size() > MAX_PACKAGE_COUNT)
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-bad-count");
+
+    // Check the shape of the package before looking anything up: no repeats,
+    // no two transactions spending the same output, and parents first.
+    std::set<uint256> setLater;
+    std::set<COutPoint> setSpent;
+    int64_t nTotalSize = 0;
+    for (MempoolAcceptBatchEntry& entry : entries) {
+        if (!CheckTransaction(*entry.tx, entry.state))
+            return state.DoS(0, false, REJECT_INVALID, "package-tx-invalid");
+        if (!setLater.insert(entry.tx->GetHash()).second)
+            return state.DoS(0, false, REJECT_INVALID, "package-duplicate-tx");
+        for (const CTxIn& txin : entry.tx->vin) {
+            if (!setSpent.insert(txin.prevout).second)
+                return state.DoS(0, false, REJECT_INVALID, "package-conflicting-txs");
+        }
+        nTotalSize += GetVirtualTransactionSize(*entry.tx);
+    }
+    if (nTotalSize > MAX_PACKAGE_SIZE)
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-too-large");
+    for (const MempoolAcceptBatchEntry& entry : entries) {
+        setLater.erase(entry.tx->GetHash());
+        for (const CTxIn& txin : entry.tx->vin) {
+            if (setLater.count(txin.prevout.hash))
+                return state.DoS(0, false, REJECT_INVALID, "package-not-sorted");
+        }
+    }
+
+    // Add up the fees of the transactions that are new, with their inputs looked up in
+    // the chain, the mempool and the package itself, and check them as one. Each new
+    // transaction's ancestors within the package (itself included) are tracked as well.
+    std::vector<std::vector<COutPoint>> coins_to_uncache(entries.size());
+    auto uncache = [&coins_to_uncache]() {
+        for (const std::vector<COutPoint>& vOutpoints : coins_to_uncache) {
+            for (const COutPoint& outpoint : vOutpoints)
+                pcoinsTip->Uncache(outpoint);
+        }
+    };
+    CAmount nPackageFees = 0;
+    int64_t nPackageSize = 0;
+    std::vector<size_t> vNew;
+    std::vector<CAmount> vFees(entries.size(), 0);
+    std::vector<int64_t> vSizes(entries.size(), 0);
+    std::vector<std::set<size_t>> vAncestors(entries.size());
+    std::map<uint256, size_t> mapNewIndex;
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
+        CCoinsViewCache view(&viewMemPool);
+        for (size_t i = 0; i < entries.size(); i++) {
+            const CTransaction& tx = *entries[i].tx;
+            const uint256& hash = tx.GetHash();
+            if (pool.exists(hash)) continue;
+            for (const CTxIn& txin : tx.vin) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                    coins_to_uncache[i].push_back(txin.prevout);
+                }
+                if (!view.HaveCoin(txin.prevout)) {
+                    entries[i].fMissingInputs = true;
+                    uncache();
+                    return state.DoS(0, false, REJECT_INVALID, "package-missing-inputs");
+                }
+                // Replacements would be lost if the package had to be rolled back
+                if (pool.GetConflictTx(txin.prevout)) {
+                    uncache();
+                    return state.DoS(0, false, REJECT_DUPLICATE, "package-mempool-conflict");
+                }
+                auto it = mapNewIndex.find(txin.prevout.hash);
+                if (it != mapNewIndex.end()) {
+                    vAncestors[i].insert(vAncestors[it->second].begin(), vAncestors[it->second].end());
+                }
+            }
+            vAncestors[i].insert(i);
+            mapNewIndex.emplace(hash, i);
+            vNew.push_back(i);
+            const CAmount nValueIn = view.GetValueIn(tx);
+            if (!MoneyRange(nValueIn) || nValueIn < tx.GetValueOut()) {
+                entries[i].state.DoS(100, false, REJECT_INVALID, "bad-txns-in-belowout");
+                uncache();
+                return state.DoS(0, false, REJECT_INVALID, "package-tx-invalid");
+            }
+            CAmount nModifiedFees = nValueIn - tx.GetValueOut();
+            pool.ApplyDelta(hash, nModifiedFees);
+            vFees[i] = nModifiedFees;
+            vSizes[i] = GetVirtualTransactionSize(tx);
+            nPackageFees += vFees[i];
+            nPackageSize += vSizes[i];
+            for (size_t j = 0; j < tx.vout.size(); j++) {
+                view.AddCoin(COutPoint(hash, j), Coin(tx.vout[j], MEMPOOL_HEIGHT, false), false);
+            }
+        }
+    }
+    if (nPackageSize == 0) {
+        return true;
+    }
+
+    const CFeeRate mempoolMinFeeRate = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    const CAmount mempoolRejectFee = mempoolMinFeeRate.GetFee(nPackageSize);
+    if (mempoolRejectFee > 0 && nPackageFees < mempoolRejectFee) {
+        uncache();
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package mempool min fee not met", false, strprintf("%d < %d", nPackageFees, mempoolRejectFee));
+    }
+    if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize)) {
+        uncache();
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package min relay fee not met", false, strprintf("%d < %d", nPackageFees, ::minRelayTxFee.GetFee(nPackageSize)));
+    }
+
+    // Fees only flow from children to their parents: a transaction is paid for if it is
+    // among the ancestors of a transaction whose ancestors in the package meet the floors.
+    std::vector<bool> vPaidFor(entries.size(), false);
+    for (size_t i : vNew) {
+        CAmount nAncestorFees = 0;
+        int64_t nAncestorSize = 0;
+        for (size_t j : vAncestors[i]) {
+            nAncestorFees += vFees[j];
+            nAncestorSize += vSizes[j];
+        }
+        if (nAncestorFees >= mempoolMinFeeRate.GetFee(nAncestorSize) && nAncestorFees >= ::minRelayTxFee.GetFee(nAncestorSize)) {
+            for (size_t j : vAncestors[i]) vPaidFor[j] = true;
+        }
+    }
+    for (size_t i : vNew) {
+        if (!vPaidFor[i]) {
+            uncache();
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package-fee-not-covered", false, entries[i].tx->GetHash().ToString());
+        }
+    }
+
+    if (nScriptCheckThreads && entries.size() > 1) {
+        PrevalidateMemPoolScripts(pool, entries, coins_to_uncache, false /* fCheckFees */);
+    }
+
+    // The package pays its way, so each transaction is accepted without the fee limits,
+    // and the mempool is trimmed once at the end. As nothing in the mempool conflicts with
+    // the package, rolling it back only removes its own transactions.
+    const int64_t nAcceptTime = GetTime();
+    std::vector<CTransactionRef> vAdded;
+    for (size_t i = 0; i < entries.size(); i++) {
+        MempoolAcceptBatchEntry& entry = entries[i];
+        if (pool.exists(entry.tx->GetHash())) continue;
+        entry.fAccepted = AcceptToMemoryPoolWorker(chainparams, pool, entry.state, entry.tx, &entry.fMissingInputs, entry.nAcceptTime ? entry.nAcceptTime : nAcceptTime, &entry.lReplaced,
+                                                   true /* bypass_limits */, nAbsurdFee, coins_to_uncache[i], false /* test_accept */);
+        if (!entry.fAccepted) {
+            state = entry.state;
+            break;
+        }
+        vAdded.push_back(entry.tx);
+    }
+    if (state.IsValid()) {
+        LimitMempoolSizeIfFull(pool);
+        for (const CTransactionRef& tx : vAdded) {
+            if (!pool.exists(tx->GetHash())) {
+                state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+                break;
+            }
+        }
+    }
+
+    if (!state.IsValid()) {
+        LOCK(pool.cs);
+        for (auto it = vAdded.rbegin(); it != vAdded.rend(); ++it) {
+            if (pool.exists((*it)->GetHash())) pool.removeRecursive(**it, MemPoolRemovalReason::UNKNOWN);
+        }
+        for (MempoolAcceptBatchEntry& entry : entries) {
+            entry.fAccepted = false;
+        }
+        uncache();
+    }
+    // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FlushStateMode::PERIODIC);
+    return state.IsValid();
+}
+
 VersionBitsCache versionbitscache GUARDED_BY(cs_main);
 
 int32_t ComputeBlockVersion(const CBlockIndex* pindexPrev, const Consensus::Params& params)
@@ -1898,7 +2296,7 @@ static int64_t nBlocksTotal = 0;
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
  *  can fail if those validity checks fail (among other reasons). */
 bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CUTXOCommitment* pcommitment)
 {
     AssertLockHeld(cs_main);
     assert(pindex);
@@ -2167,7 +2565,11 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     if (fJustCheck)
         return true;
 
-    if (!WriteUndoDataForBlock(blockundo, state, pindex, chainparams))
+    if (pcommitment) {
+        pcommitment->ConnectBlock(block, blockundo, pindex->nHeight);
+    }
+
+    if (!WriteUndoDataForBlock(std::move(blockundo), state, pindex, chainparams))
         return false;
 
     if (!pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
@@ -2252,6 +2654,9 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
+            // Never commit a block index that refers to data which failed to be written.
+            if (g_block_file_writer.HasFailed())
+                return state.Error("failed to write block or undo data");
             // Then update all block file information (which may refer to block and undo files).
             {
                 std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
@@ -2284,6 +2689,10 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
+            // Store the rolling UTXO set commitment atomically with the coins it describes.
+            if (g_chainstate.m_utxo_commitment_known && g_chainstate.m_utxo_commitment_block == pcoinsTip->GetBestBlock()) {
+                pcoinsdbview->SetCommitmentForNextWrite(g_chainstate.m_utxo_commitment_block, g_chainstate.m_utxo_commitment);
+            }
             // Flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return AbortNode(state, "Failed to write to coin database");
@@ -2418,10 +2827,12 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
     {
         CCoinsViewCache view(pcoinsTip.get());
         assert(view.GetBestBlock() == pindexDelete->GetBlockHash());
-        if (DisconnectBlock(block, pindexDelete, view) != DISCONNECT_OK)
+        CUTXOCommitment delta;
+        if (DisconnectBlock(block, pindexDelete, view, fMaintainUTXOCommitment ? &delta : nullptr) != DISCONNECT_OK)
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         bool flushed = view.Flush();
         assert(flushed);
+        UpdateUTXOCommitment(pindexDelete->GetBlockHash(), pindexDelete->pprev->GetBlockHash(), delta);
     }
     LogPrint(BCLog::BENCH, "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * MILLI);
     // Write the chain state to disk, if necessary.
@@ -2442,6 +2853,7 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
     }
 
     chainActive.SetTip(pindexDelete->pprev);
+    g_header_cache.BlockDisconnected(pindexDelete);
 
     UpdateTip(pindexDelete->pprev, chainparams);
     // Let wallets know transactions went from 1-confirmed to
@@ -2545,7 +2957,8 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
     LogPrint(BCLog::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * MILLI, nTimeReadFromDisk * MICRO);
     {
         CCoinsViewCache view(pcoinsTip.get());
-        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
+        CUTXOCommitment delta;
+        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams, false, fMaintainUTXOCommitment ? &delta : nullptr);
         GetMainSignals().BlockChecked(blockConnecting, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2556,6 +2969,7 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
         LogPrint(BCLog::BENCH, "  - Connect total: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime3 - nTime2) * MILLI, nTimeConnectTotal * MICRO, nTimeConnectTotal * MILLI / nBlocksTotal);
         bool flushed = view.Flush();
         assert(flushed);
+        UpdateUTXOCommitment(pindexNew->pprev ? pindexNew->pprev->GetBlockHash() : uint256(), pindexNew->GetBlockHash(), delta);
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint(BCLog::BENCH, "  - Flush: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime4 - nTime3) * MILLI, nTimeFlush * MICRO, nTimeFlush * MILLI / nBlocksTotal);
@@ -2566,9 +2980,11 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
     LogPrint(BCLog::BENCH, "  - Writing chainstate: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime5 - nTime4) * MILLI, nTimeChainState * MICRO, nTimeChainState * MILLI / nBlocksTotal);
     // Remove conflicting transactions from the mempool.;
     mempool.removeForBlock(blockConnecting.vtx, pindexNew->nHeight);
+    ::feeEstimator.SetBlockInterval(GetRecentBlockInterval(pindexNew, chainparams.GetConsensus()));
     disconnectpool.removeForBlock(blockConnecting.vtx);
     // Update chainActive & related variables.
     chainActive.SetTip(pindexNew);
+    g_header_cache.BlockConnected(pindexNew, blockConnecting);
     UpdateTip(pindexNew, chainparams);
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
@@ -3659,20 +4075,29 @@ bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidatio
 }
 
 /** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
-static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
-    unsigned int nBlockSize = ::GetSerializeSize(block, CLIENT_VERSION);
+static CDiskBlockPos SaveBlockToDisk(const std::shared_ptr<const CBlock>& pblock, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
+    unsigned int nBlockSize = ::GetSerializeSize(*pblock, CLIENT_VERSION);
     CDiskBlockPos blockPos;
     if (dbp != nullptr)
         blockPos = *dbp;
-    if (!FindBlockPos(blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != nullptr)) {
+    if (!FindBlockPos(blockPos, nBlockSize+8, nHeight, pblock->GetBlockTime(), dbp != nullptr)) {
         error("%s: FindBlockPos failed", __func__);
         return CDiskBlockPos();
     }
     if (dbp == nullptr) {
-        if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart())) {
-            AbortNode("Failed to write block");
-            return CDiskBlockPos();
-        }
+        // Written on the block file writer thread; the data follows the
+        // 8-byte index header at the position FindBlockPos handed out.
+        const CDiskBlockPos writePos = blockPos;
+        g_block_file_writer.Enqueue(writePos.nFile, [pblock, writePos, &chainparams]() {
+            CDiskBlockPos pos = writePos;
+            try {
+                if (WriteBlockToDisk(*pblock, pos, chainparams.MessageStart())) return true;
+            } catch (const std::exception& e) {
+                LogPrintf("SaveBlockToDisk: %s\n", e.what());
+            }
+            return AbortNode("Failed to write block");
+        });
+        blockPos.nPos += 8;
     }
     return blockPos;
 }
@@ -3740,7 +4165,7 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
     // Write block to history file
     if (fNewBlock) *fNewBlock = true;
     try {
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, pindex->nHeight, chainparams, dbp);
+        CDiskBlockPos blockPos = SaveBlockToDisk(pblock, pindex->nHeight, chainparams, dbp);
         if (blockPos.IsNull()) {
             state.Error(strprintf("%s: Failed to find position to write new block to disk", __func__));
             return false;
@@ -4054,6 +4479,10 @@ bool CChainState::LoadBlockIndex(const Consensus::Params& consensus_params, CBlo
     if (!blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }))
         return false;
 
+    uint256 hashSnapshotBase;
+    unsigned int nSnapshotChainTx = 0;
+    blocktree.ReadSnapshotBase(hashSnapshotBase, nSnapshotChainTx);
+
     // Calculate nChainWork
     std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
@@ -4082,6 +4511,11 @@ bool CChainState::LoadBlockIndex(const Consensus::Params& consensus_params, CBlo
                 pindex->nChainTx = pindex->nTx;
             }
         }
+        if (!hashSnapshotBase.IsNull() && pindex->GetBlockHash() == hashSnapshotBase) {
+            // The snapshot base has no block data, but its descendants can be linked to it
+            pindex->nChainTx = nSnapshotChainTx;
+            pindexSnapshotBase = pindex;
+        }
         if (!(pindex->nStatus & BLOCK_FAILED_MASK) && pindex->pprev && (pindex->pprev->nStatus & BLOCK_FAILED_MASK)) {
             pindex->nStatus |= BLOCK_FAILED_CHILD;
             setDirtyBlockIndex.insert(pindex);
@@ -4158,6 +4592,8 @@ bool LoadChainTip(const CChainParams& chainparams)
 
     if (chainActive.Tip() && chainActive.Tip()->GetBlockHash() == pcoinsTip->GetBestBlock()) return true;
 
+    g_chainstate.LoadUTXOCommitment();
+
     if (pcoinsTip->GetBestBlock().IsNull() && mapBlockIndex.size() == 1) {
         // In case we just added the genesis block, connect it now, so
         // that we always have a chainActive.Tip() when we return.
@@ -4185,6 +4621,99 @@ bool LoadChainTip(const CChainParams& chainparams)
     return true;
 }
 
+void CChainState::LoadUTXOCommitment()
+{
+    m_utxo_commitment = CUTXOCommitment();
+    m_utxo_commitment_block = pcoinsTip->GetBestBlock();
+    m_utxo_commitment_known = fMaintainUTXOCommitment;
+    if (!fMaintainUTXOCommitment || m_utxo_commitment_block.IsNull()) return;
+
+    uint256 hashBlock;
+    if (!pcoinsdbview->ReadCommitment(hashBlock, m_utxo_commitment) || hashBlock != m_utxo_commitment_block) {
+        LogPrintf("%s: no UTXO set commitment stored for the best block, it will be computed on first use\n", __func__);
+        m_utxo_commitment_known = false;
+    }
+}
+
+void CChainState::UpdateUTXOCommitment(const uint256& hashFrom, const uint256& hashTo, const CUTXOCommitment& delta)
+{
+    if (!fMaintainUTXOCommitment || !m_utxo_commitment_known) return;
+    if (m_utxo_commitment_block != hashFrom) {
+        // The coins were changed behind our back (e.g. replayed after a crash)
+        m_utxo_commitment_known = false;
+        return;
+    }
+    m_utxo_commitment += delta;
+    m_utxo_commitment_block = hashTo;
+}
+
+bool GetUTXOCommitment(CUTXOCommitment& commitment, uint256& hashBlock)
+{
+    LOCK(cs_main);
+    if (!fMaintainUTXOCommitment || !g_chainstate.m_utxo_commitment_known || !chainActive.Tip() || g_chainstate.m_utxo_commitment_block != chainActive.Tip()->GetBlockHash()) {
+        return false;
+    }
+    commitment = g_chainstate.m_utxo_commitment;
+    hashBlock = g_chainstate.m_utxo_commitment_block;
+    return true;
+}
+
+void SeedUTXOCommitment(const CUTXOCommitment& commitment, const uint256& hashBlock)
+{
+    LOCK(cs_main);
+    if (!fMaintainUTXOCommitment || g_chainstate.m_utxo_commitment_known) return;
+    if (!chainActive.Tip() || chainActive.Tip()->GetBlockHash() != hashBlock || pcoinsTip->GetBestBlock() != hashBlock) return;
+    g_chainstate.m_utxo_commitment = commitment;
+    g_chainstate.m_utxo_commitment_block = hashBlock;
+    g_chainstate.m_utxo_commitment_known = true;
+}
+
+bool CChainState::ActivateSnapshot(const CChainParams& chainparams, CBlockIndex* pindex, unsigned int nChainTx, std::string& strError)
+{
+    AssertLockHeld(cs_main);
+
+    // The coins database now describes the state after pindex. Treat the
+    // block as fully validated so blocks on top of it can be connected.
+    pindex->nChainTx = nChainTx;
+    pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+    setDirtyBlockIndex.insert(pindex);
+    if (!pblocktree->WriteSnapshotBase(pindex->GetBlockHash(), nChainTx)) {
+        strError = "Failed to write to the block index database";
+        return false;
+    }
+    pindexSnapshotBase = pindex;
+    setBlockIndexCandidates.insert(pindex);
+
+    // Transactions in the mempool were validated against the old (genesis) chainstate
+    mempool.clear();
+    g_header_cache.Clear();
+    pcoinsTip->SetBestBlock(pindex->GetBlockHash());
+    if (!LoadChainTip(chainparams)) {
+        strError = "Failed to activate the snapshot base block";
+        return false;
+    }
+    UpdateTip(pindex, chainparams);
+    GetMainSignals().UpdatedBlockTip(pindex, chainActive.Genesis(), IsInitialBlockDownload());
+
+    CValidationState state;
+    if (!FlushStateToDisk(chainparams, state, FlushStateMode::ALWAYS)) {
+        strError = FormatStateMessage(state);
+        return false;
+    }
+    return true;
+}
+
+bool ActivateUTXOSnapshot(CBlockIndex* pindex, unsigned int nChainTx, std::string& strError)
+{
+    return g_chainstate.ActivateSnapshot(Params(), pindex, nChainTx, strError);
+}
+
+bool IsUsingUTXOSnapshot()
+{
+    LOCK(cs_main);
+    return g_chainstate.pindexSnapshotBase != nullptr;
+}
+
 CVerifyDB::CVerifyDB()
 {
     uiInterface.ShowProgress(_("Verifying blocks..."), 0, false);
@@ -4229,6 +4758,11 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
             LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
             break;
         }
+        if (g_chainstate.pindexSnapshotBase && pindex->nHeight <= g_chainstate.pindexSnapshotBase->nHeight) {
+            // Blocks below a UTXO snapshot were never downloaded.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (UTXO snapshot base)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
@@ -4443,6 +4977,8 @@ bool CChainState::RewindBlockIndex(const CChainParams& params)
     int nHeight = 1;
     {
         LOCK(cs_main);
+        // Blocks up to a UTXO snapshot base were not validated by us and can't be re-downloaded into place
+        if (pindexSnapshotBase) nHeight = pindexSnapshotBase->nHeight + 1;
         while (nHeight <= chainActive.Height()) {
             // Although SCRIPT_VERIFY_WITNESS is now generally enforced on all
             // blocks in ConnectBlock, we don't need to go back and
@@ -4536,6 +5072,10 @@ bool RewindBlockIndex(const CChainParams& params) {
 
 void CChainState::UnloadBlockIndex() {
     nBlockSequenceId = 1;
+    pindexSnapshotBase = nullptr;
+    m_utxo_commitment = CUTXOCommitment();
+    m_utxo_commitment_block.SetNull();
+    m_utxo_commitment_known = true;
     m_failed_blocks.clear();
     setBlockIndexCandidates.clear();
 }
@@ -4547,6 +5087,7 @@ void UnloadBlockIndex()
 {
     LOCK(cs_main);
     chainActive.SetTip(nullptr);
+    g_header_cache.Clear();
     pindexBestInvalid = nullptr;
     pindexBestHeader = nullptr;
     mempool.clear();
@@ -4604,7 +5145,7 @@ bool CChainState::LoadGenesisBlock(const CChainParams& chainparams)
 
     try {
         const CBlock& block = chainparams.GenesisBlock();
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, 0, chainparams, nullptr);
+        CDiskBlockPos blockPos = SaveBlockToDisk(std::make_shared<const CBlock>(block), 0, chainparams, nullptr);
         if (blockPos.IsNull())
             return error("%s: writing genesis block to disk failed", __func__);
         CBlockIndex *pindex = AddToBlockIndex(block);
@@ -4751,6 +5292,12 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
 
     LOCK(cs_main);
 
+    // The invariants below assume every block in the active chain was
+    // downloaded, which does not hold for a chainstate loaded from a snapshot.
+    if (pindexSnapshotBase) {
+        return;
+    }
+
     // During a reindex, we read the genesis block and call CheckBlockIndex before ActivateBestChain,
     // so we have the genesis block in mapBlockIndex but no active chain.  (A few of the tests when
     // iterating the block tree require that chainActive has been initialized.)
@@ -4958,10 +5505,11 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
 }
 
 static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Number of transactions from disk that are validated together while loading the mempool */
+static const size_t MEMPOOL_LOAD_BATCH = 256;
 
 bool LoadMempool()
 {
-    const CChainParams& chainparams = Params();
     int64_t nExpiryTimeout = gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
     FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat", "rb");
     CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
@@ -4976,6 +5524,10 @@ bool LoadMempool()
     int64_t already_there = 0;
     int64_t nNow = GetTime();
 
+    // Transactions are dumped parents first and journaled in the order they
+    // were accepted, so they can be validated in batches as they come.
+    std::vector<CMempoolJournal::Entry> vTx;
+    std::map<uint256, CAmount> mapDeltas;
     try {
         uint64_t version;
         file >> version;
@@ -4996,42 +5548,63 @@ bool LoadMempool()
             if (amountdelta) {
                 mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, nTime,
-                                           nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */,
-                                           false /* test_accept */);
-                if (state.IsValid()) {
-                    ++count;
-                } else {
-                    // mempool may contain the transaction already, e.g. from
-                    // wallet(s) having loaded it while we were processing
-                    // mempool transactions; consider these as valid, instead of
-                    // failed, but mark them as 'already there'
-                    if (mempool.exists(tx->GetHash())) {
-                        ++already_there;
-                    } else {
-                        ++failed;
-                    }
-                }
-            } else {
-                ++expired;
-            }
-            if (ShutdownRequested())
-                return false;
+            vTx.push_back(CMempoolJournal::Entry{tx, nTime});
         }
-        std::map<uint256, CAmount> mapDeltas;
         file >> mapDeltas;
-
-        for (const auto& i : mapDeltas) {
-            mempool.PrioritiseTransaction(i.first, i.second);
-        }
     } catch (const std::exception& e) {
         LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
         return false;
     }
 
+    // Replay the changes made after the dump
+    std::vector<CMempoolJournal::Entry> vJournalAdded;
+    std::set<uint256> setJournalRemoved;
+    if (ReadMempoolJournal(GetDataDir() / "mempool.journal", vJournalAdded, setJournalRemoved)) {
+        LogPrintf("Read mempool journal: %u transactions added, %u removed since the last dump\n", vJournalAdded.size(), setJournalRemoved.size());
+        vTx.erase(std::remove_if(vTx.begin(), vTx.end(), [&](const CMempoolJournal::Entry& entry) {
+            return setJournalRemoved.count(entry.tx->GetHash()) > 0;
+        }), vTx.end());
+        vTx.insert(vTx.end(), vJournalAdded.begin(), vJournalAdded.end());
+    }
+
+    std::vector<MempoolAcceptBatchEntry> batch;
+    for (size_t i = 0; i < vTx.size(); i++) {
+        if (vTx[i].nTime + nExpiryTimeout > nNow) {
+            batch.emplace_back(vTx[i].tx);
+            batch.back().nAcceptTime = vTx[i].nTime;
+        } else {
+            ++expired;
+        }
+        if (batch.size() < MEMPOOL_LOAD_BATCH && i + 1 < vTx.size()) continue;
+
+        {
+            LOCK(cs_main);
+            AcceptToMemoryPoolBatch(mempool, batch);
+        }
+        for (const MempoolAcceptBatchEntry& entry : batch) {
+            if (entry.fAccepted) {
+                ++count;
+            } else {
+                // mempool may contain the transaction already, e.g. from
+                // wallet(s) having loaded it while we were processing
+                // mempool transactions; consider these as valid, instead of
+                // failed, but mark them as 'already there'
+                if (mempool.exists(entry.tx->GetHash())) {
+                    ++already_there;
+                } else {
+                    ++failed;
+                }
+            }
+        }
+        batch.clear();
+        if (ShutdownRequested())
+            return false;
+    }
+
+    for (const auto& i : mapDeltas) {
+        mempool.PrioritiseTransaction(i.first, i.second);
+    }
+
     LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there\n", count, failed, expired, already_there);
     return true;
 }
@@ -5052,6 +5625,7 @@ bool DumpMempool()
             mapDeltas[i.first] = i.second;
         }
         vinfo = mempool.infoAll();
+        if (g_mempool_journal) g_mempool_journal->DumpStarted();
     }
 
     int64_t mid = GetTimeMicros();
@@ -5059,6 +5633,7 @@ bool DumpMempool()
     try {
         FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat.new", "wb");
         if (!filestr) {
+            if (g_mempool_journal) g_mempool_journal->DumpFinished(false);
             return false;
         }
 
@@ -5080,15 +5655,100 @@ bool DumpMempool()
             throw std::runtime_error("FileCommit failed");
         file.fclose();
         RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        if (g_mempool_journal) g_mempool_journal->DumpFinished(true);
         int64_t last = GetTimeMicros();
         LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid-start)*MICRO, (last-mid)*MICRO);
     } catch (const std::exception& e) {
+        if (g_mempool_journal) g_mempool_journal->DumpFinished(false);
         LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
         return false;
     }
     return true;
 }
 
+static const uint64_t SIGCACHE_DUMP_VERSION = 1;
+
+bool LoadSignatureCaches()
+{
+    int64_t start = GetTimeMicros();
+    FILE* filestr = fsbridge::fopen(GetDataDir() / "sigcache.dat", "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open signature cache file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    uint256 sigNonce, scriptNonce;
+    std::vector<uint256> vSigEntries, vScriptEntries;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != SIGCACHE_DUMP_VERSION) {
+            return false;
+        }
+        file >> sigNonce >> vSigEntries >> scriptNonce >> vScriptEntries;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize signature cache data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LoadSignatureCacheEntries(sigNonce, vSigEntries);
+    {
+        LOCK(cs_main);
+        LoadScriptExecutionCacheEntries(scriptNonce, vScriptEntries);
+    }
+    LogPrintf("Imported signature cache from disk: %u signatures, %u script executions, %gs\n", vSigEntries.size(), vScriptEntries.size(), (GetTimeMicros() - start) * MICRO);
+    return true;
+}
+
+bool DumpSignatureCaches()
+{
+    int64_t start = GetTimeMicros();
+
+    uint256 sigNonce, scriptNonce;
+    std::vector<uint256> vSigEntries, vScriptEntries;
+    GetSignatureCacheEntries(sigNonce, vSigEntries);
+    {
+        LOCK(cs_main);
+        GetScriptExecutionCacheEntries(scriptNonce, vScriptEntries);
+    }
+
+    try {
+        FILE* filestr = fsbridge::fopen(GetDataDir() / "sigcache.dat.new", "wb");
+        if (!filestr) {
+            return false;
+        }
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file << SIGCACHE_DUMP_VERSION;
+        file << sigNonce << vSigEntries << scriptNonce << vScriptEntries;
+        if (!FileCommit(file.Get()))
+            throw std::runtime_error("FileCommit failed");
+        file.fclose();
+        RenameOver(GetDataDir() / "sigcache.dat.new", GetDataDir() / "sigcache.dat");
+        LogPrintf("Dumped signature cache: %u signatures, %u script executions, %gs\n", vSigEntries.size(), vScriptEntries.size(), (GetTimeMicros() - start) * MICRO);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump signature cache: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+/** Number of blocks the recent block interval is measured over: 24 of each algorithm */
+static const int BLOCK_INTERVAL_WINDOW = 24 * NUM_ALGOS;
+
+int64_t GetRecentBlockInterval(const CBlockIndex* pindex, const Consensus::Params& params)
+{
+    if (pindex == nullptr) return 0;
+    // Blocks of different algorithms come in with timestamps out of order, so use median times
+    if (pindex->nHeight >= BLOCK_INTERVAL_WINDOW) {
+        const CBlockIndex* pindexStart = pindex->GetAncestor(pindex->nHeight - BLOCK_INTERVAL_WINDOW);
+        const int64_t nTimespan = pindex->GetMedianTimePast() - pindexStart->GetMedianTimePast();
+        if (nTimespan > 0) return std::max<int64_t>(nTimespan / BLOCK_INTERVAL_WINDOW, 1);
+    }
+    return params.TargetSpacing(pindex->nHeight);
+}
+
 //! Guess how far we are in the verification process at the given block index
 //! require cs_main if pindex has not been validated yet (because nChainTx might be unset)
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex *pindex) {
@@ -12,6 +12,7 @@
 
 #include <amount.h>
 #include <coins.h>
+#include <consensus/validation.h>
 #include <crypto/common.h> // for ReadLE64
 #include <fs.h>
 #include <policy/feerate.h>
@@ -41,6 +42,7 @@ class CConnman;
 class CScriptCheck;
 class CBlockPolicyEstimator;
 class CTxMemPool;
+class CUTXOCommitment;
 class CValidationState;
 struct ChainTxData;
 
@@ -69,6 +71,14 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Share of -maxmempool (in percent) past which the mempool is trimmed in the background */
+static const unsigned int MEMPOOL_TRIM_HIGH_PERCENT = 95;
+/** Share of -maxmempool (in percent) the mempool is trimmed down to in the background */
+static const unsigned int MEMPOOL_TRIM_LOW_PERCENT = 90;
+/** Most memory (in bytes) evicted from the mempool in one hold of cs_main */
+static const size_t MEMPOOL_TRIM_STEP = 1000000;
+/** How often (in milliseconds) the mempool is expired and trimmed in the background */
+static const int64_t MEMPOOL_TRIM_INTERVAL = 1000;
 /** Maximum kilobytes for transactions to store for processing during reorg */
 static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -82,7 +92,7 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its download rate is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
@@ -106,8 +116,8 @@ static const int MAX_CMPCTBLOCK_DEPTH = 5;
 static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
- *  degree of disordering of blocks on disk (which make reindexing and pruning harder). We'll probably
- *  want to make this a per-peer adaptive value at some point. */
+ *  degree of disordering of blocks on disk (which make reindexing and pruning harder). This is the size
+ *  for a 10 minute block interval; see GetBlockDownloadWindow(). */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
@@ -128,9 +138,12 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+static const bool DEFAULT_UTXO_COMMITMENT = true;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -persistsigcache */
+static const bool DEFAULT_PERSIST_SIGCACHE = true;
 /** Default for -mempoolreplacement */
 static const bool DEFAULT_ENABLE_REPLACEMENT = true;
 /** Default for using fee filter */
@@ -172,6 +185,8 @@ extern int nScriptCheckThreads;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+/** Whether to maintain a rolling commitment to the UTXO set as blocks are (dis)connected */
+extern bool fMaintainUTXOCommitment;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
@@ -270,6 +285,14 @@ bool LoadGenesisBlock(const CChainParams& chainparams);
 bool LoadBlockIndex(const CChainParams& chainparams) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 /** Update the chain tip based on database information. */
 bool LoadChainTip(const CChainParams& chainparams) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+/** Make a block whose UTXO set was just bulk-loaded into the coins database the chain tip. */
+bool ActivateUTXOSnapshot(CBlockIndex* pindex, unsigned int nChainTx, std::string& strError) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+/** Whether the chainstate was bootstrapped from a UTXO snapshot */
+bool IsUsingUTXOSnapshot();
+/** Get the rolling UTXO set commitment, if it is known for the current tip. */
+bool GetUTXOCommitment(CUTXOCommitment& commitment, uint256& hashBlock);
+/** Install a commitment computed from a full scan of the coins at hashBlock, if none is known and hashBlock is still the tip. */
+void SeedUTXOCommitment(const CUTXOCommitment& commitment, const uint256& hashBlock);
 /** Unload database information */
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
@@ -290,6 +313,9 @@ CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams);
 /** Guess verification progress (as a fraction between 0.0=genesis and 1.0=current tip). */
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex* pindex);
 
+/** Average time in seconds between the blocks leading up to pindex, or the target spacing if there are too few. */
+int64_t GetRecentBlockInterval(const CBlockIndex* pindex, const Consensus::Params& params);
+
 /** Calculate the amount of disk space the block & undo files currently use */
 uint64_t CalculateCurrentUsage();
 
@@ -316,6 +342,45 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee, bool test_accept=false) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+/** A transaction passed to AcceptToMemoryPoolBatch, and the outcome for it */
+struct MempoolAcceptBatchEntry
+{
+    CTransactionRef tx;
+    CValidationState state;
+    bool fMissingInputs = false;
+    bool fAccepted = false;
+    //! Time the transaction entered the mempool, or 0 for now
+    int64_t nAcceptTime = 0;
+    //! Transactions replaced from the mempool by this one
+    std::list<CTransactionRef> lReplaced;
+
+    explicit MempoolAcceptBatchEntry(const CTransactionRef& txIn) : tx(txIn) {}
+};
+
+/** Largest number of transactions relayed by a peer that are validated together. */
+static const unsigned int MAX_MEMPOOL_ACCEPT_BATCH = 64;
+
+/** (try to) add a group of transactions to the memory pool, with the same outcome as
+ * calling AcceptToMemoryPool for each of them in turn. The inputs of the whole group
+ * are looked up in one pass and their scripts are verified in parallel on the script
+ * check threads first, so that accepting them one by one mostly hits the caches. **/
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<MempoolAcceptBatchEntry>& entries) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
+/** Largest number of transactions accepted together as a package. */
+static const unsigned int MAX_PACKAGE_COUNT = 25;
+/** Largest total virtual size of a package. */
+static const int64_t MAX_PACKAGE_SIZE = 101000;
+
+/** (try to) add a package of transactions to the memory pool, all of them or none. Parents
+ * must come before their children. The fees of the package are checked against the mempool
+ * minimum fee and the minimum relay fee as a whole, so that a child can pay for a parent
+ * that would be turned away on its own: a transaction below them has to be an ancestor of
+ * one whose ancestors in the package pay for both. Every other check still applies to each
+ * transaction, and a package cannot replace mempool transactions. Transactions already in
+ * the mempool are left in and do not count towards the package.
+ * On failure, state says why, and the entry of the transaction at fault (if any) is filled in. **/
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, std::vector<MempoolAcceptBatchEntry>& entries, const CAmount nAbsurdFee) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -398,6 +463,11 @@ public:
 
 /** Initializes the script-execution cache */
 void InitScriptExecutionCache();
+/** The nonce of the script-execution cache and the entries it still holds, to save them. */
+void GetScriptExecutionCacheEntries(uint256& nonce, std::vector<uint256>& entries) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+/** Switch the script-execution cache over to a saved nonce and insert the entries saved with it,
+ *  before any script is checked. */
+void LoadScriptExecutionCacheEntries(const uint256& nonce, const std::vector<uint256>& entries) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 
 /** Functions for disk access for blocks */
@@ -509,12 +579,26 @@ static const unsigned int REJECT_HIGHFEE = 0x100;
 /** Get block file info entry for one block file */
 CBlockFileInfo* GetBlockFileInfo(size_t n);
 
+/**
+ * Expire old transactions from the mempool and, once it is past the high
+ * watermark of limit, evict the lowest feerate packages until it is down
+ * to the low watermark, releasing cs_main between steps. Acceptance only
+ * trims the mempool itself past limit, as a hard cap.
+ */
+void TrimMempool(CTxMemPool& pool, size_t limit, unsigned long age) LOCKS_EXCLUDED(cs_main);
+
 /** Dump the mempool to disk. */
 bool DumpMempool();
 
 /** Load the mempool from disk. */
 bool LoadMempool();
 
+/** Dump the signature and script-execution caches to disk, with their nonces. */
+bool DumpSignatureCaches();
+
+/** Load the signature and script-execution caches from disk, before any script is checked. */
+bool LoadSignatureCaches();
+
 //! Check whether the block associated with this index entry is pruned or not.
 inline bool IsBlockPruned(const CBlockIndex* pblockindex)
 {
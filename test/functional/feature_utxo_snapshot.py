@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# Copyright (c) 2019 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test UTXO snapshots (dumptxoutset and loadtxoutset)
+
+A snapshot dumped by one node is loaded into a fresh node, which then has
+the same UTXO set and follows the chain from the snapshot's base block.
+"""
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, assert_raises_rpc_error, connect_nodes, sync_blocks
+
+SNAPSHOT_FIELDS = ['height', 'bestblock', 'transactions', 'txouts', 'hash_serialized_2', 'total_amount']
+
+
+class UTXOSnapshotTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self):
+        # The second node stays on its own until it has loaded the snapshot
+        self.setup_nodes()
+
+    def run_test(self):
+        node, fresh = self.nodes
+        node.generatetoaddress(120, node.get_deterministic_priv_key().address)
+
+        self.log.info("Dump the UTXO set of the first node")
+        result = node.dumptxoutset('utxo.dat')
+        assert_equal(result['base_hash'], node.getbestblockhash())
+        assert_equal(result['base_height'], 120)
+        assert_equal(result['coins_written'], node.gettxoutsetinfo()['txouts'])
+        assert_raises_rpc_error(-8, 'already exists', node.dumptxoutset, 'utxo.dat')
+        path = result['path']
+
+        self.log.info("A snapshot is only loaded once its base block header is known")
+        assert_raises_rpc_error(-1, None, fresh.loadtxoutset, path)
+        for height in range(1, 121):
+            fresh.submitheader(node.getblockheader(node.getblockhash(height), False))
+        assert_equal(fresh.getblockcount(), 0)
+
+        self.log.info("A snapshot that does not match the expected hash is rejected")
+        assert_raises_rpc_error(-1, None, fresh.loadtxoutset, path, '11' * 32)
+        assert_equal(fresh.getblockcount(), 0)
+
+        self.log.info("Load the snapshot into the fresh node")
+        loaded = fresh.loadtxoutset(path, result['hash'])
+        assert_equal(loaded['coins_loaded'], result['coins_written'])
+        assert_equal(loaded['base_hash'], result['base_hash'])
+        assert_equal(loaded['hash'], result['hash'])
+        assert_equal(fresh.getbestblockhash(), result['base_hash'])
+        expected = node.gettxoutsetinfo()
+        info = fresh.gettxoutsetinfo()
+        for field in SNAPSHOT_FIELDS:
+            assert_equal(info[field], expected[field])
+        assert_raises_rpc_error(-1, None, fresh.loadtxoutset, path)
+
+        self.log.info("The loaded chainstate survives a restart")
+        self.restart_node(1)
+        fresh = self.nodes[1]
+        assert_equal(fresh.getbestblockhash(), result['base_hash'])
+        assert_equal(fresh.gettxoutsetinfo()['hash_serialized_2'], expected['hash_serialized_2'])
+
+        self.log.info("-txindex is refused on a chainstate loaded from a snapshot")
+        self.stop_node(1)
+        fresh.assert_start_raises_init_error(['-txindex'], "Error: -txindex requires the full block history and can't be used with a UTXO snapshot.")
+        self.start_node(1)
+        fresh = self.nodes[1]
+
+        self.log.info("Blocks on top of the snapshot are validated and relayed")
+        connect_nodes(node, 1)
+        node.generatetoaddress(5, node.get_deterministic_priv_key().address)
+        sync_blocks(self.nodes)
+        fresh.generatetoaddress(5, fresh.get_deterministic_priv_key().address)
+        sync_blocks(self.nodes)
+        assert_equal(fresh.getblockcount(), 130)
+        assert_equal(fresh.gettxoutsetinfo()['hash_serialized_2'], node.gettxoutsetinfo()['hash_serialized_2'])
+
+
+if __name__ == '__main__':
+    UTXOSnapshotTest().main()
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# Copyright (c) 2019 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test processing peer messages on several message handler threads (-msghandthreads)
+
+Peers are spread over the threads, but the messages of each of them are
+still answered in the order they were sent.
+"""
+
+from test_framework.messages import msg_ping
+from test_framework.mininode import P2PInterface, mininode_lock
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, connect_nodes, sync_blocks, wait_until
+
+NUM_PEERS = 8
+NUM_PINGS = 50
+
+
+class PongRecorder(P2PInterface):
+    def __init__(self):
+        super().__init__()
+        self.pong_nonces = []
+
+    def on_pong(self, message):
+        self.pong_nonces.append(message.nonce)
+
+
+class MsgHandThreadsTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+        self.extra_args = [["-msghandthreads=4"], []]
+
+    def setup_network(self):
+        self.setup_nodes()
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        self.log.info("Check that one message handler thread is started per -msghandthreads")
+        with node.assert_debug_log(["msghand.{} thread start".format(i) for i in range(4)]):
+            self.restart_node(0)
+
+        self.log.info("Check that the messages of every peer are answered in order")
+        peers = [node.add_p2p_connection(PongRecorder()) for _ in range(NUM_PEERS)]
+        for i in range(NUM_PINGS):
+            for n, peer in enumerate(peers):
+                peer.send_message(msg_ping(nonce=n * NUM_PINGS + i + 1))
+        for n, peer in enumerate(peers):
+            wait_until(lambda: len(peer.pong_nonces) == NUM_PINGS, lock=mininode_lock)
+            with mininode_lock:
+                assert_equal(peer.pong_nonces, [n * NUM_PINGS + i + 1 for i in range(NUM_PINGS)])
+
+        self.log.info("Check that blocks are relayed both ways with another node")
+        connect_nodes(node, 1)
+        address = node.get_deterministic_priv_key().address
+        node.generatetoaddress(5, address)
+        sync_blocks(self.nodes)
+        self.nodes[1].generatetoaddress(5, address)
+        sync_blocks(self.nodes)
+        assert_equal(node.getblockcount(), 10)
+        assert_equal(len(node.getpeerinfo()), NUM_PEERS + 1)
+
+
+if __name__ == '__main__':
+    MsgHandThreadsTest().main()